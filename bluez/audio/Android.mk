@@ -23,7 +23,22 @@ LOCAL_SRC_FILES+= \
 	media.c \
 	control.c \
 	avdtp.c \
-	unix.c
+	a2dp-sender.c \
+	mmsg.c \
+	shm-stream.c \
+	unix.c \
+	../sbc/sbc_primitives.c \
+	../sbc/sbc_primitives_neon.c
+
+ifeq ($(TARGET_ARCH),x86)
+LOCAL_SRC_FILES+= \
+	../sbc/sbc_primitives_mmx.c \
+	../sbc/sbc.c
+else
+LOCAL_SRC_FILES+= \
+	../sbc/sbc.c.arm \
+	../sbc/sbc_primitives_armv6.c
+endif
 
 else
 LOCAL_SRC_FILES+= \
@@ -53,6 +68,7 @@ LOCAL_C_INCLUDES:= \
 	$(LOCAL_PATH)/../gdbus \
 	$(LOCAL_PATH)/../src \
 	$(LOCAL_PATH)/../btio \
+	$(LOCAL_PATH)/../sbc \
 	$(call include-path-for, glib) \
 	$(call include-path-for, dbus)
 
@@ -61,6 +77,7 @@ LOCAL_SHARED_LIBRARIES := \
 	libbluetoothd \
 	libbtio \
 	libdbus \
+	libcutils \
 	libutils \
 	libglib
 
@@ -82,6 +99,9 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
 	android_audio_hw.c \
 	liba2dp.c \
+	a2dp-bitpool.c \
+	a2dp-sender.c \
+	mmsg.c \
 	ipc.c \
 	../sbc/sbc_primitives.c \
 	../sbc/sbc_primitives_neon.c
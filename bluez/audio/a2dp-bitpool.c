@@ -0,0 +1,141 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "ipc.h"
+#include "a2dp-bitpool.h"
+
+/* Clean packets in a row before the bitpool is raised by one step */
+#define RAISE_INTERVAL		50
+
+/* After a congestion event wait this many times longer before raising */
+#define CONGESTION_HOLDOFF	4
+
+uint8_t a2dp_default_bitpool(uint8_t freq, uint8_t mode)
+{
+	switch (freq) {
+	case BT_SBC_SAMPLING_FREQ_16000:
+	case BT_SBC_SAMPLING_FREQ_32000:
+		return 53;
+	case BT_SBC_SAMPLING_FREQ_44100:
+		switch (mode) {
+		case BT_A2DP_CHANNEL_MODE_MONO:
+		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
+			return 31;
+		case BT_A2DP_CHANNEL_MODE_STEREO:
+		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
+		default:
+			return 53;
+		}
+	case BT_SBC_SAMPLING_FREQ_48000:
+		switch (mode) {
+		case BT_A2DP_CHANNEL_MODE_MONO:
+		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
+			return 29;
+		case BT_A2DP_CHANNEL_MODE_STEREO:
+		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
+		default:
+			return 51;
+		}
+	default:
+		return 53;
+	}
+}
+
+void a2dp_bitpool_init(struct a2dp_bitpool *bp, uint8_t min, uint8_t max,
+						unsigned int outq_limit)
+{
+	memset(bp, 0, sizeof(*bp));
+
+	if (min > max)
+		min = max;
+
+	bp->min = min;
+	bp->max = max;
+	bp->bitpool = max;
+	bp->outq_limit = outq_limit;
+	bp->holdoff = RAISE_INTERVAL;
+}
+
+static void bitpool_decrease(struct a2dp_bitpool *bp, unsigned int shift)
+{
+	unsigned int step = bp->bitpool >> shift;
+
+	if (step == 0)
+		step = 1;
+
+	if ((unsigned int) (bp->bitpool - bp->min) > step)
+		bp->bitpool -= step;
+	else
+		bp->bitpool = bp->min;
+
+	bp->good = 0;
+	bp->holdoff = RAISE_INTERVAL * CONGESTION_HOLDOFF;
+}
+
+uint8_t a2dp_bitpool_update(struct a2dp_bitpool *bp, int sk,
+				unsigned int latency, unsigned int duration,
+				int dropped)
+{
+	int outq = 0;
+
+	if (bp->min == bp->max)
+		return bp->bitpool;
+
+	if (dropped) {
+		/* The link could not keep up at all, back off hard */
+		bitpool_decrease(bp, 2);
+		return bp->bitpool;
+	}
+
+	if (ioctl(sk, SIOCOUTQ, &outq) < 0)
+		outq = 0;
+
+	if ((bp->outq_limit && (unsigned int) outq > bp->outq_limit) ||
+					(duration && latency > duration)) {
+		/* Either data is piling up in the socket or send() had to
+		 * block for longer than the packet plays: the controller
+		 * is not draining fast enough for this bitrate */
+		bitpool_decrease(bp, 3);
+		return bp->bitpool;
+	}
+
+	if (++bp->good < bp->holdoff)
+		return bp->bitpool;
+
+	bp->good = 0;
+	bp->holdoff = RAISE_INTERVAL;
+
+	if (bp->bitpool < bp->max)
+		bp->bitpool++;
+
+	return bp->bitpool;
+}
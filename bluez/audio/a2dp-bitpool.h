@@ -0,0 +1,51 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+/* Adaptive bitpool controller.
+ *
+ * The controller is fed once per transmitted media packet with the time
+ * send() took, the playback duration of the packet and whether it was
+ * dropped.  It additionally samples the socket send queue (SIOCOUTQ).
+ * When the link shows signs of congestion the bitpool is lowered
+ * (multiplicatively, harder for dropped packets), and once the link has
+ * been clean for a while it is raised again one step at a time, always
+ * staying inside the negotiated [min, max] range. */
+struct a2dp_bitpool {
+	uint8_t min;			/* Negotiated minimum bitpool */
+	uint8_t max;			/* Negotiated maximum bitpool */
+	uint8_t bitpool;		/* Current bitpool */
+	unsigned int outq_limit;	/* Send queue bytes considered congested */
+	unsigned int good;		/* Consecutive clean packets */
+	unsigned int holdoff;		/* Clean packets needed before raising */
+};
+
+uint8_t a2dp_default_bitpool(uint8_t freq, uint8_t mode);
+
+void a2dp_bitpool_init(struct a2dp_bitpool *bp, uint8_t min, uint8_t max,
+						unsigned int outq_limit);
+
+uint8_t a2dp_bitpool_update(struct a2dp_bitpool *bp, int sk,
+				unsigned int latency, unsigned int duration,
+				int dropped);
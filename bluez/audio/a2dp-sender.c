@@ -0,0 +1,198 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+#include "a2dp-sender.h"
+
+unsigned int a2dp_frames_per_packet(unsigned int mtu,
+					unsigned int frame_length)
+{
+	unsigned int frames;
+
+	if (frame_length == 0 || mtu <= A2DP_RTP_HEADER_SIZE)
+		return 0;
+
+	frames = (mtu - A2DP_RTP_HEADER_SIZE) / frame_length;
+	if (frames > A2DP_MAX_PACKET_FRAMES)
+		frames = A2DP_MAX_PACKET_FRAMES;
+
+	return frames;
+}
+
+void a2dp_sender_init(struct a2dp_sender *s, int fd, unsigned int mtu)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->fd = fd;
+	s->mtu = mtu;
+}
+
+/* Move the packets left over by a partial flush to the front of the
+ * queue, the iovecs of packets queued by a2dp_sender_queue() point at
+ * their own header slot and follow it */
+static void sender_compact(struct a2dp_sender *s)
+{
+	unsigned int i, from;
+
+	for (i = 0; s->first + i < s->count; i++) {
+		from = s->first + i;
+
+		s->msgs[i] = s->msgs[from];
+		s->msgs[i].msg_hdr.msg_iov = s->iov[i];
+		memcpy(s->iov[i], s->iov[from], sizeof(s->iov[i]));
+		memcpy(s->header[i], s->header[from], sizeof(s->header[i]));
+
+		if (s->iov[i][0].iov_base == s->header[from])
+			s->iov[i][0].iov_base = s->header[i];
+	}
+
+	s->count -= s->first;
+	s->first = 0;
+}
+
+static struct audio_mmsghdr *sender_slot(struct a2dp_sender *s)
+{
+	struct audio_mmsghdr *msg;
+
+	if (s->count == A2DP_SENDER_MAX_PACKETS && s->first > 0)
+		sender_compact(s);
+
+	if (s->count == A2DP_SENDER_MAX_PACKETS)
+		return NULL;
+
+	msg = &s->msgs[s->count];
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_hdr.msg_iov = s->iov[s->count];
+
+	return msg;
+}
+
+int a2dp_sender_queue(struct a2dp_sender *s, const void *frames,
+				size_t len, unsigned int frame_count,
+				unsigned int samples)
+{
+	struct audio_mmsghdr *msg;
+	struct rtp_header *header;
+	struct rtp_payload *payload;
+	struct iovec *iov;
+
+	if (frame_count == 0 || frame_count > A2DP_MAX_PACKET_FRAMES ||
+				len + A2DP_RTP_HEADER_SIZE > s->mtu)
+		return -EINVAL;
+
+	msg = sender_slot(s);
+	if (msg == NULL)
+		return -ENOBUFS;
+
+	header = (struct rtp_header *) s->header[s->count];
+	payload = (struct rtp_payload *) (s->header[s->count] +
+							sizeof(*header));
+
+	memset(header, 0, A2DP_RTP_HEADER_SIZE);
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(s->seq);
+	header->timestamp = htonl(s->timestamp);
+	header->ssrc = htonl(1);
+	payload->frame_count = frame_count;
+
+	iov = msg->msg_hdr.msg_iov;
+	iov[0].iov_base = header;
+	iov[0].iov_len = A2DP_RTP_HEADER_SIZE;
+	iov[1].iov_base = (void *) frames;
+	iov[1].iov_len = len;
+	msg->msg_hdr.msg_iovlen = 2;
+
+	/* The timestamp is that of the first sample in the packet */
+	s->seq++;
+	s->timestamp += samples;
+	s->count++;
+
+	return 0;
+}
+
+int a2dp_sender_queue_rtp(struct a2dp_sender *s, const struct iovec *iov,
+							unsigned int iovcnt)
+{
+	struct audio_mmsghdr *msg;
+
+	if (iovcnt == 0 || iovcnt > A2DP_SENDER_MAX_IOV)
+		return -EINVAL;
+
+	msg = sender_slot(s);
+	if (msg == NULL)
+		return -ENOBUFS;
+
+	memcpy(msg->msg_hdr.msg_iov, iov, iovcnt * sizeof(*iov));
+	msg->msg_hdr.msg_iovlen = iovcnt;
+	s->count++;
+
+	return 0;
+}
+
+unsigned int a2dp_sender_pending(struct a2dp_sender *s)
+{
+	return s->count - s->first;
+}
+
+/* Hand queued packets to the socket in order.  Returns the number of
+ * packets sent, which is less than queued when a non-blocking socket
+ * filled up; the rest stays queued for the next flush.  On failure a
+ * negative errno is returned and nothing is dequeued. */
+int a2dp_sender_flush(struct a2dp_sender *s, int flags)
+{
+	int ret;
+
+	if (s->first == s->count)
+		return 0;
+
+	ret = audio_sendmmsg(s->fd, &s->msgs[s->first], s->count - s->first,
+									flags);
+	if (ret < 0)
+		return -errno;
+
+	s->first += ret;
+	if (s->first == s->count)
+		s->first = s->count = 0;
+
+	return ret;
+}
+
+/* Drop everything not yet flushed.  Sequence numbers and timestamps
+ * already assigned stay consumed so the receiver sees the loss. */
+void a2dp_sender_discard(struct a2dp_sender *s)
+{
+	s->first = 0;
+	s->count = 0;
+}
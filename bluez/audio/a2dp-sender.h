@@ -0,0 +1,79 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "mmsg.h"
+
+/* Shared A2DP media transport sender.
+ *
+ * Packets are queued as iovecs pointing at caller owned memory, which has
+ * to stay valid until the packet has been flushed.  SBC payloads get
+ * their RTP and media payload header filled in here, keeping sequence
+ * number and timestamp (in samples of the first frame) consistent for
+ * all users.  A flush hands every queued packet to the socket with a
+ * single sendmmsg() where the kernel supports it. */
+
+/* RTP header followed by the one byte SBC media payload header */
+#define A2DP_RTP_HEADER_SIZE		13
+
+/* Limit of the 4 bit frame count in the SBC media payload header */
+#define A2DP_MAX_PACKET_FRAMES		15
+
+#define A2DP_SENDER_MAX_PACKETS		8
+#define A2DP_SENDER_MAX_IOV		4
+
+struct a2dp_sender {
+	int fd;					/* Stream socket */
+	unsigned int mtu;			/* Outgoing link MTU */
+	uint16_t seq;				/* Next RTP sequence number */
+	uint32_t timestamp;			/* Next RTP timestamp */
+
+	/* Packets first .. count - 1 are waiting to be flushed */
+	unsigned int first;
+	unsigned int count;
+	struct audio_mmsghdr msgs[A2DP_SENDER_MAX_PACKETS];
+	struct iovec iov[A2DP_SENDER_MAX_PACKETS][A2DP_SENDER_MAX_IOV];
+	uint8_t header[A2DP_SENDER_MAX_PACKETS][A2DP_RTP_HEADER_SIZE];
+};
+
+unsigned int a2dp_frames_per_packet(unsigned int mtu,
+					unsigned int frame_length);
+
+void a2dp_sender_init(struct a2dp_sender *s, int fd, unsigned int mtu);
+
+int a2dp_sender_queue(struct a2dp_sender *s, const void *frames,
+				size_t len, unsigned int frame_count,
+				unsigned int samples);
+
+int a2dp_sender_queue_rtp(struct a2dp_sender *s, const struct iovec *iov,
+							unsigned int iovcnt);
+
+unsigned int a2dp_sender_pending(struct a2dp_sender *s);
+
+int a2dp_sender_flush(struct a2dp_sender *s, int flags);
+
+void a2dp_sender_discard(struct a2dp_sender *s);
@@ -26,7 +26,9 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include <dbus/dbus.h>
@@ -47,6 +49,7 @@
 #include "transport.h"
 #include "a2dp.h"
 #include "sdpd.h"
+#include "../src/storage.h"
 
 /* The duration that streams without users are allowed to stay in
  * STREAMING state. */
@@ -98,6 +101,7 @@ struct a2dp_setup {
 	GSList *caps;
 	gboolean reconfigure;
 	gboolean start;
+	gboolean cached_config;
 	GSList *cb;
 	int ref;
 };
@@ -792,6 +796,80 @@ static void endpoint_open_cb(struct media_endpoint *endpoint, void *ret,
 	finalize_setup_errno(setup, err, finalize_config, NULL);
 }
 
+/* Configurations are stored as the hex dump of the service capabilities
+ * sent in Set_Configuration, keyed by the remote SEID they were sent to */
+static void store_config(struct avdtp *session, struct avdtp_stream *stream,
+								GSList *caps)
+{
+	struct avdtp_remote_sep *rsep;
+	GString *str;
+	bdaddr_t src, dst;
+
+	rsep = avdtp_stream_get_remote_sep(stream);
+	if (rsep == NULL || caps == NULL)
+		return;
+
+	str = g_string_new(NULL);
+
+	for (; caps != NULL; caps = caps->next) {
+		struct avdtp_service_capability *cap = caps->data;
+		uint8_t *data = (uint8_t *) cap;
+		int i;
+
+		for (i = 0; i < 2 + cap->length; i++)
+			g_string_append_printf(str, "%02X", data[i]);
+	}
+
+	avdtp_get_peers(session, &src, &dst);
+	write_a2dp_config(&src, &dst, avdtp_get_seid(rsep), str->str);
+
+	g_string_free(str, TRUE);
+}
+
+static GSList *parse_config(const char *str)
+{
+	GSList *caps = NULL;
+	uint8_t *buf;
+	size_t len, i;
+
+	len = strlen(str);
+	if (len == 0 || len % 2)
+		return NULL;
+
+	len /= 2;
+	buf = g_malloc(len);
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(str + i * 2, "%02hhX", &buf[i]) != 1)
+			goto failed;
+	}
+
+	for (i = 0; i + 2 <= len; i += 2 + buf[i + 1]) {
+		struct avdtp_service_capability *cap;
+
+		if (i + 2 + buf[i + 1] > len)
+			goto failed;
+
+		cap = avdtp_service_cap_new(buf[i], &buf[i + 2], buf[i + 1]);
+		if (cap == NULL)
+			goto failed;
+
+		caps = g_slist_append(caps, cap);
+	}
+
+	if (i != len)
+		goto failed;
+
+	g_free(buf);
+	return caps;
+
+failed:
+	g_slist_foreach(caps, (GFunc) g_free, NULL);
+	g_slist_free(caps);
+	g_free(buf);
+	return NULL;
+}
+
 static void setconf_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
 				struct avdtp_stream *stream,
 				struct avdtp_error *err, void *user_data)
@@ -810,6 +888,15 @@ static void setconf_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
 
 	if (err) {
 		if (setup) {
+			/* The remote no longer accepts what worked before */
+			if (setup->cached_config) {
+				bdaddr_t src, dst;
+
+				avdtp_get_peers(session, &src, &dst);
+				delete_a2dp_config(&src, &dst);
+				setup->cached_config = FALSE;
+			}
+
 			setup->err = err;
 			finalize_config(setup);
 		}
@@ -822,6 +909,9 @@ static void setconf_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
 	if (!setup)
 		return;
 
+	setup->cached_config = FALSE;
+	store_config(session, stream, setup->caps);
+
 	dev = a2dp_get_dev(session);
 
 	/* Notify D-Bus interface of the new stream */
@@ -2110,7 +2200,15 @@ unsigned int a2dp_config(struct avdtp *session, struct a2dp_sep *sep,
 			break;
 		}
 
-		setup->rsep = avdtp_find_remote_sep(session, sep->lsep);
+		/* Keep a remote SEP chosen by the caller if the codec fits */
+		if (setup->rsep) {
+			cap = avdtp_get_codec(setup->rsep);
+			codec_cap = (void *) cap->data;
+		}
+
+		if (!setup->rsep || sep->codec != codec_cap->media_codec_type)
+			setup->rsep = avdtp_find_remote_sep(session, sep->lsep);
+
 		if (setup->rsep == NULL) {
 			error("No matching ACP and INT SEPs found");
 			goto failed;
@@ -2151,6 +2249,97 @@ failed:
 	return 0;
 }
 
+unsigned int a2dp_config_cached(struct avdtp *session, uint8_t type,
+				a2dp_config_cb_t cb, void *user_data)
+{
+	struct a2dp_server *server;
+	struct a2dp_setup *setup;
+	struct a2dp_sep *sep = NULL;
+	struct avdtp_remote_sep *rsep;
+	struct avdtp_service_capability *cap;
+	struct avdtp_media_codec_capability *codec = NULL;
+	GSList *caps, *l;
+	unsigned int id;
+	uint8_t rseid;
+	bdaddr_t src, dst;
+	char *str;
+
+	/* Don't interfere with a configuration already in progress */
+	if (find_setup_by_session(session))
+		return 0;
+
+	avdtp_get_peers(session, &src, &dst);
+	server = find_server(servers, &src);
+	if (!server)
+		return 0;
+
+	str = read_a2dp_config(&src, &dst, &rseid);
+	if (!str)
+		return 0;
+
+	caps = parse_config(str);
+	free(str);
+
+	for (l = caps; l != NULL; l = l->next) {
+		cap = l->data;
+
+		if (cap->category != AVDTP_MEDIA_CODEC)
+			continue;
+
+		codec = (void *) cap->data;
+		break;
+	}
+
+	rsep = avdtp_get_remote_sep(session, rseid);
+	if (!codec || !rsep || avdtp_get_type(rsep) != type)
+		goto invalid;
+
+	cap = avdtp_get_codec(rsep);
+	if (((struct avdtp_media_codec_capability *) cap->data)->
+			media_codec_type != codec->media_codec_type)
+		goto invalid;
+
+	l = type == AVDTP_SEP_TYPE_SINK ? server->sources : server->sinks;
+	for (; l != NULL; l = l->next) {
+		struct a2dp_sep *tmp = l->data;
+
+		if (tmp->codec == codec->media_codec_type) {
+			sep = tmp;
+			break;
+		}
+	}
+
+	if (!sep)
+		goto invalid;
+
+	DBG("Trying cached configuration for remote SEP 0x%02X", rseid);
+
+	setup = a2dp_setup_get(session);
+	if (!setup)
+		goto failed;
+
+	g_slist_foreach(setup->caps, (GFunc) g_free, NULL);
+	g_slist_free(setup->caps);
+	setup->caps = caps;
+	setup->rsep = rsep;
+	setup->cached_config = TRUE;
+
+	id = a2dp_config(session, sep, cb, setup->caps, user_data);
+	if (id == 0)
+		setup->cached_config = FALSE;
+
+	setup_unref(setup);
+
+	return id;
+
+invalid:
+	delete_a2dp_config(&src, &dst);
+failed:
+	g_slist_foreach(caps, (GFunc) g_free, NULL);
+	g_slist_free(caps);
+	return 0;
+}
+
 unsigned int a2dp_resume(struct avdtp *session, struct a2dp_sep *sep,
 				a2dp_stream_cb_t cb, void *user_data)
 {
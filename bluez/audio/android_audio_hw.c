@@ -54,21 +54,48 @@
 /* maximum number of attempts to wait for a write completion in out_standby_stream_locked() */
 #define MAX_WRITE_COMPLETION_ATTEMPTS 5
 
-/* NOTE: there are 2 mutexes used by the a2dp output stream.
- *  - lock: protects all calls to a2dp lib functions (a2dp_stop(), a2dp_cleanup()...).
- *    One exception is a2dp_write() which is also protected by the flag write_busy. This is because
- *    out_write() cannot block waiting for a2dp_write() to complete because this function
- *    can sleep to throttle the A2DP bit rate.
- *    This flag is always set/reset and tested with "lock" mutex held.
- *  - buf_lock: protects access to pcm buffer read and write indexes.
+/* maximum time the encoder and sender threads sleep when they have nothing to do */
+#define BUF_IDLE_TIMEOUT_MS 10
+
+/* NOTE: the a2dp output stream is a three stage pipeline:
+ *  - out_write() (audioflinger thread) copies pcm into a single-producer/single-consumer
+ *    ring. Only out_write() moves buf_wr_idx and only the encoder thread moves buf_rd_idx,
+ *    so the ring itself needs no lock.
+ *  - the encoder thread (_out_buf_thread_func) encodes pcm into the a2dp lib packet queue
+ *    with a2dp_encode().
+ *  - the sender thread (_out_send_thread_func) transmits queued packets at the stream rate
+ *    with a2dp_send(), which can sleep to throttle the A2DP bit rate.
+ *  Stages only block on a struct out_event when their input is empty or their output is
+ *  full; neither "lock" nor the event lock is taken while data is flowing.
  *
- *  The locking order is always as follows:
- *      buf_lock -> lock
+ *  lock: protects all calls to a2dp lib functions (a2dp_stop(), a2dp_cleanup()...).
+ *    The exceptions are a2dp_encode() and a2dp_send(): the encoder and sender threads
+ *    only call them between _out_stage_enter() and _out_stage_exit(), which count the
+ *    stages in "busy" without a lock so that standby can wait for them to complete.
+ *    standby is set with "lock" held before waiting and is only cleared by out_write(),
+ *    which also empties the pcm ring at that point.
  *
- * If you need to hold the adev_a2dp->lock AND the astream_out->lock or astream_out->buf_lock,
- * you MUST take adev_a2dp lock first!!
+ * If you need to hold the adev_a2dp->lock AND the astream_out->lock, you MUST take
+ * adev_a2dp lock first!!
  */
 
+/* Eventcount used to sleep on a lock-free ring: a waiter samples seq with
+ * out_event_seq() before testing its ring and only sleeps if seq has not
+ * moved since. */
+struct out_event {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volatile int32_t seq;
+    volatile int32_t waiters;
+};
+
+/* time spent working and waiting by one pipeline stage, in microseconds */
+struct out_stage_timing {
+    uint64_t busy_us;
+    uint64_t wait_us;
+    uint32_t waits;
+};
+
 struct astream_out;
 struct adev_a2dp {
     struct audio_hw_device  device;
@@ -91,7 +118,7 @@ struct astream_out {
     int                     format;
 
     int                     fd;
-    bool                    standby;
+    volatile bool           standby;
     int                     start_count;
     int                     retry_count;
     void*                   data;
@@ -106,19 +133,24 @@ struct astream_out {
     bool                    suspended;
     char                    a2dp_addr[20];
 
-    uint32_t *buf;              /* pcm buffer between audioflinger thread and write thread*/
-    size_t buf_size;            /* size of pcm buffer in frames */
-    size_t buf_rd_idx;          /* read index in pcm buffer, in frames*/
-    size_t buf_wr_idx;          /* write index in pcm buffer, in frames */
-    size_t buf_frames_ready;    /* number of frames ready for writing to a2dp sink */
-    pthread_mutex_t buf_lock;   /* mutex protecting read and write indexes */
-                                /* see NOTE on mutex locking order above */
-    pthread_cond_t buf_cond;    /* condition signaling data write/read to/from pcm buffer */
-    pthread_t buf_thread;       /* thread reading data from buffer and writing to a2dp sink*/
-    bool buf_thread_exit;       /* flag requesting write thread exit */
-    bool write_busy;            /* indicates that a write to a2dp sink is in progress and that
-                                   standby must wait for this flag to be cleared by write thread */
-    pthread_cond_t write_cond;  /* condition associated with write_busy flag */
+    uint32_t *buf;              /* pcm ring between audioflinger thread and encoder thread */
+    size_t buf_size;            /* size of pcm ring in frames, one frame is always left free */
+    volatile size_t buf_rd_idx; /* read index in pcm ring, in frames, moved by encoder thread */
+    volatile size_t buf_wr_idx; /* write index in pcm ring, in frames, moved by out_write() */
+    struct out_event space_event;  /* encoder consumed pcm */
+    struct out_event data_event;   /* out_write() produced pcm */
+    struct out_event packet_event; /* encoder queued packets */
+    struct out_event sent_event;   /* sender freed packet slots */
+    struct out_event idle_event;   /* a stage left a2dp_encode()/a2dp_send() */
+    pthread_t buf_thread;       /* encoder thread reading pcm ring and encoding to a2dp lib */
+    pthread_t send_thread;      /* sender thread writing encoded packets to a2dp sink */
+    volatile bool buf_thread_exit; /* flag requesting encoder and sender threads exit */
+    volatile int32_t busy;      /* stages inside a2dp_encode() or a2dp_send(), standby
+                                   waits for this to drop to zero */
+
+    struct out_stage_timing write_timing;   /* out_write() waiting for ring space */
+    struct out_stage_timing encode_timing;  /* encoder thread */
+    struct out_stage_timing send_timing;    /* sender thread */
 };
 
 static uint64_t system_time(void)
@@ -131,6 +163,67 @@ static uint64_t system_time(void)
     return t.tv_sec*1000000000LL + t.tv_nsec;
 }
 
+static void out_event_init(struct out_event *ev)
+{
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+    ev->seq = 0;
+    ev->waiters = 0;
+}
+
+static void out_event_destroy(struct out_event *ev)
+{
+    pthread_cond_destroy(&ev->cond);
+    pthread_mutex_destroy(&ev->lock);
+}
+
+static int32_t out_event_seq(struct out_event *ev)
+{
+    int32_t seq = ev->seq;
+
+    /* read the sequence before the ring indexes it guards */
+    __sync_synchronize();
+    return seq;
+}
+
+static void out_event_signal(struct out_event *ev)
+{
+    /* full barrier: the sequence bump must be visible before waiters is read */
+    __sync_fetch_and_add(&ev->seq, 1);
+
+    if (ev->waiters) {
+        pthread_mutex_lock(&ev->lock);
+        pthread_cond_broadcast(&ev->cond);
+        pthread_mutex_unlock(&ev->lock);
+    }
+}
+
+/* returns 0 if the event was signaled since seq was sampled, -ETIMEDOUT otherwise */
+static int out_event_wait(struct out_event *ev, int32_t seq, unsigned msecs,
+                          struct out_stage_timing *timing)
+{
+    uint64_t begin = system_time();
+    int ret = 0;
+
+    pthread_mutex_lock(&ev->lock);
+    __sync_fetch_and_add(&ev->waiters, 1);
+    while (ev->seq == seq) {
+        if (pthread_cond_timeout_np(&ev->cond, &ev->lock, msecs) != 0) {
+            ret = ev->seq == seq ? -ETIMEDOUT : 0;
+            break;
+        }
+    }
+    __sync_fetch_and_sub(&ev->waiters, 1);
+    pthread_mutex_unlock(&ev->lock);
+
+    if (timing) {
+        timing->wait_us += (system_time() - begin) / 1000;
+        timing->waits++;
+    }
+
+    return ret;
+}
+
 /** audio_stream_out implementation **/
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
@@ -173,6 +266,33 @@ static int out_set_format(struct audio_stream *stream, int format)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    const struct astream_out *out = (const struct astream_out *)stream;
+    a2dp_timing_t timing;
+    char buffer[512];
+    int len;
+
+    len = snprintf(buffer, sizeof(buffer),
+                   "A2DP output: write wait %llu us (%u), "
+                   "encode busy %llu us wait %llu us (%u), "
+                   "send busy %llu us wait %llu us (%u)\n",
+                   out->write_timing.wait_us, out->write_timing.waits,
+                   out->encode_timing.busy_us, out->encode_timing.wait_us,
+                   out->encode_timing.waits,
+                   out->send_timing.busy_us, out->send_timing.wait_us,
+                   out->send_timing.waits);
+    write(fd, buffer, len);
+
+    if (out->data && a2dp_get_timing(out->data, &timing) == 0) {
+        len = snprintf(buffer, sizeof(buffer),
+                       "  packets %u dropped %u bitpool %u, encode %llu us, "
+                       "sendmsg %llu us (max %llu), throttle %llu us, "
+                       "poll %llu us\n",
+                       timing.packets, timing.dropped, timing.bitpool,
+                       timing.encode_us, timing.send_us, timing.send_max_us,
+                       timing.throttle_us, timing.poll_us);
+        write(fd, buffer, len);
+    }
+
     return 0;
 }
 
@@ -237,14 +357,23 @@ static int out_standby_stream_locked(struct astream_out *out)
         return 0;
 
     out->standby = true;
-    /* wait for write completion if needed */
-    while (out->write_busy && attempts--) {
-        ret = pthread_cond_timeout_np(&out->write_cond,
-                                &out->lock,
-                                BUF_WRITE_COMPLETION_TIMEOUT_MS);
-        LOGE_IF(ret != 0, "out_standby_stream_locked() wait cond error %d", ret);
+    /* full barrier: standby must be visible before busy is read */
+    __sync_synchronize();
+    /* wake up out_write() if it is waiting for ring space */
+    out_event_signal(&out->space_event);
+
+    /* wait for encode and send completion if needed */
+    while (out->busy && attempts--) {
+        int32_t seq = out_event_seq(&out->idle_event);
+
+        if (!out->busy)
+            break;
+        ret = out_event_wait(&out->idle_event, seq,
+                             BUF_WRITE_COMPLETION_TIMEOUT_MS, NULL);
+        LOGE_IF(ret != 0, "out_standby_stream_locked() wait error %d", ret);
     }
-    LOGE_IF(attempts == 0, "out_standby_stream_locked() a2dp_write() would not stop!!!");
+    LOGE_IF(out->busy, "out_standby_stream_locked() a2dp_write() would not stop!!!");
+    ret = 0;
 
     LOGV_IF(!out->bt_enabled, "Standby skip stop: enabled %d", out->bt_enabled);
     if (out->bt_enabled) {
@@ -355,44 +484,78 @@ static char * out_get_parameters(const struct audio_stream *stream,
     return str;
 }
 
-size_t _out_frames_available_locked(struct astream_out *out)
+/* contiguous frames out_write() can copy into the pcm ring */
+static size_t _out_frames_available(struct astream_out *out)
 {
-
-    size_t frames = out->buf_size - out->buf_frames_ready;
-    if (frames > out->buf_size - out->buf_wr_idx) {
-        frames = out->buf_size - out->buf_wr_idx;
+    size_t rd = out->buf_rd_idx;
+    size_t wr = out->buf_wr_idx;
+    size_t frames;
+
+    __sync_synchronize();
+    if (wr >= rd) {
+        frames = out->buf_size - wr;
+        /* keep one frame free so that a full ring differs from an empty one */
+        if (rd == 0)
+            frames--;
+    } else {
+        frames = rd - wr - 1;
     }
     return frames;
 }
 
-size_t _out_frames_ready_locked(struct astream_out *out)
+/* contiguous frames the encoder thread can read from the pcm ring */
+static size_t _out_frames_ready(struct astream_out *out)
 {
-    size_t frames = out->buf_frames_ready;
+    size_t rd = out->buf_rd_idx;
+    size_t wr = out->buf_wr_idx;
 
-    if (frames > out->buf_size - out->buf_rd_idx) {
-        frames = out->buf_size - out->buf_rd_idx;
-    }
-    return frames;
+    __sync_synchronize();
+    return wr >= rd ? wr - rd : out->buf_size - rd;
 }
 
-void _out_inc_wr_idx_locked(struct astream_out *out, size_t frames)
+static void _out_inc_wr_idx(struct astream_out *out, size_t frames)
 {
-    out->buf_wr_idx += frames;
-    out->buf_frames_ready += frames;
-    if (out->buf_wr_idx == out->buf_size) {
-        out->buf_wr_idx = 0;
+    size_t wr = out->buf_wr_idx + frames;
+
+    if (wr == out->buf_size) {
+        wr = 0;
     }
-    pthread_cond_signal(&out->buf_cond);
+    /* the frames must be in the ring before the index publishes them */
+    __sync_synchronize();
+    out->buf_wr_idx = wr;
+    out_event_signal(&out->data_event);
 }
 
-void _out_inc_rd_idx_locked(struct astream_out *out, size_t frames)
+static void _out_inc_rd_idx(struct astream_out *out, size_t frames)
 {
-    out->buf_rd_idx += frames;
-    out->buf_frames_ready -= frames;
-    if (out->buf_rd_idx == out->buf_size) {
-        out->buf_rd_idx = 0;
+    size_t rd = out->buf_rd_idx + frames;
+
+    if (rd >= out->buf_size) {
+        rd -= out->buf_size;
     }
-    pthread_cond_signal(&out->buf_cond);
+    __sync_synchronize();
+    out->buf_rd_idx = rd;
+    out_event_signal(&out->space_event);
+}
+
+/* a stage may only call a2dp_encode()/a2dp_send() or move buf_rd_idx between
+ * a successful _out_stage_enter() and _out_stage_exit() */
+static void _out_stage_exit(struct astream_out *out)
+{
+    __sync_fetch_and_sub(&out->busy, 1);
+    out_event_signal(&out->idle_event);
+}
+
+static bool _out_stage_enter(struct astream_out *out)
+{
+    /* full barrier: busy must be visible before standby is read, pairs with
+     * out_standby_stream_locked() */
+    __sync_fetch_and_add(&out->busy, 1);
+    if (!out->standby && out->data)
+        return true;
+
+    _out_stage_exit(out);
+    return false;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -404,7 +567,6 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     uint32_t *buf = (uint32_t *)buffer;
     size_t frames_written = 0;
 
-    pthread_mutex_lock(&out->buf_lock);
     pthread_mutex_lock(&out->lock);
     if (!out->bt_enabled || out->suspended) {
         LOGV("a2dp write: bluetooth disabled bt_en %d, suspended %d",
@@ -415,11 +577,13 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 
     if (out->standby) {
         acquire_wake_lock(PARTIAL_WAKE_LOCK, A2DP_WAKE_LOCK_NAME);
-        out->standby = false;
-        out->last_write_time = system_time();
+        /* the stages are idle during standby: drop the pcm of the stopped
+         * stream and restart the ring aligned to the codec frame size */
         out->buf_rd_idx = 0;
         out->buf_wr_idx = 0;
-        out->buf_frames_ready = 0;
+        __sync_synchronize();
+        out->standby = false;
+        out->last_write_time = system_time();
     }
 
     ret = _out_init_locked(out, NULL);
@@ -430,38 +594,39 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     pthread_mutex_unlock(&out->lock);
 
     while (frames_written < frames_total) {
-        size_t frames = _out_frames_available_locked(out);
+        int32_t seq = out_event_seq(&out->space_event);
+        size_t frames;
+
+        /* racy read, out_standby_stream_locked() wakes us up after setting it */
+        if (out->standby) {
+            pthread_mutex_lock(&out->lock);
+            goto err_write;
+        }
+
+        frames = _out_frames_available(out);
         if (frames == 0) {
-            int ret = pthread_cond_timeout_np(&out->buf_cond,
-                                              &out->buf_lock,
-                                              BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
-            if (ret != 0) {
+            if (out_event_wait(&out->space_event, seq,
+                               BUF_WRITE_AVAILABILITY_TIMEOUT_MS,
+                               &out->write_timing) != 0) {
                 pthread_mutex_lock(&out->lock);
                 goto err_write;
             }
-            frames  = _out_frames_available_locked(out);
+            continue;
         }
         if (frames > frames_total - frames_written) {
             frames = frames_total - frames_written;
         }
         memcpy(out->buf + out->buf_wr_idx, buf + frames_written, frames * sizeof(uint32_t));
         frames_written += frames;
-        _out_inc_wr_idx_locked(out, frames);
-        pthread_mutex_lock(&out->lock);
-        if (out->standby) {
-            goto err_write;
-        }
-        pthread_mutex_unlock(&out->lock);
+        _out_inc_wr_idx(out, frames);
     }
-    pthread_mutex_unlock(&out->buf_lock);
 
     return bytes;
 
-/* out->lock must be locked and out->buf_lock unlocked when jumping here */
+/* out->lock must be locked when jumping here */
 err_write:
 err_init:
 err_bt_disabled:
-    pthread_mutex_unlock(&out->buf_lock);
     LOGV("!!!! write error");
     out_standby_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
@@ -471,98 +636,114 @@ err_bt_disabled:
     return ret;
 }
 
-
 static void *_out_buf_thread_func(void *context)
 {
     struct astream_out *out = (struct astream_out *)context;
+    int retries = MAX_WRITE_RETRIES;
 
-    pthread_mutex_lock(&out->buf_lock);
-
-    while(!out->buf_thread_exit) {
+    while (!out->buf_thread_exit) {
+        int32_t seq = out_event_seq(&out->data_event);
+        int32_t sent_seq;
         size_t frames;
+        size_t bytes;
+        uint64_t begin;
+        int ret;
+
+        if (!_out_stage_enter(out)) {
+            out_event_wait(&out->data_event, seq, BUF_IDLE_TIMEOUT_MS,
+                           &out->encode_timing);
+            continue;
+        }
 
-        frames = _out_frames_ready_locked(out);
-        while (frames && !out->buf_thread_exit) {
-            int retries = MAX_WRITE_RETRIES;
-            uint64_t now;
-            uint32_t elapsed_us;
-
-            while (frames > 0 && !out->buf_thread_exit) {
-                int ret;
-                uint32_t buffer_duration_us;
-                /* PCM format is always 16bit stereo */
-                size_t bytes = frames * sizeof(uint32_t);
-                if (bytes > out->buffer_size) {
-                    bytes = out->buffer_size;
-                }
+        frames = _out_frames_ready(out);
+        if (frames == 0) {
+            _out_stage_exit(out);
+            out_event_wait(&out->data_event, seq, BUF_IDLE_TIMEOUT_MS,
+                           &out->encode_timing);
+            continue;
+        }
 
-                pthread_mutex_lock(&out->lock);
-                if (out->standby) {
-                    /* abort and clear all pending frames if standby requested */
-                    pthread_mutex_unlock(&out->lock);
-                    frames = _out_frames_ready_locked(out);
-                    _out_inc_rd_idx_locked(out, frames);
-                    goto wait;
-                }
-                /* indicate to out_standby_stream_locked() that a2dp_write() is active */
-                out->write_busy = true;
-                pthread_mutex_unlock(&out->lock);
-                pthread_mutex_unlock(&out->buf_lock);
-
-                ret = a2dp_write(out->data, out->buf + out->buf_rd_idx, bytes);
-
-                /* clear write_busy condition */
-                pthread_mutex_lock(&out->buf_lock);
-                pthread_mutex_lock(&out->lock);
-                out->write_busy = false;
-                pthread_cond_signal(&out->write_cond);
-                pthread_mutex_unlock(&out->lock);
-
-                if (ret < 0) {
-                    LOGE("%s: a2dp_write failed (%d)\n", __func__, ret);
-                    /* skip pending frames in case of write error */
-                    _out_inc_rd_idx_locked(out, frames);
-                    break;
-                } else if (ret == 0) {
-                    if (retries-- == 0) {
-                        /* skip pending frames in case of multiple time out */
-                        _out_inc_rd_idx_locked(out, frames);
-                        break;
-                    }
-                    continue;
-                }
-                ret /= sizeof(uint32_t);
-                _out_inc_rd_idx_locked(out, ret);
-                frames -= ret;
-
-                /* XXX: PLEASE FIX ME!!!! */
-
-                /* if A2DP sink runs abnormally fast, sleep a little so that
-                 * audioflinger mixer thread does no spin and starve other threads. */
-                /* NOTE: It is likely that the A2DP headset is being disconnected */
-                now = system_time();
-                elapsed_us = (now - out->last_write_time) / 1000UL;
-                buffer_duration_us = ((ret * 1000) / out->sample_rate) * 1000;
-
-                if (elapsed_us < (buffer_duration_us / 4)) {
-                    LOGV("A2DP sink runs too fast");
-                    usleep(buffer_duration_us - elapsed_us);
-                }
-                out->last_write_time = now;
+        /* PCM format is always 16bit stereo */
+        bytes = frames * sizeof(uint32_t);
+        if (bytes > out->buffer_size) {
+            bytes = out->buffer_size;
+        }
 
-            }
-            frames = _out_frames_ready_locked(out);
+        sent_seq = out_event_seq(&out->sent_event);
+        begin = system_time();
+        ret = a2dp_encode(out->data, out->buf + out->buf_rd_idx, bytes);
+        out->encode_timing.busy_us += (system_time() - begin) / 1000;
+
+        if (ret < 0) {
+            LOGE("%s: a2dp_encode failed (%d)\n", __func__, ret);
+            /* skip pending frames in case of write error */
+            _out_inc_rd_idx(out, frames);
+            _out_stage_exit(out);
+            continue;
+        }
+
+        if (ret > 0) {
+            retries = MAX_WRITE_RETRIES;
+            _out_inc_rd_idx(out, ret / sizeof(uint32_t));
+            out_event_signal(&out->packet_event);
         }
-wait:
-        if (!out->buf_thread_exit) {
-            pthread_cond_wait(&out->buf_cond, &out->buf_lock);
+
+        if ((size_t) ret < bytes) {
+            /* the packet queue is full, wait for the sender to drain it */
+            if (out_event_wait(&out->sent_event, sent_seq,
+                               BUF_IDLE_TIMEOUT_MS,
+                               &out->encode_timing) != 0 && ret == 0 &&
+                               retries-- == 0) {
+                /* skip pending frames in case of multiple time out */
+                _out_inc_rd_idx(out, frames);
+                retries = MAX_WRITE_RETRIES;
+            }
         }
+        _out_stage_exit(out);
     }
-    pthread_mutex_unlock(&out->buf_lock);
     return NULL;
 }
 
+static void *_out_send_thread_func(void *context)
+{
+    struct astream_out *out = (struct astream_out *)context;
+
+    while (!out->buf_thread_exit) {
+        int32_t seq = out_event_seq(&out->packet_event);
+        uint64_t begin;
+        int ret;
+
+        if (!_out_stage_enter(out)) {
+            out_event_wait(&out->packet_event, seq, BUF_IDLE_TIMEOUT_MS,
+                           &out->send_timing);
+            continue;
+        }
+
+        if (a2dp_pending(out->data) == 0) {
+            _out_stage_exit(out);
+            out_event_wait(&out->packet_event, seq, BUF_IDLE_TIMEOUT_MS,
+                           &out->send_timing);
+            continue;
+        }
+
+        begin = system_time();
+        ret = a2dp_send(out->data);
+        out->send_timing.busy_us += (system_time() - begin) / 1000;
+        _out_stage_exit(out);
 
+        /* packets were sent or dropped, either way there is room now */
+        out_event_signal(&out->sent_event);
+
+        if (ret <= 0) {
+            if (ret < 0)
+                LOGE("%s: a2dp_send failed (%d)\n", __func__, ret);
+            /* stream not started yet: do not spin on the queued packets */
+            out_event_wait(&out->packet_event, seq, BUF_IDLE_TIMEOUT_MS,
+                           &out->send_timing);
+        }
+    }
+    return NULL;
+}
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
@@ -666,18 +847,35 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         goto err_validate_parms;
     }
 
-    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
-    if (err != 0) {
-        goto err_validate_parms;
-    }
-
     /* PCM format is always 16bit, stereo */
     out->buf_size = (out->buffer_size * BUF_NUM_PERIODS) / sizeof(int32_t);
     out->buf = (uint32_t *)malloc(out->buf_size * sizeof(int32_t));
     if (!out->buf) {
+        ret = -ENOMEM;
         goto err_validate_parms;
     }
 
+    out_event_init(&out->space_event);
+    out_event_init(&out->data_event);
+    out_event_init(&out->packet_event);
+    out_event_init(&out->sent_event);
+    out_event_init(&out->idle_event);
+
+    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
+    if (err != 0) {
+        ret = -err;
+        goto err_events;
+    }
+
+    err = pthread_create(&out->send_thread, (const pthread_attr_t *) NULL, _out_send_thread_func, out);
+    if (err != 0) {
+        out->buf_thread_exit = true;
+        out_event_signal(&out->data_event);
+        pthread_join(out->buf_thread, (void **) NULL);
+        ret = -err;
+        goto err_events;
+    }
+
     /* XXX: check return code? */
     if (adev->bt_enabled)
         _out_init_locked(out, "00:00:00:00:00:00");
@@ -697,6 +895,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     return 0;
 
+err_events:
+    out_event_destroy(&out->space_event);
+    out_event_destroy(&out->data_event);
+    out_event_destroy(&out->packet_event);
+    out_event_destroy(&out->sent_event);
+    out_event_destroy(&out->idle_event);
+    free(out->buf);
 err_validate_parms:
     free(out);
 err_alloc:
@@ -725,13 +930,17 @@ static void adev_close_output_stream_locked(struct adev_a2dp *dev,
     out_close_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
     if (out->buf_thread) {
-        pthread_mutex_lock(&out->buf_lock);
         out->buf_thread_exit = true;
-        pthread_cond_broadcast(&out->buf_cond);
-        pthread_mutex_unlock(&out->buf_lock);
+        out_event_signal(&out->data_event);
+        out_event_signal(&out->sent_event);
+        out_event_signal(&out->packet_event);
         pthread_join(out->buf_thread, (void **) NULL);
-        pthread_cond_destroy(&out->buf_cond);
-        pthread_mutex_destroy(&out->buf_lock);
+        pthread_join(out->send_thread, (void **) NULL);
+        out_event_destroy(&out->space_event);
+        out_event_destroy(&out->data_event);
+        out_event_destroy(&out->packet_event);
+        out_event_destroy(&out->sent_event);
+    out_event_destroy(&out->idle_event);
     }
     if (out->buf) {
         free(out->buf);
@@ -33,6 +33,8 @@
 #include <unistd.h>
 #include <assert.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <bluetooth/bluetooth.h>
@@ -47,15 +49,18 @@
 #include "../src/adapter.h"
 #include "../src/manager.h"
 #include "../src/device.h"
+#include "../src/storage.h"
 
 #include "device.h"
 #include "manager.h"
 #include "control.h"
 #include "avdtp.h"
+#include "stats.h"
 #include "glib-helper.h"
 #include "btio.h"
 #include "sink.h"
 #include "source.h"
+#include "mmsg.h"
 
 #define AVDTP_PSM 25
 
@@ -90,6 +95,13 @@
 #define DISCONNECT_TIMEOUT 1
 #define STREAM_TIMEOUT 20
 
+/* Fragments of a signalling message handed to the socket at once */
+#define AVDTP_SEND_BATCH 16
+
+/* GET_CAPABILITIES requests kept outstanding during discovery */
+#define GETCAP_WINDOW 4
+#define MAX_GETCAP_WINDOW 8
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
 struct avdtp_common_header {
@@ -375,6 +387,7 @@ struct avdtp_stream {
 	gboolean delay_reporting;
 	uint16_t delay;		/* AVDTP 1.3 Delay Reporting feature */
 	gboolean starting;	/* only valid while sep state == OPEN */
+	struct media_stats stats;
 };
 
 /* Structure describing an AVDTP connection between two devices */
@@ -420,6 +433,18 @@ struct avdtp {
 
 	struct pending_req *req;
 
+	/* Capability requests of a discovery not yet sent and the ones
+	 * waiting for a response, which are matched by transaction label */
+	GSList *getcap_queue;
+	GSList *getcap_reqs;
+	guint getcap_window;
+	guint getcap_timer;
+
+	/* Remote SEPs were restored from storage instead of discovered,
+	 * stale once the remote rejected a configuration for them */
+	gboolean seps_cached;
+	gboolean seps_stale;
+
 	guint dc_timer;
 
 	/* Attempt stream setup instead of disconnecting */
@@ -434,6 +459,10 @@ static GSList *avdtp_callbacks = NULL;
 
 static gboolean auto_connect = TRUE;
 
+static guint getcap_window = GETCAP_WINDOW;
+
+static gboolean cache_seps = TRUE;
+
 static int send_request(struct avdtp *session, gboolean priority,
 			struct avdtp_stream *stream, uint8_t signal_id,
 			void *buffer, size_t size);
@@ -447,6 +476,9 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 					void *buf, int size);
 static int process_queue(struct avdtp *session);
 static void connection_lost(struct avdtp *session, int err);
+static void getcap_clear(struct avdtp *session);
+static gboolean getcap_resp(struct avdtp *session,
+				struct avdtp_common_header *header);
 static void avdtp_sep_set_state(struct avdtp *session,
 				struct avdtp_local_sep *sep,
 				avdtp_state_t state);
@@ -484,33 +516,66 @@ static const char *avdtp_statestr(avdtp_state_t state)
 	}
 }
 
-static gboolean try_send(int sk, void *data, size_t len)
+/* Each message is one L2CAP packet made of a header and a slice of the
+ * caller's payload, they go out in as few system calls as possible */
+static gboolean try_send(int sk, struct audio_mmsghdr *msgs,
+							unsigned int count)
 {
+	unsigned int sent = 0, i;
+	size_t len;
 	int err;
 
-	do {
-		err = send(sk, data, len, 0);
-	} while (err < 0 && errno == EINTR);
+	while (sent < count) {
+		err = audio_sendmmsg(sk, msgs + sent, count - sent, 0);
+		if (err < 0 && errno == EINTR)
+			continue;
 
-	if (err < 0) {
-		error("send: %s (%d)", strerror(errno), errno);
-		return FALSE;
-	} else if ((size_t) err != len) {
-		error("try_send: complete buffer not sent (%d/%zu bytes)",
-								err, len);
-		return FALSE;
+		if (err < 0) {
+			error("send: %s (%d)", strerror(errno), errno);
+			return FALSE;
+		}
+
+		for (i = sent; i < sent + err; i++) {
+			struct msghdr *hdr = &msgs[i].msg_hdr;
+
+			len = hdr->msg_iov[0].iov_len + hdr->msg_iov[1].iov_len;
+			if (msgs[i].msg_len != len) {
+				error("try_send: complete buffer not sent "
+					"(%u/%zu bytes)", msgs[i].msg_len, len);
+				return FALSE;
+			}
+		}
+
+		sent += err;
 	}
 
 	return TRUE;
 }
 
+static void fragment_init(struct audio_mmsghdr *msg, struct iovec *iov,
+				void *header, size_t header_len,
+				void *data, size_t len)
+{
+	memset(msg, 0, sizeof(*msg));
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	msg->msg_hdr.msg_iov = iov;
+	msg->msg_hdr.msg_iovlen = 2;
+}
+
 static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 				uint8_t message_type, uint8_t signal_id,
 				void *data, size_t len)
 {
-	unsigned int cont_fragments, sent;
+	unsigned int cont_fragments, sent, n;
 	struct avdtp_start_header start;
-	struct avdtp_continue_header cont;
+	struct avdtp_continue_header cont[AVDTP_SEND_BATCH];
+	struct audio_mmsghdr msgs[AVDTP_SEND_BATCH];
+	struct iovec iov[AVDTP_SEND_BATCH][2];
 	int sock;
 
 	if (session->io == NULL) {
@@ -531,10 +596,10 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 		single.message_type = message_type;
 		single.signal_id = signal_id;
 
-		memcpy(session->buf, &single, sizeof(single));
-		memcpy(session->buf + sizeof(single), data, len);
+		fragment_init(&msgs[0], iov[0], &single, sizeof(single),
+								data, len);
 
-		return try_send(sock, session->buf, sizeof(single) + len);
+		return try_send(sock, msgs, 1);
 	}
 
 	/* Check if there is enough space to start packet */
@@ -545,11 +610,11 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 
 	/* Count the number of needed fragments */
 	cont_fragments = (len - (session->omtu - sizeof(start))) /
-					(session->omtu - sizeof(cont)) + 1;
+					(session->omtu - sizeof(cont[0])) + 1;
 
 	DBG("%zu bytes split into %d fragments", len, cont_fragments + 1);
 
-	/* Send the start packet */
+	/* Queue the start packet */
 	memset(&start, 0, sizeof(start));
 	start.transaction = transaction;
 	start.packet_type = AVDTP_PKT_TYPE_START;
@@ -557,45 +622,42 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 	start.no_of_packets = cont_fragments + 1;
 	start.signal_id = signal_id;
 
-	memcpy(session->buf, &start, sizeof(start));
-	memcpy(session->buf + sizeof(start), data,
-					session->omtu - sizeof(start));
-
-	if (!try_send(sock, session->buf, session->omtu))
-		return FALSE;
-
-	DBG("first packet with %zu bytes sent", session->omtu - sizeof(start));
-
 	sent = session->omtu - sizeof(start);
+	fragment_init(&msgs[0], iov[0], &start, sizeof(start), data, sent);
+	n = 1;
 
-	/* Send the continue fragments and the end packet */
+	/* Queue the continue fragments and the end packet, the headers
+	 * live on the stack and the payload is sent from where it is */
 	while (sent < len) {
-		int left, to_copy;
+		size_t left, to_copy;
 
 		left = len - sent;
-		if (left + sizeof(cont) > session->omtu) {
-			cont.packet_type = AVDTP_PKT_TYPE_CONTINUE;
-			to_copy = session->omtu - sizeof(cont);
-			DBG("sending continue with %d bytes", to_copy);
+		memset(&cont[n], 0, sizeof(cont[n]));
+		if (left + sizeof(cont[n]) > session->omtu) {
+			cont[n].packet_type = AVDTP_PKT_TYPE_CONTINUE;
+			to_copy = session->omtu - sizeof(cont[n]);
 		} else {
-			cont.packet_type = AVDTP_PKT_TYPE_END;
+			cont[n].packet_type = AVDTP_PKT_TYPE_END;
 			to_copy = left;
-			DBG("sending end with %d bytes", to_copy);
 		}
 
-		cont.transaction = transaction;
-		cont.message_type = message_type;
-
-		memcpy(session->buf, &cont, sizeof(cont));
-		memcpy(session->buf + sizeof(cont), data + sent, to_copy);
-
-		if (!try_send(sock, session->buf, to_copy + sizeof(cont)))
-			return FALSE;
+		cont[n].transaction = transaction;
+		cont[n].message_type = message_type;
 
+		fragment_init(&msgs[n], iov[n], &cont[n], sizeof(cont[n]),
+					(uint8_t *) data + sent, to_copy);
 		sent += to_copy;
+
+		if (++n == AVDTP_SEND_BATCH && sent < len) {
+			if (!try_send(sock, msgs, n))
+				return FALSE;
+			n = 0;
+		}
 	}
 
-	return TRUE;
+	DBG("sending %u fragments with %zu bytes", cont_fragments + 1, len);
+
+	return try_send(sock, msgs, n);
 }
 
 static void pending_req_free(struct pending_req *req)
@@ -1150,6 +1212,8 @@ static void connection_lost(struct avdtp *session, int err)
 
 	session->free_lock = 1;
 
+	getcap_clear(session);
+
 	finalize_discovery(session, err);
 
 	g_slist_foreach(session->streams, (GFunc) release_stream, session);
@@ -1229,6 +1293,8 @@ void avdtp_unref(struct avdtp *session)
 	if (session->req)
 		pending_req_free(session->req);
 
+	getcap_clear(session);
+
 	g_slist_foreach(session->seps, (GFunc) g_free, NULL);
 	g_slist_free(session->seps);
 
@@ -1339,6 +1405,157 @@ static GSList *caps_to_list(uint8_t *data, int size,
 	return caps;
 }
 
+static void remote_sep_free(struct avdtp_remote_sep *sep)
+{
+	g_slist_foreach(sep->caps, (GFunc) g_free, NULL);
+	g_slist_free(sep->caps);
+	g_free(sep);
+}
+
+/* Stored as space separated "SEID:TYPE:MEDIA:CAPS" entries where CAPS are
+ * the service capabilities in their wire format, hex encoded */
+static void store_remote_seps(struct avdtp *session)
+{
+	GString *str;
+	GSList *l, *c;
+
+	str = g_string_new(NULL);
+
+	for (l = session->seps; l != NULL; l = l->next) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		if (sep->codec == NULL)
+			continue;
+
+		if (str->len > 0)
+			g_string_append_c(str, ' ');
+
+		g_string_append_printf(str, "%02X:%02X:%02X:", sep->seid,
+						sep->type, sep->media_type);
+
+		for (c = sep->caps; c != NULL; c = c->next) {
+			struct avdtp_service_capability *cap = c->data;
+			uint8_t *data = (uint8_t *) cap;
+			int i;
+
+			for (i = 0; i < 2 + cap->length; i++)
+				g_string_append_printf(str, "%02X", data[i]);
+		}
+	}
+
+	if (str->len > 0)
+		write_avdtp_seps(&session->server->src, &session->dst,
+								str->str);
+
+	g_string_free(str, TRUE);
+}
+
+static struct avdtp_remote_sep *parse_remote_sep(const char *entry)
+{
+	struct avdtp_remote_sep *sep;
+	uint8_t seid, type, media_type, *caps;
+	size_t len, i;
+
+	len = strlen(entry);
+	if (len < 9 || entry[8] != ':' || (len - 9) % 2)
+		return NULL;
+
+	if (sscanf(entry, "%02hhX:%02hhX:%02hhX:", &seid, &type,
+							&media_type) != 3)
+		return NULL;
+
+	len = (len - 9) / 2;
+	caps = g_malloc(len);
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(entry + 9 + i * 2, "%02hhX", &caps[i]) != 1) {
+			g_free(caps);
+			return NULL;
+		}
+	}
+
+	sep = g_new0(struct avdtp_remote_sep, 1);
+	sep->seid = seid;
+	sep->type = type;
+	sep->media_type = media_type;
+	sep->caps = caps_to_list(caps, len, &sep->codec,
+						&sep->delay_reporting);
+
+	g_free(caps);
+
+	if (sep->codec == NULL) {
+		remote_sep_free(sep);
+		return NULL;
+	}
+
+	return sep;
+}
+
+static void load_remote_seps(struct avdtp *session)
+{
+	char *str, **entries;
+	int i;
+
+	str = read_avdtp_seps(&session->server->src, &session->dst);
+	if (str == NULL)
+		return;
+
+	entries = g_strsplit(str, " ", 0);
+
+	for (i = 0; entries[i] != NULL; i++) {
+		struct avdtp_remote_sep *sep = parse_remote_sep(entries[i]);
+
+		if (sep == NULL) {
+			error("Invalid stored SEP: %s", entries[i]);
+			continue;
+		}
+
+		DBG("seid %d type %d media %d from storage", sep->seid,
+						sep->type, sep->media_type);
+
+		session->seps = g_slist_append(session->seps, sep);
+	}
+
+	g_strfreev(entries);
+	free(str);
+
+	session->seps_cached = session->seps != NULL;
+}
+
+/* The stored SEPs turned out to be unusable, make the next connection
+ * discover them again */
+static void forget_remote_seps(struct avdtp *session)
+{
+	if (!session->seps_cached)
+		return;
+
+	DBG("Removing stored SEPs");
+
+	delete_avdtp_seps(&session->server->src, &session->dst);
+	session->seps_cached = FALSE;
+	session->seps_stale = TRUE;
+}
+
+/* Drop stale SEPs that no stream refers to so they get discovered */
+static void remove_stale_seps(struct avdtp *session)
+{
+	GSList *l, *next;
+
+	session->seps_stale = FALSE;
+
+	for (l = session->seps; l != NULL; l = next) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		next = l->next;
+
+		if (sep->stream)
+			continue;
+
+		session->seps = g_slist_remove(session->seps, sep);
+		remote_sep_free(sep);
+	}
+}
+
 static gboolean avdtp_unknown_cmd(struct avdtp *session, uint8_t transaction,
 							uint8_t signal_id)
 {
@@ -1911,6 +2128,8 @@ static gboolean avdtp_delayreport_cmd(struct avdtp *session,
 	}
 
 	stream->delay = ntohs(req->delay);
+	stream->stats.delay = stream->delay;
+	stream->stats.delay_reports++;
 
 	if (sep->ind && sep->ind->delayreport) {
 		if (!sep->ind->delayreport(session, sep, stream->rseid,
@@ -2150,7 +2369,8 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 			goto failed;
 		}
 
-		if (session->ref == 1 && !session->streams && !session->req)
+		if (session->ref == 1 && !session->streams && !session->req &&
+							!session->getcap_reqs)
 			set_disconnect_timer(session);
 
 		if (session->streams && session->dc_timer)
@@ -2159,6 +2379,14 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		return TRUE;
 	}
 
+	if (session->getcap_reqs &&
+		(session->in.signal_id == AVDTP_GET_CAPABILITIES ||
+		session->in.signal_id == AVDTP_GET_ALL_CAPABILITIES)) {
+		if (!getcap_resp(session, header))
+			goto failed;
+		return TRUE;
+	}
+
 	if (session->req == NULL) {
 		error("No pending request, ignoring message");
 		return TRUE;
@@ -2607,6 +2835,7 @@ static int cancel_request(struct avdtp *session, int err)
 		break;
 	case AVDTP_SET_CONFIGURATION:
 		error("SetConfiguration: %s (%d)", strerror(err), err);
+		forget_remote_seps(session);
 		if (lsep && lsep->cfm && lsep->cfm->set_configuration)
 			lsep->cfm->set_configuration(session, lsep, stream,
 							&averr, lsep->user_data);
@@ -2653,10 +2882,19 @@ static gboolean request_timeout(gpointer user_data)
 	return FALSE;
 }
 
+static uint8_t next_transaction(void)
+{
+	static uint8_t transaction = 0;
+	uint8_t label = transaction;
+
+	transaction = (transaction + 1) % 16;
+
+	return label;
+}
+
 static int send_req(struct avdtp *session, gboolean priority,
 			struct pending_req *req)
 {
-	static int transaction = 0;
 	int err;
 
 	if (session->state == AVDTP_SESSION_STATE_DISCONNECTED) {
@@ -2669,13 +2907,12 @@ static int send_req(struct avdtp *session, gboolean priority,
 	}
 
 	if (session->state < AVDTP_SESSION_STATE_CONNECTED ||
-			session->req != NULL) {
+			session->req != NULL || session->getcap_reqs != NULL) {
 		queue_request(session, req, priority);
 		return 0;
 	}
 
-	req->transaction = transaction++;
-	transaction %= 16;
+	req->transaction = next_transaction();
 
 	/* FIXME: Should we retry to send if the buffer
 	was not totally sent or in case of EINTR? */
@@ -2720,6 +2957,108 @@ static int send_request(struct avdtp *session, gboolean priority,
 	return send_req(session, priority, req);
 }
 
+static gboolean getcap_timeout(gpointer user_data);
+
+/* Send queued capability requests until the window is full */
+static int getcap_send(struct avdtp *session)
+{
+	struct pending_req *req;
+
+	while (session->getcap_queue &&
+			g_slist_length(session->getcap_reqs) <
+						session->getcap_window) {
+		req = session->getcap_queue->data;
+		session->getcap_queue = g_slist_remove(session->getcap_queue,
+									req);
+
+		req->transaction = next_transaction();
+
+		if (!avdtp_send(session, req->transaction,
+					AVDTP_MSG_TYPE_COMMAND, req->signal_id,
+					req->data, req->data_size)) {
+			pending_req_free(req);
+			return -EIO;
+		}
+
+		session->getcap_reqs = g_slist_append(session->getcap_reqs,
+									req);
+	}
+
+	if (session->getcap_reqs && !session->getcap_timer)
+		session->getcap_timer = g_timeout_add_seconds(REQ_TIMEOUT,
+							getcap_timeout,
+							session);
+
+	return 0;
+}
+
+static void getcap_clear(struct avdtp *session)
+{
+	if (session->getcap_timer) {
+		g_source_remove(session->getcap_timer);
+		session->getcap_timer = 0;
+	}
+
+	g_slist_foreach(session->getcap_queue, (GFunc) pending_req_free, NULL);
+	g_slist_free(session->getcap_queue);
+	session->getcap_queue = NULL;
+
+	g_slist_foreach(session->getcap_reqs, (GFunc) pending_req_free, NULL);
+	g_slist_free(session->getcap_reqs);
+	session->getcap_reqs = NULL;
+}
+
+/* Keep the pipeline going and complete the discovery once every SEP has
+ * answered */
+static void getcap_next(struct avdtp *session)
+{
+	int err;
+
+	err = getcap_send(session);
+	if (err < 0) {
+		getcap_clear(session);
+		finalize_discovery(session, -err);
+		process_queue(session);
+		return;
+	}
+
+	if (session->getcap_reqs)
+		return;
+
+	if (cache_seps && session->seps)
+		store_remote_seps(session);
+
+	finalize_discovery(session, 0);
+
+	process_queue(session);
+}
+
+static gboolean getcap_timeout(gpointer user_data)
+{
+	struct avdtp *session = user_data;
+
+	session->getcap_timer = 0;
+
+	if (session->getcap_window > 1) {
+		/* The remote may not cope with several outstanding
+		 * commands, retry what is left one at a time */
+		error("GetCapabilities: %s, disabling pipelining",
+							strerror(ETIMEDOUT));
+		session->getcap_queue = g_slist_concat(session->getcap_reqs,
+							session->getcap_queue);
+		session->getcap_reqs = NULL;
+		session->getcap_window = 1;
+		getcap_next(session);
+		return FALSE;
+	}
+
+	error("GetCapabilities: %s (%d)", strerror(ETIMEDOUT), ETIMEDOUT);
+	getcap_clear(session);
+	connection_lost(session, ETIMEDOUT);
+
+	return FALSE;
+}
+
 static gboolean avdtp_discover_resp(struct avdtp *session,
 					struct discover_resp *resp, int size)
 {
@@ -2736,8 +3075,8 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 	for (i = 0; i < sep_count; i++) {
 		struct avdtp_remote_sep *sep;
 		struct avdtp_stream *stream;
-		struct seid_req req;
-		int ret;
+		struct pending_req *req;
+		struct seid_req sreq;
 
 		DBG("seid %d type %d media %d in use %d",
 				resp->seps[i].seid, resp->seps[i].type,
@@ -2758,26 +3097,32 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 		sep->type = resp->seps[i].type;
 		sep->media_type = resp->seps[i].media_type;
 
-		memset(&req, 0, sizeof(req));
-		req.acp_seid = sep->seid;
+		memset(&sreq, 0, sizeof(sreq));
+		sreq.acp_seid = sep->seid;
 
-		ret = send_request(session, TRUE, NULL, getcap_cmd,
-							&req, sizeof(req));
-		if (ret < 0) {
-			finalize_discovery(session, -ret);
-			break;
-		}
+		req = g_new0(struct pending_req, 1);
+		req->signal_id = getcap_cmd;
+		req->data = g_memdup(&sreq, sizeof(sreq));
+		req->data_size = sizeof(sreq);
+
+		session->getcap_queue = g_slist_append(session->getcap_queue,
+									req);
 	}
 
+	/* The capability requests carry their own transaction labels so
+	 * several of them can be outstanding at once */
+	session->getcap_window = getcap_window;
+	getcap_next(session);
+
 	return TRUE;
 }
 
 static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
+						uint8_t seid,
 						struct getcap_resp *resp,
 						unsigned int size)
 {
 	struct avdtp_remote_sep *sep;
-	uint8_t seid;
 
 	/* Check for minimum required packet size includes:
 	 *   1. getcap resp header
@@ -2791,9 +3136,11 @@ static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
 		return FALSE;
 	}
 
-	seid = ((struct seid_req *) session->req->data)->acp_seid;
-
 	sep = find_remote_sep(session->seps, seid);
+	if (sep == NULL) {
+		error("getcap resp for unknown seid %d", seid);
+		return TRUE;
+	}
 
 	DBG("seid %d type %d media %d", sep->seid,
 					sep->type, sep->media_type);
@@ -2812,6 +3159,76 @@ static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
 	return TRUE;
 }
 
+/* Responses to capability requests are matched by transaction label as
+ * several can be outstanding */
+static gboolean getcap_resp(struct avdtp *session,
+				struct avdtp_common_header *header)
+{
+	struct pending_req *req = NULL;
+	gboolean ret = TRUE;
+	GSList *l;
+
+	for (l = session->getcap_reqs; l != NULL; l = l->next) {
+		struct pending_req *tmp = l->data;
+
+		if (tmp->transaction == header->transaction) {
+			req = tmp;
+			break;
+		}
+	}
+
+	if (req == NULL) {
+		error("Transaction label doesn't match");
+		return TRUE;
+	}
+
+	if (session->in.signal_id != req->signal_id) {
+		error("Reponse signal doesn't match");
+		return TRUE;
+	}
+
+	session->getcap_reqs = g_slist_remove(session->getcap_reqs, req);
+
+	/* Restarted by getcap_send for the requests still outstanding */
+	g_source_remove(session->getcap_timer);
+	session->getcap_timer = 0;
+
+	switch (header->message_type) {
+	case AVDTP_MSG_TYPE_ACCEPT:
+		DBG("GET_%sCAPABILITIES request succeeded",
+			req->signal_id == AVDTP_GET_ALL_CAPABILITIES ?
+								"ALL_" : "");
+		ret = avdtp_get_capabilities_resp(session,
+				((struct seid_req *) req->data)->acp_seid,
+				(void *) session->in.buf,
+				session->in.data_size);
+		if (!ret)
+			error("Unable to parse accept response");
+		break;
+	case AVDTP_MSG_TYPE_REJECT:
+		ret = avdtp_parse_rej(session, NULL, header->transaction,
+						session->in.signal_id,
+						session->in.buf,
+						session->in.data_size);
+		if (!ret)
+			error("Unable to parse reject response");
+		break;
+	case AVDTP_MSG_TYPE_GEN_REJECT:
+		error("Received a General Reject message");
+		break;
+	default:
+		error("Unknown message type 0x%02X", header->message_type);
+		break;
+	}
+
+	pending_req_free(req);
+
+	if (ret)
+		getcap_next(session);
+
+	return ret;
+}
+
 static gboolean avdtp_set_configuration_resp(struct avdtp *session,
 						struct avdtp_stream *stream,
 						struct avdtp_single_header *resp,
@@ -2928,30 +3345,10 @@ static gboolean avdtp_parse_resp(struct avdtp *session,
 					uint8_t transaction, uint8_t signal_id,
 					void *buf, int size)
 {
-	struct pending_req *next;
-	const char *get_all = "";
-
-	if (session->prio_queue)
-		next = session->prio_queue->data;
-	else if (session->req_queue)
-		next = session->req_queue->data;
-	else
-		next = NULL;
-
 	switch (signal_id) {
 	case AVDTP_DISCOVER:
 		DBG("DISCOVER request succeeded");
 		return avdtp_discover_resp(session, buf, size);
-	case AVDTP_GET_ALL_CAPABILITIES:
-		get_all = "ALL_";
-	case AVDTP_GET_CAPABILITIES:
-		DBG("GET_%sCAPABILITIES request succeeded", get_all);
-		if (!avdtp_get_capabilities_resp(session, buf, size))
-			return FALSE;
-		if (!(next && (next->signal_id == AVDTP_GET_CAPABILITIES ||
-				next->signal_id == AVDTP_GET_ALL_CAPABILITIES)))
-			finalize_discovery(session, 0);
-		return TRUE;
 	}
 
 	/* The remaining commands require an existing stream so bail out
@@ -3073,6 +3470,7 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 			return FALSE;
 		error("SET_CONFIGURATION request rejected: %s (%d)",
 				avdtp_strerror(&err), err.err.error_code);
+		forget_remote_seps(session);
 		if (sep && sep->cfm && sep->cfm->set_configuration)
 			sep->cfm->set_configuration(session, sep, stream,
 							&err, sep->user_data);
@@ -3236,12 +3634,17 @@ gboolean avdtp_stream_get_transport(struct avdtp_stream *stream, int *sock,
 	return TRUE;
 }
 
+struct media_stats *avdtp_stream_get_stats(struct avdtp_stream *stream)
+{
+	return &stream->stats;
+}
+
 static int process_queue(struct avdtp *session)
 {
 	GSList **queue, *l;
 	struct pending_req *req;
 
-	if (session->req)
+	if (session->req || session->getcap_reqs)
 		return 0;
 
 	if (session->prio_queue)
@@ -3333,6 +3736,13 @@ int avdtp_discover(struct avdtp *session, avdtp_discover_cb_t cb,
 	if (session->discov_cb)
 		return -EBUSY;
 
+	if (session->seps_stale)
+		remove_stale_seps(session);
+
+	/* Known devices can skip the discovery and capability requests */
+	if (!session->seps && cache_seps)
+		load_remote_seps(session);
+
 	if (session->seps) {
 		session->discov_cb = cb;
 		session->user_data = user_data;
@@ -3824,6 +4234,7 @@ int avdtp_init(const bdaddr_t *src, GKeyFile *config, uint16_t *version)
 	gboolean tmp, master = TRUE;
 	struct avdtp_server *server;
 	uint16_t ver = 0x0102;
+	int window;
 
 	if (!config)
 		goto proceed;
@@ -3846,6 +4257,20 @@ int avdtp_init(const bdaddr_t *src, GKeyFile *config, uint16_t *version)
 	if (g_key_file_get_boolean(config, "A2DP", "DelayReporting", NULL))
 		ver = 0x0103;
 
+	window = g_key_file_get_integer(config, "A2DP", "CapabilityRequests",
+									&err);
+	if (err)
+		g_clear_error(&err);
+	else
+		getcap_window = CLAMP(window, 1, MAX_GETCAP_WINDOW);
+
+	tmp = g_key_file_get_boolean(config, "A2DP", "CacheCapabilities",
+									&err);
+	if (err)
+		g_clear_error(&err);
+	else
+		cache_seps = tmp;
+
 proceed:
 	server = g_new0(struct avdtp_server, 1);
 	if (!server)
@@ -32,6 +32,7 @@ struct avdtp;
 struct avdtp_stream;
 struct avdtp_local_sep;
 struct avdtp_remote_sep;
+struct media_stats;
 struct avdtp_error {
 	uint8_t category;
 	union {
@@ -258,6 +259,7 @@ gboolean avdtp_stream_remove_cb(struct avdtp *session,
 gboolean avdtp_stream_get_transport(struct avdtp_stream *stream, int *sock,
 					uint16_t *imtu, uint16_t *omtu,
 					GSList **caps);
+struct media_stats *avdtp_stream_get_stats(struct avdtp_stream *stream);
 struct avdtp_service_capability *avdtp_stream_get_codec(
 						struct avdtp_stream *stream);
 gboolean avdtp_stream_has_capability(struct avdtp_stream *stream,
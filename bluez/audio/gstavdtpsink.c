@@ -42,6 +42,7 @@
 #include "ipc.h"
 #include "rtp.h"
 #include "a2dp-codecs.h"
+#include "a2dp-sender.h"
 
 #include "gstpragma.h"
 #include "gstavdtpsink.h"
@@ -79,6 +80,8 @@ struct bluetooth_data {
 	gint config_size;
 
 	gchar buffer[BUFFER_SIZE];	/* Codec transfer buffer */
+
+	struct a2dp_sender sender;	/* Batches RTP packets to the stream */
 };
 
 #define IS_SBC(n) (strcmp((n), "audio/x-sbc") == 0)
@@ -478,6 +481,8 @@ proceed:
 
 	memset(data->buffer, 0, sizeof(data->buffer));
 
+	a2dp_sender_init(&data->sender, fd, data->link_mtu);
+
 	return TRUE;
 }
 
@@ -1716,23 +1721,94 @@ static GstFlowReturn gst_avdtp_sink_preroll(GstBaseSink *basesink,
 	return GST_FLOW_OK;
 }
 
+static GstFlowReturn gst_avdtp_sink_flush(GstAvdtpSink *self)
+{
+	struct a2dp_sender *sender = &self->data->sender;
+	int ret;
+
+	/* The stream socket is blocking, so this only returns early on
+	 * errors */
+	while (a2dp_sender_pending(sender) > 0) {
+		ret = a2dp_sender_flush(sender, MSG_NOSIGNAL);
+		if (ret < 0 && ret != -EINTR) {
+			GST_ERROR_OBJECT(self, "Error while writting to "
+					"socket: %s", strerror(-ret));
+			a2dp_sender_discard(sender);
+			return GST_FLOW_ERROR;
+		}
+	}
+
+	return GST_FLOW_OK;
+}
+
 static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
 					GstBuffer *buffer)
 {
 	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
-	ssize_t ret;
-	int fd;
+	struct iovec iov;
 
-	fd = g_io_channel_unix_get_fd(self->stream);
+	/* The payloader hands over complete RTP packets */
+	iov.iov_base = GST_BUFFER_DATA(buffer);
+	iov.iov_len = GST_BUFFER_SIZE(buffer);
 
-	ret = write(fd, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer));
-	if (ret < 0) {
-		GST_ERROR_OBJECT(self, "Error while writting to socket: %s",
-							strerror(errno));
+	if (a2dp_sender_queue_rtp(&self->data->sender, &iov, 1) < 0)
 		return GST_FLOW_ERROR;
+
+	return gst_avdtp_sink_flush(self);
+}
+
+/* Each group of the list is one RTP packet, possibly split into header
+ * and payload buffers.  The buffers stay referenced by the list until we
+ * return, so they are sent from where they are and a whole list goes out
+ * in as few sendmmsg() calls as the sender allows. */
+static GstFlowReturn gst_avdtp_sink_render_list(GstBaseSink *basesink,
+						GstBufferList *list)
+{
+	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
+	struct a2dp_sender *sender = &self->data->sender;
+	GstBufferListIterator *it;
+	GstFlowReturn ret = GST_FLOW_OK;
+	struct iovec iov[A2DP_SENDER_MAX_IOV];
+	GstBuffer *buffer;
+	guint n;
+
+	it = gst_buffer_list_iterate(list);
+
+	while (ret == GST_FLOW_OK &&
+			gst_buffer_list_iterator_next_group(it)) {
+		n = 0;
+		while ((buffer = gst_buffer_list_iterator_next(it)) != NULL) {
+			if (n == A2DP_SENDER_MAX_IOV) {
+				GST_ERROR_OBJECT(self, "Too many buffers "
+							"in RTP packet");
+				ret = GST_FLOW_ERROR;
+				break;
+			}
+
+			iov[n].iov_base = GST_BUFFER_DATA(buffer);
+			iov[n].iov_len = GST_BUFFER_SIZE(buffer);
+			n++;
+		}
+
+		if (ret != GST_FLOW_OK || n == 0)
+			continue;
+
+		if (a2dp_sender_queue_rtp(sender, iov, n) == -ENOBUFS) {
+			ret = gst_avdtp_sink_flush(self);
+			if (ret == GST_FLOW_OK &&
+				a2dp_sender_queue_rtp(sender, iov, n) < 0)
+				ret = GST_FLOW_ERROR;
+		}
 	}
 
-	return GST_FLOW_OK;
+	gst_buffer_list_iterator_free(it);
+
+	if (ret != GST_FLOW_OK) {
+		a2dp_sender_discard(sender);
+		return ret;
+	}
+
+	return gst_avdtp_sink_flush(self);
 }
 
 static gboolean gst_avdtp_sink_unlock(GstBaseSink *basesink)
@@ -1782,6 +1858,8 @@ static void gst_avdtp_sink_class_init(GstAvdtpSinkClass *klass)
 	basesink_class->stop = GST_DEBUG_FUNCPTR(gst_avdtp_sink_stop);
 	basesink_class->render = GST_DEBUG_FUNCPTR(
 					gst_avdtp_sink_render);
+	basesink_class->render_list = GST_DEBUG_FUNCPTR(
+					gst_avdtp_sink_render_list);
 	basesink_class->preroll = GST_DEBUG_FUNCPTR(
 					gst_avdtp_sink_preroll);
 	basesink_class->unlock = GST_DEBUG_FUNCPTR(
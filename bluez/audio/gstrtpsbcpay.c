@@ -32,7 +32,6 @@
 
 #define RTP_SBC_PAYLOAD_HEADER_SIZE 1
 #define DEFAULT_MIN_FRAMES 0
-#define RTP_SBC_HEADER_TOTAL (12 + RTP_SBC_PAYLOAD_HEADER_SIZE)
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -153,6 +152,8 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 				bitpool, channel_mode);
 
 	sbcpay->frame_length = frame_len;
+	sbcpay->frame_samples = blocks * subbands;
+	sbcpay->rate = rate;
 
 	gst_basertppayload_set_options(payload, "audio", TRUE, "SBC", rate);
 
@@ -209,27 +210,175 @@ static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
 	return gst_basertppayload_push(GST_BASE_RTP_PAYLOAD(sbcpay), outbuf);
 }
 
+static GstBuffer *gst_rtp_sbc_pay_new_header(GstRtpSBCPay *sbcpay,
+						guint frame_count)
+{
+	GstBuffer *buf;
+	struct rtp_payload *payload;
+
+	buf = gst_buffer_new_and_alloc(RTP_SBC_PAYLOAD_HEADER_SIZE);
+
+	payload = (struct rtp_payload *) GST_BUFFER_DATA(buf);
+	memset(payload, 0, sizeof(struct rtp_payload));
+	payload->frame_count = frame_count;
+
+	return buf;
+}
+
+/* Timestamp of the frame that starts at the given frame index */
+static GstClockTime gst_rtp_sbc_pay_frame_time(GstRtpSBCPay *sbcpay,
+				GstClockTime timestamp, guint frames)
+{
+	if (!GST_CLOCK_TIME_IS_VALID(timestamp) || sbcpay->rate <= 0)
+		return timestamp;
+
+	return timestamp + gst_util_uint64_scale_int(
+			(guint64) frames * sbcpay->frame_samples,
+			GST_SECOND, sbcpay->rate);
+}
+
+/* Frames that fit in one packet, at most 15 for the SBC payload header */
+static guint gst_rtp_sbc_pay_max_frames(GstRtpSBCPay *sbcpay)
+{
+	guint max_frames;
+
+	max_frames = gst_rtp_buffer_calc_payload_len(
+		GST_BASE_RTP_PAYLOAD_MTU(sbcpay) - RTP_SBC_PAYLOAD_HEADER_SIZE,
+		0, 0) / sbcpay->frame_length;
+
+	return MIN(max_frames, 15);
+}
+
+/* Packetize a buffer without copying its frames: every packet becomes a
+ * group of the RTP header, the SBC payload header and a subbuffer of the
+ * input, which the sink gathers straight into the socket. A tail too
+ * short to be sent on its own is left in the adapter, and sbcpay->timestamp
+ * then holds the time of its first frame. */
+static GstFlowReturn gst_rtp_sbc_pay_push_frames(GstRtpSBCPay *sbcpay,
+				GstBuffer *buffer, GstClockTime timestamp)
+{
+	GstBufferList *list;
+	GstBufferListIterator *it;
+	guint size, offset = 0, frames = 0;
+	guint max_frames, min_frames;
+
+	size = GST_BUFFER_SIZE(buffer);
+	max_frames = gst_rtp_sbc_pay_max_frames(sbcpay);
+
+	/* min-frames -1 asks for packets as full as the MTU allows */
+	min_frames = MIN(sbcpay->min_frames, max_frames);
+
+	list = gst_buffer_list_new();
+	it = gst_buffer_list_iterate(list);
+
+	while (offset < size) {
+		GstBuffer *header;
+		guint frame_count, length;
+
+		frame_count = MIN(max_frames,
+				(size - offset) / sbcpay->frame_length);
+		length = frame_count * sbcpay->frame_length;
+
+		if (frame_count < max_frames && frame_count <= min_frames) {
+			gst_adapter_push(sbcpay->adapter,
+				gst_buffer_create_sub(buffer, offset,
+							size - offset));
+			break;
+		}
+
+		header = gst_rtp_buffer_new_allocate(0, 0, 0);
+		gst_rtp_buffer_set_payload_type(header,
+				GST_BASE_RTP_PAYLOAD_PT(sbcpay));
+		GST_BUFFER_TIMESTAMP(header) = gst_rtp_sbc_pay_frame_time(
+						sbcpay, timestamp, frames);
+
+		gst_buffer_list_iterator_add_group(it);
+		gst_buffer_list_iterator_add(it, header);
+		gst_buffer_list_iterator_add(it,
+				gst_rtp_sbc_pay_new_header(sbcpay,
+							frame_count));
+		gst_buffer_list_iterator_add(it,
+				gst_buffer_create_sub(buffer, offset, length));
+
+		offset += length;
+		frames += frame_count;
+	}
+
+	sbcpay->timestamp = gst_rtp_sbc_pay_frame_time(sbcpay, timestamp,
+								frames);
+
+	gst_buffer_list_iterator_free(it);
+	gst_buffer_unref(buffer);
+
+	if (gst_buffer_list_n_groups(list) == 0) {
+		gst_buffer_list_unref(list);
+		return GST_FLOW_OK;
+	}
+
+	GST_DEBUG_OBJECT(sbcpay, "Pushing %d bytes in %d packets", offset,
+					gst_buffer_list_n_groups(list));
+
+	return gst_basertppayload_push_list(GST_BASE_RTP_PAYLOAD(sbcpay),
+									list);
+}
+
 static GstFlowReturn gst_rtp_sbc_pay_handle_buffer(GstBaseRTPPayload *payload,
 			GstBuffer *buffer)
 {
 	GstRtpSBCPay *sbcpay;
-	guint available;
+	GstClockTime timestamp;
+	guint available, max_frames;
 
 	/* FIXME check for negotiation */
 
 	sbcpay = GST_RTP_SBC_PAY(payload);
-	sbcpay->timestamp = GST_BUFFER_TIMESTAMP(buffer);
 
-	gst_adapter_push(sbcpay->adapter, buffer);
+	if (sbcpay->frame_length == 0) {
+		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
+		gst_buffer_unref(buffer);
+		return GST_FLOW_ERROR;
+	}
+
+	max_frames = gst_rtp_sbc_pay_max_frames(sbcpay);
+	if (max_frames == 0) {
+		GST_ERROR_OBJECT(sbcpay, "MTU too small for a frame");
+		gst_buffer_unref(buffer);
+		return GST_FLOW_ERROR;
+	}
 
+	timestamp = GST_BUFFER_TIMESTAMP(buffer);
+
+	/* Complete a pending tail to a full packet with the head of the new
+	 * data. Only that packet is copied and the adapter never holds more
+	 * than one packet. */
 	available = gst_adapter_available(sbcpay->adapter);
-	if (available + RTP_SBC_HEADER_TOTAL >=
-				GST_BASE_RTP_PAYLOAD_MTU(sbcpay) ||
-			(available >
-				(sbcpay->min_frames * sbcpay->frame_length)))
-		return gst_rtp_sbc_pay_flush_buffers(sbcpay);
+	if (available > 0) {
+		GstBuffer *head, *rest;
+		GstFlowReturn ret;
+		guint size, fill;
+
+		size = GST_BUFFER_SIZE(buffer);
+		fill = MIN(size, max_frames * sbcpay->frame_length - available);
+
+		head = gst_buffer_join(
+			gst_adapter_take_buffer(sbcpay->adapter, available),
+			gst_buffer_create_sub(buffer, 0, fill));
+
+		ret = gst_rtp_sbc_pay_push_frames(sbcpay, head,
+							sbcpay->timestamp);
+		if (ret != GST_FLOW_OK || fill == size) {
+			gst_buffer_unref(buffer);
+			return ret;
+		}
+
+		rest = gst_buffer_create_sub(buffer, fill, size - fill);
+		gst_buffer_unref(buffer);
+
+		buffer = rest;
+		timestamp = sbcpay->timestamp;
+	}
 
-	return GST_FLOW_OK;
+	return gst_rtp_sbc_pay_push_frames(sbcpay, buffer, timestamp);
 }
 
 static gboolean gst_rtp_sbc_pay_handle_event(GstPad *pad,
@@ -51,6 +51,8 @@ struct _GstRtpSBCPay {
 	GstClockTime timestamp;
 
 	guint frame_length;
+	guint frame_samples;
+	gint rate;
 
 	guint min_frames;
 };
@@ -60,11 +60,9 @@ static GstFlowReturn sbc_dec_chain(GstPad *pad, GstBuffer *buffer)
 {
 	GstSbcDec *dec = GST_SBC_DEC(gst_pad_get_parent(pad));
 	GstFlowReturn res = GST_FLOW_OK;
-	guint size, codesize, offset = 0;
+	guint size, offset = 0;
 	guint8 *data;
 
-	codesize = sbc_get_codesize(&dec->sbc);
-
 	if (dec->buffer) {
 		GstBuffer *temp = buffer;
 		buffer = gst_buffer_span(dec->buffer, 0, buffer,
@@ -81,20 +79,41 @@ static GstFlowReturn sbc_dec_chain(GstPad *pad, GstBuffer *buffer)
 		GstBuffer *output;
 		GstPadTemplate *template;
 		GstCaps *caps;
-		int consumed;
+		guint codesize, frames;
+		int framelen, consumed;
+		size_t written;
+
+		/* The header of the next frame tells its length, assume the
+		 * following frames share it and decode all of them into one
+		 * output buffer.  A frame with a different length just ends
+		 * the batch and starts the next one. */
+		framelen = sbc_parse(&dec->sbc, data + offset, size - offset);
+		if (framelen <= 0)
+			break;
+
+		frames = (size - offset) / framelen;
+		if (frames == 0)
+			break;
+
+		codesize = sbc_get_codesize(&dec->sbc);
 
 		res = gst_pad_alloc_buffer_and_set_caps(dec->srcpad,
 						GST_BUFFER_OFFSET_NONE,
-						codesize, NULL, &output);
-
+						frames * codesize, NULL,
+						&output);
 		if (res != GST_FLOW_OK)
 			goto done;
 
-		consumed = sbc_decode(&dec->sbc, data + offset, size - offset,
-					GST_BUFFER_DATA(output), codesize,
-					NULL);
-		if (consumed <= 0)
+		consumed = sbc_decode_frames(&dec->sbc, data + offset,
+					frames * framelen,
+					GST_BUFFER_DATA(output),
+					GST_BUFFER_SIZE(output), &written);
+		if (consumed <= 0) {
+			gst_buffer_unref(output);
 			break;
+		}
+
+		GST_BUFFER_SIZE(output) = written;
 
 		/* we will reuse the same caps object */
 		if (dec->outcaps == NULL) {
@@ -376,32 +376,41 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 		GstBuffer *output;
 		GstCaps *caps;
 		const guint8 *data;
+		guint available, frames;
 		gint consumed;
+		ssize_t written;
+
+		/* encode all complete frames available in one go */
+		available = gst_adapter_available(adapter);
+		frames = available / enc->codesize;
+		available = frames * enc->codesize;
 
 		caps = GST_PAD_CAPS(enc->srcpad);
 		res = gst_pad_alloc_buffer_and_set_caps(enc->srcpad,
 						GST_BUFFER_OFFSET_NONE,
-						enc->frame_length, caps,
-						&output);
+						frames * enc->frame_length,
+						caps, &output);
 		if (res != GST_FLOW_OK)
 			goto done;
 
-		data = gst_adapter_peek(adapter, enc->codesize);
+		data = gst_adapter_peek(adapter, available);
 
-		consumed = sbc_encode(&enc->sbc, (gpointer) data,
-					enc->codesize,
+		consumed = sbc_encode_frames(&enc->sbc, (gpointer) data,
+					available,
 					GST_BUFFER_DATA(output),
-					GST_BUFFER_SIZE(output), NULL);
+					GST_BUFFER_SIZE(output), &written);
 		if (consumed <= 0) {
 			GST_DEBUG_OBJECT(enc, "comsumed < 0, codesize: %d",
 					enc->codesize);
+			gst_buffer_unref(output);
 			break;
 		}
 		gst_adapter_flush(adapter, consumed);
 
+		GST_BUFFER_SIZE(output) = written;
 		GST_BUFFER_TIMESTAMP(output) = GST_BUFFER_TIMESTAMP(buffer);
-		/* we have only 1 frame */
-		GST_BUFFER_DURATION(output) = enc->frame_duration;
+		GST_BUFFER_DURATION(output) = enc->frame_duration *
+						(consumed / enc->codesize);
 
 		res = gst_pad_push(enc->srcpad, output);
 
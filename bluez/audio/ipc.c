@@ -93,19 +93,26 @@ int bt_audio_service_close(int sk)
 	return close(sk);
 }
 
-int bt_audio_service_get_data_fd(int sk)
+/* Receives count file descriptors passed together, as with the ring memfd
+ * and eventfd of BT_SHM_STREAM_RSP */
+int bt_audio_service_get_data_fds(int sk, int *fds, int count)
 {
-	char cmsg_b[CMSG_SPACE(sizeof(int))], m;
+	char cmsg_b[CMSG_SPACE(2 * sizeof(int))], m;
 	int err, ret;
 	struct iovec iov = { &m, sizeof(m) };
 	struct msghdr msgh;
 	struct cmsghdr *cmsg;
 
+	if (count < 1 || count > 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
 	msgh.msg_iovlen = 1;
 	msgh.msg_control = &cmsg_b;
-	msgh.msg_controllen = CMSG_LEN(sizeof(int));
+	msgh.msg_controllen = CMSG_LEN(count * sizeof(int));
 
 	ret = recvmsg(sk, &msgh, 0);
 	if (ret < 0) {
@@ -121,8 +128,23 @@ int bt_audio_service_get_data_fd(int sk)
 			cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
 		if (cmsg->cmsg_level == SOL_SOCKET
 				&& cmsg->cmsg_type == SCM_RIGHTS) {
-			memcpy(&ret, CMSG_DATA(cmsg), sizeof(int));
-			return ret;
+			int i, received;
+
+			received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (received == count) {
+				memcpy(fds, CMSG_DATA(cmsg),
+						count * sizeof(int));
+				return 0;
+			}
+
+			/* Do not leak what came in place of what we wanted */
+			for (i = 0; i < received; i++) {
+				memcpy(&ret, CMSG_DATA(cmsg) + i * sizeof(int),
+								sizeof(int));
+				close(ret);
+			}
+
+			break;
 		}
 	}
 
@@ -130,6 +152,16 @@ int bt_audio_service_get_data_fd(int sk)
 	return -1;
 }
 
+int bt_audio_service_get_data_fd(int sk)
+{
+	int fd;
+
+	if (bt_audio_service_get_data_fds(sk, &fd, 1) < 0)
+		return -1;
+
+	return fd;
+}
+
 const char *bt_audio_strtype(uint8_t type)
 {
 	if (type >= ARRAY_SIZE(strtypes))
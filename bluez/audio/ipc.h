@@ -57,6 +57,37 @@
 
  */
 
+/*
+  Message sequence chart of shared memory streaming for A2DP transport
+
+  Audio daemon			User
+				on snd_pcm_hw_params
+				<--BT_SET_CONFIGURATION_REQ
+
+  BT_SET_CONFIGURATION_RSP-->
+
+				<--BT_SHM_STREAM_REQ
+
+  BT_SHM_STREAM_RSP-->
+  <ring memfd + eventfd>
+
+				on snd_pcm_prepare
+				<--BT_START_STREAM_REQ
+
+  BT_START_STREAM_RSP-->
+
+  BT_NEW_STREAM_IND -->
+  <no stream fd, the daemon encodes>
+
+				< writes PCM to the ring,
+				  signals the eventfd >
+				..........
+
+  Further clients of the same device may send BT_SHM_STREAM_REQ without
+  opening the stream themselves, their PCM is mixed into the same stream.
+
+ */
+
 #ifndef BT_AUDIOCLIENT_H
 #define BT_AUDIOCLIENT_H
 
@@ -102,6 +133,7 @@ typedef struct {
 #define BT_CLOSE			6
 #define BT_CONTROL			7
 #define BT_DELAY_REPORT			8
+#define BT_SHM_STREAM			9
 
 #define BT_CAPABILITIES_TRANSPORT_A2DP	0
 #define BT_CAPABILITIES_TRANSPORT_SCO	1
@@ -335,6 +367,35 @@ struct bt_delay_report_ind {
 	uint16_t		delay;
 } __attribute__ ((packed));
 
+/* Shared memory PCM ring, mapped from the memfd passed with
+ * BT_SHM_STREAM_RSP.  The client writes interleaved native endian 16 bit
+ * samples and advances head, then writes to the eventfd; the daemon
+ * consumes from tail.  Both are free running byte counters, the data
+ * offset is the counter modulo size. */
+#define BT_SHM_RING_MAGIC		0x62745043	/* "btPC" */
+
+struct bt_shm_ring {
+	uint32_t		magic;
+	uint32_t		size;		/* Bytes of data, power of two */
+	volatile uint32_t	head;		/* Written by the client */
+	volatile uint32_t	tail;		/* Written by the daemon */
+	uint8_t			data[0];
+};
+
+struct bt_shm_stream_req {
+	bt_audio_msg_header_t	h;
+	uint32_t		size;		/* Requested ring size, 0 for default */
+} __attribute__ ((packed));
+
+/* This message is followed by one byte of data containing the ring memfd
+   and the eventfd as ancilliary data */
+struct bt_shm_stream_rsp {
+	bt_audio_msg_header_t	h;
+	uint32_t		size;		/* Ring size */
+	uint16_t		rate;		/* Sampling rate */
+	uint8_t			channels;	/* Interleaved channels */
+} __attribute__ ((packed));
+
 /* Function declaration */
 
 /* Opens a connection to the audio service: return a socket descriptor */
@@ -347,6 +408,9 @@ int bt_audio_service_close(int sk);
 BT_STREAMFD_IND message is returned */
 int bt_audio_service_get_data_fd(int sk);
 
+/* Receive several file descriptors, returns 0 on success */
+int bt_audio_service_get_data_fds(int sk, int *fds, int count);
+
 /* Human readable message type string */
 const char *bt_audio_strtype(uint8_t type);
 
@@ -38,6 +38,7 @@
 #include <netinet/in.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
+#include <sys/uio.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -45,6 +46,8 @@
 #include "ipc.h"
 #include "sbc.h"
 #include "rtp.h"
+#include "a2dp-bitpool.h"
+#include "a2dp-sender.h"
 #include "liba2dp.h"
 
 #define LOG_NDEBUG 0
@@ -53,7 +56,6 @@
 
 #define ENABLE_DEBUG
 /* #define ENABLE_VERBOSE */
-/* #define ENABLE_TIMING */
 
 #define BUFFER_SIZE 2048
 
@@ -85,6 +87,9 @@
 /* Number of packets to buffer in the stream socket */
 #define PACKET_BUFFER_COUNT		10
 
+/* Number of packets that can be encoded ahead of the stream socket */
+#define PACKET_RING_SIZE		4
+
 /* timeout in milliseconds to prevent poll() from hanging indefinitely */
 #define POLL_TIMEOUT			1000
 
@@ -118,6 +123,15 @@ typedef enum {
 	A2DP_CMD_QUIT,
 } a2dp_command_t;
 
+struct a2dp_packet {
+	uint8_t frames[BUFFER_SIZE];		/* Encoded SBC frames */
+	unsigned int len;			/* Bytes used in frames */
+	int frame_count;			/* Number of frames in packet */
+	unsigned int samples;			/* PCM samples per channel */
+	unsigned int gen;			/* Stream generation of packet */
+	uint64_t first_try;			/* First transmission attempt */
+};
+
 struct bluetooth_data {
 	unsigned int link_mtu;			/* MTU for transport channel */
 	struct pollfd stream;			/* Audio stream filedescriptor */
@@ -133,15 +147,36 @@ struct bluetooth_data {
 
 	sbc_capabilities_t sbc_capabilities;
 	sbc_t sbc;				/* Codec data */
+	struct a2dp_bitpool bitpool;		/* Adaptive bitpool controller */
 	int	frame_duration;			/* length of an SBC frame in microseconds */
 	int codesize;				/* SBC codesize */
-	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	int count;				/* Codec transfer buffer counter */
 
-	int nsamples;				/* Cumulative number of codec samples */
-	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
+	/* ring_head is the packet being encoded, ring_tail .. ring_head - 1
+	 * are complete packets waiting for the stream socket.  The encoder
+	 * only moves ring_head and the sender only moves ring_tail, so the
+	 * two may run in different threads (see a2dp_encode/a2dp_send) */
+	struct a2dp_packet ring[PACKET_RING_SIZE];
+	volatile unsigned int ring_head;
+	volatile unsigned int ring_tail;
+	volatile unsigned int stream_gen;	/* Bumped on every stream start */
+	unsigned int send_gen;			/* Generation the sender paces */
+	volatile uint8_t next_bitpool;		/* Bitpool chosen by the sender */
+
+	/* Owned by the sender, holds the oldest packets of the ring while
+	 * they are being flushed to the stream socket */
+	struct a2dp_sender sender;
+
+	/* Held by the sender while it uses stream.fd, a2dp_thread takes it
+	 * to replace or close the socket.  Never taken under mutex by the
+	 * sender, a2dp_thread does take it with mutex held. */
+	pthread_mutex_t stream_lock;
+	/* Stream generation the sender found broken, a2dp_thread closes the
+	 * connection when it is still the current one */
+	volatile unsigned int broken_gen;
+
+	/* The encoder, the sender and a2dp_thread all update the counters */
+	pthread_mutex_t timing_lock;
+	a2dp_timing_t timing;			/* Exported timing counters */
 
 	char	address[20];
 	int	rate;
@@ -158,12 +193,24 @@ static uint64_t get_microseconds()
 	return (now.tv_sec * 1000000UL + now.tv_nsec / 1000UL);
 }
 
-#ifdef ENABLE_TIMING
-static void print_time(const char* message, uint64_t then, uint64_t now)
+static void __timing_add(unsigned long long *total, unsigned long long *max,
+						uint64_t then, uint64_t now)
 {
-	DBG("%s: %lld us", message, now - then);
+	uint64_t delta = now - then;
+
+	*total += delta;
+	if (max && delta > *max)
+		*max = delta;
+}
+
+static void timing_add(struct bluetooth_data *data,
+			unsigned long long *total, unsigned long long *max,
+			uint64_t then, uint64_t now)
+{
+	pthread_mutex_lock(&data->timing_lock);
+	__timing_add(total, max, then, now);
+	pthread_mutex_unlock(&data->timing_lock);
 }
-#endif
 
 static int audioservice_send(struct bluetooth_data *data, const bt_audio_msg_header_t *msg);
 static int audioservice_expect(struct bluetooth_data *data, bt_audio_msg_header_t *outmsg,
@@ -172,6 +219,21 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data);
 static void set_state(struct bluetooth_data *data, a2dp_state_t state);
 
 
+/* Only called by a2dp_thread, which owns stream.fd.  The shutdown wakes
+ * a sender blocked in poll() so the lock is released promptly. */
+static void stream_close(struct bluetooth_data *data)
+{
+	if (data->stream.fd < 0)
+		return;
+
+	shutdown(data->stream.fd, SHUT_RDWR);
+
+	pthread_mutex_lock(&data->stream_lock);
+	close(data->stream.fd);
+	data->stream.fd = -1;
+	pthread_mutex_unlock(&data->stream_lock);
+}
+
 static void bluetooth_close(struct bluetooth_data *data)
 {
 	DBG("bluetooth_close");
@@ -180,10 +242,7 @@ static void bluetooth_close(struct bluetooth_data *data)
 		data->server.fd = -1;
 	}
 
-	if (data->stream.fd >= 0) {
-		close(data->stream.fd);
-		data->stream.fd = -1;
-	}
+	stream_close(data);
 
 	data->state = A2DP_STATE_NONE;
 }
@@ -220,7 +279,7 @@ static int bluetooth_start(struct bluetooth_data *data)
 	struct bt_start_stream_req *start_req = (void*) buf;
 	struct bt_start_stream_rsp *start_rsp = (void*) buf;
 	struct bt_new_stream_ind *streamfd_ind = (void*) buf;
-	int opt_name, err, bytes;
+	int opt_name, err, bytes, fd;
 
 	DBG("bluetooth_start");
 	data->state = A2DP_STATE_STARTING;
@@ -245,27 +304,39 @@ static int bluetooth_start(struct bluetooth_data *data)
 	if (err < 0)
 		goto error;
 
-	data->stream.fd = bt_audio_service_get_data_fd(data->server.fd);
-	if (data->stream.fd < 0) {
+	fd = bt_audio_service_get_data_fd(data->server.fd);
+	if (fd < 0) {
 		ERR("bt_audio_service_get_data_fd failed, errno: %d", errno);
 		err = -errno;
 		goto error;
 	}
-	l2cap_set_flushable(data->stream.fd, 1);
-	data->stream.events = POLLOUT;
+	l2cap_set_flushable(fd, 1);
 
 	/* set our socket buffer to the size of PACKET_BUFFER_COUNT packets */
 	bytes = data->link_mtu * PACKET_BUFFER_COUNT;
-	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
-			sizeof(bytes));
-
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->nsamples = 0;
-	data->seq_num = 0;
-	data->frame_count = 0;
-	data->next_write = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+
+	pthread_mutex_lock(&data->stream_lock);
+	data->stream.fd = fd;
+	data->stream.events = POLLOUT;
+	pthread_mutex_unlock(&data->stream_lock);
+
+	/* The encoder is blocked in wait_for_start() so its side of the ring
+	 * can be reset here; packets still queued from the previous stream
+	 * are dropped by the sender once it sees the new generation */
+	data->ring[data->ring_head % PACKET_RING_SIZE].len = 0;
+	data->ring[data->ring_head % PACKET_RING_SIZE].frame_count = 0;
+	data->ring[data->ring_head % PACKET_RING_SIZE].samples = 0;
+
+	pthread_mutex_lock(&data->timing_lock);
+	memset(&data->timing, 0, sizeof(data->timing));
+	pthread_mutex_unlock(&data->timing_lock);
+
+	/* start every stream at the best quality the link agreed on and let
+	 * the controller back off from there */
+	data->next_bitpool = data->sbc_capabilities.max_bitpool;
+	data->sbc.bitpool = data->next_bitpool;
+	data->stream_gen++;
 
 	set_state(data, A2DP_STATE_STARTED);
 	return 0;
@@ -291,10 +362,7 @@ static int bluetooth_stop(struct bluetooth_data *data)
 
 	data->state = A2DP_STATE_STOPPING;
 	l2cap_set_flushable(data->stream.fd, 0);
-	if (data->stream.fd >= 0) {
-		close(data->stream.fd);
-		data->stream.fd = -1;
-	}
+	stream_close(data);
 
 	/* send stop request */
 	memset(stop_req, 0, BT_SUGGESTED_BUFFER_SIZE);
@@ -317,42 +385,6 @@ error:
 	return err;
 }
 
-static uint8_t default_bitpool(uint8_t freq, uint8_t mode)
-{
-	switch (freq) {
-	case BT_SBC_SAMPLING_FREQ_16000:
-	case BT_SBC_SAMPLING_FREQ_32000:
-		return 53;
-	case BT_SBC_SAMPLING_FREQ_44100:
-		switch (mode) {
-		case BT_A2DP_CHANNEL_MODE_MONO:
-		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
-			return 31;
-		case BT_A2DP_CHANNEL_MODE_STEREO:
-		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
-			return 53;
-		default:
-			ERR("Invalid channel mode %u", mode);
-			return 53;
-		}
-	case BT_SBC_SAMPLING_FREQ_48000:
-		switch (mode) {
-		case BT_A2DP_CHANNEL_MODE_MONO:
-		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
-			return 29;
-		case BT_A2DP_CHANNEL_MODE_STEREO:
-		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
-			return 51;
-		default:
-			ERR("Invalid channel mode %u", mode);
-			return 51;
-		}
-	default:
-		ERR("Invalid sampling freq %u", freq);
-		return 53;
-	}
-}
-
 static int bluetooth_a2dp_init(struct bluetooth_data *data)
 {
 	sbc_capabilities_t *cap = &data->sbc_capabilities;
@@ -422,7 +454,7 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data)
 		cap->allocation_method = BT_A2DP_ALLOCATION_SNR;
 
 		min_bitpool = MAX(MIN_BITPOOL, cap->min_bitpool);
-		max_bitpool = MIN(default_bitpool(cap->frequency,
+		max_bitpool = MIN(a2dp_default_bitpool(cap->frequency,
 					cap->channel_mode),
 					cap->max_bitpool);
 
@@ -636,97 +668,314 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	return 0;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+static unsigned int avdtp_queued(struct bluetooth_data *data)
 {
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
+	unsigned int queued = data->ring_head - data->ring_tail;
 
-	uint64_t now;
-	long duration = data->frame_duration * data->frame_count;
-#ifdef ENABLE_TIMING
-	uint64_t begin, end, begin2, end2;
-	begin = get_microseconds();
-#endif
+	/* order the index read before any access to the packets */
+	__sync_synchronize();
+
+	return queued;
+}
 
-	header = (struct rtp_header *)data->buffer;
-	payload = (struct rtp_payload *)(data->buffer + sizeof(*header));
+static void avdtp_queue_packet(struct bluetooth_data *data)
+{
+	struct a2dp_packet *pkt = &data->ring[data->ring_head % PACKET_RING_SIZE];
 
-	memset(data->buffer, 0, sizeof(*header) + sizeof(*payload));
+	pkt->gen = data->stream_gen;
+	pkt->first_try = 0;
 
-	payload->frame_count = data->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(data->seq_num);
-	header->timestamp = htonl(data->nsamples);
-	header->ssrc = htonl(1);
+	/* publish the packet before handing it to the sender */
+	__sync_synchronize();
+	data->ring_head++;
 
-	data->stream.revents = 0;
-#ifdef ENABLE_TIMING
-	begin2 = get_microseconds();
-#endif
-	ret = poll(&data->stream, 1, POLL_TIMEOUT);
-#ifdef ENABLE_TIMING
-	end2 = get_microseconds();
-	print_time("poll", begin2, end2);
-#endif
-	if (ret == 1 && data->stream.revents == POLLOUT) {
-		long ahead = 0;
+	/* the next slot was released by the sender, start it empty */
+	pkt = &data->ring[data->ring_head % PACKET_RING_SIZE];
+	pkt->len = 0;
+	pkt->frame_count = 0;
+	pkt->samples = 0;
+}
+
+static void avdtp_packet_done(struct bluetooth_data *data,
+				struct a2dp_packet *pkt, uint64_t now,
+				int dropped)
+{
+	long duration = data->frame_duration * pkt->frame_count;
+
+	/* the encoder picks the new bitpool up at its next packet */
+	if (data->stream.fd >= 0)
+		data->next_bitpool = a2dp_bitpool_update(&data->bitpool,
+						data->stream.fd,
+						now - pkt->first_try,
+						duration, dropped);
+
+	pthread_mutex_lock(&data->timing_lock);
+	if (dropped)
+		data->timing.dropped++;
+	else
+		data->timing.packets++;
+	data->timing.bitpool = data->next_bitpool;
+	pthread_mutex_unlock(&data->timing_lock);
+
+	__sync_synchronize();
+	data->ring_tail++;
+}
+
+/* Returns 0 if pkt belongs to the stream being sent, otherwise drops it */
+static int avdtp_check_generation(struct bluetooth_data *data,
+						struct a2dp_packet *pkt)
+{
+	if (pkt->gen == data->send_gen)
+		return 0;
+
+	if (pkt->gen != data->stream_gen) {
+		/* left over from a stream that has been stopped */
+		__sync_synchronize();
+		data->ring_tail++;
+		return -1;
+	}
+
+	/* first packet of a new stream: restart pacing, adaptation and the
+	 * RTP sequence */
+	data->send_gen = pkt->gen;
+	data->next_write = 0;
+	a2dp_sender_init(&data->sender, data->stream.fd, data->link_mtu);
+	a2dp_bitpool_init(&data->bitpool, data->sbc_capabilities.min_bitpool,
+				data->sbc_capabilities.max_bitpool,
+				data->link_mtu * PACKET_BUFFER_COUNT / 2);
+
+	return 0;
+}
+
+/* Drop the packets the sender holds, they either belong to a stream that
+ * has been stopped or could not be sent */
+static void avdtp_drop_pending(struct bluetooth_data *data, uint64_t now)
+{
+	unsigned int i, pending = a2dp_sender_pending(&data->sender);
+
+	a2dp_sender_discard(&data->sender);
+
+	for (i = 0; i < pending; i++)
+		avdtp_packet_done(data,
+			&data->ring[data->ring_tail % PACKET_RING_SIZE],
+			now, 1);
+}
+
+/* Ask a2dp_thread to close the connection of a stream the remote end
+ * has gone away from, the next write then reconnects */
+static void avdtp_stream_broken(struct bluetooth_data *data,
+							unsigned int gen)
+{
+	pthread_mutex_lock(&data->mutex);
+	data->broken_gen = gen;
+	pthread_cond_signal(&data->thread_wait);
+	pthread_mutex_unlock(&data->mutex);
+}
+
+/* Send queued packets whose pacing deadline has passed.  All due packets
+ * are handed to the sender and flushed together, packets that are not
+ * yet due, or that do not fit into the socket, stay in the ring so that
+ * encoding can continue.  With block set the oldest packet is sent even
+ * if that means sleeping for its deadline or polling for socket space.
+ * Returns the number of packets handed to the socket. */
+static int avdtp_write(struct bluetooth_data *data, int block)
+{
+	struct a2dp_sender *sender = &data->sender;
+	struct a2dp_packet *pkt;
+	uint64_t now, begin;
+	long duration, ahead;
+	unsigned int n, broken = 0;
+	int sent = 0, ret;
+
+	pthread_mutex_lock(&data->stream_lock);
+
+	while (1) {
+		n = a2dp_sender_pending(sender);
 		now = get_microseconds();
 
-		if (data->next_write) {
+		if (n > 0 && data->ring[data->ring_tail %
+				PACKET_RING_SIZE].gen != data->stream_gen) {
+			/* the stream was restarted behind our back */
+			avdtp_drop_pending(data, now);
+			n = 0;
+		}
+
+		/* Queue due packets behind the ones the sender still holds */
+		while (avdtp_queued(data) > n && n < A2DP_SENDER_MAX_PACKETS) {
+			pkt = &data->ring[(data->ring_tail + n) %
+							PACKET_RING_SIZE];
+			if (pkt->gen != data->send_gen) {
+				if (n > 0)
+					break;
+				if (avdtp_check_generation(data, pkt) < 0)
+					continue;
+			}
+
+			duration = data->frame_duration * pkt->frame_count;
+
+			if (!data->next_write)
+				data->next_write = now;
+
 			ahead = data->next_write - now;
-#ifdef ENABLE_TIMING
-			DBG("duration: %ld, ahead: %ld", duration, ahead);
-#endif
 			if (ahead > 0) {
+				if (!block || sent || n > 0)
+					break;
+
 				/* too fast, need to throttle */
 				usleep(ahead);
+				pthread_mutex_lock(&data->timing_lock);
+				data->timing.throttle_us += ahead;
+				pthread_mutex_unlock(&data->timing_lock);
+				now = get_microseconds();
 			}
-		} else {
-			data->next_write = now;
+
+			if (!pkt->first_try)
+				pkt->first_try = now;
+
+			if (a2dp_sender_queue(sender, pkt->frames, pkt->len,
+						pkt->frame_count,
+						pkt->samples) < 0)
+				break;
+
+			if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
+				/* fallen too far behind, don't try to catch up */
+				VDBG("ahead < %d, reseting next_write timestamp", -CATCH_UP_TIMEOUT * 1000);
+				data->next_write = 0;
+			} else {
+				data->next_write += duration;
+			}
+
+			n++;
 		}
-		if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
-			/* fallen too far behind, don't try to catch up */
-			VDBG("ahead < %d, reseting next_write timestamp", -CATCH_UP_TIMEOUT * 1000);
-			data->next_write = 0;
-		} else {
-			data->next_write += duration;
+
+		if (n == 0)
+			break;
+
+		begin = now;
+		sender->fd = data->stream.fd;
+		ret = a2dp_sender_flush(sender, MSG_DONTWAIT | MSG_NOSIGNAL);
+		now = get_microseconds();
+		timing_add(data, &data->timing.send_us,
+				&data->timing.send_max_us, begin, now);
+
+		if (ret > 0) {
+			sent += ret;
+			while (ret-- > 0)
+				avdtp_packet_done(data,
+					&data->ring[data->ring_tail %
+							PACKET_RING_SIZE],
+					now, 0);
+			continue;
 		}
 
-#ifdef ENABLE_TIMING
-		begin2 = get_microseconds();
-#endif
-		ret = send(data->stream.fd, data->buffer, data->count, MSG_NOSIGNAL);
-#ifdef ENABLE_TIMING
-		end2 = get_microseconds();
-		print_time("send", begin2, end2);
-#endif
-		if (ret < 0) {
+		if (ret == -EAGAIN) {
+			if (!block || sent)
+				break;
+
+			/* wait for the socket to drain */
+			data->stream.revents = 0;
+			ret = poll(&data->stream, 1, POLL_TIMEOUT);
+			timing_add(data, &data->timing.poll_us, NULL, now,
+							get_microseconds());
+			if (ret == 1 && data->stream.revents == POLLOUT)
+				continue;
+
 			/* can happen during normal remote disconnect */
-			VDBG("send() failed: %d (errno %s)", ret, strerror(errno));
-		}
-		if (ret == -EPIPE) {
-			bluetooth_close(data);
+			VDBG("poll() failed: %d (revents = %d, errno %s)",
+				ret, data->stream.revents, strerror(errno));
+			data->next_write = 0;
+			avdtp_drop_pending(data, get_microseconds());
+			continue;
 		}
-	} else {
+
 		/* can happen during normal remote disconnect */
-		VDBG("poll() failed: %d (revents = %d, errno %s)",
-				ret, data->stream.revents, strerror(errno));
-		data->next_write = 0;
+		VDBG("sendmmsg() failed: %d (errno %s)", ret, strerror(-ret));
+		if (ret == -EPIPE)
+			broken = data->send_gen;
+
+		avdtp_drop_pending(data, now);
 	}
 
-	/* Reset buffer of data to send */
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->seq_num++;
+	pthread_mutex_unlock(&data->stream_lock);
 
-#ifdef ENABLE_TIMING
-	end = get_microseconds();
-	print_time("avdtp_write", begin, end);
-#endif
-	return 0; /* always return success */
+	if (broken)
+		avdtp_stream_broken(data, broken);
+
+	return sent;
+}
+
+/* Encode PCM into the packet ring until the input is used up or the ring
+ * is full.  Returns the number of bytes consumed or a negative error. */
+static int avdtp_encode(struct bluetooth_data *data, const uint8_t *src,
+								int count)
+{
+	struct a2dp_packet *pkt;
+	unsigned int packet_size, frames;
+	int codesize, frame_length, input, encoded, ret = 0;
+	ssize_t written;
+	uint64_t now;
+
+	codesize = data->codesize;
+	frame_length = sbc_get_frame_length(&data->sbc);
+	frames = a2dp_frames_per_packet(data->link_mtu, frame_length);
+	packet_size = MIN(data->link_mtu - A2DP_RTP_HEADER_SIZE, BUFFER_SIZE);
+
+	while (1) {
+		pkt = &data->ring[data->ring_head % PACKET_RING_SIZE];
+
+		/* No space left for another frame then send */
+		if (pkt->frame_count && (unsigned int) pkt->frame_count >= frames) {
+			if (avdtp_queued(data) >= PACKET_RING_SIZE - 1)
+				break;
+
+			VDBG("queueing packet, count %d, link_mtu %u",
+					pkt->len, data->link_mtu);
+			avdtp_queue_packet(data);
+			continue;
+		}
+
+		if (count < codesize)
+			break;
+
+		if (pkt->len == 0 && data->sbc.bitpool != data->next_bitpool) {
+			/* the bitpool may have been adapted to the link */
+			DBG("bitpool %u -> %u", data->sbc.bitpool,
+							data->next_bitpool);
+			data->sbc.bitpool = data->next_bitpool;
+			frame_length = sbc_get_frame_length(&data->sbc);
+			frames = a2dp_frames_per_packet(data->link_mtu,
+								frame_length);
+			continue;
+		}
+
+		/* Fill the packet up to the frame count that fits the MTU */
+		input = MIN(count, (int) (frames - pkt->frame_count) *
+								codesize);
+
+		/* Encode as many frames as fit into the current packet */
+		now = get_microseconds();
+		encoded = sbc_encode_frames(&(data->sbc), src, input,
+					pkt->frames + pkt->len,
+					packet_size - pkt->len,
+					&written);
+		timing_add(data, &data->timing.encode_us, NULL, now,
+							get_microseconds());
+		if (encoded <= 0) {
+			ERR("Encoding error %d", encoded);
+			return ret > 0 ? ret : -EIO;
+		}
+		VDBG("sbc_encode_frames returned %d, codesize: %d, written: %d\n",
+			encoded, codesize, (int) written);
+
+		src += encoded;
+		count -= encoded;
+		ret += encoded;
+		pkt->len += written;
+		pkt->frame_count += encoded / codesize;
+		pkt->samples += encoded / (2 * data->channels);
+	}
+
+	return ret;
 }
 
 static int audioservice_send(struct bluetooth_data *data,
@@ -968,10 +1217,9 @@ static int wait_for_start(struct bluetooth_data *data, int timeout)
 	struct timespec ts;
 	int err = 0;
 
-#ifdef ENABLE_TIMING
-	uint64_t begin, end;
+	uint64_t begin;
+
 	begin = get_microseconds();
-#endif
 
 	gettimeofday(&tv, (struct timezone *) NULL);
 	ts.tv_sec = tv.tv_sec + (timeout / 1000);
@@ -1011,10 +1259,8 @@ again:
 	}
 	pthread_mutex_unlock(&data->mutex);
 
-#ifdef ENABLE_TIMING
-	end = get_microseconds();
-	print_time("wait_for_start", begin, end);
-#endif
+	timing_add(data, &data->timing.start_wait_us, NULL, begin,
+						get_microseconds());
 
 	/* pthread_cond_timedwait returns positive errors */
 	return -err;
@@ -1025,6 +1271,8 @@ static void a2dp_free(struct bluetooth_data *data)
 	pthread_cond_destroy(&data->client_wait);
 	pthread_cond_destroy(&data->thread_wait);
 	pthread_cond_destroy(&data->thread_start);
+	pthread_mutex_destroy(&data->timing_lock);
+	pthread_mutex_destroy(&data->stream_lock);
 	pthread_mutex_destroy(&data->mutex);
 	free(data);
 	return;
@@ -1049,6 +1297,16 @@ static void* a2dp_thread(void *d)
 		while (1) {
 			pthread_cond_wait(&data->thread_wait, &data->mutex);
 
+			/* The sender lost the stream being played */
+			if (data->broken_gen &&
+					data->broken_gen == data->stream_gen &&
+					data->state == A2DP_STATE_STARTED) {
+				DBG("stream broken, closing connection");
+				bluetooth_close(data);
+				pthread_cond_signal(&data->client_wait);
+			}
+			data->broken_gen = 0;
+
 			/* Initialization needed */
 			if (data->state == A2DP_STATE_NONE &&
 				data->command != A2DP_CMD_QUIT) {
@@ -1130,6 +1388,8 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 	sbc_init(&data->sbc, 0);
 
 	pthread_mutex_init(&data->mutex, NULL);
+	pthread_mutex_init(&data->stream_lock, NULL);
+	pthread_mutex_init(&data->timing_lock, NULL);
 	pthread_cond_init(&data->thread_start, NULL);
 	pthread_cond_init(&data->thread_wait, NULL);
 	pthread_cond_init(&data->client_wait, NULL);
@@ -1183,70 +1443,94 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
 	uint8_t* src = (uint8_t *)buffer;
-	int codesize;
 	int err, ret = 0;
 	long frames_left = count;
 	int encoded;
-	unsigned int written;
-	const char *buff;
-	int did_configure = 0;
-#ifdef ENABLE_TIMING
-	uint64_t begin, end;
-	DBG("********** a2dp_write **********");
+	uint64_t begin;
+
 	begin = get_microseconds();
-#endif
 
 	err = wait_for_start(data, WRITE_TIMEOUT);
 	if (err < 0)
 		return err;
 
-	codesize = data->codesize;
-
-	while (frames_left >= codesize) {
-		/* Enough data to encode (sbc wants 512 byte blocks) */
-		encoded = sbc_encode(&(data->sbc), src, codesize,
-					data->buffer + data->count,
-					sizeof(data->buffer) - data->count,
-					&written);
-		if (encoded <= 0) {
-			ERR("Encoding error %d", encoded);
+	while (frames_left >= data->codesize) {
+		encoded = avdtp_encode(data, src, frames_left);
+		if (encoded < 0)
 			goto done;
-		}
-		VDBG("sbc_encode returned %d, codesize: %d, written: %d\n",
-			encoded, codesize, written);
 
 		src += encoded;
-		data->count += written;
-		data->frame_count++;
-		data->samples += encoded;
-		data->nsamples += encoded;
-
-		/* No space left for another frame then send */
-		if ((data->count + written >= data->link_mtu) ||
-				(data->count + written >= BUFFER_SIZE)) {
-			VDBG("sending packet %d, count %d, link_mtu %u",
-					data->seq_num, data->count,
-					data->link_mtu);
-			err = avdtp_write(data);
-			if (err < 0)
-				return err;
-		}
-
 		ret += encoded;
 		frames_left -= encoded;
+
+		/* Wait for the oldest packet to go out if the ring is full */
+		avdtp_write(data, frames_left >= data->codesize);
 	}
 
 	if (frames_left > 0)
 		ERR("%ld bytes left at end of a2dp_write\n", frames_left);
 
 done:
-#ifdef ENABLE_TIMING
-	end = get_microseconds();
-	print_time("a2dp_write total", begin, end);
-#endif
+	pthread_mutex_lock(&data->timing_lock);
+	data->timing.writes++;
+	__timing_add(&data->timing.write_us, &data->timing.write_max_us,
+						begin, get_microseconds());
+	pthread_mutex_unlock(&data->timing_lock);
+	return ret;
+}
+
+int a2dp_encode(a2dpData d, const void* buffer, int count)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	int err, ret;
+	uint64_t begin;
+
+	begin = get_microseconds();
+
+	err = wait_for_start(data, WRITE_TIMEOUT);
+	if (err < 0)
+		return err;
+
+	ret = avdtp_encode(data, buffer, count);
+
+	pthread_mutex_lock(&data->timing_lock);
+	data->timing.writes++;
+	__timing_add(&data->timing.write_us, &data->timing.write_max_us,
+						begin, get_microseconds());
+	pthread_mutex_unlock(&data->timing_lock);
 	return ret;
 }
 
+int a2dp_send(a2dpData d)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+
+	if (data->state != A2DP_STATE_STARTED)
+		return 0;
+
+	return avdtp_write(data, 1);
+}
+
+int a2dp_pending(a2dpData d)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+
+	return avdtp_queued(data);
+}
+
+int a2dp_get_timing(a2dpData d, a2dp_timing_t *timing)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+
+	if (!data || !timing)
+		return -EINVAL;
+
+	pthread_mutex_lock(&data->timing_lock);
+	memcpy(timing, &data->timing, sizeof(*timing));
+	pthread_mutex_unlock(&data->timing_lock);
+	return 0;
+}
+
 int a2dp_stop(a2dpData d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
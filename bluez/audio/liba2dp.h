@@ -28,10 +28,38 @@ extern "C" {
 
 typedef void* a2dpData;
 
+/* Counters of the current stream, reset whenever streaming (re)starts.
+ * All times are in microseconds. */
+typedef struct {
+	unsigned int writes;			/* a2dp_write()/a2dp_encode() calls */
+	unsigned int packets;			/* RTP packets sent */
+	unsigned int dropped;			/* RTP packets dropped */
+	unsigned int bitpool;			/* Current SBC bitpool */
+	unsigned long long write_us;		/* Time spent in a2dp_write() */
+	unsigned long long write_max_us;	/* Longest a2dp_write() call */
+	unsigned long long encode_us;		/* Time spent encoding */
+	unsigned long long send_us;		/* Time spent in sendmsg() */
+	unsigned long long send_max_us;		/* Longest sendmsg() call */
+	unsigned long long throttle_us;		/* Time slept for pacing */
+	unsigned long long poll_us;		/* Time waiting for the socket */
+	unsigned long long start_wait_us;	/* Time waiting for the stream */
+} a2dp_timing_t;
+
 int a2dp_init(int rate, int channels, a2dpData* dataPtr);
 void a2dp_set_sink(a2dpData data, const char* address);
 int a2dp_write(a2dpData data, const void* buffer, int count);
+
+/* Split pipeline: a2dp_encode() queues encoded packets without sending
+ * and returns the number of bytes consumed, which is short once the packet
+ * queue is full.  a2dp_send() transmits the queued packets at the stream
+ * rate, blocking for the oldest one, and returns how many were sent.
+ * Each may run in its own thread but neither may be called concurrently
+ * with itself or with a2dp_write(). */
+int a2dp_encode(a2dpData data, const void* buffer, int count);
+int a2dp_send(a2dpData data);
+int a2dp_pending(a2dpData data);
 int a2dp_stop(a2dpData data);
+int a2dp_get_timing(a2dpData data, a2dp_timing_t *timing);
 void a2dp_cleanup(a2dpData data);
 
 #ifdef __cplusplus
@@ -0,0 +1,98 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "mmsg.h"
+
+#ifndef MSG_WAITFORONE
+#define MSG_WAITFORONE 0x10000
+#endif
+
+/* Set once the kernel turned out not to have the batched calls */
+static int no_sendmmsg;
+static int no_recvmmsg;
+
+int audio_sendmmsg(int fd, struct audio_mmsghdr *msgs, unsigned int count,
+								int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+#ifdef __NR_sendmmsg
+	if (!no_sendmmsg) {
+		ret = syscall(__NR_sendmmsg, fd, msgs, count, flags);
+		if (ret >= 0 || errno != ENOSYS)
+			return ret;
+
+		no_sendmmsg = 1;
+	}
+#endif
+
+	/* Kernels before 3.0 only have sendmsg() */
+	for (i = 0; i < count; i++) {
+		ret = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (ret < 0)
+			return i > 0 ? (int) i : -1;
+
+		msgs[i].msg_len = ret;
+	}
+
+	return count;
+}
+
+int audio_recvmmsg(int fd, struct audio_mmsghdr *msgs, unsigned int count,
+								int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+#ifdef __NR_recvmmsg
+	if (!no_recvmmsg) {
+		ret = syscall(__NR_recvmmsg, fd, msgs, count,
+						flags | MSG_WAITFORONE, NULL);
+		if (ret >= 0 || errno != ENOSYS)
+			return ret;
+
+		no_recvmmsg = 1;
+	}
+#endif
+
+	/* Only the first receive may block */
+	for (i = 0; i < count; i++) {
+		ret = recvmsg(fd, &msgs[i].msg_hdr,
+					i > 0 ? flags | MSG_DONTWAIT : flags);
+		if (ret < 0)
+			return i > 0 ? (int) i : -1;
+
+		msgs[i].msg_len = ret;
+	}
+
+	return count;
+}
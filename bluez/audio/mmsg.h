@@ -0,0 +1,51 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef AUDIO_MMSG_H
+#define AUDIO_MMSG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Batched socket I/O for the audio transports.
+ *
+ * Messages go through a single sendmmsg()/recvmmsg() where the kernel
+ * has them, kernels before 3.0 get one sendmsg()/recvmsg() per message.
+ * Both return the number of messages transferred, which is short when
+ * a non-blocking socket runs full or empty after the first one, or -1
+ * with errno set if not even the first could be transferred. */
+
+/* Same layout as the kernel's struct mmsghdr, which not every libc has */
+struct audio_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+int audio_sendmmsg(int fd, struct audio_mmsghdr *msgs, unsigned int count,
+								int flags);
+
+/* Blocks, unless flags say otherwise, only until the first message */
+int audio_recvmmsg(int fd, struct audio_mmsghdr *msgs, unsigned int count,
+								int flags);
+
+#endif /* AUDIO_MMSG_H */
@@ -31,7 +31,9 @@
 #include <sys/un.h>
 #include <time.h>
 #include <sys/time.h>
-#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <limits.h>
 
@@ -42,13 +44,17 @@
 
 #include "ipc.h"
 #include "sbc.h"
-#include "rtp.h"
+#include "a2dp-bitpool.h"
+#include "a2dp-sender.h"
+#include "sco-transport.h"
 
 /* #define ENABLE_DEBUG */
 
-#define UINT_SECS_MAX (UINT_MAX / 1000000 - 1)
+/* A sink delay report error is corrected over this many microseconds */
+#define DRIFT_WINDOW_US 10000000
 
-#define MIN_PERIOD_TIME 1
+/* Maximum clock correction applied from delay reports */
+#define MAX_DRIFT_PPM 1000
 
 #define BUFFER_SIZE 2048
 
@@ -95,15 +101,26 @@
 struct bluetooth_a2dp {
 	sbc_capabilities_t sbc_capabilities;
 	sbc_t sbc;				/* Codec data */
+	struct a2dp_bitpool bitpool;		/* Adaptive bitpool controller */
 	int sbc_initialized;			/* Keep track if the encoder is initialized */
 	unsigned int codesize;			/* SBC codesize */
-	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	unsigned int count;			/* Codec transfer buffer counter */
-
-	int nsamples;				/* Cumulative number of codec samples */
-	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
+	struct a2dp_sender sender;		/* Media transport sender */
+
+	/* One payload more than the sender queues, so the packet being
+	 * encoded never overwrites one waiting to be flushed */
+	uint8_t buffer[A2DP_SENDER_MAX_PACKETS + 1][BUFFER_SIZE];
+	unsigned int current;			/* Payload being encoded */
+	unsigned int count;			/* Bytes in current payload */
+	unsigned int frame_count;		/* Frames in current payload */
+	unsigned int samples;			/* Samples in current payload */
+	unsigned int frames_per_packet;		/* Frames that fit the link MTU */
+	uint8_t next_bitpool;			/* Bitpool for the next packet */
+
+	/* With shm the daemon encodes the PCM written to this ring */
+	struct bt_shm_ring *ring;
+	size_t ring_map_size;
+	uint32_t ring_size;
+	int ring_eventfd;			/* Signalled after writing */
 };
 
 struct bluetooth_alsa_config {
@@ -124,6 +141,8 @@ struct bluetooth_alsa_config {
 	uint8_t bitpool;		/* A2DP only */
 	int has_bitpool;
 	int autoconnect;
+	int drift_correction;		/* Follow sink delay reports */
+	int shm;			/* A2DP only, daemon encodes */
 };
 
 struct bluetooth_data {
@@ -137,11 +156,15 @@ struct bluetooth_data {
 	uint8_t buffer[BUFFER_SIZE];		/* Encoded transfer buffer */
 	unsigned int count;				/* Transfer buffer counter */
 	struct bluetooth_a2dp a2dp;			/* A2DP data */
-
-	pthread_t hw_thread;				/* Makes virtual hw pointer move */
-	int pipefd[2];					/* Inter thread communication */
+	struct sco_transport sco;			/* SCO data */
+
+	int timerfd;					/* Makes virtual hw pointer move */
+	int eventfd;					/* Wakes up clients polling at us */
+	uint64_t period_ns;				/* Nominal period length */
+	long drift_ppm;					/* Correction of the period */
+	int delay;					/* Sink delay in 1/10 ms or -1 */
+	int delay_ref;					/* First delay of this run */
 	int stopped;
-	sig_atomic_t reset;				/* Request XRUN handling */
 };
 
 static int audioservice_send(int sk, const bt_audio_msg_header_t *msg);
@@ -162,116 +185,122 @@ static int bluetooth_stop(snd_pcm_ioplug_t *io)
 	return 0;
 }
 
-static void *playback_hw_thread(void *param)
+static int bluetooth_timer_arm(struct bluetooth_data *data, int restart)
 {
-	struct bluetooth_data *data = param;
-	unsigned int prev_periods;
-	double period_time;
-	struct timespec start;
-	struct pollfd fds[2];
-	int poll_timeout;
+	struct itimerspec ts;
+	struct timespec interval;
+	uint64_t period;
 
-	data->server.events = POLLIN;
-	/* note: only errors for data->stream.events */
+	period = data->period_ns * (1000000 + data->drift_ppm) / 1000000;
 
-	fds[0] = data->server;
-	fds[1] = data->stream;
+	interval.tv_sec = period / 1000000000;
+	interval.tv_nsec = period % 1000000000;
 
-	prev_periods = 0;
-	period_time = 1000000.0 * data->io.period_size / data->io.rate;
-	if (period_time > (int) (MIN_PERIOD_TIME * 1000))
-		poll_timeout = (int) (period_time / 1000.0f);
-	else
-		poll_timeout = MIN_PERIOD_TIME;
+	/* Keep the phase of a running timer when only the rate changes */
+	if (restart || timerfd_gettime(data->timerfd, &ts) < 0 ||
+			(ts.it_value.tv_sec == 0 && ts.it_value.tv_nsec == 0))
+		ts.it_value = interval;
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	ts.it_interval = interval;
 
-	while (1) {
-		unsigned int dtime, periods;
-		struct timespec cur, delta;
-		int ret;
-
-		if (data->stopped)
-			goto iter_sleep;
-
-		if (data->reset) {
-			DBG("Handle XRUN in hw-thread.");
-			data->reset = 0;
-			clock_gettime(CLOCK_MONOTONIC, &start);
-			prev_periods = 0;
-		}
+	if (timerfd_settime(data->timerfd, 0, &ts, NULL) < 0)
+		return -errno;
 
-		clock_gettime(CLOCK_MONOTONIC, &cur);
+	return 0;
+}
 
-		priv_timespecsub(&cur, &start, &delta);
+static void bluetooth_timer_disarm(struct bluetooth_data *data)
+{
+	struct itimerspec ts;
 
-		dtime = delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
-		periods = 1.0 * dtime / period_time;
+	memset(&ts, 0, sizeof(ts));
+	timerfd_settime(data->timerfd, 0, &ts, NULL);
+}
 
-		if (periods > prev_periods) {
-			char c = 'w';
-			int frags = periods - prev_periods, n;
+/* Advance the hw pointer by the periods the timer counted since last time */
+static void bluetooth_update_hw_ptr(struct bluetooth_data *data)
+{
+	uint64_t expired;
 
-			data->hw_ptr += frags *	data->io.period_size;
-			data->hw_ptr %= data->io.buffer_size;
+	if (data->stopped)
+		return;
 
-			for (n = 0; n < frags; n++) {
-				/* Notify user that hardware pointer
-				 * has moved * */
-				if (write(data->pipefd[1], &c, 1) < 0)
-					pthread_testcancel();
-			}
+	if (read(data->timerfd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
 
-			/* Reset point of reference to avoid too big values
-			 * that wont fit an unsigned int */
-			if ((unsigned int) delta.tv_sec < UINT_SECS_MAX)
-				prev_periods = periods;
-			else {
-				prev_periods = 0;
-				clock_gettime(CLOCK_MONOTONIC, &start);
-			}
-		}
+	data->hw_ptr = (data->hw_ptr + expired * data->io.period_size) %
+							data->io.buffer_size;
+}
 
-iter_sleep:
-		/* sleep up to one period interval */
-		ret = poll(fds, 2, poll_timeout);
+static void bluetooth_delay_report(struct bluetooth_data *data,
+							uint16_t delay)
+{
+	long error_us, ppm;
 
-		if (ret < 0) {
-			if (errno != EINTR) {
-				SNDERR("poll error: %s (%d)", strerror(errno),
-								errno);
-				break;
-			}
-		} else if (ret > 0) {
-			ret = (fds[0].revents) ? 0 : 1;
-			SNDERR("poll fd %d revents %d", ret, fds[ret].revents);
-			if (fds[ret].revents & (POLLERR | POLLHUP | POLLNVAL))
-				break;
-		}
+	DBG("delay report %u.%ums", delay / 10, delay % 10);
+
+	data->delay = delay;
 
-		/* Offer opportunity to be canceled by main thread */
-		pthread_testcancel();
+	if (!data->alsa_config.drift_correction || data->stopped)
+		return;
+
+	if (data->delay_ref < 0) {
+		data->delay_ref = delay;
+		return;
 	}
 
-	data->hw_thread = 0;
-	pthread_exit(NULL);
+	/* A growing sink delay means the sink consumes slower than our
+	 * clock produces, so lengthen the period, and vice versa */
+	error_us = (data->delay - data->delay_ref) * 100;
+	ppm = error_us * 1000000LL / DRIFT_WINDOW_US;
+	ppm = MAX(-MAX_DRIFT_PPM, MIN(MAX_DRIFT_PPM, ppm));
+
+	if (ppm == data->drift_ppm)
+		return;
+
+	DBG("drift correction %ld ppm", ppm);
+
+	/* Rearming drops expirations that were not read yet, account them
+	 * to the hw pointer first */
+	bluetooth_update_hw_ptr(data);
+
+	data->drift_ppm = ppm;
+	bluetooth_timer_arm(data, 0);
+}
+
+static void bluetooth_handle_indications(struct bluetooth_data *data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	bt_audio_msg_header_t *msg = (void *) buf;
+	struct bt_delay_report_ind *ind = (void *) buf;
+	ssize_t len;
+
+	while (1) {
+		len = recv(data->server.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < (ssize_t) sizeof(*msg))
+			break;
+
+		if (msg->type != BT_INDICATION)
+			continue;
+
+		if (msg->name == BT_DELAY_REPORT &&
+					(size_t) len >= sizeof(*ind))
+			bluetooth_delay_report(data, ind->delay);
+	}
 }
 
 static int bluetooth_playback_start(snd_pcm_ioplug_t *io)
 {
 	struct bluetooth_data *data = io->private_data;
-	int err;
 
 	DBG("%p", io);
 
 	data->stopped = 0;
+	data->drift_ppm = 0;
+	data->delay_ref = -1;
+	data->period_ns = 1000000000ULL * io->period_size / io->rate;
 
-	if (data->hw_thread)
-		return 0;
-
-	err = pthread_create(&data->hw_thread, 0, playback_hw_thread, data);
-
-	return -err;
+	return bluetooth_timer_arm(data, 1);
 }
 
 static int bluetooth_playback_stop(snd_pcm_ioplug_t *io)
@@ -281,10 +310,20 @@ static int bluetooth_playback_stop(snd_pcm_ioplug_t *io)
 	DBG("%p", io);
 
 	data->stopped = 1;
+	bluetooth_timer_disarm(data);
 
 	return 0;
 }
 
+static snd_pcm_sframes_t bluetooth_playback_pointer(snd_pcm_ioplug_t *io)
+{
+	struct bluetooth_data *data = io->private_data;
+
+	bluetooth_update_hw_ptr(data);
+
+	return data->hw_ptr;
+}
+
 static snd_pcm_sframes_t bluetooth_pointer(snd_pcm_ioplug_t *io)
 {
 	struct bluetooth_data *data = io->private_data;
@@ -292,6 +331,19 @@ static snd_pcm_sframes_t bluetooth_pointer(snd_pcm_ioplug_t *io)
 	return data->hw_ptr;
 }
 
+static void bluetooth_a2dp_shm_release(struct bluetooth_a2dp *a2dp)
+{
+	if (a2dp->ring) {
+		munmap(a2dp->ring, a2dp->ring_map_size);
+		a2dp->ring = NULL;
+	}
+
+	if (a2dp->ring_eventfd >= 0) {
+		close(a2dp->ring_eventfd);
+		a2dp->ring_eventfd = -1;
+	}
+}
+
 static void bluetooth_exit(struct bluetooth_data *data)
 {
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
@@ -302,19 +354,16 @@ static void bluetooth_exit(struct bluetooth_data *data)
 	if (data->stream.fd >= 0)
 		close(data->stream.fd);
 
-	if (data->hw_thread) {
-		pthread_cancel(data->hw_thread);
-		pthread_join(data->hw_thread, 0);
-	}
-
 	if (a2dp->sbc_initialized)
 		sbc_finish(&a2dp->sbc);
 
-	if (data->pipefd[0] > 0)
-		close(data->pipefd[0]);
+	bluetooth_a2dp_shm_release(a2dp);
 
-	if (data->pipefd[1] > 0)
-		close(data->pipefd[1]);
+	if (data->timerfd >= 0)
+		close(data->timerfd);
+
+	if (data->eventfd >= 0)
+		close(data->eventfd);
 
 	free(data);
 }
@@ -333,7 +382,7 @@ static int bluetooth_close(snd_pcm_ioplug_t *io)
 static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 {
 	struct bluetooth_data *data = io->private_data;
-	char c = 'w';
+	uint64_t wakeup = 1;
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_start_stream_req *req = (void *) buf;
 	struct bt_start_stream_rsp *rsp = (void *) buf;
@@ -345,15 +394,10 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	DBG("Preparing with io->period_size=%lu io->buffer_size=%lu",
 					io->period_size, io->buffer_size);
 
-	data->reset = 0;
-
-	/* As we're gonna receive messages on the server socket, we have to stop the
-	   hw thread that is polling on it, if any */
-	if (data->hw_thread) {
-		pthread_cancel(data->hw_thread);
-		pthread_join(data->hw_thread, 0);
-		data->hw_thread = 0;
-	}
+	/* Drop indications that arrived since the last run so that they are
+	 * not mistaken for the start stream response */
+	bluetooth_handle_indications(data);
+	data->delay = -1;
 
 	if (io->stream == SND_PCM_STREAM_PLAYBACK)
 		/* If not null for playback, xmms doesn't display time
@@ -386,8 +430,14 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	if (err < 0)
 		return err;
 
-	if (data->stream.fd >= 0)
+	if (data->stream.fd >= 0) {
 		close(data->stream.fd);
+		data->stream.fd = -1;
+	}
+
+	/* No data fd comes for shared memory, the daemon encodes */
+	if (data->a2dp.ring)
+		goto wakeup;
 
 	data->stream.fd = bt_audio_service_get_data_fd(data->server.fd);
 	if (data->stream.fd < 0) {
@@ -395,6 +445,9 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	}
 
 	if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP) {
+		a2dp_sender_init(&data->a2dp.sender, data->stream.fd,
+							data->link_mtu);
+
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SO_SNDTIMEO : SO_RCVTIMEO;
 
@@ -402,27 +455,36 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 							sizeof(t)) < 0)
 			return -errno;
 	} else {
+		/* Periods span several packets, let the socket queue a
+		 * whole buffer of them (16 bit mono samples) */
+		uint32_t packets = io->buffer_size * 2 / data->link_mtu;
+
+		err = sco_transport_init(&data->sco, data->stream.fd,
+					data->link_mtu, &sco_framing_pcm, NULL);
+		if (err < 0)
+			return err;
+
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SCO_TXBUFS : SCO_RXBUFS;
 
-		if (setsockopt(data->stream.fd, SOL_SCO, opt_name, &period_count,
-						sizeof(period_count)) == 0)
+		if (setsockopt(data->stream.fd, SOL_SCO, opt_name, &packets,
+						sizeof(packets)) == 0)
 			return 0;
 
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SO_SNDBUF : SO_RCVBUF;
 
-		if (setsockopt(data->stream.fd, SOL_SCO, opt_name, &period_count,
-						sizeof(period_count)) == 0)
+		if (setsockopt(data->stream.fd, SOL_SCO, opt_name, &packets,
+						sizeof(packets)) == 0)
 			return 0;
 
 		/* FIXME : handle error codes */
 	}
 
+wakeup:
 	/* wake up any client polling at us */
-	err = write(data->pipefd[1], &c, 1);
-	if (err < 0)
-		return err;
+	if (write(data->eventfd, &wakeup, sizeof(wakeup)) < 0)
+		return -errno;
 
 	return 0;
 }
@@ -487,42 +549,6 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 	return 0;
 }
 
-static uint8_t default_bitpool(uint8_t freq, uint8_t mode)
-{
-	switch (freq) {
-	case BT_SBC_SAMPLING_FREQ_16000:
-	case BT_SBC_SAMPLING_FREQ_32000:
-		return 53;
-	case BT_SBC_SAMPLING_FREQ_44100:
-		switch (mode) {
-		case BT_A2DP_CHANNEL_MODE_MONO:
-		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
-			return 31;
-		case BT_A2DP_CHANNEL_MODE_STEREO:
-		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
-			return 53;
-		default:
-			DBG("Invalid channel mode %u", mode);
-			return 53;
-		}
-	case BT_SBC_SAMPLING_FREQ_48000:
-		switch (mode) {
-		case BT_A2DP_CHANNEL_MODE_MONO:
-		case BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL:
-			return 29;
-		case BT_A2DP_CHANNEL_MODE_STEREO:
-		case BT_A2DP_CHANNEL_MODE_JOINT_STEREO:
-			return 51;
-		default:
-			DBG("Invalid channel mode %u", mode);
-			return 51;
-		}
-	default:
-		DBG("Invalid sampling freq %u", freq);
-		return 53;
-	}
-}
-
 static int bluetooth_a2dp_init(struct bluetooth_data *data,
 					snd_pcm_hw_params_t *params)
 {
@@ -608,7 +634,7 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data,
 		min_bitpool = max_bitpool = cfg->bitpool;
 	else {
 		min_bitpool = MAX(MIN_BITPOOL, cap->min_bitpool);
-		max_bitpool = MIN(default_bitpool(cap->frequency,
+		max_bitpool = MIN(a2dp_default_bitpool(cap->frequency,
 					cap->channel_mode),
 					cap->max_bitpool);
 	}
@@ -683,7 +709,208 @@ static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
 
 	a2dp->sbc.bitpool = active_capabilities.max_bitpool;
 	a2dp->codesize = sbc_get_codesize(&a2dp->sbc);
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+}
+
+/* Hand everything queued to the socket in one go.  With force set the
+ * packets the socket did not take are dropped to make room. */
+static int avdtp_flush(struct bluetooth_data *data, int force)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct timespec begin, end, delta;
+	unsigned int duration, latency, pending;
+	int ret, i;
+
+	pending = a2dp_sender_pending(&a2dp->sender);
+	if (pending == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	ret = a2dp_sender_flush(&a2dp->sender, MSG_DONTWAIT | MSG_NOSIGNAL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0)
+		DBG("sendmmsg returned %d (%s)", ret, strerror(-ret));
+
+	/* Feed the link feedback into the bitpool controller, a packet
+	 * refused by a full socket counts as dropped.  The new bitpool is
+	 * applied from the next packet on. */
+	priv_timespecsub(&end, &begin, &delta);
+	duration = sbc_get_frame_duration(&a2dp->sbc) *
+						a2dp->frames_per_packet;
+	latency = delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
+	if (ret > 0)
+		latency /= ret;
+
+	for (i = 0; i < ret; i++)
+		a2dp->next_bitpool = a2dp_bitpool_update(&a2dp->bitpool,
+						data->stream.fd, latency,
+						duration, 0);
+
+	if (ret < 0 || (force && a2dp_sender_pending(&a2dp->sender) > 0)) {
+		a2dp->next_bitpool = a2dp_bitpool_update(&a2dp->bitpool,
+						data->stream.fd, latency,
+						duration, 1);
+		a2dp_sender_discard(&a2dp->sender);
+	}
+
+	return ret;
+}
+
+/* Start encoding into the next free payload */
+static void avdtp_begin_packet(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+
+	if (a2dp->next_bitpool != a2dp->sbc.bitpool) {
+		DBG("bitpool %u -> %u", a2dp->sbc.bitpool, a2dp->next_bitpool);
+		a2dp->sbc.bitpool = a2dp->next_bitpool;
+	}
+
+	a2dp->count = 0;
+	a2dp->frame_count = 0;
+	a2dp->samples = 0;
+	a2dp->frames_per_packet = a2dp_frames_per_packet(
+				MIN(data->link_mtu,
+					BUFFER_SIZE + A2DP_RTP_HEADER_SIZE),
+				sbc_get_frame_length(&a2dp->sbc));
+}
+
+static void avdtp_queue_packet(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	int ret;
+
+	DBG("queueing packet %u, count %u, link_mtu %u", a2dp->sender.seq,
+					a2dp->count, data->link_mtu);
+
+	ret = a2dp_sender_queue(&a2dp->sender, a2dp->buffer[a2dp->current],
+					a2dp->count, a2dp->frame_count,
+					a2dp->samples);
+	if (ret == -ENOBUFS) {
+		/* The socket did not take the backlog, make room */
+		avdtp_flush(data, 1);
+		ret = a2dp_sender_queue(&a2dp->sender,
+					a2dp->buffer[a2dp->current],
+					a2dp->count, a2dp->frame_count,
+					a2dp->samples);
+	}
+
+	if (ret < 0)
+		DBG("Dropping packet: %s", strerror(-ret));
+	else
+		a2dp->current = (a2dp->current + 1) %
+					(A2DP_SENDER_MAX_PACKETS + 1);
+
+	avdtp_begin_packet(data);
+}
+
+/* Ask the daemon for a PCM ring holding at least the whole buffer */
+static int bluetooth_a2dp_shm_setup(snd_pcm_ioplug_t *io)
+{
+	struct bluetooth_data *data = io->private_data;
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_shm_stream_req *req = (void *) buf;
+	struct bt_shm_stream_rsp *rsp = (void *) buf;
+	struct bt_shm_ring *ring;
+	size_t map_size;
+	int fds[2], err;
+
+	bluetooth_a2dp_shm_release(a2dp);
+
+	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
+	req->h.type = BT_REQUEST;
+	req->h.name = BT_SHM_STREAM;
+	req->h.length = sizeof(*req);
+	req->size = io->buffer_size * io->channels * sizeof(int16_t);
+
+	err = audioservice_send(data->server.fd, &req->h);
+	if (err < 0)
+		return err;
+
+	rsp->h.length = sizeof(*rsp);
+	err = audioservice_expect(data->server.fd, &rsp->h, BT_SHM_STREAM);
+	if (err < 0)
+		return err;
+
+	if (bt_audio_service_get_data_fds(data->server.fd, fds, 2) < 0)
+		return -errno;
+
+	if (rsp->rate != io->rate || rsp->channels != io->channels ||
+			rsp->size == 0 || (rsp->size & (rsp->size - 1))) {
+		SNDERR("Shared memory stream of %u Hz, %u channels does "
+				"not match", rsp->rate, rsp->channels);
+		err = -EINVAL;
+		goto failed;
+	}
+
+	map_size = sizeof(*ring) + rsp->size;
+	ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+								fds[0], 0);
+	if (ring == MAP_FAILED) {
+		err = -errno;
+		goto failed;
+	}
+
+	if (ring->magic != BT_SHM_RING_MAGIC || ring->size != rsp->size) {
+		munmap(ring, map_size);
+		err = -EPROTO;
+		goto failed;
+	}
+
+	/* The mapping keeps the ring alive */
+	close(fds[0]);
+
+	a2dp->ring = ring;
+	a2dp->ring_map_size = map_size;
+	a2dp->ring_size = rsp->size;
+	a2dp->ring_eventfd = fds[1];
+
+	return 0;
+
+failed:
+	close(fds[0]);
+	close(fds[1]);
+	return err;
+}
+
+/* Copies as many whole frames as there is room for into the ring and
+ * tells the daemon about them */
+static snd_pcm_sframes_t bluetooth_a2dp_shm_write(struct bluetooth_data *data,
+					const uint8_t *buff,
+					snd_pcm_uframes_t size, int frame_size)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct bt_shm_ring *ring = a2dp->ring;
+	uint32_t head, tail, len, offset, first;
+	uint64_t wakeup = 1;
+
+	head = ring->head;
+	tail = ring->tail;
+
+	/* Pairs with the daemon's barrier before advancing tail */
+	__sync_synchronize();
+
+	len = MIN(a2dp->ring_size - (head - tail), size * frame_size);
+	len -= len % frame_size;
+	if (len == 0)
+		return 0;
+
+	offset = head & (a2dp->ring_size - 1);
+	first = MIN(len, a2dp->ring_size - offset);
+
+	memcpy(ring->data + offset, buff, first);
+	memcpy(ring->data, buff + first, len - first);
+
+	/* The samples must land before the daemon sees head move */
+	__sync_synchronize();
+
+	ring->head = head + len;
+
+	if (write(a2dp->ring_eventfd, &wakeup, sizeof(wakeup)) < 0 &&
+							errno != EAGAIN)
+		return -errno;
+
+	return len / frame_size;
 }
 
 static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
@@ -701,6 +928,13 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	DBG("Preparing with io->period_size=%lu io->buffer_size=%lu",
 					io->period_size, io->buffer_size);
 
+	/* Another client may already have the stream configured, its SEP
+	 * is locked then and the ring is mixed into its stream */
+	if (data->alsa_config.shm && bluetooth_a2dp_shm_setup(io) == 0) {
+		data->transport = BT_CAPABILITIES_TRANSPORT_A2DP;
+		return 0;
+	}
+
 	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	open_req->h.type = BT_REQUEST;
 	open_req->h.name = BT_OPEN;
@@ -753,6 +987,19 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	/* Setup SBC encoder now we agree on parameters */
 	bluetooth_a2dp_setup(a2dp);
 
+	/* Allow a couple of packets in flight before backing off */
+	a2dp_bitpool_init(&a2dp->bitpool, a2dp->sbc_capabilities.min_bitpool,
+				a2dp->sbc_capabilities.max_bitpool,
+				data->link_mtu * 2);
+	a2dp->next_bitpool = a2dp->sbc.bitpool;
+	avdtp_begin_packet(data);
+
+	if (data->alsa_config.shm) {
+		err = bluetooth_a2dp_shm_setup(io);
+		if (err < 0)
+			return err;
+	}
+
 	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
 		a2dp->sbc.allocation, a2dp->sbc.subbands, a2dp->sbc.blocks,
 		a2dp->sbc.bitpool);
@@ -790,7 +1037,7 @@ static int bluetooth_poll_revents(snd_pcm_ioplug_t *io ATTRIBUTE_UNUSED,
 
 static int bluetooth_playback_poll_descriptors_count(snd_pcm_ioplug_t *io)
 {
-	return 2;
+	return 4;
 }
 
 static int bluetooth_playback_poll_descriptors(snd_pcm_ioplug_t *io,
@@ -800,43 +1047,62 @@ static int bluetooth_playback_poll_descriptors(snd_pcm_ioplug_t *io,
 
 	DBG("");
 
-	assert(data->pipefd[0] >= 0);
+	assert(data->timerfd >= 0 && data->eventfd >= 0);
 
-	if (space < 2)
+	if (space < 4)
 		return 0;
 
-	pfd[0].fd = data->pipefd[0];
+	/* Readable once per elapsed period */
+	pfd[0].fd = data->timerfd;
 	pfd[0].events = POLLIN;
 	pfd[0].revents = 0;
-	pfd[1].fd = data->stream.fd;
-	pfd[1].events = POLLERR | POLLHUP | POLLNVAL;
+	/* Readable when woken up explicitly */
+	pfd[1].fd = data->eventfd;
+	pfd[1].events = POLLIN;
 	pfd[1].revents = 0;
-
-	return 2;
+	pfd[2].fd = data->stream.fd;
+	pfd[2].events = POLLERR | POLLHUP | POLLNVAL;
+	pfd[2].revents = 0;
+	/* Delay reports from the audio service */
+	pfd[3].fd = data->server.fd;
+	pfd[3].events = POLLIN;
+	pfd[3].revents = 0;
+
+	return 4;
 }
 
 static int bluetooth_playback_poll_revents(snd_pcm_ioplug_t *io,
 					struct pollfd *pfds, unsigned int nfds,
 					unsigned short *revents)
 {
-	static char buf[1];
+	struct bluetooth_data *data = io->private_data;
+	uint64_t wakeup;
 
 	DBG("");
 
 	assert(pfds);
-	assert(nfds == 2);
+	assert(nfds == 4);
 	assert(revents);
 	assert(pfds[0].fd >= 0);
 	assert(pfds[1].fd >= 0);
 
-	if (io->state != SND_PCM_STATE_PREPARED)
-		if (read(pfds[0].fd, buf, 1) < 0)
+	if (pfds[0].revents & POLLIN)
+		bluetooth_update_hw_ptr(data);
+
+	/* Keep signalling until started so the client fills the buffer */
+	if ((pfds[1].revents & POLLIN) && io->state != SND_PCM_STATE_PREPARED)
+		if (read(pfds[1].fd, &wakeup, sizeof(wakeup)) < 0)
 			SYSERR("read error: %s (%d)", strerror(errno), errno);
 
-	if (pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+	if (pfds[3].revents & POLLIN)
+		bluetooth_handle_indications(data);
+
+	if ((pfds[2].revents | pfds[3].revents) &
+					(POLLERR | POLLHUP | POLLNVAL))
 		io->state = SND_PCM_STATE_DISCONNECTED;
 
-	*revents = (pfds[0].revents & POLLIN) ? POLLOUT : 0;
+	*revents = ((pfds[0].revents | pfds[1].revents) & POLLIN) ?
+								POLLOUT : 0;
 
 	return 0;
 }
@@ -848,55 +1114,35 @@ static snd_pcm_sframes_t bluetooth_hsp_read(snd_pcm_ioplug_t *io,
 				snd_pcm_uframes_t size)
 {
 	struct bluetooth_data *data = io->private_data;
-	snd_pcm_uframes_t frames_to_write, ret;
+	snd_pcm_sframes_t ret;
 	unsigned char *buff;
 	unsigned int frame_size = 0;
-	int nrecv;
+	ssize_t nrecv;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu io->nonblock=%u",
 			areas->step, areas->first, offset, size, io->nonblock);
 
 	frame_size = areas->step / 8;
 
-	if (data->count > 0)
-		goto proceed;
+	buff = (unsigned char *) areas->addr +
+			(areas->first + areas->step * offset) / 8;
 
-	nrecv = recv(data->stream.fd, data->buffer, data->link_mtu,
+	/* Packets queued by the socket are taken in one go and played out
+	 * of the jitter buffer */
+	nrecv = sco_transport_read(&data->sco, buff, size * frame_size,
 					io->nonblock ? MSG_DONTWAIT : 0);
-
 	if (nrecv < 0) {
-		ret = (errno == EPIPE) ? -EIO : -errno;
+		ret = (nrecv == -EPIPE) ? -EIO : nrecv;
 		goto done;
 	}
 
-	if ((unsigned int) nrecv != data->link_mtu) {
-		ret = -EIO;
-		SNDERR(strerror(-ret));
-		goto done;
-	}
+	ret = nrecv / frame_size;
 
 	/* Increment hardware transmition pointer */
-	data->hw_ptr = (data->hw_ptr + data->link_mtu / frame_size) %
-				io->buffer_size;
-
-proceed:
-	buff = (unsigned char *) areas->addr +
-			(areas->first + areas->step * offset) / 8;
-
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_write = size;
-	else
-		frames_to_write = (data->link_mtu - data->count) / frame_size;
-
-	memcpy(buff, data->buffer + data->count, frame_size * frames_to_write);
-	data->count += (frame_size * frames_to_write);
-	data->count %= data->link_mtu;
-
-	/* Return written frames count */
-	ret = frames_to_write;
+	data->hw_ptr = (data->hw_ptr + ret) % io->buffer_size;
 
 done:
-	DBG("returning %lu", ret);
+	DBG("returning %ld", ret);
 	return ret;
 }
 
@@ -907,9 +1153,9 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 {
 	struct bluetooth_data *data = io->private_data;
 	snd_pcm_sframes_t ret = 0;
-	snd_pcm_uframes_t frames_to_read;
 	uint8_t *buff;
-	int rsend, frame_size;
+	ssize_t rsend;
+	int frame_size;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu, size=%lu io->nonblock=%u",
 			areas->step, areas->first, offset, size, io->nonblock);
@@ -922,36 +1168,17 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 	}
 
 	frame_size = areas->step / 8;
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_read = size;
-	else
-		frames_to_read = (data->link_mtu - data->count) / frame_size;
 
-	DBG("count=%d frames_to_read=%lu", data->count, frames_to_read);
-
-	/* Ready for more data */
 	buff = (uint8_t *) areas->addr +
 			(areas->first + areas->step * offset) / 8;
-	memcpy(data->buffer + data->count, buff, frame_size * frames_to_read);
-
-	/* Remember we have some frames in the pipe now */
-	data->count += frames_to_read * frame_size;
-	if (data->count != data->link_mtu) {
-		ret = frames_to_read;
-		goto done;
-	}
 
-	rsend = send(data->stream.fd, data->buffer, data->link_mtu,
-			io->nonblock ? MSG_DONTWAIT : 0);
-	if (rsend > 0) {
-		/* Reset count pointer */
-		data->count = 0;
-
-		ret = frames_to_read;
-	} else if (rsend < 0)
-		ret = (errno == EPIPE) ? -EIO : -errno;
+	/* All packets completed by this chunk leave with one call */
+	rsend = sco_transport_write(&data->sco, buff, size * frame_size,
+					io->nonblock ? MSG_DONTWAIT : 0);
+	if (rsend < 0)
+		ret = (rsend == -EPIPE) ? -EIO : rsend;
 	else
-		ret = -EIO;
+		ret = rsend / frame_size;
 
 done:
 	DBG("returning %ld", ret);
@@ -966,40 +1193,6 @@ static snd_pcm_sframes_t bluetooth_a2dp_read(snd_pcm_ioplug_t *io,
 	return ret;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
-{
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
-	struct bluetooth_a2dp *a2dp = &data->a2dp;
-
-	header = (void *) a2dp->buffer;
-	payload = (void *) (a2dp->buffer + sizeof(*header));
-
-	memset(a2dp->buffer, 0, sizeof(*header) + sizeof(*payload));
-
-	payload->frame_count = a2dp->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(a2dp->seq_num);
-	header->timestamp = htonl(a2dp->nsamples);
-	header->ssrc = htonl(1);
-
-	ret = send(data->stream.fd, a2dp->buffer, a2dp->count, MSG_DONTWAIT);
-	if (ret < 0) {
-		DBG("send returned %d errno %s.", ret, strerror(errno));
-		ret = -errno;
-	}
-
-	/* Reset buffer of data to send */
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	a2dp->frame_count = 0;
-	a2dp->samples = 0;
-	a2dp->seq_num++;
-
-	return ret;
-}
-
 static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 				const snd_pcm_channel_area_t *areas,
 				snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
@@ -1028,7 +1221,6 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		ret = bluetooth_playback_stop(io);
 		if (ret == 0)
 			ret = -EPIPE;
-		data->reset = 1;
 		return ret;
 	}
 
@@ -1051,6 +1243,9 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		snd_pcm_sw_params_free(swparams);
 	}
 
+	if (a2dp->ring)
+		return bluetooth_a2dp_shm_write(data, buff, size, frame_size);
+
 	/* Check if we have any left over data from the last write */
 	if (data->count > 0) {
 		unsigned int additional_bytes_needed =
@@ -1063,9 +1258,8 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 
 		/* Enough data to encode (sbc wants 1k blocks) */
 		encoded = sbc_encode(&a2dp->sbc, data->buffer, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
+				a2dp->buffer[a2dp->current] + a2dp->count,
+				BUFFER_SIZE - a2dp->count, &written);
 		if (encoded <= 0) {
 			DBG("Encoding error %d", encoded);
 			goto done;
@@ -1075,15 +1269,10 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		a2dp->count += written;
 		a2dp->frame_count++;
 		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
 
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-					a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
+		/* No space left for another frame then queue */
+		if (a2dp->frame_count >= a2dp->frames_per_packet)
+			avdtp_queue_packet(data);
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
@@ -1097,11 +1286,13 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 
 	/* Process this buffer in full chunks */
 	while (bytes_left >= a2dp->codesize) {
-		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, buff, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
+		unsigned int input = MIN(bytes_left, (a2dp->frames_per_packet -
+				a2dp->frame_count) * a2dp->codesize);
+
+		/* Encode as many frames as fit into the current packet */
+		encoded = sbc_encode_frames(&a2dp->sbc, buff, input,
+				a2dp->buffer[a2dp->current] + a2dp->count,
+				BUFFER_SIZE - a2dp->count, &written);
 		if (encoded <= 0) {
 			DBG("Encoding error %d", encoded);
 			goto done;
@@ -1109,22 +1300,17 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
-		buff += a2dp->codesize;
-		bytes_left -= a2dp->codesize;
+		buff += encoded;
+		bytes_left -= encoded;
 
 		/* Increment a2dp buffers */
 		a2dp->count += written;
-		a2dp->frame_count++;
+		a2dp->frame_count += encoded / a2dp->codesize;
 		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
 
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-						a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
+		/* No space left for another frame then queue */
+		if (a2dp->frame_count >= a2dp->frames_per_packet)
+			avdtp_queue_packet(data);
 	}
 
 out:
@@ -1136,6 +1322,9 @@ out:
 	}
 
 done:
+	/* Everything complete from this period goes out together */
+	avdtp_flush(data, 0);
+
 	DBG("returning %ld", size - bytes_left / frame_size);
 
 	return size - bytes_left / frame_size;
@@ -1144,6 +1333,8 @@ done:
 static int bluetooth_playback_delay(snd_pcm_ioplug_t *io,
 					snd_pcm_sframes_t *delayp)
 {
+	struct bluetooth_data *data = io->private_data;
+
 	DBG("");
 
 	/* This updates io->hw_ptr value using pointer() function */
@@ -1156,6 +1347,10 @@ static int bluetooth_playback_delay(snd_pcm_ioplug_t *io,
 		*delayp = 0;
 	}
 
+	/* Account for the latency the sink reported, in 1/10 ms */
+	if (data->delay > 0)
+		*delayp += (snd_pcm_sframes_t) data->delay * io->rate / 10000;
+
 	/* This should never fail, ALSA API is really not
 	prepared to handle a non zero return value */
 	return 0;
@@ -1164,7 +1359,7 @@ static int bluetooth_playback_delay(snd_pcm_ioplug_t *io,
 static snd_pcm_ioplug_callback_t bluetooth_hsp_playback = {
 	.start			= bluetooth_playback_start,
 	.stop			= bluetooth_playback_stop,
-	.pointer		= bluetooth_pointer,
+	.pointer		= bluetooth_playback_pointer,
 	.close			= bluetooth_close,
 	.hw_params		= bluetooth_hsp_hw_params,
 	.prepare		= bluetooth_prepare,
@@ -1190,7 +1385,7 @@ static snd_pcm_ioplug_callback_t bluetooth_hsp_capture = {
 static snd_pcm_ioplug_callback_t bluetooth_a2dp_playback = {
 	.start			= bluetooth_playback_start,
 	.stop			= bluetooth_playback_stop,
-	.pointer		= bluetooth_pointer,
+	.pointer		= bluetooth_playback_pointer,
 	.close			= bluetooth_close,
 	.hw_params		= bluetooth_a2dp_hw_params,
 	.prepare		= bluetooth_prepare,
@@ -1228,7 +1423,8 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 	unsigned int format_list[] = {
 		SND_PCM_FORMAT_S16
 	};
-	int err;
+	unsigned int period_list[SCO_TRANSPORT_MAX_PACKETS];
+	int i, err;
 
 	/* access type */
 	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
@@ -1254,9 +1450,12 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 	if (err < 0)
 		return err;
 
-	/* supported block size */
-	err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-						data->link_mtu, data->link_mtu);
+	/* supported block size, whole packets up to a full batch */
+	for (i = 0; i < SCO_TRANSPORT_MAX_PACKETS; i++)
+		period_list[i] = data->link_mtu * (i + 1);
+
+	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					SCO_TRANSPORT_MAX_PACKETS, period_list);
 	if (err < 0)
 		return err;
 
@@ -1387,6 +1586,7 @@ static int bluetooth_parse_config(snd_config_t *conf,
 
 	/* Set defaults */
 	bt_config->autoconnect = 1;
+	bt_config->drift_correction = 1;
 
 	snd_config_for_each(i, next, conf) {
 		snd_config_t *n = snd_config_iterator_entry(i);
@@ -1411,6 +1611,32 @@ static int bluetooth_parse_config(snd_config_t *conf,
 			continue;
 		}
 
+		if (strcmp(id, "drift_correction") == 0) {
+			int b;
+
+			b = snd_config_get_bool(n);
+			if (b < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->drift_correction = b;
+			continue;
+		}
+
+		if (strcmp(id, "shm") == 0) {
+			int b;
+
+			b = snd_config_get_bool(n);
+			if (b < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->shm = b;
+			continue;
+		}
+
 		if (strcmp(id, "device") == 0 || strcmp(id, "bdaddr") == 0) {
 			if (snd_config_get_string(n, &value) < 0) {
 				SNDERR("Invalid type for %s", id);
@@ -1657,6 +1883,10 @@ static int bluetooth_init(struct bluetooth_data *data,
 
 	memset(data, 0, sizeof(struct bluetooth_data));
 
+	data->timerfd = -1;
+	data->eventfd = -1;
+	data->a2dp.ring_eventfd = -1;
+
 	err = bluetooth_parse_config(conf, alsa_conf);
 	if (err < 0)
 		return err;
@@ -1673,18 +1903,21 @@ static int bluetooth_init(struct bluetooth_data *data,
 	data->server.fd = sk;
 	data->server.events = POLLIN;
 
-	data->pipefd[0] = -1;
-	data->pipefd[1] = -1;
+	data->delay = -1;
 
-	if (pipe(data->pipefd) < 0) {
-		err = -errno;
-		goto failed;
-	}
-	if (fcntl(data->pipefd[0], F_SETFL, O_NONBLOCK) < 0) {
+	/* Delay reports are ignored until playback starts */
+	data->stopped = 1;
+	data->delay_ref = -1;
+
+	data->timerfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->timerfd < 0) {
 		err = -errno;
 		goto failed;
 	}
-	if (fcntl(data->pipefd[1], F_SETFL, O_NONBLOCK) < 0) {
+
+	data->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (data->eventfd < 0) {
 		err = -errno;
 		goto failed;
 	}
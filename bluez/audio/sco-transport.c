@@ -0,0 +1,343 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "sco-transport.h"
+
+#ifndef MIN
+# define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif
+
+const struct sco_framing sco_framing_pcm = {
+	.name		= "pcm",
+};
+
+int sco_transport_init(struct sco_transport *t, int fd, unsigned int mtu,
+				const struct sco_framing *framing,
+				void *user_data)
+{
+	memset(t, 0, sizeof(*t));
+
+	if (mtu == 0 || mtu > SCO_TRANSPORT_MAX_MTU)
+		return -EINVAL;
+
+	t->frame_len = framing->frame_len ? framing->frame_len : mtu;
+	t->pcm_len = framing->pcm_len ? framing->pcm_len : t->frame_len;
+
+	if (t->frame_len > SCO_TRANSPORT_MAX_FRAME ||
+				t->pcm_len > SCO_TRANSPORT_MAX_FRAME)
+		return -EINVAL;
+
+	/* Passing data through only works when nothing changes size */
+	if ((framing->encode == NULL || framing->decode == NULL) &&
+						t->frame_len != t->pcm_len)
+		return -EINVAL;
+
+	t->fd = fd;
+	t->mtu = mtu;
+	t->framing = framing;
+	t->user_data = user_data;
+	t->depth = SCO_TRANSPORT_JITTER_DEPTH;
+
+	return 0;
+}
+
+/* Bytes that can still be packed before the queue is full */
+static unsigned int tx_room(struct sco_transport *t)
+{
+	return (SCO_TRANSPORT_MAX_PACKETS - t->tx_count) * t->mtu - t->tx_fill;
+}
+
+/* Appends one coded frame, which may straddle packets */
+static void tx_pack(struct sco_transport *t, const uint8_t *frame)
+{
+	unsigned int done = 0, chunk;
+
+	while (done < t->frame_len) {
+		chunk = MIN(t->frame_len - done, t->mtu - t->tx_fill);
+
+		memcpy(t->tx[t->tx_count] + t->tx_fill, frame + done, chunk);
+		t->tx_fill += chunk;
+		done += chunk;
+
+		if (t->tx_fill == t->mtu) {
+			t->tx_count++;
+			t->tx_fill = 0;
+		}
+	}
+}
+
+/* Sends every complete packet with one call.  Packets a non-blocking
+ * socket did not take stay queued.  Returns the packets sent or a
+ * negative errno. */
+int sco_transport_flush(struct sco_transport *t, int flags)
+{
+	struct audio_mmsghdr msgs[SCO_TRANSPORT_MAX_PACKETS];
+	struct iovec iov[SCO_TRANSPORT_MAX_PACKETS];
+	unsigned int i, left;
+	int ret;
+
+	if (t->tx_count == 0)
+		return 0;
+
+	memset(msgs, 0, t->tx_count * sizeof(*msgs));
+
+	for (i = 0; i < t->tx_count; i++) {
+		iov[i].iov_base = t->tx[i];
+		iov[i].iov_len = t->mtu;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = audio_sendmmsg(t->fd, msgs, t->tx_count, flags);
+	if (ret < 0)
+		return -errno;
+
+	t->tx_packets += ret;
+	t->tx_calls++;
+
+	if (ret == 0)
+		return 0;
+
+	/* Move what is left, the packet being filled included, to the
+	 * front */
+	left = t->tx_count - ret;
+	if (t->tx_count < SCO_TRANSPORT_MAX_PACKETS)
+		left++;
+
+	memmove(t->tx[0], t->tx[ret], left * sizeof(t->tx[0]));
+	t->tx_count -= ret;
+
+	return ret;
+}
+
+/* Takes PCM, codes every completed frame and sends the complete packets.
+ * Returns the PCM bytes taken, -EAGAIN when a non-blocking socket left
+ * no room at all, or another negative errno on failure. */
+ssize_t sco_transport_write(struct sco_transport *t, const void *pcm,
+						size_t len, int flags)
+{
+	const uint8_t *in = pcm;
+	uint8_t frame[SCO_TRANSPORT_MAX_FRAME];
+	size_t done = 0;
+	unsigned int chunk;
+	int err;
+
+	while (done < len) {
+		chunk = MIN(len - done, t->pcm_len - t->tx_pcm_fill);
+
+		/* Make room before taking the PCM completing a frame */
+		if (t->tx_pcm_fill + chunk == t->pcm_len &&
+					tx_room(t) < t->frame_len) {
+			err = sco_transport_flush(t, flags);
+			if (err < 0 && err != -EAGAIN)
+				return err;
+
+			if (tx_room(t) < t->frame_len)
+				break;
+		}
+
+		memcpy(t->tx_pcm + t->tx_pcm_fill, in + done, chunk);
+		t->tx_pcm_fill += chunk;
+		done += chunk;
+
+		if (t->tx_pcm_fill < t->pcm_len)
+			continue;
+
+		t->tx_pcm_fill = 0;
+
+		if (t->framing->encode == NULL) {
+			tx_pack(t, t->tx_pcm);
+			continue;
+		}
+
+		if (t->framing->encode(t->user_data, t->tx_pcm, frame) < 0)
+			return -EIO;
+
+		tx_pack(t, frame);
+	}
+
+	if (done == 0)
+		return -EAGAIN;
+
+	err = sco_transport_flush(t, flags);
+	if (err < 0 && err != -EAGAIN)
+		return err;
+
+	return done;
+}
+
+/* Receives what fits into the jitter buffer.  When it is full the oldest
+ * packets are dropped: late audio is worth less than staying in time. */
+static int rx_receive(struct sco_transport *t, int flags)
+{
+	struct audio_mmsghdr msgs[SCO_TRANSPORT_MAX_PACKETS];
+	struct iovec iov[SCO_TRANSPORT_MAX_PACKETS];
+	unsigned int i, tail, count;
+	int ret;
+
+	if (t->rx_count == SCO_TRANSPORT_JITTER_PACKETS) {
+		count = SCO_TRANSPORT_MAX_PACKETS;
+
+		t->rx_head = (t->rx_head + count) %
+						SCO_TRANSPORT_JITTER_PACKETS;
+		t->rx_count -= count;
+		t->rx_offset = 0;
+		t->rx_frame_fill = 0;
+		t->overruns += count;
+	}
+
+	count = MIN(SCO_TRANSPORT_JITTER_PACKETS - t->rx_count,
+					SCO_TRANSPORT_MAX_PACKETS);
+	tail = t->rx_head + t->rx_count;
+
+	memset(msgs, 0, count * sizeof(*msgs));
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = t->rx[(tail + i) %
+					SCO_TRANSPORT_JITTER_PACKETS];
+		iov[i].iov_len = t->mtu;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = audio_recvmmsg(t->fd, msgs, count, flags);
+	if (ret < 0)
+		return -errno;
+
+	t->rx_calls++;
+
+	for (i = 0; i < (unsigned int) ret; i++) {
+		/* The link went away */
+		if (msgs[i].msg_len == 0)
+			return i > 0 ? (int) i : -EIO;
+
+		t->rx_len[(tail + i) % SCO_TRANSPORT_JITTER_PACKETS] =
+							msgs[i].msg_len;
+		t->rx_count++;
+		t->rx_packets++;
+	}
+
+	return ret;
+}
+
+/* Assembles and decodes the next frame from the buffered packets */
+static int rx_next_frame(struct sco_transport *t)
+{
+	uint8_t *frame = t->framing->decode ? t->rx_frame : t->rx_pcm;
+	unsigned int len, chunk;
+
+	while (t->rx_frame_fill < t->frame_len) {
+		if (t->rx_count == 0)
+			return -EAGAIN;
+
+		len = t->rx_len[t->rx_head];
+		chunk = MIN(t->frame_len - t->rx_frame_fill,
+						len - t->rx_offset);
+
+		memcpy(frame + t->rx_frame_fill,
+				t->rx[t->rx_head] + t->rx_offset, chunk);
+		t->rx_frame_fill += chunk;
+		t->rx_offset += chunk;
+
+		if (t->rx_offset == len) {
+			t->rx_head = (t->rx_head + 1) %
+						SCO_TRANSPORT_JITTER_PACKETS;
+			t->rx_count--;
+			t->rx_offset = 0;
+		}
+	}
+
+	t->rx_frame_fill = 0;
+
+	/* A frame which does not decode is played as silence */
+	if (t->framing->decode && t->framing->decode(t->user_data,
+						t->rx_frame, t->rx_pcm) < 0)
+		memset(t->rx_pcm, 0, t->pcm_len);
+
+	t->rx_pcm_len = t->pcm_len;
+	t->rx_pcm_offset = 0;
+
+	return 0;
+}
+
+/* Hands out received PCM.  Returns the bytes copied, -EAGAIN when a
+ * non-blocking read found the jitter buffer still filling, or another
+ * negative errno on failure. */
+ssize_t sco_transport_read(struct sco_transport *t, void *pcm, size_t len,
+								int flags)
+{
+	uint8_t *out = pcm;
+	size_t done = 0;
+	unsigned int chunk;
+	int ret;
+
+	while (done == 0) {
+		/* Take whatever the socket has queued meanwhile */
+		ret = rx_receive(t, flags | MSG_DONTWAIT);
+		if (ret < 0 && ret != -EAGAIN)
+			return ret;
+
+		while (!t->primed && t->rx_count < t->depth) {
+			if (flags & MSG_DONTWAIT)
+				return -EAGAIN;
+
+			ret = rx_receive(t, flags);
+			if (ret < 0)
+				return ret;
+		}
+
+		t->primed = 1;
+
+		while (done < len) {
+			if (t->rx_pcm_offset == t->rx_pcm_len &&
+						rx_next_frame(t) < 0) {
+				/* Ran dry, fill up again before going on */
+				t->primed = 0;
+				t->underruns++;
+				break;
+			}
+
+			chunk = MIN(len - done,
+					t->rx_pcm_len - t->rx_pcm_offset);
+
+			memcpy(out + done, t->rx_pcm + t->rx_pcm_offset,
+									chunk);
+			t->rx_pcm_offset += chunk;
+			done += chunk;
+		}
+
+		if (done == 0 && (flags & MSG_DONTWAIT))
+			return -EAGAIN;
+	}
+
+	return done;
+}
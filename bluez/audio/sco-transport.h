@@ -0,0 +1,114 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "mmsg.h"
+
+/* Batched SCO audio transport.
+ *
+ * Outgoing PCM is cut into frames by a framing stage, coded and packed
+ * into link MTU sized packets; every complete packet queued by one write
+ * goes to the socket with a single sendmmsg().  Incoming packets are
+ * taken with recvmmsg() into a jitter buffer, which only starts handing
+ * out audio once it holds a few packets and starts over after running
+ * empty, so bursty delivery does not turn into gaps.
+ *
+ * The framing stage only knows the frame sizes and optional coding
+ * callbacks.  CVSD is coded by the controller and uses the plain PCM
+ * framing, a wideband codec plugs in with its own frame lengths. */
+
+#define SCO_TRANSPORT_MAX_MTU		512
+#define SCO_TRANSPORT_MAX_FRAME		512
+#define SCO_TRANSPORT_MAX_PACKETS	16
+#define SCO_TRANSPORT_JITTER_PACKETS	32
+
+/* Packets buffered before received audio is played out */
+#define SCO_TRANSPORT_JITTER_DEPTH	4
+
+struct sco_framing {
+	const char *name;
+	unsigned int frame_len;		/* Coded bytes per frame, 0 for MTU */
+	unsigned int pcm_len;		/* PCM bytes per frame, 0 for frame_len */
+
+	/* Code exactly one frame, NULL passes the bytes through */
+	int (*encode)(void *user_data, const void *pcm, void *frame);
+	int (*decode)(void *user_data, const void *frame, void *pcm);
+};
+
+/* Linear PCM, the controller does the air coding */
+extern const struct sco_framing sco_framing_pcm;
+
+struct sco_transport {
+	int fd;					/* SCO socket */
+	unsigned int mtu;			/* Link MTU */
+
+	const struct sco_framing *framing;
+	void *user_data;			/* Passed to the framing */
+	unsigned int frame_len;			/* Resolved coded frame size */
+	unsigned int pcm_len;			/* Resolved PCM frame size */
+
+	/* Transmit: packets 0 .. count - 1 are complete and waiting,
+	 * packet count is being filled with tx_fill bytes */
+	uint8_t tx[SCO_TRANSPORT_MAX_PACKETS][SCO_TRANSPORT_MAX_MTU];
+	unsigned int tx_count;
+	unsigned int tx_fill;
+	uint8_t tx_pcm[SCO_TRANSPORT_MAX_FRAME];	/* PCM of next frame */
+	unsigned int tx_pcm_fill;
+
+	/* Receive: ring of packets forming the jitter buffer */
+	uint8_t rx[SCO_TRANSPORT_JITTER_PACKETS][SCO_TRANSPORT_MAX_MTU];
+	unsigned int rx_len[SCO_TRANSPORT_JITTER_PACKETS];
+	unsigned int rx_head;			/* Oldest packet */
+	unsigned int rx_count;			/* Packets buffered */
+	unsigned int rx_offset;			/* Bytes used of oldest */
+	unsigned int depth;			/* Packets needed to start */
+	int primed;				/* Playing out */
+	uint8_t rx_frame[SCO_TRANSPORT_MAX_FRAME];	/* Coded frame */
+	unsigned int rx_frame_fill;
+	uint8_t rx_pcm[SCO_TRANSPORT_MAX_FRAME];	/* Decoded frame */
+	unsigned int rx_pcm_len;
+	unsigned int rx_pcm_offset;
+
+	/* Counters */
+	unsigned long tx_packets;
+	unsigned long tx_calls;
+	unsigned long rx_packets;
+	unsigned long rx_calls;
+	unsigned long overruns;			/* Packets dropped when full */
+	unsigned long underruns;		/* Times the buffer ran empty */
+};
+
+int sco_transport_init(struct sco_transport *t, int fd, unsigned int mtu,
+				const struct sco_framing *framing,
+				void *user_data);
+
+ssize_t sco_transport_write(struct sco_transport *t, const void *pcm,
+						size_t len, int flags);
+
+int sco_transport_flush(struct sco_transport *t, int flags);
+
+ssize_t sco_transport_read(struct sco_transport *t, void *pcm, size_t len,
+								int flags);
@@ -0,0 +1,862 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include <bluetooth/bluetooth.h>
+#include <dbus/dbus.h>
+#include <glib.h>
+
+#ifdef ANDROID
+#include <cutils/ashmem.h>
+#endif
+
+#include "log.h"
+#include "sbc.h"
+#include "ipc.h"
+#include "device.h"
+#include "avdtp.h"
+#include "a2dp.h"
+#include "sink.h"
+#include "a2dp-sender.h"
+#include "stats.h"
+#include "shm-stream.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		(1024 + 9)
+#endif
+
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK		0x0002
+#endif
+
+#ifndef F_SEAL_GROW
+#define F_SEAL_GROW		0x0004
+#endif
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+#define DEFAULT_RING_SIZE	32768
+#define MIN_RING_SIZE		4096
+#define MAX_RING_SIZE		(1 << 20)
+
+/* Falling further behind than this skips ahead instead of bursting */
+#define MAX_LATE_MS		200
+
+struct shm_input {
+	struct shm_stream *stream;
+	struct bt_shm_ring *ring;
+	uint32_t size;
+	size_t map_size;
+	int ring_fd;
+	int event_fd;
+	guint watch;
+	shm_input_cb_t removed;
+	void *user_data;
+};
+
+struct shm_stream {
+	struct audio_device *dev;
+	struct avdtp_stream *stream;
+	GSList *inputs;
+
+	sbc_t sbc;
+	unsigned int rate;
+	unsigned int channels;
+	size_t codesize;
+	size_t frame_length;
+	unsigned int frame_samples;
+	unsigned int frames_per_packet;
+
+	/* Mixed PCM of one packet and the scratch space to read inputs */
+	int32_t *mix;
+	int16_t *pcm;
+
+	struct a2dp_sender sender;
+	uint8_t *packets[A2DP_SENDER_MAX_PACKETS];
+
+	gboolean started;
+	guint timer;
+	struct timespec start;
+	uint64_t samples;
+
+	/* Sinks of one broadcast group with the same SBC configuration share
+	 * the encoder of the first one started, which mixes the inputs of
+	 * all members and queues every packet to each member's socket. */
+	char *group;
+	struct shm_stream *leader;	/* Encoding stream, NULL if self */
+	GSList *members;		/* Streams this one encodes for */
+};
+
+static GSList *streams = NULL;
+
+/* Creates a shared memory region of a fixed size and maps it.  A client
+ * resizing the region under the mapping would make the daemon fault on
+ * the pages past the new end, so the size is locked before the fd can
+ * be handed out: memfds are sealed against shrinking and growing, the
+ * size of an ashmem region is fixed by its first mapping. */
+int shm_create_fd(const char *name, size_t size, void **map)
+{
+	int fd, err;
+
+#ifdef ANDROID
+	fd = ashmem_create_region(name, size);
+	if (fd < 0)
+		return -errno;
+#elif defined(__NR_memfd_create)
+	fd = syscall(__NR_memfd_create, name,
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, size) < 0 ||
+			fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+#else
+	return -ENOSYS;
+#endif
+
+	*map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+/* Returns a read-only fd of a region from shm_create_fd() for readers that
+ * must not touch it.  The daemon's mapping stays writable, but no write
+ * and no writable mapping is allowed afterwards, including through
+ * reopening /proc/self/fd. */
+int shm_share_readonly(int fd)
+{
+	int ro;
+#ifdef ANDROID
+	if (ashmem_set_prot_region(fd, PROT_READ) < 0)
+		return -errno;
+
+	ro = dup(fd);
+#else
+	char path[32];
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0)
+		return -errno;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ro = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+	if (ro < 0)
+		return -errno;
+
+	return ro;
+}
+
+/* Takes up to len bytes of whole samples out of the ring */
+static size_t ring_read(struct shm_input *in, void *buf, size_t len,
+						unsigned int frame_size)
+{
+	struct bt_shm_ring *ring = in->ring;
+	uint32_t head, tail, avail, offset, first;
+
+	head = ring->head;
+	tail = ring->tail;
+
+	/* Pairs with the client's barrier before advancing head */
+	__sync_synchronize();
+
+	avail = head - tail;
+	if (avail > in->size) {
+		error("PCM ring overrun by client, resynchronizing");
+		ring->tail = head;
+		return 0;
+	}
+
+	if (len > avail)
+		len = avail;
+
+	len -= len % frame_size;
+	if (len == 0)
+		return 0;
+
+	offset = tail & (in->size - 1);
+	first = MIN(len, in->size - offset);
+
+	memcpy(buf, ring->data + offset, first);
+	memcpy((uint8_t *) buf + first, ring->data, len - first);
+
+	__sync_synchronize();
+
+	ring->tail = tail + len;
+
+	return len;
+}
+
+static gboolean ring_empty(struct shm_input *in)
+{
+	return in->ring->head == in->ring->tail;
+}
+
+static gboolean mix_stream(struct shm_stream *s, struct shm_stream *member,
+								size_t len)
+{
+	unsigned int i, frame_size = s->channels * sizeof(int16_t);
+	gboolean active = FALSE;
+	GSList *l;
+
+	for (l = member->inputs; l != NULL; l = l->next) {
+		struct shm_input *in = l->data;
+		size_t got;
+
+		got = ring_read(in, s->pcm, len, frame_size);
+		if (got == 0)
+			continue;
+
+		active = TRUE;
+
+		for (i = 0; i < got / sizeof(int16_t); i++)
+			s->mix[i] += s->pcm[i];
+	}
+
+	return active;
+}
+
+/* Mixes len bytes from every input of the stream and its group members,
+ * inputs running short are padded with silence.  Returns FALSE when no
+ * input had anything at all. */
+static gboolean mix_inputs(struct shm_stream *s, size_t len)
+{
+	unsigned int i, count = len / sizeof(int16_t);
+	gboolean active;
+	GSList *l;
+
+	memset(s->mix, 0, count * sizeof(int32_t));
+
+	active = mix_stream(s, s, len);
+
+	for (l = s->members; l != NULL; l = l->next) {
+		if (mix_stream(s, l->data, len))
+			active = TRUE;
+	}
+
+	for (i = 0; i < count; i++)
+		s->pcm[i] = CLAMP(s->mix[i], -32768, 32767);
+
+	return active;
+}
+
+/* Packets fit the smallest MTU of the group */
+static unsigned int group_frames_per_packet(struct shm_stream *s)
+{
+	unsigned int frames = s->frames_per_packet;
+	GSList *l;
+
+	for (l = s->members; l != NULL; l = l->next) {
+		struct shm_stream *member = l->data;
+
+		frames = MIN(frames, member->frames_per_packet);
+	}
+
+	return frames;
+}
+
+/* Sends what was queued for one stream.  Every member has its own
+ * non-blocking socket and sender state, so a sink which cannot keep up
+ * only loses its own packets and never holds back the others. */
+static void flush_packets(struct shm_stream *s, const size_t *lengths,
+					unsigned int encoded,
+					unsigned int frames)
+{
+	struct media_stats *stats = avdtp_stream_get_stats(s->stream);
+	struct timespec begin, end;
+	unsigned int sent, latency, i;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	ret = a2dp_sender_flush(&s->sender, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0 && ret != -EAGAIN)
+		error("Unable to send media packets: %s (%d)",
+						strerror(-ret), -ret);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	latency = (end.tv_sec - begin.tv_sec) * 1000000 +
+				(end.tv_nsec - begin.tv_nsec) / 1000;
+
+	sent = ret > 0 ? ret : 0;
+	for (i = 0; i < sent; i++)
+		stats->bytes += lengths[i];
+
+	stats->frames += encoded * frames;
+	stats->packets += sent;
+	stats->send_errors += encoded - sent;
+	stats->sends++;
+	stats->latency_total += latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+	stats->bitpool = s->sbc.bitpool;
+
+	/* Late audio is worth less than staying in time */
+	a2dp_sender_discard(&s->sender);
+}
+
+static gboolean encode_packets(gpointer data)
+{
+	struct shm_stream *s = data;
+	unsigned int frames = group_frames_per_packet(s);
+	unsigned int packet_samples = frames * s->frame_samples;
+	size_t pcm_len = frames * s->codesize;
+	struct media_stats *stats = avdtp_stream_get_stats(s->stream);
+	size_t lengths[A2DP_SENDER_MAX_PACKETS];
+	unsigned int encoded = 0;
+	gboolean active = FALSE;
+	struct timespec now;
+	int64_t elapsed;
+	uint64_t due;
+	GSList *l;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed = (int64_t) (now.tv_sec - s->start.tv_sec) * 1000000 +
+				(now.tv_nsec - s->start.tv_nsec) / 1000;
+	due = elapsed * s->rate / 1000000;
+
+	if (due > s->samples + s->rate * MAX_LATE_MS / 1000) {
+		DBG("%llu samples late, skipping ahead",
+				(unsigned long long) (due - s->samples));
+		s->samples = due - packet_samples;
+	}
+
+	while (s->samples + packet_samples <= due &&
+			encoded < A2DP_SENDER_MAX_PACKETS) {
+		uint8_t *buf = s->packets[encoded];
+		ssize_t written = 0;
+
+		if (mix_inputs(s, pcm_len))
+			active = TRUE;
+		else
+			stats->underruns++;
+
+		if (sbc_encode_frames(&s->sbc, s->pcm, pcm_len, buf,
+					frames * s->frame_length,
+					&written) < (ssize_t) pcm_len) {
+			error("SBC encoding failed");
+			break;
+		}
+
+		/* Members reference the same encoded frames */
+		a2dp_sender_queue(&s->sender, buf, written, frames,
+							packet_samples);
+
+		for (l = s->members; l != NULL; l = l->next) {
+			struct shm_stream *member = l->data;
+
+			a2dp_sender_queue(&member->sender, buf, written,
+						frames, packet_samples);
+		}
+
+		lengths[encoded] = A2DP_RTP_HEADER_SIZE + written;
+
+		s->samples += packet_samples;
+		encoded++;
+	}
+
+	if (encoded > 0) {
+		flush_packets(s, lengths, encoded, frames);
+
+		for (l = s->members; l != NULL; l = l->next)
+			flush_packets(l->data, lengths, encoded, frames);
+	}
+
+	/* Every ring ran dry, sleep until a client signals new data */
+	if (encoded > 0 && !active) {
+		s->timer = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static guint add_encoder_timer(struct shm_stream *s)
+{
+	unsigned int interval;
+
+	interval = group_frames_per_packet(s) * s->frame_samples * 1000 /
+								s->rate;
+
+	return g_timeout_add(MAX(interval, 1), encode_packets, s);
+}
+
+static void start_encoder(struct shm_stream *s)
+{
+	if (s->leader)
+		s = s->leader;
+
+	if (!s->started || s->timer)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	s->samples = 0;
+
+	s->timer = add_encoder_timer(s);
+}
+
+static gboolean same_config(struct shm_stream *a, struct shm_stream *b)
+{
+	return a->sbc.frequency == b->sbc.frequency &&
+			a->sbc.mode == b->sbc.mode &&
+			a->sbc.subbands == b->sbc.subbands &&
+			a->sbc.blocks == b->sbc.blocks &&
+			a->sbc.allocation == b->sbc.allocation &&
+			a->sbc.bitpool == b->sbc.bitpool;
+}
+
+static struct shm_stream *find_group_leader(struct shm_stream *s)
+{
+	GSList *l;
+
+	if (s->group == NULL)
+		return NULL;
+
+	for (l = streams; l != NULL; l = l->next) {
+		struct shm_stream *other = l->data;
+
+		if (other == s || !other->started || other->leader)
+			continue;
+
+		if (g_strcmp0(other->group, s->group) != 0)
+			continue;
+
+		if (same_config(other, s))
+			return other;
+	}
+
+	return NULL;
+}
+
+static void group_leave(struct shm_stream *s)
+{
+	struct shm_stream *next;
+	GSList *l;
+
+	if (s->leader) {
+		DBG("%p leaves group %s", s, s->group);
+		s->leader->members = g_slist_remove(s->leader->members, s);
+		s->leader = NULL;
+		return;
+	}
+
+	if (s->members == NULL)
+		return;
+
+	/* Hand the encoder over to the next member, keeping its clock so
+	 * the others do not notice */
+	next = s->members->data;
+	next->leader = NULL;
+	next->members = g_slist_copy(s->members->next);
+
+	for (l = next->members; l != NULL; l = l->next) {
+		struct shm_stream *member = l->data;
+
+		member->leader = next;
+	}
+
+	g_slist_free(s->members);
+	s->members = NULL;
+
+	DBG("%p takes over group %s from %p", next, next->group, s);
+
+	if (s->timer) {
+		next->start = s->start;
+		next->samples = s->samples;
+		next->timer = add_encoder_timer(next);
+	}
+}
+
+static gboolean input_event(GIOChannel *io, GIOCondition cond,
+							gpointer data)
+{
+	struct shm_input *in = data;
+	uint64_t value;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		in->watch = 0;
+		return FALSE;
+	}
+
+	if (read(in->event_fd, &value, sizeof(value)) < 0 &&
+							errno != EAGAIN) {
+		error("eventfd read: %s (%d)", strerror(errno), errno);
+		in->watch = 0;
+		return FALSE;
+	}
+
+	if (in->stream)
+		start_encoder(in->stream);
+
+	return TRUE;
+}
+
+struct shm_stream *shm_stream_new(struct audio_device *dev,
+					struct avdtp_stream *stream)
+{
+	struct avdtp_service_capability *service;
+	struct avdtp_media_codec_capability *codec;
+	struct sbc_codec_cap *sbc_cap;
+	struct shm_stream *s;
+	int i;
+
+	service = avdtp_stream_get_codec(stream);
+	if (service == NULL)
+		return NULL;
+
+	codec = (struct avdtp_media_codec_capability *) service->data;
+	if (codec->media_codec_type != A2DP_CODEC_SBC) {
+		error("Shared memory streams need SBC");
+		return NULL;
+	}
+
+	sbc_cap = (struct sbc_codec_cap *) codec;
+
+	s = g_new0(struct shm_stream, 1);
+	s->dev = dev;
+	s->stream = stream;
+
+	sbc_init(&s->sbc, 0);
+
+	switch (sbc_cap->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		s->sbc.frequency = SBC_FREQ_16000;
+		s->rate = 16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		s->sbc.frequency = SBC_FREQ_32000;
+		s->rate = 32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		s->sbc.frequency = SBC_FREQ_44100;
+		s->rate = 44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+	default:
+		s->sbc.frequency = SBC_FREQ_48000;
+		s->rate = 48000;
+		break;
+	}
+
+	switch (sbc_cap->channel_mode) {
+	case SBC_CHANNEL_MODE_MONO:
+		s->sbc.mode = SBC_MODE_MONO;
+		break;
+	case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+		s->sbc.mode = SBC_MODE_DUAL_CHANNEL;
+		break;
+	case SBC_CHANNEL_MODE_STEREO:
+		s->sbc.mode = SBC_MODE_STEREO;
+		break;
+	case SBC_CHANNEL_MODE_JOINT_STEREO:
+	default:
+		s->sbc.mode = SBC_MODE_JOINT_STEREO;
+		break;
+	}
+
+	s->channels = s->sbc.mode == SBC_MODE_MONO ? 1 : 2;
+
+	s->sbc.allocation = sbc_cap->allocation_method == SBC_ALLOCATION_SNR ?
+						SBC_AM_SNR : SBC_AM_LOUDNESS;
+	s->sbc.subbands = sbc_cap->subbands == SBC_SUBBANDS_4 ?
+						SBC_SB_4 : SBC_SB_8;
+
+	switch (sbc_cap->block_length) {
+	case SBC_BLOCK_LENGTH_4:
+		s->sbc.blocks = SBC_BLK_4;
+		break;
+	case SBC_BLOCK_LENGTH_8:
+		s->sbc.blocks = SBC_BLK_8;
+		break;
+	case SBC_BLOCK_LENGTH_12:
+		s->sbc.blocks = SBC_BLK_12;
+		break;
+	case SBC_BLOCK_LENGTH_16:
+	default:
+		s->sbc.blocks = SBC_BLK_16;
+		break;
+	}
+
+	s->sbc.bitpool = sbc_cap->max_bitpool;
+
+	s->codesize = sbc_get_codesize(&s->sbc);
+	s->frame_length = sbc_get_frame_length(&s->sbc);
+	s->frame_samples = s->codesize / (s->channels * sizeof(int16_t));
+
+	s->mix = g_new(int32_t, A2DP_MAX_PACKET_FRAMES * s->codesize /
+							sizeof(int16_t));
+	s->pcm = g_malloc(A2DP_MAX_PACKET_FRAMES * s->codesize);
+
+	for (i = 0; i < A2DP_SENDER_MAX_PACKETS; i++)
+		s->packets[i] = g_malloc(A2DP_MAX_PACKET_FRAMES *
+							s->frame_length);
+
+	streams = g_slist_append(streams, s);
+
+	DBG("%p: %u Hz, %u channels, bitpool %u", s, s->rate, s->channels,
+							s->sbc.bitpool);
+
+	return s;
+}
+
+void shm_stream_free(struct shm_stream *s)
+{
+	int i;
+
+	DBG("%p", s);
+
+	streams = g_slist_remove(streams, s);
+
+	shm_stream_suspend(s);
+
+	/* Inputs belong to their clients, which are told that nothing
+	 * will consume them anymore */
+	while (s->inputs) {
+		struct shm_input *in = s->inputs->data;
+
+		s->inputs = g_slist_remove(s->inputs, in);
+		in->stream = NULL;
+
+		if (in->removed)
+			in->removed(in, in->user_data);
+	}
+
+	sbc_finish(&s->sbc);
+
+	g_free(s->group);
+
+	for (i = 0; i < A2DP_SENDER_MAX_PACKETS; i++)
+		g_free(s->packets[i]);
+
+	g_free(s->mix);
+	g_free(s->pcm);
+	g_free(s);
+}
+
+struct shm_stream *shm_stream_find(struct audio_device *dev)
+{
+	GSList *l;
+
+	for (l = streams; l != NULL; l = l->next) {
+		struct shm_stream *s = l->data;
+
+		if (s->dev == dev)
+			return s;
+	}
+
+	return NULL;
+}
+
+void shm_stream_get_format(struct shm_stream *s, uint16_t *rate,
+							uint8_t *channels)
+{
+	*rate = s->rate;
+	*channels = s->channels;
+}
+
+int shm_stream_resume(struct shm_stream *s)
+{
+	uint16_t omtu;
+	GSList *l;
+	int fd;
+
+	if (s->started)
+		return 0;
+
+	if (!avdtp_stream_get_transport(s->stream, &fd, NULL, &omtu, NULL))
+		return -EIO;
+
+	s->frames_per_packet = a2dp_frames_per_packet(omtu, s->frame_length);
+	if (s->frames_per_packet == 0) {
+		error("MTU %u too small for SBC frames of %zu bytes", omtu,
+							s->frame_length);
+		return -EINVAL;
+	}
+
+	a2dp_sender_init(&s->sender, fd, omtu);
+
+	s->started = TRUE;
+
+	g_free(s->group);
+	s->group = g_strdup(sink_get_broadcast(s->dev));
+
+	s->leader = find_group_leader(s);
+	if (s->leader) {
+		DBG("%p joins group %s encoded by %p", s, s->group, s->leader);
+		s->leader->members = g_slist_append(s->leader->members, s);
+	}
+
+	for (l = s->inputs; l != NULL; l = l->next) {
+		if (!ring_empty(l->data)) {
+			start_encoder(s);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void shm_stream_suspend(struct shm_stream *s)
+{
+	if (s->started)
+		group_leave(s);
+
+	s->started = FALSE;
+
+	if (s->timer) {
+		g_source_remove(s->timer);
+		s->timer = 0;
+	}
+
+	a2dp_sender_discard(&s->sender);
+}
+
+struct shm_input *shm_input_new(struct shm_stream *s, uint32_t size,
+					shm_input_cb_t removed,
+					void *user_data, int *err)
+{
+	struct shm_input *in;
+	GIOChannel *io;
+	uint32_t ring_size;
+	void *map;
+
+	if (size == 0)
+		size = DEFAULT_RING_SIZE;
+
+	size = CLAMP(size, MIN_RING_SIZE, MAX_RING_SIZE);
+
+	for (ring_size = MIN_RING_SIZE; ring_size < size; ring_size <<= 1);
+
+	in = g_new0(struct shm_input, 1);
+	in->size = ring_size;
+	in->map_size = sizeof(struct bt_shm_ring) + ring_size;
+	in->event_fd = -1;
+
+	in->ring_fd = shm_create_fd("bluetooth-pcm", in->map_size, &map);
+	if (in->ring_fd < 0) {
+		*err = in->ring_fd;
+		error("Unable to create PCM ring: %s (%d)", strerror(-*err),
+									-*err);
+		g_free(in);
+		return NULL;
+	}
+
+	in->ring = map;
+	in->ring->magic = BT_SHM_RING_MAGIC;
+	in->ring->size = ring_size;
+	in->ring->head = 0;
+	in->ring->tail = 0;
+
+	in->event_fd = eventfd(0, 0);
+	if (in->event_fd < 0 ||
+			fcntl(in->event_fd, F_SETFL, O_NONBLOCK) < 0) {
+		*err = -errno;
+		error("eventfd: %s (%d)", strerror(errno), errno);
+		goto failed;
+	}
+
+	io = g_io_channel_unix_new(in->event_fd);
+	in->watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+						G_IO_NVAL, input_event, in);
+	g_io_channel_unref(io);
+
+	in->stream = s;
+	in->removed = removed;
+	in->user_data = user_data;
+	s->inputs = g_slist_append(s->inputs, in);
+
+	DBG("%p: ring of %u bytes for stream %p", in, ring_size, s);
+
+	return in;
+
+failed:
+	shm_input_free(in);
+	return NULL;
+}
+
+void shm_input_free(struct shm_input *in)
+{
+	DBG("%p", in);
+
+	if (in->stream)
+		in->stream->inputs = g_slist_remove(in->stream->inputs, in);
+
+	if (in->watch)
+		g_source_remove(in->watch);
+
+	if (in->ring)
+		munmap(in->ring, in->map_size);
+
+	if (in->event_fd >= 0)
+		close(in->event_fd);
+
+	if (in->ring_fd >= 0)
+		close(in->ring_fd);
+
+	g_free(in);
+}
+
+uint32_t shm_input_get_size(struct shm_input *in)
+{
+	return in->size;
+}
+
+void shm_input_get_fds(struct shm_input *in, int *ring_fd, int *event_fd)
+{
+	*ring_fd = in->ring_fd;
+	*event_fd = in->event_fd;
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Daemon side SBC encoder for clients using shared memory PCM rings.
+ *
+ * A shm_stream exists per A2DP stream and owns the encoder and the media
+ * socket.  Every client attaches a shm_input, a ring shared through a
+ * memfd plus an eventfd it signals after writing.  While the stream is
+ * started all inputs are mixed, encoded once and paced out at the
+ * sampling rate. */
+
+struct shm_stream;
+struct shm_input;
+
+/* Called when the stream of an input is freed before the input, which
+ * may be freed from the callback */
+typedef void (*shm_input_cb_t)(struct shm_input *in, void *user_data);
+
+int shm_create_fd(const char *name, size_t size, void **map);
+int shm_share_readonly(int fd);
+
+struct shm_stream *shm_stream_new(struct audio_device *dev,
+					struct avdtp_stream *stream);
+void shm_stream_free(struct shm_stream *s);
+struct shm_stream *shm_stream_find(struct audio_device *dev);
+
+void shm_stream_get_format(struct shm_stream *s, uint16_t *rate,
+							uint8_t *channels);
+int shm_stream_resume(struct shm_stream *s);
+void shm_stream_suspend(struct shm_stream *s);
+
+struct shm_input *shm_input_new(struct shm_stream *s, uint32_t size,
+					shm_input_cb_t removed,
+					void *user_data, int *err);
+void shm_input_free(struct shm_input *in);
+uint32_t shm_input_get_size(struct shm_input *in);
+void shm_input_get_fds(struct shm_input *in, int *ring_fd, int *event_fd);
@@ -54,6 +54,8 @@ struct pending_request {
 	DBusConnection *conn;
 	DBusMessage *msg;
 	unsigned int id;
+	gboolean cached_config;		/* Setting up the cached config */
+	gboolean cache_tried;		/* Done once per connect */
 };
 
 struct sink {
@@ -68,6 +70,7 @@ struct sink {
 	struct pending_request *connect;
 	struct pending_request *disconnect;
 	DBusConnection *conn;
+	char *broadcast;
 };
 
 struct sink_state_callback {
@@ -286,6 +289,9 @@ static gboolean stream_setup_retry(gpointer user_data)
 	return FALSE;
 }
 
+static void discovery_complete(struct avdtp *session, GSList *seps,
+				struct avdtp_error *err, void *user_data);
+
 static void stream_setup_complete(struct avdtp *session, struct a2dp_sep *sep,
 					struct avdtp_stream *stream,
 					struct avdtp_error *err, void *user_data)
@@ -312,6 +318,18 @@ static void stream_setup_complete(struct avdtp *session, struct a2dp_sep *sep,
 		return;
 	}
 
+	/* A rejected cached configuration falls back to full negotiation */
+	if (pending->cached_config) {
+		pending->cached_config = FALSE;
+
+		if (avdtp_error_category(err) != AVDTP_ERRNO &&
+				avdtp_discover(sink->session, discovery_complete,
+								sink) == 0) {
+			DBG("Cached configuration rejected, renegotiating");
+			return;
+		}
+	}
+
 	avdtp_unref(sink->session);
 	sink->session = NULL;
 	if (avdtp_error_category(err) == AVDTP_ERRNO
@@ -387,6 +405,21 @@ static void discovery_complete(struct avdtp *session, GSList *seps, struct avdtp
 
 	DBG("Discovery complete");
 
+	/* Skip capability selection if a configuration is known to work.
+	 * A failed setup may store the configuration again, so it is only
+	 * tried once for the whole connect. */
+	if (!pending->cache_tried) {
+		pending->cache_tried = TRUE;
+
+		id = a2dp_config_cached(sink->session, AVDTP_SEP_TYPE_SINK,
+						stream_setup_complete, sink);
+		if (id != 0) {
+			pending->cached_config = TRUE;
+			pending->id = id;
+			return;
+		}
+	}
+
 	id = a2dp_select_capabilities(sink->session, AVDTP_SEP_TYPE_SINK, NULL,
 						select_complete, sink);
 	if (id == 0)
@@ -618,6 +651,11 @@ static DBusMessage *sink_get_properties(DBusConnection *conn,
 	if (state)
 		dict_append_entry(&dict, "State", DBUS_TYPE_STRING, &state);
 
+	/* BroadcastGroup */
+	if (sink->broadcast)
+		dict_append_entry(&dict, "BroadcastGroup", DBUS_TYPE_STRING,
+							&sink->broadcast);
+
 	dbus_message_iter_close_container(&iter, &dict);
 
 	return reply;
@@ -667,6 +705,7 @@ static void sink_free(struct audio_device *dev)
 	if (sink->retry_id)
 		g_source_remove(sink->retry_id);
 
+	g_free(sink->broadcast);
 	g_free(sink);
 	dev->sink = NULL;
 }
@@ -745,6 +784,35 @@ avdtp_state_t sink_get_state(struct audio_device *dev)
 	return sink->stream_state;
 }
 
+const char *sink_get_broadcast(struct audio_device *dev)
+{
+	struct sink *sink = dev->sink;
+
+	if (sink == NULL)
+		return NULL;
+
+	return sink->broadcast;
+}
+
+void sink_set_broadcast(struct audio_device *dev, const char *group)
+{
+	struct sink *sink = dev->sink;
+	const char *value;
+
+	if (group && *group == '\0')
+		group = NULL;
+
+	if (g_strcmp0(sink->broadcast, group) == 0)
+		return;
+
+	g_free(sink->broadcast);
+	sink->broadcast = g_strdup(group);
+
+	value = group ? group : "";
+	emit_property_changed(dev->conn, dev->path, AUDIO_SINK_INTERFACE,
+				"BroadcastGroup", DBUS_TYPE_STRING, &value);
+}
+
 gboolean sink_new_stream(struct audio_device *dev, struct avdtp *session,
 				struct avdtp_stream *stream)
 {
@@ -0,0 +1,54 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+/* Counters of one A2DP stream.  They are kept by the shm-stream encoder
+ * while bluetoothd moves the media itself, clients sending on their own
+ * stream fd are not counted.  They start from zero with every new
+ * stream. */
+struct media_stats {
+	uint64_t frames;		/* Codec frames encoded */
+	uint64_t packets;		/* Media packets sent */
+	uint64_t bytes;			/* Media bytes sent, headers included */
+	uint32_t send_errors;		/* Packets failed or dropped */
+	uint32_t underruns;		/* Packets padded with silence */
+	uint32_t sends;			/* Send calls timed */
+	uint32_t latency_max;		/* Longest send call in usec */
+	uint64_t latency_total;		/* Sum of send call times in usec */
+	uint32_t delay_reports;		/* AVDTP delay reports received */
+	uint16_t delay;			/* Last reported delay in 1/10 ms */
+	uint8_t bitpool;		/* Current SBC bitpool */
+};
+
+/* Layout of the memory behind MediaTransport.AcquireStatistics().  The
+ * daemon refreshes it about once a second; seq is odd while an update is
+ * in progress, so readers copy the counters and retry if seq was odd or
+ * changed meanwhile. */
+#define MEDIA_STATS_MAGIC		0x53746174	/* "Stat" */
+
+struct media_stats_snapshot {
+	uint32_t magic;
+	volatile uint32_t seq;
+	struct media_stats stats;
+};
@@ -27,6 +27,8 @@
 #endif
 
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <glib.h>
 #include <gdbus.h>
@@ -42,6 +44,9 @@
 #include "transport.h"
 #include "a2dp.h"
 #include "headset.h"
+#include "sink.h"
+#include "stats.h"
+#include "shm-stream.h"
 
 #ifndef DBUS_TYPE_UNIX_FD
 #define DBUS_TYPE_UNIX_FD -1
@@ -49,6 +54,9 @@
 
 #define MEDIA_TRANSPORT_INTERFACE "org.bluez.MediaTransport"
 
+/* Seconds between refreshes of the statistics snapshot */
+#define STATS_INTERVAL 1
+
 struct media_request {
 	DBusMessage		*msg;
 	guint			id;
@@ -79,6 +87,9 @@ struct media_transport {
 	gboolean		read_lock;
 	gboolean		write_lock;
 	gboolean		in_use;
+	int			stats_fd;	/* Statistics snapshot memory */
+	struct media_stats_snapshot *snapshot;
+	guint			stats_timer;
 	guint			(*resume) (struct media_transport *transport,
 					struct media_owner *owner);
 	guint			(*suspend) (struct media_transport *transport,
@@ -92,6 +103,8 @@ struct media_transport {
 					struct media_transport *transport,
 					const char *property,
 					DBusMessageIter *value);
+	struct media_stats	*(*get_stats) (
+					struct media_transport *transport);
 };
 
 void media_transport_destroy(struct media_transport *transport)
@@ -641,6 +654,24 @@ static int set_property_a2dp(struct media_transport *transport,
 
 		/* FIXME: send new delay */
 		return 0;
+	} else if (g_strcmp0(property, "BroadcastGroup") == 0) {
+		const char *group;
+
+		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_STRING)
+			return -EINVAL;
+		dbus_message_iter_get_basic(value, &group);
+
+		/* Only streams sent by us can be broadcast */
+		if (transport->device->sink == NULL)
+			return -ENOTSUP;
+
+		sink_set_broadcast(transport->device, group);
+
+		emit_property_changed(transport->conn, transport->path,
+					MEDIA_TRANSPORT_INTERFACE,
+					"BroadcastGroup", DBUS_TYPE_STRING,
+					&group);
+		return 0;
 	}
 
 	return -EINVAL;
@@ -719,10 +750,59 @@ static DBusMessage *set_property(DBusConnection *conn, DBusMessage *msg,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+/* Send side counters are only kept while bluetoothd encodes the stream for
+ * shared memory clients, others encode and send on their own */
+static struct media_stats *get_stats_a2dp(struct media_transport *transport)
+{
+	struct a2dp_sep *sep = media_endpoint_get_sep(transport->endpoint);
+	struct avdtp_stream *stream;
+
+	if (shm_stream_find(transport->device) == NULL)
+		return NULL;
+
+	stream = a2dp_sep_get_stream(sep);
+	if (stream == NULL)
+		return NULL;
+
+	return avdtp_stream_get_stats(stream);
+}
+
+static void get_properties_stats(struct media_stats *stats,
+						DBusMessageIter *dict)
+{
+	uint32_t average;
+
+	average = stats->sends ? stats->latency_total / stats->sends : 0;
+
+	dict_append_entry(dict, "FramesEncoded", DBUS_TYPE_UINT64,
+							&stats->frames);
+	dict_append_entry(dict, "PacketsSent", DBUS_TYPE_UINT64,
+							&stats->packets);
+	dict_append_entry(dict, "BytesSent", DBUS_TYPE_UINT64, &stats->bytes);
+	dict_append_entry(dict, "SendErrors", DBUS_TYPE_UINT32,
+							&stats->send_errors);
+	dict_append_entry(dict, "Underruns", DBUS_TYPE_UINT32,
+							&stats->underruns);
+	dict_append_entry(dict, "MaxSendLatency", DBUS_TYPE_UINT32,
+							&stats->latency_max);
+	dict_append_entry(dict, "AverageSendLatency", DBUS_TYPE_UINT32,
+								&average);
+	dict_append_entry(dict, "Bitpool", DBUS_TYPE_BYTE, &stats->bitpool);
+	dict_append_entry(dict, "DelayReports", DBUS_TYPE_UINT32,
+							&stats->delay_reports);
+}
+
 static void get_properties_a2dp(struct media_transport *transport,
 						DBusMessageIter *dict)
 {
+	const char *group;
+
 	dict_append_entry(dict, "Delay", DBUS_TYPE_UINT16, &transport->delay);
+
+	group = sink_get_broadcast(transport->device);
+	if (group)
+		dict_append_entry(dict, "BroadcastGroup", DBUS_TYPE_STRING,
+								&group);
 }
 
 static void get_properties_headset(struct media_transport *transport,
@@ -745,6 +825,7 @@ void transport_get_properties(struct media_transport *transport,
 							DBusMessageIter *iter)
 {
 	DBusMessageIter dict;
+	struct media_stats *stats;
 	const char *uuid;
 	uint8_t codec;
 
@@ -769,6 +850,10 @@ void transport_get_properties(struct media_transport *transport,
 	if (transport->get_properties)
 		transport->get_properties(transport, &dict);
 
+	stats = transport->get_stats ? transport->get_stats(transport) : NULL;
+	if (stats)
+		get_properties_stats(stats, &dict);
+
 	dbus_message_iter_close_container(iter, &dict);
 }
 
@@ -790,8 +875,77 @@ static DBusMessage *get_properties(DBusConnection *conn, DBusMessage *msg,
 	return reply;
 }
 
+static void update_snapshot(struct media_transport *transport)
+{
+	struct media_stats_snapshot *snapshot = transport->snapshot;
+	struct media_stats *stats;
+
+	stats = transport->get_stats ? transport->get_stats(transport) : NULL;
+
+	snapshot->seq++;
+	__sync_synchronize();
+
+	if (stats)
+		memcpy(&snapshot->stats, stats, sizeof(*stats));
+	else
+		memset(&snapshot->stats, 0, sizeof(snapshot->stats));
+
+	__sync_synchronize();
+	snapshot->seq++;
+}
+
+static gboolean snapshot_timeout(gpointer data)
+{
+	update_snapshot(data);
+
+	return TRUE;
+}
+
+static DBusMessage *acquire_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct media_transport *transport = data;
+	void *map;
+	int fd, ro;
+
+	if (transport->stats_fd >= 0)
+		goto done;
+
+	if (transport->get_stats == NULL ||
+				transport->get_stats(transport) == NULL)
+		return btd_error_not_available(msg);
+
+	fd = shm_create_fd("bluetooth-stats",
+				sizeof(struct media_stats_snapshot), &map);
+	if (fd < 0)
+		return btd_error_failed(msg, strerror(-fd));
+
+	/* Agents only read, only the mapping above writes */
+	ro = shm_share_readonly(fd);
+	close(fd);
+	if (ro < 0) {
+		munmap(map, sizeof(struct media_stats_snapshot));
+		return btd_error_failed(msg, strerror(-ro));
+	}
+
+	transport->stats_fd = ro;
+	transport->snapshot = map;
+	transport->snapshot->magic = MEDIA_STATS_MAGIC;
+
+	update_snapshot(transport);
+
+	transport->stats_timer = g_timeout_add_seconds(STATS_INTERVAL,
+						snapshot_timeout, transport);
+
+done:
+	return g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD,
+					&transport->stats_fd,
+					DBUS_TYPE_INVALID);
+}
+
 static GDBusMethodTable transport_methods[] = {
 	{ "GetProperties",	"",	"a{sv}",	get_properties },
+	{ "AcquireStatistics",	"",	"h",		acquire_statistics },
 	{ "Acquire",		"s",	"h",		acquire,
 						G_DBUS_METHOD_FLAG_ASYNC},
 	{ "Release",		"s",	"",		release,
@@ -821,6 +975,16 @@ static void media_transport_free(void *data)
 	if (transport->nrec_id)
 		headset_remove_nrec_cb(transport->device, transport->nrec_id);
 
+	if (transport->stats_timer)
+		g_source_remove(transport->stats_timer);
+
+	if (transport->snapshot)
+		munmap(transport->snapshot,
+				sizeof(struct media_stats_snapshot));
+
+	if (transport->stats_fd >= 0)
+		close(transport->stats_fd);
+
 	if (transport->conn)
 		dbus_connection_unref(transport->conn);
 
@@ -860,6 +1024,7 @@ struct media_transport *media_transport_create(DBusConnection *conn,
 	transport->size = size;
 	transport->path = g_strdup_printf("%s/fd%d", device->path, fd++);
 	transport->fd = -1;
+	transport->stats_fd = -1;
 
 	uuid = media_endpoint_get_uuid(endpoint);
 	if (strcasecmp(uuid, A2DP_SOURCE_UUID) == 0 ||
@@ -869,6 +1034,7 @@ struct media_transport *media_transport_create(DBusConnection *conn,
 		transport->cancel = cancel_a2dp;
 		transport->get_properties = get_properties_a2dp;
 		transport->set_property = set_property_a2dp;
+		transport->get_stats = get_stats_a2dp;
 	} else if (strcasecmp(uuid, HFP_AG_UUID) == 0 ||
 			strcasecmp(uuid, HSP_AG_UUID) == 0) {
 		transport->resume = resume_headset;
@@ -51,6 +51,7 @@
 #include "sink.h"
 #include "gateway.h"
 #include "unix.h"
+#include "shm-stream.h"
 #include "glib-helper.h"
 
 #define check_nul(str) (str[sizeof(str) - 1] == '\0')
@@ -69,6 +70,7 @@ struct a2dp_data {
 	struct avdtp *session;
 	struct avdtp_stream *stream;
 	struct a2dp_sep *sep;
+	struct shm_stream *shm;		/* Encoder owned by this client */
 };
 
 struct headset_data {
@@ -88,6 +90,7 @@ struct unix_client {
 	int sock;
 	int lock;
 	int data_fd; /* To be deleted once two phase configuration is fully implemented */
+	struct shm_input *shm_input;
 	unsigned int req_id;
 	unsigned int cb_id;
 	gboolean (*cancel) (struct audio_device *dev, unsigned int id);
@@ -104,6 +107,9 @@ static void client_free(struct unix_client *client)
 	if (client->cancel && client->dev && client->req_id > 0)
 		client->cancel(client->dev, client->req_id);
 
+	if (client->shm_input)
+		shm_input_free(client->shm_input);
+
 	if (client->sock >= 0)
 		close(client->sock);
 
@@ -135,33 +141,41 @@ static int set_nonblocking(int fd)
 	return 0;
 }
 
-/* Pass file descriptor through local domain sockets (AF_LOCAL, formerly
+/* Pass file descriptors through local domain sockets (AF_LOCAL, formerly
  * AF_UNIX) and the sendmsg() system call with the cmsg_type field of a "struct
- * cmsghdr" set to SCM_RIGHTS and the data being an integer value equal to the
- * handle of the file descriptor to be passed. */
-static int unix_sendmsg_fd(int sock, int fd)
+ * cmsghdr" set to SCM_RIGHTS and the data being an array of integer values
+ * equal to the handles of the file descriptors to be passed. */
+static int unix_sendmsg_fds(int sock, const int *fds, int count)
 {
-	char cmsg_b[CMSG_SPACE(sizeof(int))], m = 'm';
+	char cmsg_b[CMSG_SPACE(2 * sizeof(int))], m = 'm';
 	struct cmsghdr *cmsg;
 	struct iovec iov = { &m, sizeof(m) };
 	struct msghdr msgh;
 
+	if (count > 2)
+		return -EINVAL;
+
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
 	msgh.msg_iovlen = 1;
 	msgh.msg_control = &cmsg_b;
-	msgh.msg_controllen = CMSG_LEN(sizeof(int));
+	msgh.msg_controllen = CMSG_LEN(count * sizeof(int));
 
 	cmsg = CMSG_FIRSTHDR(&msgh);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
 	/* Initialize the payload */
-	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
 
 	return sendmsg(sock, &msgh, MSG_NOSIGNAL);
 }
 
+static int unix_sendmsg_fd(int sock, int fd)
+{
+	return unix_sendmsg_fds(sock, &fd, 1);
+}
+
 static void unix_ipc_sendmsg(struct unix_client *client,
 					const bt_audio_msg_header_t *msg)
 {
@@ -231,7 +245,15 @@ static void stream_state_changed(struct avdtp_stream *stream,
 	struct a2dp_data *a2dp = &client->d.a2dp;
 
 	switch (new_state) {
+	case AVDTP_STATE_OPEN:
+		if (a2dp->shm && old_state == AVDTP_STATE_STREAMING)
+			shm_stream_suspend(a2dp->shm);
+		break;
 	case AVDTP_STATE_IDLE:
+		if (a2dp->shm) {
+			shm_stream_free(a2dp->shm);
+			a2dp->shm = NULL;
+		}
 		if (a2dp->sep) {
 			a2dp_sep_unlock(a2dp->sep, a2dp->session);
 			a2dp->sep = NULL;
@@ -801,6 +823,13 @@ static void a2dp_resume_complete(struct avdtp *session,
 
 	unix_ipc_sendmsg(client, &ind->h);
 
+	if (a2dp->shm && shm_stream_resume(a2dp->shm) < 0)
+		goto failed;
+
+	/* The daemon encodes for shared memory clients, no data fd */
+	if (client->shm_input)
+		return;
+
 	if (unix_sendmsg_fd(client->sock, client->data_fd) < 0) {
 		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
 		goto failed;
@@ -835,10 +864,14 @@ static void a2dp_suspend_complete(struct avdtp *session,
 	struct unix_client *client = user_data;
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_stop_stream_rsp *rsp = (void *) buf;
+	struct a2dp_data *a2dp = &client->d.a2dp;
 
 	if (err)
 		goto failed;
 
+	if (a2dp->shm)
+		shm_stream_suspend(a2dp->shm);
+
 	memset(buf, 0, sizeof(buf));
 	rsp->h.type = BT_RESPONSE;
 	rsp->h.name = BT_STOP_STREAM;
@@ -1084,6 +1117,13 @@ static void start_resume(struct audio_device *dev, struct unix_client *client)
 	case TYPE_SOURCE:
 		a2dp = &client->d.a2dp;
 
+		/* An input mixed into the stream of another client plays
+		 * whenever that client has the stream started */
+		if (!a2dp->sep && client->shm_input) {
+			a2dp_resume_complete(NULL, NULL, client);
+			return;
+		}
+
 		if (!a2dp->sep) {
 			error("seid not opened");
 			goto failed;
@@ -1160,6 +1200,12 @@ static void start_suspend(struct audio_device *dev, struct unix_client *client)
 	case TYPE_SOURCE:
 		a2dp = &client->d.a2dp;
 
+		/* Leave the stream of the other client alone */
+		if (!a2dp->sep && client->shm_input) {
+			a2dp_suspend_complete(NULL, NULL, client);
+			return;
+		}
+
 		if (!a2dp->sep) {
 			error("seid not opened");
 			goto failed;
@@ -1266,6 +1312,14 @@ static void start_close(struct audio_device *dev, struct unix_client *client,
 	case TYPE_SINK:
 		a2dp = &client->d.a2dp;
 
+		if (client->shm_input) {
+			shm_input_free(client->shm_input);
+			client->shm_input = NULL;
+		}
+		if (a2dp->shm) {
+			shm_stream_free(a2dp->shm);
+			a2dp->shm = NULL;
+		}
 		if (client->cb_id > 0) {
 			avdtp_stream_remove_cb(a2dp->session, a2dp->stream,
 								client->cb_id);
@@ -1587,6 +1641,84 @@ failed:
 	unix_ipc_error(client, BT_SET_CONFIGURATION, err ? : EIO);
 }
 
+/* The stream the input was mixed into went away, usually along with
+ * the client that configured it.  Disconnect so that the client notices,
+ * just like clients with a data fd see it hang up. */
+static void shm_input_removed(struct shm_input *in, void *user_data)
+{
+	struct unix_client *client = user_data;
+
+	DBG("shm stream of client %p removed", client);
+
+	shm_input_free(in);
+	client->shm_input = NULL;
+
+	shutdown(client->sock, SHUT_RDWR);
+}
+
+static void handle_shm_stream_req(struct unix_client *client,
+					struct bt_shm_stream_req *req)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_shm_stream_rsp *rsp = (void *) buf;
+	struct a2dp_data *a2dp = &client->d.a2dp;
+	struct shm_stream *shm;
+	uint16_t rate;
+	uint8_t channels;
+	int fds[2], err;
+
+	if (!client->dev || client->type != TYPE_SINK) {
+		err = -EINVAL;
+		goto failed;
+	}
+
+	/* Mix into a stream another client already encodes, otherwise the
+	 * client must have configured one itself */
+	shm = shm_stream_find(client->dev);
+	if (!shm && a2dp->stream) {
+		a2dp->shm = shm_stream_new(client->dev, a2dp->stream);
+		shm = a2dp->shm;
+	}
+
+	if (!shm) {
+		err = -EIO;
+		goto failed;
+	}
+
+	if (client->shm_input)
+		shm_input_free(client->shm_input);
+
+	client->shm_input = shm_input_new(shm, req->size, shm_input_removed,
+								client, &err);
+	if (!client->shm_input)
+		goto failed;
+
+	shm_stream_get_format(shm, &rate, &channels);
+
+	memset(buf, 0, sizeof(buf));
+	rsp->h.type = BT_RESPONSE;
+	rsp->h.name = BT_SHM_STREAM;
+	rsp->h.length = sizeof(*rsp);
+	rsp->size = shm_input_get_size(client->shm_input);
+	rsp->rate = rate;
+	rsp->channels = channels;
+
+	unix_ipc_sendmsg(client, &rsp->h);
+
+	shm_input_get_fds(client->shm_input, &fds[0], &fds[1]);
+
+	if (unix_sendmsg_fds(client->sock, fds, 2) < 0) {
+		error("unix_sendmsg_fds: %s(%d)", strerror(errno), errno);
+		shm_input_free(client->shm_input);
+		client->shm_input = NULL;
+	}
+
+	return;
+
+failed:
+	unix_ipc_error(client, BT_SHM_STREAM, -err);
+}
+
 static void handle_streamstart_req(struct unix_client *client,
 					struct bt_start_stream_req *req)
 {
@@ -1762,6 +1894,10 @@ static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 		handle_delay_report_req(client,
 				(struct bt_delay_report_req *) msghdr);
 		break;
+	case BT_SHM_STREAM:
+		handle_shm_stream_req(client,
+				(struct bt_shm_stream_req *) msghdr);
+		break;
 	default:
 		error("Audio API: received unexpected message name %d",
 				msghdr->name);
@@ -927,6 +927,9 @@ int sdp_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
 	memset(buf, 0, sizeof(sdp_buf_t));
 	sdp_list_foreach(rec->attrlist, sdp_attr_size, buf);
 
+	/* Room for the sequence header sdp_append_to_buf() puts in front */
+	buf->buf_size += sizeof(uint8_t) + sizeof(uint16_t);
+
 	buf->data = malloc(buf->buf_size);
 	if (!buf->data)
 		return -ENOMEM;
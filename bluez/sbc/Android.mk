@@ -13,6 +13,8 @@ LOCAL_SRC_FILES:= \
 	sbc.c \
 	sbc_primitives.c \
 	sbc_primitives_mmx.c \
+	sbc_primitives_sse2.c \
+	sbc_primitives_avx2.c \
 	sbc_primitives_neon.c
 
 LOCAL_CFLAGS:= \
@@ -42,6 +42,8 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <endian.h>
+#include <byteswap.h>
 
 #include "sbc_math.h"
 #include "sbc_tables.h"
@@ -51,6 +53,31 @@
 
 #define SBC_SYNCWORD	0x9C
 
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define SBC_NATIVE	SBC_LE
+#else
+#define SBC_NATIVE	SBC_BE
+#endif
+
+static inline uint32_t sbc_get_be32(const uint8_t *ptr)
+{
+	uint32_t v;
+
+	memcpy(&v, ptr, sizeof(v));
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	v = bswap_32(v);
+#endif
+	return v;
+}
+
+static inline void sbc_put_be32(uint8_t *ptr, uint32_t v)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	v = bswap_32(v);
+#endif
+	memcpy(ptr, &v, sizeof(v));
+}
+
 /* This structure contains an unpacked SBC frame.
    Yes, there is probably quite some unused space herein */
 struct sbc_frame {
@@ -90,12 +117,6 @@ struct sbc_frame {
 	int16_t SBC_ALIGNED pcm_sample[2][16*8];
 };
 
-struct sbc_decoder_state {
-	int subbands;
-	int32_t V[2][170];
-	int offset[2][16];
-};
-
 /*
  * Calculates the CRC-8 of the first len bits in data
  */
@@ -143,7 +164,8 @@ static uint8_t sbc_crc8(const uint8_t *data, size_t len)
 	for (i = 0; i < len / 8; i++)
 		crc = crc_table[crc ^ data[i]];
 
-	octet = data[i];
+	/* A whole number of bytes leaves no trailing octet to read */
+	octet = len % 8 ? data[i] : 0;
 	for (i = 0; i < len % 8; i++) {
 		char bit = ((octet ^ crc) & 0x80) >> 7;
 
@@ -373,8 +395,71 @@ static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8])
  *  -3   CRC8 incorrect
  *  -4   Bitpool value out of bounds
  */
+/* Supplementary bitstream reading macro for 'sbc_unpack_frame' */
+
+#define GET_BITS(data_ptr, bits_cache, bits_count, v, n)		\
+	do {								\
+		if (bits_count < (n)) {					\
+			bits_cache = (bits_cache << 32) |		\
+				sbc_get_be32(data_ptr);			\
+			bits_count += 32;				\
+			data_ptr += 4;					\
+		}							\
+		bits_count -= (n);					\
+		v = (uint32_t) (bits_cache >> bits_count) &		\
+						((1 << (n)) - 1);	\
+	} while (0)
+
+/*
+ * Reads the audio samples of a frame word-at-a-time. The caller has to
+ * make sure that all the samples are present in the input, the reader
+ * may look up to 4 bytes ahead of the last sample and falls back to
+ * byte loads near the end of the buffer.
+ */
+static void sbc_unpack_samples(const uint8_t *data, size_t len,
+				unsigned int consumed, struct sbc_frame *frame,
+				int bits[2][8], uint32_t levels[2][8])
+{
+	const uint8_t *data_ptr = data + (consumed >> 3);
+	const uint8_t *data_end = data + len;
+	uint64_t bits_cache = *data_ptr++;
+	uint32_t bits_count = 8 - (consumed & 0x7);
+	uint32_t audio_sample;
+	int ch, sb, blk, n;
+
+	for (blk = 0; blk < frame->blocks; blk++) {
+		for (ch = 0; ch < frame->channels; ch++) {
+			for (sb = 0; sb < frame->subbands; sb++) {
+				n = bits[ch][sb];
+				if (n == 0) {
+					frame->sb_sample[blk][ch][sb] = 0;
+					continue;
+				}
+
+				if (data_end - data_ptr >= 4) {
+					GET_BITS(data_ptr, bits_cache,
+						bits_count, audio_sample, n);
+				} else {
+					while (bits_count < (uint32_t) n) {
+						bits_cache = (bits_cache << 8) |
+								*data_ptr++;
+						bits_count += 8;
+					}
+					bits_count -= n;
+					audio_sample = (uint32_t) (bits_cache >>
+						bits_count) & ((1 << n) - 1);
+				}
+
+				frame->sb_sample[blk][ch][sb] =
+					(((audio_sample << 1) | 1) << frame->scale_factor[ch][sb]) /
+					levels[ch][sb] - (1 << frame->scale_factor[ch][sb]);
+			}
+		}
+	}
+}
+
 static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
-								size_t len)
+						size_t len, unsigned long flags)
 {
 	unsigned int consumed;
 	/* Will copy the parts of the header that are relevant to crc
@@ -490,26 +575,41 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 			levels[ch][sb] = (1 << bits[ch][sb]) - 1;
 	}
 
-	for (blk = 0; blk < frame->blocks; blk++) {
-		for (ch = 0; ch < frame->channels; ch++) {
-			for (sb = 0; sb < frame->subbands; sb++) {
-				if (levels[ch][sb] > 0) {
-					audio_sample = 0;
-					for (bit = 0; bit < bits[ch][sb]; bit++) {
-						if (consumed > len * 8)
-							return -1;
+	if (!(flags & SBC_FLAG_REFERENCE_BITSTREAM)) {
+		unsigned int total = 0;
 
-						if ((data[consumed >> 3] >> (7 - (consumed & 0x7))) & 0x01)
-							audio_sample |= 1 << (bits[ch][sb] - bit - 1);
+		for (ch = 0; ch < frame->channels; ch++)
+			for (sb = 0; sb < frame->subbands; sb++)
+				total += bits[ch][sb];
+		total *= frame->blocks;
 
-						consumed++;
-					}
+		if (consumed + total > len * 8)
+			return -1;
 
-					frame->sb_sample[blk][ch][sb] =
-						(((audio_sample << 1) | 1) << frame->scale_factor[ch][sb]) /
-						levels[ch][sb] - (1 << frame->scale_factor[ch][sb]);
-				} else
-					frame->sb_sample[blk][ch][sb] = 0;
+		sbc_unpack_samples(data, len, consumed, frame, bits, levels);
+		consumed += total;
+	} else {
+		for (blk = 0; blk < frame->blocks; blk++) {
+			for (ch = 0; ch < frame->channels; ch++) {
+				for (sb = 0; sb < frame->subbands; sb++) {
+					if (levels[ch][sb] > 0) {
+						audio_sample = 0;
+						for (bit = 0; bit < bits[ch][sb]; bit++) {
+							if (consumed > len * 8)
+								return -1;
+
+							if ((data[consumed >> 3] >> (7 - (consumed & 0x7))) & 0x01)
+								audio_sample |= 1 << (bits[ch][sb] - bit - 1);
+
+							consumed++;
+						}
+
+						frame->sb_sample[blk][ch][sb] =
+							(((audio_sample << 1) | 1) << frame->scale_factor[ch][sb]) /
+							levels[ch][sb] - (1 << frame->scale_factor[ch][sb]);
+					} else
+						frame->sb_sample[blk][ch][sb] = 0;
+				}
 			}
 		}
 	}
@@ -546,124 +646,29 @@ static void sbc_decoder_init(struct sbc_decoder_state *state,
 	for (ch = 0; ch < 2; ch++)
 		for (i = 0; i < frame->subbands * 2; i++)
 			state->offset[ch][i] = (10 * i + 10);
-}
-
-static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
-{
-	if (s > 0x7FFF)
-		return 0x7FFF;
-	else if (s < -0x8000)
-		return -0x8000;
-	else
-		return s;
-}
-
-static inline void sbc_synthesize_four(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
-{
-	int i, k, idx;
-	int32_t *v = state->V[ch];
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 8; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 79;
-			memcpy(v + 80, v, 9 * sizeof(*v));
-		}
-
-		/* Distribute the new matrix value to the shifted position */
-		v[offset[i]] = SCALE4_STAGED1(
-			MULA(synmatrix4[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix4[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix4[i][2], frame->sb_sample[blk][ch][2],
-			MUL (synmatrix4[i][3], frame->sb_sample[blk][ch][3])))));
-	}
-
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 4; i++, idx += 5) {
-		k = (i + 4) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 4 + i] = sbc_clip16(SCALE4_STAGED1(
-			MULA(v[offset[i] + 0], sbc_proto_4_40m0[idx + 0],
-			MULA(v[offset[k] + 1], sbc_proto_4_40m1[idx + 0],
-			MULA(v[offset[i] + 2], sbc_proto_4_40m0[idx + 1],
-			MULA(v[offset[k] + 3], sbc_proto_4_40m1[idx + 1],
-			MULA(v[offset[i] + 4], sbc_proto_4_40m0[idx + 2],
-			MULA(v[offset[k] + 5], sbc_proto_4_40m1[idx + 2],
-			MULA(v[offset[i] + 6], sbc_proto_4_40m0[idx + 3],
-			MULA(v[offset[k] + 7], sbc_proto_4_40m1[idx + 3],
-			MULA(v[offset[i] + 8], sbc_proto_4_40m0[idx + 4],
-			MUL( v[offset[k] + 9], sbc_proto_4_40m1[idx + 4]))))))))))));
-	}
-}
 
-static inline void sbc_synthesize_eight(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
-{
-	int i, j, k, idx;
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 16; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 159;
-			for (j = 0; j < 9; j++)
-				state->V[ch][j + 160] = state->V[ch][j];
-		}
-
-		/* Distribute the new matrix value to the shifted position */
-		state->V[ch][offset[i]] = SCALE8_STAGED1(
-			MULA(synmatrix8[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix8[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix8[i][2], frame->sb_sample[blk][ch][2],
-			MULA(synmatrix8[i][3], frame->sb_sample[blk][ch][3],
-			MULA(synmatrix8[i][4], frame->sb_sample[blk][ch][4],
-			MULA(synmatrix8[i][5], frame->sb_sample[blk][ch][5],
-			MULA(synmatrix8[i][6], frame->sb_sample[blk][ch][6],
-			MUL( synmatrix8[i][7], frame->sb_sample[blk][ch][7])))))))));
-	}
+	memset(state->W, 0, sizeof(state->W));
+	state->position[0] = state->position[1] = 0;
 
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 8; i++, idx += 5) {
-		k = (i + 8) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 8 + i] = sbc_clip16(SCALE8_STAGED1(
-			MULA(state->V[ch][offset[i] + 0], sbc_proto_8_80m0[idx + 0],
-			MULA(state->V[ch][offset[k] + 1], sbc_proto_8_80m1[idx + 0],
-			MULA(state->V[ch][offset[i] + 2], sbc_proto_8_80m0[idx + 1],
-			MULA(state->V[ch][offset[k] + 3], sbc_proto_8_80m1[idx + 1],
-			MULA(state->V[ch][offset[i] + 4], sbc_proto_8_80m0[idx + 2],
-			MULA(state->V[ch][offset[k] + 5], sbc_proto_8_80m1[idx + 2],
-			MULA(state->V[ch][offset[i] + 6], sbc_proto_8_80m0[idx + 3],
-			MULA(state->V[ch][offset[k] + 7], sbc_proto_8_80m1[idx + 3],
-			MULA(state->V[ch][offset[i] + 8], sbc_proto_8_80m0[idx + 4],
-			MUL( state->V[ch][offset[k] + 9], sbc_proto_8_80m1[idx + 4]))))))))))));
-	}
+	sbc_init_dec_primitives(state);
 }
 
 static int sbc_synthesize_audio(struct sbc_decoder_state *state,
 						struct sbc_frame *frame)
 {
-	int ch, blk;
+	int ch;
 
 	switch (frame->subbands) {
 	case 4:
-		for (ch = 0; ch < frame->channels; ch++) {
-			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_four(state, frame, ch, blk);
-		}
+		for (ch = 0; ch < frame->channels; ch++)
+			state->sbc_synthesize_4s(state, ch, frame->sb_sample,
+					frame->pcm_sample[ch], frame->blocks);
 		return frame->blocks * 4;
 
 	case 8:
-		for (ch = 0; ch < frame->channels; ch++) {
-			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_eight(state, frame, ch, blk);
-		}
+		for (ch = 0; ch < frame->channels; ch++)
+			state->sbc_synthesize_8s(state, ch, frame->sb_sample,
+					frame->pcm_sample[ch], frame->blocks);
 		return frame->blocks * 8;
 
 	default:
@@ -729,6 +734,22 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 		}							\
 	} while (0)
 
+/*
+ * Same as PUT_BITS, but uses a 64-bit cache and stores 32 bits at once,
+ * 'n' must not exceed 32 bits
+ */
+#define PUT_BITS64(data_ptr, bits_cache, bits_count, v, n)		\
+	do {								\
+		bits_cache = (v) | (bits_cache << (n));			\
+		bits_count += (n);					\
+		if (bits_count >= 32) {					\
+			bits_count -= 32;				\
+			sbc_put_be32(data_ptr,				\
+				(uint32_t) (bits_cache >> bits_count));	\
+			data_ptr += 4;					\
+		}							\
+	} while (0)
+
 #define FLUSH_BITS(data_ptr, bits_cache, bits_count)			\
 	do {								\
 		while (bits_count >= 8) {				\
@@ -759,7 +780,7 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 					struct sbc_frame *frame, size_t len,
 					int frame_subbands, int frame_channels,
-					int joint)
+					int joint, unsigned long flags)
 {
 	/* Bitstream writer starts from the fourth byte */
 	uint8_t *data_ptr = data + 4;
@@ -776,6 +797,8 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 	int bits[2][8];		/* bits distribution */
 	uint32_t levels[2][8];	/* levels are derived from that */
 	uint32_t sb_sample_delta[2][8];
+	uint32_t quantized[2][8];
+	uint64_t bits_cache64;
 
 	data[0] = SBC_SYNCWORD;
 
@@ -851,45 +874,97 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 		}
 	}
 
-	for (blk = 0; blk < frame->blocks; blk++) {
-		for (ch = 0; ch < frame_channels; ch++) {
-			for (sb = 0; sb < frame_subbands; sb++) {
+	if (flags & SBC_FLAG_REFERENCE_BITSTREAM) {
+		for (blk = 0; blk < frame->blocks; blk++) {
+			for (ch = 0; ch < frame_channels; ch++) {
+				for (sb = 0; sb < frame_subbands; sb++) {
 
-				if (bits[ch][sb] == 0)
-					continue;
+					if (bits[ch][sb] == 0)
+						continue;
+
+					audio_sample = ((uint64_t) levels[ch][sb] *
+						(sb_sample_delta[ch][sb] +
+						frame->sb_sample_f[blk][ch][sb])) >> 32;
+
+					PUT_BITS(data_ptr, bits_cache, bits_count,
+						audio_sample, bits[ch][sb]);
+				}
+			}
+		}
 
-				audio_sample = ((uint64_t) levels[ch][sb] *
+		FLUSH_BITS(data_ptr, bits_cache, bits_count);
+
+		return data_ptr - data;
+	}
+
+	/*
+	 * Quantize a whole block in a branchless loop first (zero bits
+	 * subbands have zero levels and produce zero samples), then write
+	 * the samples out through the 64-bit bits cache.
+	 */
+	bits_cache64 = bits_cache;
+
+	for (blk = 0; blk < frame->blocks; blk++) {
+		for (ch = 0; ch < frame_channels; ch++) {
+			for (sb = 0; sb < frame_subbands; sb++)
+				quantized[ch][sb] = ((uint64_t) levels[ch][sb] *
 					(sb_sample_delta[ch][sb] +
 					frame->sb_sample_f[blk][ch][sb])) >> 32;
+		}
 
-				PUT_BITS(data_ptr, bits_cache, bits_count,
-					audio_sample, bits[ch][sb]);
-			}
+		for (ch = 0; ch < frame_channels; ch++) {
+			for (sb = 0; sb < frame_subbands; sb++)
+				PUT_BITS64(data_ptr, bits_cache64, bits_count,
+					quantized[ch][sb], bits[ch][sb]);
 		}
 	}
 
-	FLUSH_BITS(data_ptr, bits_cache, bits_count);
+	FLUSH_BITS(data_ptr, bits_cache64, bits_count);
 
 	return data_ptr - data;
 }
 
+/*
+ * Length of an encoded frame. Every channel of a dual channel frame has
+ * its own bitpool, so it is counted like mono, once per channel.
+ */
+static size_t sbc_frame_length(uint8_t subbands, uint8_t channels,
+				uint8_t blocks, uint8_t mode, uint8_t bitpool)
+{
+	size_t ret;
+
+	ret = 4 + (4 * subbands * channels) / 8;
+	/* This term is not always evenly divide so we round it up */
+	if (mode == SBC_MODE_MONO || mode == SBC_MODE_DUAL_CHANNEL)
+		ret += ((blocks * channels * bitpool) + 7) / 8;
+	else
+		ret += (((mode == SBC_MODE_JOINT_STEREO ? subbands : 0) +
+						blocks * bitpool) + 7) / 8;
+
+	return ret;
+}
+
 static ssize_t sbc_pack_frame(uint8_t *data, struct sbc_frame *frame, size_t len,
-								int joint)
+						int joint, unsigned long flags)
 {
+	if (len < sbc_frame_length(frame->subbands, frame->channels,
+				frame->blocks, frame->mode, frame->bitpool))
+		return -ENOSPC;
+
 	if (frame->subbands == 4) {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 1, joint);
+				data, frame, len, 4, 1, joint, flags);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 2, joint);
+				data, frame, len, 4, 2, joint, flags);
 	} else {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 1, joint);
+				data, frame, len, 8, 1, joint, flags);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 2, joint);
+				data, frame, len, 8, 2, joint, flags);
 	}
 }
 
@@ -907,10 +982,15 @@ struct sbc_priv {
 	struct SBC_ALIGNED sbc_frame frame;
 	struct SBC_ALIGNED sbc_decoder_state dec_state;
 	struct SBC_ALIGNED sbc_encoder_state enc_state;
+	int (*enc_process_input)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
 };
 
 static void sbc_set_defaults(sbc_t *sbc, unsigned long flags)
 {
+	sbc->flags = flags;
+
 	sbc->frequency = SBC_FREQ_44100;
 	sbc->mode = SBC_MODE_STEREO;
 	sbc->subbands = SBC_SB_8;
@@ -951,19 +1031,59 @@ ssize_t sbc_parse(sbc_t *sbc, const void *input, size_t input_len)
 	return sbc_decode(sbc, input, input_len, NULL, 0, NULL);
 }
 
-ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
-			void *output, size_t output_len, size_t *written)
+/* Writes the decoded samples in native byte order */
+static void sbc_output_pcm(void *output, const struct sbc_frame *frame,
+					int samples, unsigned long flags)
 {
-	struct sbc_priv *priv;
-	char *ptr;
-	int i, ch, framelen, samples;
+	int i, ch, channels = frame->channels;
 
-	if (!sbc || !input)
-		return -EIO;
+	if (flags & SBC_FLAG_FLOAT) {
+		float *out = output;
 
-	priv = sbc->priv;
+		if (flags & SBC_FLAG_PLANAR) {
+			for (ch = 0; ch < channels; ch++)
+				for (i = 0; i < samples; i++)
+					*out++ = frame->pcm_sample[ch][i] *
+							(1.0f / 32768.0f);
+		} else {
+			for (i = 0; i < samples; i++)
+				for (ch = 0; ch < channels; ch++)
+					*out++ = frame->pcm_sample[ch][i] *
+							(1.0f / 32768.0f);
+		}
+	} else if (flags & SBC_FLAG_PLANAR) {
+		int16_t *out = output;
+
+		for (ch = 0; ch < channels; ch++) {
+			memcpy(out, frame->pcm_sample[ch],
+						samples * sizeof(int16_t));
+			out += samples;
+		}
+	} else {
+		int16_t *out = output;
 
-	framelen = sbc_unpack_frame(input, &priv->frame, input_len);
+		if (channels == 1) {
+			memcpy(out, frame->pcm_sample[0],
+						samples * sizeof(int16_t));
+			return;
+		}
+
+		for (i = 0; i < samples; i++) {
+			*out++ = frame->pcm_sample[0][i];
+			*out++ = frame->pcm_sample[1][i];
+		}
+	}
+}
+
+static ssize_t sbc_decode_frame(sbc_t *sbc, struct sbc_priv *priv,
+			const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *written)
+{
+	char *ptr;
+	int i, ch, framelen, samples, sample_size;
+
+	framelen = sbc_unpack_frame(input, &priv->frame, input_len,
+								sbc->flags);
 
 	if (!priv->init) {
 		sbc_decoder_init(&priv->dec_state, &priv->frame);
@@ -994,50 +1114,94 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 
 	samples = sbc_synthesize_audio(&priv->dec_state, &priv->frame);
 
-	ptr = output;
+	sample_size = sbc->flags & SBC_FLAG_FLOAT ? 4 : 2;
 
-	if (output_len < (size_t) (samples * priv->frame.channels * 2))
-		samples = output_len / (priv->frame.channels * 2);
+	if (output_len < (size_t) (samples * priv->frame.channels * sample_size))
+		samples = output_len / (priv->frame.channels * sample_size);
 
-	for (i = 0; i < samples; i++) {
-		for (ch = 0; ch < priv->frame.channels; ch++) {
-			int16_t s;
-			s = priv->frame.pcm_sample[ch][i];
+	if (sbc->flags & (SBC_FLAG_PLANAR | SBC_FLAG_FLOAT))
+		sbc_output_pcm(output, &priv->frame, samples, sbc->flags);
+	else if (sbc->endian == SBC_NATIVE)
+		sbc_output_pcm(output, &priv->frame, samples, 0);
+	else {
+		ptr = output;
 
-			if (sbc->endian == SBC_BE) {
-				*ptr++ = (s & 0xff00) >> 8;
-				*ptr++ = (s & 0x00ff);
-			} else {
-				*ptr++ = (s & 0x00ff);
-				*ptr++ = (s & 0xff00) >> 8;
+		for (i = 0; i < samples; i++) {
+			for (ch = 0; ch < priv->frame.channels; ch++) {
+				int16_t s;
+				s = priv->frame.pcm_sample[ch][i];
+
+				if (sbc->endian == SBC_BE) {
+					*ptr++ = (s & 0xff00) >> 8;
+					*ptr++ = (s & 0x00ff);
+				} else {
+					*ptr++ = (s & 0x00ff);
+					*ptr++ = (s & 0xff00) >> 8;
+				}
 			}
 		}
 	}
 
 	if (written)
-		*written = samples * priv->frame.channels * 2;
+		*written = samples * priv->frame.channels * sample_size;
 
 	return framelen;
 }
 
-ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
-			void *output, size_t output_len, ssize_t *written)
+ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *written)
+{
+	if (!sbc || !input)
+		return -EIO;
+
+	return sbc_decode_frame(sbc, sbc->priv, input, input_len,
+					output, output_len, written);
+}
+
+ssize_t sbc_decode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *written)
 {
 	struct sbc_priv *priv;
-	int samples;
+	const uint8_t *in = input;
+	uint8_t *out = output;
+	size_t consumed = 0, total = 0, len;
 	ssize_t framelen;
-	int (*sbc_enc_process_input)(int position,
-			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
-			int nsamples, int nchannels);
 
-	if (!sbc || !input)
+	if (written)
+		*written = 0;
+
+	if (!sbc || !input || !output)
 		return -EIO;
 
 	priv = sbc->priv;
 
+	while (consumed < input_len) {
+		/* stop before a frame which would not fit into the output */
+		if (priv->init && output_len - total < priv->frame.codesize)
+			break;
+
+		framelen = sbc_decode_frame(sbc, priv, in + consumed,
+					input_len - consumed, out + total,
+					output_len - total, &len);
+		if (framelen <= 0) {
+			/* report errors only if nothing was decoded */
+			if (consumed == 0)
+				return framelen;
+			break;
+		}
+
+		consumed += framelen;
+		total += len;
+	}
+
 	if (written)
-		*written = 0;
+		*written = total;
+
+	return consumed;
+}
 
+static void sbc_encoder_setup(sbc_t *sbc, struct sbc_priv *priv)
+{
 	if (!priv->init) {
 		priv->frame.frequency = sbc->frequency;
 		priv->frame.mode = sbc->mode;
@@ -1058,55 +1222,145 @@ ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 		priv->frame.bitpool = sbc->bitpool;
 	}
 
-	/* input must be large enough to encode a complete frame */
-	if (input_len < priv->frame.codesize)
-		return 0;
-
-	/* output must be large enough to receive the encoded frame */
-	if (!output || output_len < priv->frame.length)
-		return -ENOSPC;
-
-	/* Select the needed input data processing function and call it */
+	/* Select the needed input data processing function */
 	if (priv->frame.subbands == 8) {
-		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
+		if (sbc->flags & SBC_FLAG_FLOAT)
+			priv->enc_process_input = sbc->flags & SBC_FLAG_PLANAR ?
+				priv->enc_state.sbc_enc_process_input_8s_float_planar :
+				priv->enc_state.sbc_enc_process_input_8s_float;
+		else if (sbc->flags & SBC_FLAG_PLANAR)
+			priv->enc_process_input =
+				priv->enc_state.sbc_enc_process_input_8s_planar;
+		else if (sbc->endian == SBC_BE)
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_8s_be;
 		else
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_8s_le;
 	} else {
-		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
+		if (sbc->flags & SBC_FLAG_FLOAT)
+			priv->enc_process_input = sbc->flags & SBC_FLAG_PLANAR ?
+				priv->enc_state.sbc_enc_process_input_4s_float_planar :
+				priv->enc_state.sbc_enc_process_input_4s_float;
+		else if (sbc->flags & SBC_FLAG_PLANAR)
+			priv->enc_process_input =
+				priv->enc_state.sbc_enc_process_input_4s_planar;
+		else if (sbc->endian == SBC_BE)
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_4s_be;
 		else
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_4s_le;
 	}
+}
 
-	priv->enc_state.position = sbc_enc_process_input(
+/* Encodes one frame, input and output sizes must be checked by the caller */
+static ssize_t sbc_encode_frame(sbc_t *sbc, struct sbc_priv *priv,
+			const void *input, void *output, size_t output_len)
+{
+	priv->enc_state.position = priv->enc_process_input(
 		priv->enc_state.position, (const uint8_t *) input,
 		priv->enc_state.X, priv->frame.subbands * priv->frame.blocks,
 		priv->frame.channels);
 
-	samples = sbc_analyze_audio(&priv->enc_state, &priv->frame);
+	sbc_analyze_audio(&priv->enc_state, &priv->frame);
 
 	if (priv->frame.mode == JOINT_STEREO) {
 		int j = priv->enc_state.sbc_calc_scalefactors_j(
 			priv->frame.sb_sample_f, priv->frame.scale_factor,
 			priv->frame.blocks, priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, j);
-	} else {
-		priv->enc_state.sbc_calc_scalefactors(
-			priv->frame.sb_sample_f, priv->frame.scale_factor,
-			priv->frame.blocks, priv->frame.channels,
-			priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, 0);
+		return sbc_pack_frame(output, &priv->frame, output_len, j,
+								sbc->flags);
 	}
 
+	priv->enc_state.sbc_calc_scalefactors(
+		priv->frame.sb_sample_f, priv->frame.scale_factor,
+		priv->frame.blocks, priv->frame.channels,
+		priv->frame.subbands);
+	return sbc_pack_frame(output, &priv->frame, output_len, 0,
+								sbc->flags);
+}
+
+ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written)
+{
+	struct sbc_priv *priv;
+	ssize_t framelen;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_setup(sbc, priv);
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < priv->frame.codesize)
+		return 0;
+
+	/* output must be large enough to receive the encoded frame */
+	if (!output || output_len < priv->frame.length)
+		return -ENOSPC;
+
+	framelen = sbc_encode_frame(sbc, priv, input, output, output_len);
+
 	if (written)
 		*written = framelen;
 
-	return samples * priv->frame.channels * 2;
+	return priv->frame.codesize;
+}
+
+ssize_t sbc_encode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written)
+{
+	struct sbc_priv *priv;
+	const uint8_t *in = input;
+	uint8_t *out = output;
+	size_t codesize, length, consumed = 0, total = 0;
+	ssize_t framelen;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_setup(sbc, priv);
+
+	codesize = priv->frame.codesize;
+	length = priv->frame.length;
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < codesize)
+		return 0;
+
+	/* output must be large enough to receive at least one frame */
+	if (!output || output_len < length)
+		return -ENOSPC;
+
+	while (input_len - consumed >= codesize &&
+					output_len - total >= length) {
+		framelen = sbc_encode_frame(sbc, priv, in + consumed,
+					out + total, output_len - total);
+		if (framelen < 0) {
+			if (consumed == 0)
+				return framelen;
+			break;
+		}
+
+		consumed += codesize;
+		total += framelen;
+	}
+
+	if (written)
+		*written = total;
+
+	return consumed;
 }
 
 void sbc_finish(sbc_t *sbc)
@@ -1121,8 +1375,7 @@ void sbc_finish(sbc_t *sbc)
 
 size_t sbc_get_frame_length(sbc_t *sbc)
 {
-	int ret;
-	uint8_t subbands, channels, blocks, joint, bitpool;
+	uint8_t subbands, channels, blocks, bitpool;
 	struct sbc_priv *priv;
 
 	priv = sbc->priv;
@@ -1132,17 +1385,10 @@ size_t sbc_get_frame_length(sbc_t *sbc)
 	subbands = sbc->subbands ? 8 : 4;
 	blocks = 4 + (sbc->blocks * 4);
 	channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
-	joint = sbc->mode == SBC_MODE_JOINT_STEREO ? 1 : 0;
 	bitpool = sbc->bitpool;
 
-	ret = 4 + (4 * subbands * channels) / 8;
-	/* This term is not always evenly divide so we round it up */
-	if (channels == 1)
-		ret += ((blocks * channels * bitpool) + 7) / 8;
-	else
-		ret += (((joint ? subbands : 0) + blocks * bitpool) + 7) / 8;
-
-	return ret;
+	return sbc_frame_length(subbands, channels, blocks, sbc->mode,
+								bitpool);
 }
 
 unsigned sbc_get_frame_duration(sbc_t *sbc)
@@ -1199,6 +1445,9 @@ size_t sbc_get_codesize(sbc_t *sbc)
 		channels = priv->frame.channels;
 	}
 
+	if (sbc->flags & SBC_FLAG_FLOAT)
+		return subbands * blocks * channels * sizeof(float);
+
 	return subbands * blocks * channels * 2;
 }
 
@@ -1213,7 +1462,10 @@ const char *sbc_get_implementation_info(sbc_t *sbc)
 	if (!priv)
 		return NULL;
 
-	return priv->enc_state.implementation_info;
+	if (priv->enc_state.implementation_info)
+		return priv->enc_state.implementation_info;
+
+	return priv->dec_state.implementation_info;
 }
 
 int sbc_reinit(sbc_t *sbc, unsigned long flags)
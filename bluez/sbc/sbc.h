@@ -64,6 +64,14 @@ extern "C" {
 #define SBC_LE			0x00
 #define SBC_BE			0x01
 
+/* Flags for sbc_init() and sbc_reinit() */
+#define SBC_FLAG_REFERENCE_BITSTREAM	0x01	/* bit-by-bit frame packing */
+/* PCM data layout, planar and float samples are always in native byte
+ * order and the endian field is ignored for them */
+#define SBC_FLAG_PLANAR			0x02	/* channels one after another
+						 * within each frame */
+#define SBC_FLAG_FLOAT			0x04	/* float samples in [-1, 1] */
+
 struct sbc_struct {
 	unsigned long flags;
 
@@ -94,6 +102,16 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 			void *output, size_t output_len, ssize_t *written);
 
+/* Decodes as many complete frames as fit into the output buffer, returns
+ * the number of input bytes consumed */
+ssize_t sbc_decode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *written);
+
+/* Encodes as many complete input blocks as fit into the output buffer,
+ * returns the number of input bytes consumed */
+ssize_t sbc_encode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written);
+
 /* Returns the output block size in bytes */
 size_t sbc_get_frame_length(sbc_t *sbc);
 
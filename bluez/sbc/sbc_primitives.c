@@ -33,6 +33,8 @@
 
 #include "sbc_primitives.h"
 #include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse2.h"
+#include "sbc_primitives_avx2.h"
 #include "sbc_primitives_iwmmxt.h"
 #include "sbc_primitives_neon.h"
 #include "sbc_primitives_armv6.h"
@@ -219,18 +221,86 @@ static inline int16_t unaligned16_le(const uint8_t *ptr)
 	return (int16_t) (ptr[0] | (ptr[1] << 8));
 }
 
+static inline int16_t unaligned16_native(const uint8_t *ptr)
+{
+	int16_t v;
+
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+/* Converts float sample from [-1.0, 1.0] range with rounding and clipping */
+static inline int16_t unaligned_float_to_s16(const uint8_t *ptr)
+{
+	float f;
+
+	memcpy(&f, ptr, sizeof(f));
+	f *= 32768.0f;
+
+	if (f >= 32767.0f)
+		return 32767;
+	if (f <= -32768.0f)
+		return -32768;
+
+	return (int16_t) (f < 0 ? f - 0.5f : f + 0.5f);
+}
+
+/* Input data formats for the helper functions below */
+#define PCM_S16_LE		0
+#define PCM_S16_BE		1
+#define PCM_S16_PLANAR		2
+#define PCM_FLOAT		3
+#define PCM_FLOAT_PLANAR	4
+
+static SBC_ALWAYS_INLINE int16_t sbc_pcm_sample(const uint8_t *pcm,
+				int ch, int i, int nchannels, int plane,
+				int format)
+{
+	switch (format) {
+	case PCM_S16_BE:
+		return unaligned16_be(pcm + (ch + i * nchannels) * 2);
+	case PCM_S16_PLANAR:
+		return unaligned16_native(pcm + (ch * plane + i) * 2);
+	case PCM_FLOAT:
+		return unaligned_float_to_s16(pcm + (ch + i * nchannels) * 4);
+	case PCM_FLOAT_PLANAR:
+		return unaligned_float_to_s16(pcm + (ch * plane + i) * 4);
+	default:
+		return unaligned16_le(pcm + (ch + i * nchannels) * 2);
+	}
+}
+
+/* Distance in bytes between two consecutive samples of the same channel */
+static SBC_ALWAYS_INLINE int sbc_pcm_step(int nchannels, int format)
+{
+	switch (format) {
+	case PCM_S16_PLANAR:
+		return 2;
+	case PCM_FLOAT:
+		return 4 * nchannels;
+	case PCM_FLOAT_PLANAR:
+		return 4;
+	default:
+		return 2 * nchannels;
+	}
+}
+
 /*
  * Internal helper functions for input data processing. In order to get
  * optimal performance, it is important to have "nsamples", "nchannels"
- * and "big_endian" arguments used with this inline function as compile
- * time constants.
+ * and "format" arguments used with this inline function as compile
+ * time constants. Planar data has all the samples of the first channel
+ * followed by all the samples of the second channel.
  */
 
 static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s4_internal(
 	int position,
 	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
-	int nsamples, int nchannels, int big_endian)
+	int nsamples, int nchannels, int format)
 {
+	int plane = nsamples;
+	int step = sbc_pcm_step(nchannels, format);
+
 	/* handle X buffer wraparound */
 	if (position < nsamples) {
 		if (nchannels > 0)
@@ -242,35 +312,34 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s4_internal(
 		position = SBC_X_BUFFER_SIZE - 40;
 	}
 
-	#define PCM(i) (big_endian ? \
-		unaligned16_be(pcm + (i) * 2) : unaligned16_le(pcm + (i) * 2))
+	#define PCM(ch, i) sbc_pcm_sample(pcm, ch, i, nchannels, plane, format)
 
 	/* copy/permutate audio samples */
 	while ((nsamples -= 8) >= 0) {
 		position -= 8;
 		if (nchannels > 0) {
 			int16_t *x = &X[0][position];
-			x[0]  = PCM(0 + 7 * nchannels);
-			x[1]  = PCM(0 + 3 * nchannels);
-			x[2]  = PCM(0 + 6 * nchannels);
-			x[3]  = PCM(0 + 4 * nchannels);
-			x[4]  = PCM(0 + 0 * nchannels);
-			x[5]  = PCM(0 + 2 * nchannels);
-			x[6]  = PCM(0 + 1 * nchannels);
-			x[7]  = PCM(0 + 5 * nchannels);
+			x[0]  = PCM(0, 7);
+			x[1]  = PCM(0, 3);
+			x[2]  = PCM(0, 6);
+			x[3]  = PCM(0, 4);
+			x[4]  = PCM(0, 0);
+			x[5]  = PCM(0, 2);
+			x[6]  = PCM(0, 1);
+			x[7]  = PCM(0, 5);
 		}
 		if (nchannels > 1) {
 			int16_t *x = &X[1][position];
-			x[0]  = PCM(1 + 7 * nchannels);
-			x[1]  = PCM(1 + 3 * nchannels);
-			x[2]  = PCM(1 + 6 * nchannels);
-			x[3]  = PCM(1 + 4 * nchannels);
-			x[4]  = PCM(1 + 0 * nchannels);
-			x[5]  = PCM(1 + 2 * nchannels);
-			x[6]  = PCM(1 + 1 * nchannels);
-			x[7]  = PCM(1 + 5 * nchannels);
+			x[0]  = PCM(1, 7);
+			x[1]  = PCM(1, 3);
+			x[2]  = PCM(1, 6);
+			x[3]  = PCM(1, 4);
+			x[4]  = PCM(1, 0);
+			x[5]  = PCM(1, 2);
+			x[6]  = PCM(1, 1);
+			x[7]  = PCM(1, 5);
 		}
-		pcm += 16 * nchannels;
+		pcm += 8 * step;
 	}
 	#undef PCM
 
@@ -280,8 +349,11 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s4_internal(
 static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 	int position,
 	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
-	int nsamples, int nchannels, int big_endian)
+	int nsamples, int nchannels, int format)
 {
+	int plane = nsamples;
+	int step = sbc_pcm_step(nchannels, format);
+
 	/* handle X buffer wraparound */
 	if (position < nsamples) {
 		if (nchannels > 0)
@@ -293,51 +365,50 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 		position = SBC_X_BUFFER_SIZE - 72;
 	}
 
-	#define PCM(i) (big_endian ? \
-		unaligned16_be(pcm + (i) * 2) : unaligned16_le(pcm + (i) * 2))
+	#define PCM(ch, i) sbc_pcm_sample(pcm, ch, i, nchannels, plane, format)
 
 	/* copy/permutate audio samples */
 	while ((nsamples -= 16) >= 0) {
 		position -= 16;
 		if (nchannels > 0) {
 			int16_t *x = &X[0][position];
-			x[0]  = PCM(0 + 15 * nchannels);
-			x[1]  = PCM(0 + 7 * nchannels);
-			x[2]  = PCM(0 + 14 * nchannels);
-			x[3]  = PCM(0 + 8 * nchannels);
-			x[4]  = PCM(0 + 13 * nchannels);
-			x[5]  = PCM(0 + 9 * nchannels);
-			x[6]  = PCM(0 + 12 * nchannels);
-			x[7]  = PCM(0 + 10 * nchannels);
-			x[8]  = PCM(0 + 11 * nchannels);
-			x[9]  = PCM(0 + 3 * nchannels);
-			x[10] = PCM(0 + 6 * nchannels);
-			x[11] = PCM(0 + 0 * nchannels);
-			x[12] = PCM(0 + 5 * nchannels);
-			x[13] = PCM(0 + 1 * nchannels);
-			x[14] = PCM(0 + 4 * nchannels);
-			x[15] = PCM(0 + 2 * nchannels);
+			x[0]  = PCM(0, 15);
+			x[1]  = PCM(0, 7);
+			x[2]  = PCM(0, 14);
+			x[3]  = PCM(0, 8);
+			x[4]  = PCM(0, 13);
+			x[5]  = PCM(0, 9);
+			x[6]  = PCM(0, 12);
+			x[7]  = PCM(0, 10);
+			x[8]  = PCM(0, 11);
+			x[9]  = PCM(0, 3);
+			x[10] = PCM(0, 6);
+			x[11] = PCM(0, 0);
+			x[12] = PCM(0, 5);
+			x[13] = PCM(0, 1);
+			x[14] = PCM(0, 4);
+			x[15] = PCM(0, 2);
 		}
 		if (nchannels > 1) {
 			int16_t *x = &X[1][position];
-			x[0]  = PCM(1 + 15 * nchannels);
-			x[1]  = PCM(1 + 7 * nchannels);
-			x[2]  = PCM(1 + 14 * nchannels);
-			x[3]  = PCM(1 + 8 * nchannels);
-			x[4]  = PCM(1 + 13 * nchannels);
-			x[5]  = PCM(1 + 9 * nchannels);
-			x[6]  = PCM(1 + 12 * nchannels);
-			x[7]  = PCM(1 + 10 * nchannels);
-			x[8]  = PCM(1 + 11 * nchannels);
-			x[9]  = PCM(1 + 3 * nchannels);
-			x[10] = PCM(1 + 6 * nchannels);
-			x[11] = PCM(1 + 0 * nchannels);
-			x[12] = PCM(1 + 5 * nchannels);
-			x[13] = PCM(1 + 1 * nchannels);
-			x[14] = PCM(1 + 4 * nchannels);
-			x[15] = PCM(1 + 2 * nchannels);
+			x[0]  = PCM(1, 15);
+			x[1]  = PCM(1, 7);
+			x[2]  = PCM(1, 14);
+			x[3]  = PCM(1, 8);
+			x[4]  = PCM(1, 13);
+			x[5]  = PCM(1, 9);
+			x[6]  = PCM(1, 12);
+			x[7]  = PCM(1, 10);
+			x[8]  = PCM(1, 11);
+			x[9]  = PCM(1, 3);
+			x[10] = PCM(1, 6);
+			x[11] = PCM(1, 0);
+			x[12] = PCM(1, 5);
+			x[13] = PCM(1, 1);
+			x[14] = PCM(1, 4);
+			x[15] = PCM(1, 2);
 		}
-		pcm += 32 * nchannels;
+		pcm += 16 * step;
 	}
 	#undef PCM
 
@@ -362,10 +433,10 @@ static int sbc_enc_process_input_4s_le(int position,
 {
 	if (nchannels > 1)
 		return sbc_encoder_process_input_s4_internal(
-			position, pcm, X, nsamples, 2, 0);
+			position, pcm, X, nsamples, 2, PCM_S16_LE);
 	else
 		return sbc_encoder_process_input_s4_internal(
-			position, pcm, X, nsamples, 1, 0);
+			position, pcm, X, nsamples, 1, PCM_S16_LE);
 }
 
 static int sbc_enc_process_input_4s_be(int position,
@@ -374,10 +445,10 @@ static int sbc_enc_process_input_4s_be(int position,
 {
 	if (nchannels > 1)
 		return sbc_encoder_process_input_s4_internal(
-			position, pcm, X, nsamples, 2, 1);
+			position, pcm, X, nsamples, 2, PCM_S16_BE);
 	else
 		return sbc_encoder_process_input_s4_internal(
-			position, pcm, X, nsamples, 1, 1);
+			position, pcm, X, nsamples, 1, PCM_S16_BE);
 }
 
 static int sbc_enc_process_input_8s_le(int position,
@@ -386,10 +457,10 @@ static int sbc_enc_process_input_8s_le(int position,
 {
 	if (nchannels > 1)
 		return sbc_encoder_process_input_s8_internal(
-			position, pcm, X, nsamples, 2, 0);
+			position, pcm, X, nsamples, 2, PCM_S16_LE);
 	else
 		return sbc_encoder_process_input_s8_internal(
-			position, pcm, X, nsamples, 1, 0);
+			position, pcm, X, nsamples, 1, PCM_S16_LE);
 }
 
 static int sbc_enc_process_input_8s_be(int position,
@@ -398,10 +469,82 @@ static int sbc_enc_process_input_8s_be(int position,
 {
 	if (nchannels > 1)
 		return sbc_encoder_process_input_s8_internal(
-			position, pcm, X, nsamples, 2, 1);
+			position, pcm, X, nsamples, 2, PCM_S16_BE);
+	else
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 1, PCM_S16_BE);
+}
+
+static int sbc_enc_process_input_4s_planar(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 2, PCM_S16_PLANAR);
+	else
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 1, PCM_S16_PLANAR);
+}
+
+static int sbc_enc_process_input_4s_float(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 2, PCM_FLOAT);
+	else
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 1, PCM_FLOAT);
+}
+
+static int sbc_enc_process_input_4s_float_planar(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 2, PCM_FLOAT_PLANAR);
+	else
+		return sbc_encoder_process_input_s4_internal(
+			position, pcm, X, nsamples, 1, PCM_FLOAT_PLANAR);
+}
+
+static int sbc_enc_process_input_8s_planar(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 2, PCM_S16_PLANAR);
+	else
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 1, PCM_S16_PLANAR);
+}
+
+static int sbc_enc_process_input_8s_float(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 2, PCM_FLOAT);
+	else
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 1, PCM_FLOAT);
+}
+
+static int sbc_enc_process_input_8s_float_planar(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s8_internal(
+			position, pcm, X, nsamples, 2, PCM_FLOAT_PLANAR);
 	else
 		return sbc_encoder_process_input_s8_internal(
-			position, pcm, X, nsamples, 1, 1);
+			position, pcm, X, nsamples, 1, PCM_FLOAT_PLANAR);
 }
 
 /* Supplementary function to count the number of leading zeros */
@@ -516,10 +659,132 @@ static int sbc_calc_scalefactors_j(
 	return joint;
 }
 
+static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
+{
+	if (s > 0x7FFF)
+		return 0x7FFF;
+	else if (s < -0x8000)
+		return -0x8000;
+	else
+		return s;
+}
+
 /*
- * Detect CPU features and setup function pointers
+ * Reference C code of synthesis filter. It keeps every matrixed value in
+ * the V array at the position, which is shifted for each output sample
+ * separately, so no data needs to be moved around except for the rare
+ * cases when the position wraps around.
  */
-void sbc_init_primitives(struct sbc_encoder_state *state)
+
+static inline void sbc_synthesize_four(struct sbc_decoder_state *state,
+				int ch, const int32_t *sb, int16_t *out)
+{
+	int i, k, idx;
+	int32_t *v = state->V[ch];
+	int *offset = state->offset[ch];
+
+	for (i = 0; i < 8; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 79;
+			memcpy(v + 80, v, 9 * sizeof(*v));
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		v[offset[i]] = SCALE4_STAGED1(
+			MULA(synmatrix4[i][0], sb[0],
+			MULA(synmatrix4[i][1], sb[1],
+			MULA(synmatrix4[i][2], sb[2],
+			MUL (synmatrix4[i][3], sb[3])))));
+	}
+
+	/* Compute the samples */
+	for (idx = 0, i = 0; i < 4; i++, idx += 5) {
+		k = (i + 4) & 0xf;
+
+		/* Store in output, Q0 */
+		out[i] = sbc_clip16(SCALE4_STAGED1(
+			MULA(v[offset[i] + 0], sbc_proto_4_40m0[idx + 0],
+			MULA(v[offset[k] + 1], sbc_proto_4_40m1[idx + 0],
+			MULA(v[offset[i] + 2], sbc_proto_4_40m0[idx + 1],
+			MULA(v[offset[k] + 3], sbc_proto_4_40m1[idx + 1],
+			MULA(v[offset[i] + 4], sbc_proto_4_40m0[idx + 2],
+			MULA(v[offset[k] + 5], sbc_proto_4_40m1[idx + 2],
+			MULA(v[offset[i] + 6], sbc_proto_4_40m0[idx + 3],
+			MULA(v[offset[k] + 7], sbc_proto_4_40m1[idx + 3],
+			MULA(v[offset[i] + 8], sbc_proto_4_40m0[idx + 4],
+			MUL( v[offset[k] + 9], sbc_proto_4_40m1[idx + 4]))))))))))));
+	}
+}
+
+static inline void sbc_synthesize_eight(struct sbc_decoder_state *state,
+				int ch, const int32_t *sb, int16_t *out)
+{
+	int i, j, k, idx;
+	int *offset = state->offset[ch];
+
+	for (i = 0; i < 16; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 159;
+			for (j = 0; j < 9; j++)
+				state->V[ch][j + 160] = state->V[ch][j];
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		state->V[ch][offset[i]] = SCALE8_STAGED1(
+			MULA(synmatrix8[i][0], sb[0],
+			MULA(synmatrix8[i][1], sb[1],
+			MULA(synmatrix8[i][2], sb[2],
+			MULA(synmatrix8[i][3], sb[3],
+			MULA(synmatrix8[i][4], sb[4],
+			MULA(synmatrix8[i][5], sb[5],
+			MULA(synmatrix8[i][6], sb[6],
+			MUL( synmatrix8[i][7], sb[7])))))))));
+	}
+
+	/* Compute the samples */
+	for (idx = 0, i = 0; i < 8; i++, idx += 5) {
+		k = (i + 8) & 0xf;
+
+		/* Store in output, Q0 */
+		out[i] = sbc_clip16(SCALE8_STAGED1(
+			MULA(state->V[ch][offset[i] + 0], sbc_proto_8_80m0[idx + 0],
+			MULA(state->V[ch][offset[k] + 1], sbc_proto_8_80m1[idx + 0],
+			MULA(state->V[ch][offset[i] + 2], sbc_proto_8_80m0[idx + 1],
+			MULA(state->V[ch][offset[k] + 3], sbc_proto_8_80m1[idx + 1],
+			MULA(state->V[ch][offset[i] + 4], sbc_proto_8_80m0[idx + 2],
+			MULA(state->V[ch][offset[k] + 5], sbc_proto_8_80m1[idx + 2],
+			MULA(state->V[ch][offset[i] + 6], sbc_proto_8_80m0[idx + 3],
+			MULA(state->V[ch][offset[k] + 7], sbc_proto_8_80m1[idx + 3],
+			MULA(state->V[ch][offset[i] + 8], sbc_proto_8_80m0[idx + 4],
+			MUL( state->V[ch][offset[k] + 9], sbc_proto_8_80m1[idx + 4]))))))))))));
+	}
+}
+
+static void sbc_synthesize_4s(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk;
+
+	for (blk = 0; blk < blocks; blk++)
+		sbc_synthesize_four(state, ch, sb_sample[blk][ch],
+							pcm + blk * 4);
+}
+
+static void sbc_synthesize_8s(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk;
+
+	for (blk = 0; blk < blocks; blk++)
+		sbc_synthesize_eight(state, ch, sb_sample[blk][ch],
+							pcm + blk * 8);
+}
+
+static void sbc_init_primitives_c(struct sbc_encoder_state *state)
 {
 	/* Default implementation for analyze functions */
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_simd;
@@ -531,24 +796,138 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	state->sbc_enc_process_input_8s_le = sbc_enc_process_input_8s_le;
 	state->sbc_enc_process_input_8s_be = sbc_enc_process_input_8s_be;
 
+	/* Planar and float input is only handled by the C code */
+	state->sbc_enc_process_input_4s_planar =
+				sbc_enc_process_input_4s_planar;
+	state->sbc_enc_process_input_4s_float =
+				sbc_enc_process_input_4s_float;
+	state->sbc_enc_process_input_4s_float_planar =
+				sbc_enc_process_input_4s_float_planar;
+	state->sbc_enc_process_input_8s_planar =
+				sbc_enc_process_input_8s_planar;
+	state->sbc_enc_process_input_8s_float =
+				sbc_enc_process_input_8s_float;
+	state->sbc_enc_process_input_8s_float_planar =
+				sbc_enc_process_input_8s_float_planar;
+
 	/* Default implementation for scale factors calculation */
 	state->sbc_calc_scalefactors = sbc_calc_scalefactors;
 	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j;
 	state->implementation_info = "Generic C";
+}
+
+static void sbc_init_dec_primitives_c(struct sbc_decoder_state *state)
+{
+	/* Default implementation for synthesis functions */
+	state->sbc_synthesize_4s = sbc_synthesize_4s;
+	state->sbc_synthesize_8s = sbc_synthesize_8s;
+	state->implementation_info = "Generic C";
+}
 
+/*
+ * Optimized implementations in the order they are tried, every one of
+ * them checks the CPU capabilities and overrides some of the function
+ * pointers set up by the previous ones.
+ */
+static void (* const sbc_init_primitives_list[])(
+					struct sbc_encoder_state *state) = {
 	/* X86/AMD64 optimizations */
 #ifdef SBC_BUILD_WITH_MMX_SUPPORT
-	sbc_init_primitives_mmx(state);
+	sbc_init_primitives_mmx,
+#endif
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	sbc_init_primitives_sse2,
+#endif
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	sbc_init_primitives_avx2,
 #endif
 
 	/* ARM optimizations */
 #ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
-	sbc_init_primitives_armv6(state);
+	sbc_init_primitives_armv6,
 #endif
 #ifdef SBC_BUILD_WITH_IWMMXT_SUPPORT
-	sbc_init_primitives_iwmmxt(state);
+	sbc_init_primitives_iwmmxt,
 #endif
 #ifdef SBC_BUILD_WITH_NEON_SUPPORT
-	sbc_init_primitives_neon(state);
+	sbc_init_primitives_neon,
+#endif
+	NULL
+};
+
+static void (* const sbc_init_dec_primitives_list[])(
+					struct sbc_decoder_state *state) = {
+	/* X86/AMD64 optimizations */
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+	sbc_init_dec_primitives_sse2,
+#endif
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	sbc_init_dec_primitives_avx2,
 #endif
+	NULL
+};
+
+int sbc_init_primitives_nth(struct sbc_encoder_state *state, int n)
+{
+	const char *info = NULL;
+	int i;
+
+	sbc_init_primitives_c(state);
+
+	for (i = 0; sbc_init_primitives_list[i] && i != n; i++) {
+		info = state->implementation_info;
+		sbc_init_primitives_list[i](state);
+	}
+
+	if (n <= 0)
+		return 0;
+
+	/* not built in */
+	if (i < n)
+		return -1;
+
+	/* not supported by the CPU */
+	if (state->implementation_info == info)
+		return 1;
+
+	return 0;
+}
+
+int sbc_init_dec_primitives_nth(struct sbc_decoder_state *state, int n)
+{
+	const char *info = NULL;
+	int i;
+
+	sbc_init_dec_primitives_c(state);
+
+	for (i = 0; sbc_init_dec_primitives_list[i] && i != n; i++) {
+		info = state->implementation_info;
+		sbc_init_dec_primitives_list[i](state);
+	}
+
+	if (n <= 0)
+		return 0;
+
+	/* not built in */
+	if (i < n)
+		return -1;
+
+	/* not supported by the CPU */
+	if (state->implementation_info == info)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Detect CPU features and setup function pointers
+ */
+void sbc_init_primitives(struct sbc_encoder_state *state)
+{
+	sbc_init_primitives_nth(state, -1);
+}
+
+void sbc_init_dec_primitives(struct sbc_decoder_state *state)
+{
+	sbc_init_dec_primitives_nth(state, -1);
 }
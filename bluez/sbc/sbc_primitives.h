@@ -59,6 +59,26 @@ struct sbc_encoder_state {
 	int (*sbc_enc_process_input_8s_be)(int position,
 			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
 			int nsamples, int nchannels);
+	/* Process native endian planar int16, interleaved float and
+	 * planar float input data */
+	int (*sbc_enc_process_input_4s_planar)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*sbc_enc_process_input_4s_float)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*sbc_enc_process_input_4s_float_planar)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*sbc_enc_process_input_8s_planar)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*sbc_enc_process_input_8s_float)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	int (*sbc_enc_process_input_8s_float_planar)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
 	/* Scale factors calculation */
 	void (*sbc_calc_scalefactors)(int32_t sb_sample_f[16][2][8],
 			uint32_t scale_factor[2][8],
@@ -70,11 +90,44 @@ struct sbc_encoder_state {
 	const char *implementation_info;
 };
 
+struct sbc_decoder_state {
+	int subbands;
+	int32_t V[2][170];
+	int offset[2][16];
+	/* Ring buffer with the history of matrixed subband samples for
+	 * SIMD optimized synthesis filters. It keeps 10 most recent blocks
+	 * and every block is stored twice, so that the whole window starting
+	 * at 'position' is always available as a contiguous array */
+	int position[2];
+	int32_t SBC_ALIGNED W[2][20][16];
+	/* Polyphase synthesis filter for 4 subbands configuration,
+	 * it handles all the blocks of one channel at once */
+	void (*sbc_synthesize_4s)(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks);
+	/* Polyphase synthesis filter for 8 subbands configuration,
+	 * it handles all the blocks of one channel at once */
+	void (*sbc_synthesize_8s)(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks);
+	const char *implementation_info;
+};
+
 /*
  * Initialize pointers to the functions which are the basic "building bricks"
  * of SBC codec. Best implementation is selected based on target CPU
  * capabilities.
  */
 void sbc_init_primitives(struct sbc_encoder_state *encoder_state);
+void sbc_init_dec_primitives(struct sbc_decoder_state *decoder_state);
+
+/*
+ * Same as above, but only the first 'n' optimized implementations are
+ * applied on top of the generic C code (all of them for negative 'n').
+ * Returns -1 if the n-th implementation is not built in and 1 if it is not
+ * supported by the CPU. Used for benchmarking each implementation
+ * separately.
+ */
+int sbc_init_primitives_nth(struct sbc_encoder_state *encoder_state, int n);
+int sbc_init_dec_primitives_nth(struct sbc_decoder_state *decoder_state,
+									int n);
 
 #endif
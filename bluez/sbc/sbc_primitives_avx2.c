@@ -0,0 +1,563 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_avx2.h"
+
+/*
+ * AVX2 optimizations
+ */
+
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+
+static inline void sbc_analyze_four_avx2(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+	};
+	asm volatile (
+		"vmovdqu        (%[in]), %%ymm0\n"
+		"vmovdqu      32(%[in]), %%ymm1\n"
+		"vmovdqu      64(%[in]), %%xmm2\n"
+		"vpmaddwd       (%[consts]), %%ymm0, %%ymm0\n"
+		"vpmaddwd     32(%[consts]), %%ymm1, %%ymm1\n"
+		"vpmaddwd     64(%[consts]), %%xmm2, %%xmm2\n"
+		"vpaddd         %%ymm1, %%ymm0, %%ymm0\n"
+		"vextracti128       $1, %%ymm0, %%xmm1\n"
+		"vpaddd         %%xmm1, %%xmm0, %%xmm0\n"
+		"vpaddd         %%xmm2, %%xmm0, %%xmm0\n"
+		"vpaddd       (%[round]), %%xmm0, %%xmm0\n"
+		"\n"
+		"vpsrad      %[shift], %%xmm0, %%xmm0\n"
+		"vpackssdw      %%xmm0, %%xmm0, %%xmm0\n"
+		"\n"
+		"vpshufd         $0x00, %%xmm0, %%xmm1\n"
+		"vpshufd         $0x55, %%xmm0, %%xmm0\n"
+		"vpmaddwd     80(%[consts]), %%xmm1, %%xmm1\n"
+		"vpmaddwd     96(%[consts]), %%xmm0, %%xmm0\n"
+		"vpaddd         %%xmm1, %%xmm0, %%xmm0\n"
+		"\n"
+		"vmovdqa        %%xmm0, (%[out])\n"
+		:
+		: [in] "r" (in), [consts] "r" (consts), [round] "r" (&round_c),
+		  [out] "r" (out), [shift] "i" (SBC_PROTO_FIXED4_SCALE)
+		: "xmm0", "xmm1", "xmm2", "cc", "memory");
+}
+
+static inline void sbc_analyze_eight_avx2(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[8] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"vmovdqu        (%[in]), %%ymm0\n"
+		"vmovdqu      32(%[in]), %%ymm1\n"
+		"vmovdqu      64(%[in]), %%ymm2\n"
+		"vmovdqu      96(%[in]), %%ymm3\n"
+		"vmovdqu     128(%[in]), %%ymm4\n"
+		"vpmaddwd       (%[consts]), %%ymm0, %%ymm0\n"
+		"vpmaddwd     32(%[consts]), %%ymm1, %%ymm1\n"
+		"vpmaddwd     64(%[consts]), %%ymm2, %%ymm2\n"
+		"vpmaddwd     96(%[consts]), %%ymm3, %%ymm3\n"
+		"vpmaddwd    128(%[consts]), %%ymm4, %%ymm4\n"
+		"vpaddd       (%[round]), %%ymm0, %%ymm0\n"
+		"vpaddd         %%ymm1, %%ymm0, %%ymm0\n"
+		"vpaddd         %%ymm3, %%ymm2, %%ymm2\n"
+		"vpaddd         %%ymm4, %%ymm0, %%ymm0\n"
+		"vpaddd         %%ymm2, %%ymm0, %%ymm0\n"
+		"\n"
+		"vpsrad      %[shift], %%ymm0, %%ymm0\n"
+		"vextracti128       $1, %%ymm0, %%xmm1\n"
+		"vpackssdw      %%xmm1, %%xmm0, %%xmm0\n"
+		"\n"
+		"vpbroadcastd   %%xmm0, %%ymm2\n"
+		"vpmaddwd    160(%[consts]), %%ymm2, %%ymm2\n"
+		"vpshufd         $0x55, %%xmm0, %%xmm1\n"
+		"vpbroadcastd   %%xmm1, %%ymm1\n"
+		"vpmaddwd    192(%[consts]), %%ymm1, %%ymm1\n"
+		"vpaddd         %%ymm1, %%ymm2, %%ymm2\n"
+		"vpshufd         $0xaa, %%xmm0, %%xmm1\n"
+		"vpbroadcastd   %%xmm1, %%ymm1\n"
+		"vpmaddwd    224(%[consts]), %%ymm1, %%ymm1\n"
+		"vpaddd         %%ymm1, %%ymm2, %%ymm2\n"
+		"vpshufd         $0xff, %%xmm0, %%xmm1\n"
+		"vpbroadcastd   %%xmm1, %%ymm1\n"
+		"vpmaddwd    256(%[consts]), %%ymm1, %%ymm1\n"
+		"vpaddd         %%ymm1, %%ymm2, %%ymm2\n"
+		"\n"
+		"vmovdqu        %%ymm2, (%[out])\n"
+		:
+		: [in] "r" (in), [consts] "r" (consts), [round] "r" (&round_c),
+		  [out] "r" (out), [shift] "i" (SBC_PROTO_FIXED8_SCALE)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "cc", "memory");
+}
+
+static inline void sbc_analyze_4b_4s_avx2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_four_avx2(x + 12, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_avx2(x + 8, out, analysis_consts_fixed4_simd_even);
+	out += out_stride;
+	sbc_analyze_four_avx2(x + 4, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_avx2(x + 0, out, analysis_consts_fixed4_simd_even);
+
+	asm volatile ("vzeroupper\n");
+}
+
+static inline void sbc_analyze_4b_8s_avx2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_avx2(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 0, out, analysis_consts_fixed8_simd_even);
+
+	asm volatile ("vzeroupper\n");
+}
+
+/*
+ * Scale factors calculation works on a whole row of subband samples at
+ * once: ymm registers for 8 subbands and xmm registers for 4 subbands.
+ * 'w' selects the register width and is either 'x' or 'y'.
+ */
+#define R(w, n) "%%" #w "mm" #n
+
+/*
+ * Accumulate (abs(x) - 1) of the values from register 'src' into 'acc'
+ * with bitwise OR, zero values are skipped. 'vpmaxud' keeps the result
+ * identical to the C code even for abs(INT32_MIN) wraparound.
+ * Needs register 7 to be set to all ones (int32_t 1).
+ */
+#define SF_ACCUMULATE(w, src, acc)					\
+	"vpabsd       " R(w, src) ", " R(w, src) "\n"		\
+	"vpmaxud      " R(w, 7) ", " R(w, src) ", " R(w, src) "\n"	\
+	"vpsubd       " R(w, 7) ", " R(w, src) ", " R(w, src) "\n"	\
+	"vpor         " R(w, src) ", " R(w, acc) ", " R(w, acc) "\n"
+
+#define SF_CALC(w)							\
+		"vpbroadcastd  (%[consts]), " R(w, 0) "\n"		\
+		"vpbroadcastd 4(%[consts]), " R(w, 7) "\n"		\
+	"1:\n"								\
+		"vmovdqu      (%[in], %[blk]), " R(w, 1) "\n"		\
+		SF_ACCUMULATE(w, 1, 0)					\
+		"sub          %[inc], %[blk]\n"			\
+		"jns          1b\n"					\
+		"vmovdqu      " R(w, 0) ", (%[x])\n"
+
+#define SF_CALC_J(w)							\
+		"vpbroadcastd  (%[consts]), " R(w, 0) "\n"		\
+		"vpbroadcastd 4(%[consts]), " R(w, 7) "\n"		\
+		"vmovdqa      " R(w, 0) ", " R(w, 1) "\n"		\
+		"vmovdqa      " R(w, 0) ", " R(w, 2) "\n"		\
+		"vmovdqa      " R(w, 0) ", " R(w, 3) "\n"		\
+	"1:\n"								\
+		"vmovdqu        (%[in], %[blk]), " R(w, 4) "\n"	\
+		"vmovdqu      32(%[in], %[blk]), " R(w, 5) "\n"	\
+		"vpsrad        $1, " R(w, 4) ", " R(w, 8) "\n"		\
+		"vpsrad        $1, " R(w, 5) ", " R(w, 9) "\n"		\
+		"vpaddd       " R(w, 9) ", " R(w, 8) ", " R(w, 10) "\n"	\
+		"vpsubd       " R(w, 9) ", " R(w, 8) ", " R(w, 11) "\n"	\
+		SF_ACCUMULATE(w, 4, 0)					\
+		SF_ACCUMULATE(w, 5, 1)					\
+		SF_ACCUMULATE(w, 10, 2)					\
+		SF_ACCUMULATE(w, 11, 3)					\
+		"sub          %[inc], %[blk]\n"			\
+		"jns          1b\n"					\
+		"vmovdqu      " R(w, 0) ", (%[x])\n"			\
+		"vmovdqu      " R(w, 1) ", 32(%[x])\n"			\
+		"vmovdqu      " R(w, 2) ", 64(%[x])\n"			\
+		"vmovdqu      " R(w, 3) ", 96(%[x])\n"
+
+#define SF_JOINT_UPDATE(w)						\
+		"vmovdqu      (%[mask]), " R(w, 7) "\n"		\
+	"1:\n"								\
+		"vmovdqu        (%[in], %[blk]), " R(w, 0) "\n"	\
+		"vmovdqu      32(%[in], %[blk]), " R(w, 1) "\n"	\
+		"vpsrad        $1, " R(w, 0) ", " R(w, 2) "\n"		\
+		"vpsrad        $1, " R(w, 1) ", " R(w, 3) "\n"		\
+		"vpaddd       " R(w, 3) ", " R(w, 2) ", " R(w, 4) "\n"	\
+		"vpsubd       " R(w, 3) ", " R(w, 2) ", " R(w, 5) "\n"	\
+		"vpblendvb    " R(w, 7) ", " R(w, 4) ", " R(w, 0) ", "	\
+				R(w, 0) "\n"				\
+		"vpblendvb    " R(w, 7) ", " R(w, 5) ", " R(w, 1) ", "	\
+				R(w, 1) "\n"				\
+		"vmovdqu      " R(w, 0) ", (%[in], %[blk])\n"		\
+		"vmovdqu      " R(w, 1) ", 32(%[in], %[blk])\n"	\
+		"sub          %[inc], %[blk]\n"			\
+		"jns          1b\n"
+
+static const SBC_ALIGNED int32_t sf_consts[2] = {
+	1 << SCALE_OUT_BITS, 1
+};
+
+static void sbc_calc_scalefactors_avx2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	uint32_t SBC_ALIGNED x[8];
+	int ch, sb;
+	intptr_t blk;
+
+	for (ch = 0; ch < channels; ch++) {
+		blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		if (subbands == 8)
+			asm volatile (
+				SF_CALC(y)
+			: [blk] "+r" (blk)
+			: [in] "r" (&sb_sample_f[0][ch][0]),
+			  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+			  [x] "r" (x),
+			  [consts] "r" (sf_consts)
+			: "xmm0", "xmm1", "xmm7", "cc", "memory");
+		else
+			asm volatile (
+				SF_CALC(x)
+			: [blk] "+r" (blk)
+			: [in] "r" (&sb_sample_f[0][ch][0]),
+			  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+			  [x] "r" (x),
+			  [consts] "r" (sf_consts)
+			: "xmm0", "xmm1", "xmm7", "cc", "memory");
+
+		for (sb = 0; sb < subbands; sb++)
+			scale_factor[ch][sb] = (31 - SCALE_OUT_BITS) -
+				__builtin_clz(x[sb]);
+	}
+
+	asm volatile ("vzeroupper\n");
+}
+
+static int sbc_calc_scalefactors_j_avx2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	/* scale factors bits for left, right, mid and side channels */
+	uint32_t SBC_ALIGNED x[4][8];
+	int32_t SBC_ALIGNED mask[8];
+	int sb, joint = 0, use_joint = 0;
+	intptr_t blk;
+
+	blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+		(char *) &sb_sample_f[0][0][0]));
+	if (subbands == 8)
+		asm volatile (
+			SF_CALC_J(y)
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][0]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [x] "r" (x),
+		  [consts] "r" (sf_consts)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7",
+		  "xmm8", "xmm9", "xmm10", "xmm11", "cc", "memory");
+	else
+		asm volatile (
+			SF_CALC_J(x)
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][0]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [x] "r" (x),
+		  [consts] "r" (sf_consts)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7",
+		  "xmm8", "xmm9", "xmm10", "xmm11", "cc", "memory");
+
+	for (sb = 0; sb < subbands; sb++) {
+		uint32_t l = (31 - SCALE_OUT_BITS) - __builtin_clz(x[0][sb]);
+		uint32_t r = (31 - SCALE_OUT_BITS) - __builtin_clz(x[1][sb]);
+		uint32_t m = (31 - SCALE_OUT_BITS) - __builtin_clz(x[2][sb]);
+		uint32_t s = (31 - SCALE_OUT_BITS) - __builtin_clz(x[3][sb]);
+
+		mask[sb] = 0;
+		/* last subband does not use joint stereo */
+		if (sb < subbands - 1 && l + r > m + s) {
+			joint |= 1 << (subbands - 1 - sb);
+			mask[sb] = -1;
+			use_joint = 1;
+			l = m;
+			r = s;
+		}
+		scale_factor[0][sb] = l;
+		scale_factor[1][sb] = r;
+	}
+
+	if (!use_joint)
+		goto done;
+
+	/* replace left/right with mid/side for joint stereo subbands */
+	blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+		(char *) &sb_sample_f[0][0][0]));
+	if (subbands == 8)
+		asm volatile (
+			SF_JOINT_UPDATE(y)
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][0]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [mask] "r" (mask)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7",
+		  "cc", "memory");
+	else
+		asm volatile (
+			SF_JOINT_UPDATE(x)
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][0]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [mask] "r" (mask)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm7",
+		  "cc", "memory");
+
+done:
+	asm volatile ("vzeroupper\n");
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+/* Multiply 8 values by one subband sample for 'sbc_synthesize_four_avx2' */
+#define SYN_MATRIX_STEP_4(s)						\
+	"vpbroadcastd " #s "*4(%[sb]), %%ymm1\n"			\
+	"vpmulld   " #s "*32(%[consts]), %%ymm1, %%ymm1\n"		\
+	"vpaddd       %%ymm1, %%ymm0, %%ymm0\n"
+
+/* Multiply 16 values by one subband sample for 'sbc_synthesize_eight_avx2' */
+#define SYN_MATRIX_STEP_8(s)						\
+	"vpbroadcastd " #s "*4(%[sb]), %%ymm2\n"			\
+	"vpmulld   " #s "*64(%[consts]), %%ymm2, %%ymm3\n"		\
+	"vpmulld   " #s "*64+32(%[consts]), %%ymm2, %%ymm2\n"		\
+	"vpaddd       %%ymm3, %%ymm0, %%ymm0\n"			\
+	"vpaddd       %%ymm2, %%ymm1, %%ymm1\n"
+
+#define SYN_WINDOW_STEP_4(t, off)					\
+	"vmovdqu   " #t "*64+" #off "(%[w]), %%xmm1\n"		\
+	"vpmulld   " #t "*16(%[consts]), %%xmm1, %%xmm1\n"		\
+	"vpaddd       %%xmm1, %%xmm0, %%xmm0\n"
+
+#define SYN_WINDOW_STEP_8(t, off)					\
+	"vmovdqu   " #t "*64+" #off "(%[w]), %%ymm1\n"		\
+	"vpmulld   " #t "*32(%[consts]), %%ymm1, %%ymm1\n"		\
+	"vpaddd       %%ymm1, %%ymm0, %%ymm0\n"
+
+static inline void sbc_synthesize_four_avx2(const int32_t *sb,
+						int32_t *w, int16_t *out)
+{
+	asm volatile (
+		"vpxor        %%ymm0, %%ymm0, %%ymm0\n"
+		SYN_MATRIX_STEP_4(0)
+		SYN_MATRIX_STEP_4(1)
+		SYN_MATRIX_STEP_4(2)
+		SYN_MATRIX_STEP_4(3)
+		"vpsrad    %[shift], %%ymm0, %%ymm0\n"
+		"vmovdqu      %%ymm0, (%[w])\n"
+		"vmovdqu      %%ymm0, 640(%[w])\n"
+		:
+		: [sb] "r" (sb), [w] "r" (w),
+		  [consts] "r" (synmatrix4_simd),
+		  [shift] "i" (SCALE4_STAGED1_BITS)
+		: "xmm0", "xmm1", "cc", "memory");
+
+	asm volatile (
+		"vpxor        %%xmm0, %%xmm0, %%xmm0\n"
+		SYN_WINDOW_STEP_4(0, 0)
+		SYN_WINDOW_STEP_4(1, 16)
+		SYN_WINDOW_STEP_4(2, 0)
+		SYN_WINDOW_STEP_4(3, 16)
+		SYN_WINDOW_STEP_4(4, 0)
+		SYN_WINDOW_STEP_4(5, 16)
+		SYN_WINDOW_STEP_4(6, 0)
+		SYN_WINDOW_STEP_4(7, 16)
+		SYN_WINDOW_STEP_4(8, 0)
+		SYN_WINDOW_STEP_4(9, 16)
+		"vpsrad    %[shift], %%xmm0, %%xmm0\n"
+		"vpackssdw    %%xmm0, %%xmm0, %%xmm0\n"
+		"vmovq        %%xmm0, (%[out])\n"
+		:
+		: [w] "r" (w), [consts] "r" (sbc_proto_4_40_simd),
+		  [out] "r" (out), [shift] "i" (SCALE4_STAGED1_BITS)
+		: "xmm0", "xmm1", "cc", "memory");
+}
+
+static inline void sbc_synthesize_eight_avx2(const int32_t *sb,
+						int32_t *w, int16_t *out)
+{
+	asm volatile (
+		"vpxor        %%ymm0, %%ymm0, %%ymm0\n"
+		"vpxor        %%ymm1, %%ymm1, %%ymm1\n"
+		SYN_MATRIX_STEP_8(0)
+		SYN_MATRIX_STEP_8(1)
+		SYN_MATRIX_STEP_8(2)
+		SYN_MATRIX_STEP_8(3)
+		SYN_MATRIX_STEP_8(4)
+		SYN_MATRIX_STEP_8(5)
+		SYN_MATRIX_STEP_8(6)
+		SYN_MATRIX_STEP_8(7)
+		"vpsrad    %[shift], %%ymm0, %%ymm0\n"
+		"vpsrad    %[shift], %%ymm1, %%ymm1\n"
+		"vmovdqu      %%ymm0, (%[w])\n"
+		"vmovdqu      %%ymm1, 32(%[w])\n"
+		"vmovdqu      %%ymm0, 640(%[w])\n"
+		"vmovdqu      %%ymm1, 672(%[w])\n"
+		:
+		: [sb] "r" (sb), [w] "r" (w),
+		  [consts] "r" (synmatrix8_simd),
+		  [shift] "i" (SCALE8_STAGED1_BITS)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "cc", "memory");
+
+	asm volatile (
+		"vpxor        %%ymm0, %%ymm0, %%ymm0\n"
+		SYN_WINDOW_STEP_8(0, 0)
+		SYN_WINDOW_STEP_8(1, 32)
+		SYN_WINDOW_STEP_8(2, 0)
+		SYN_WINDOW_STEP_8(3, 32)
+		SYN_WINDOW_STEP_8(4, 0)
+		SYN_WINDOW_STEP_8(5, 32)
+		SYN_WINDOW_STEP_8(6, 0)
+		SYN_WINDOW_STEP_8(7, 32)
+		SYN_WINDOW_STEP_8(8, 0)
+		SYN_WINDOW_STEP_8(9, 32)
+		"vpsrad    %[shift], %%ymm0, %%ymm0\n"
+		"vextracti128    $1, %%ymm0, %%xmm1\n"
+		"vpackssdw    %%xmm1, %%xmm0, %%xmm0\n"
+		"vmovdqu      %%xmm0, (%[out])\n"
+		:
+		: [w] "r" (w), [consts] "r" (sbc_proto_8_80_simd),
+		  [out] "r" (out), [shift] "i" (SCALE8_STAGED1_BITS)
+		: "xmm0", "xmm1", "cc", "memory");
+}
+
+static void sbc_synthesize_4s_avx2(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk, pos = state->position[ch];
+
+	for (blk = 0; blk < blocks; blk++) {
+		pos = (pos == 0 ? 10 : pos) - 1;
+		sbc_synthesize_four_avx2(sb_sample[blk][ch],
+				state->W[ch][pos], pcm + blk * 4);
+	}
+
+	state->position[ch] = pos;
+
+	asm volatile ("vzeroupper\n");
+}
+
+static void sbc_synthesize_8s_avx2(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk, pos = state->position[ch];
+
+	for (blk = 0; blk < blocks; blk++) {
+		pos = (pos == 0 ? 10 : pos) - 1;
+		sbc_synthesize_eight_avx2(sb_sample[blk][ch],
+				state->W[ch][pos], pcm + blk * 8);
+	}
+
+	state->position[ch] = pos;
+
+	asm volatile ("vzeroupper\n");
+}
+
+static inline void sbc_cpuid(uint32_t leaf, uint32_t regs[4])
+{
+	asm volatile (
+		"cpuid\n"
+		: "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]),
+		  "=d" (regs[3])
+		: "a" (leaf), "c" (0));
+}
+
+static int check_avx2_support(void)
+{
+	uint32_t regs[4], xcr0;
+
+	sbc_cpuid(0, regs);
+	if (regs[0] < 7)
+		return 0;
+
+	/* AVX state must be enabled by the OS (OSXSAVE + AVX bits) */
+	sbc_cpuid(1, regs);
+	if ((regs[2] & (3 << 27)) != (3 << 27))
+		return 0;
+
+	asm volatile ("xgetbv\n" : "=a" (xcr0), "=d" (regs[3]) : "c" (0));
+	if ((xcr0 & 6) != 6)
+		return 0;
+
+	sbc_cpuid(7, regs);
+	return regs[1] & (1 << 5);
+}
+
+void sbc_init_primitives_avx2(struct sbc_encoder_state *state)
+{
+	if (check_avx2_support()) {
+		state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_avx2;
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_avx2;
+		state->sbc_calc_scalefactors = sbc_calc_scalefactors_avx2;
+		state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_avx2;
+		state->implementation_info = "AVX2";
+	}
+}
+
+void sbc_init_dec_primitives_avx2(struct sbc_decoder_state *state)
+{
+	if (check_avx2_support()) {
+		state->sbc_synthesize_4s = sbc_synthesize_4s_avx2;
+		state->sbc_synthesize_8s = sbc_synthesize_8s_avx2;
+		state->implementation_info = "AVX2";
+	}
+}
+
+#endif
@@ -0,0 +1,843 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_sse2.h"
+
+/*
+ * SSE2 optimizations
+ */
+
+#ifdef SBC_BUILD_WITH_SSE2_SUPPORT
+
+static inline void sbc_analyze_four_sse2(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%[in]), %%xmm0\n"
+		"movdqu    16(%[in]), %%xmm1\n"
+		"movdqu    32(%[in]), %%xmm2\n"
+		"movdqu    48(%[in]), %%xmm3\n"
+		"movdqu    64(%[in]), %%xmm4\n"
+		"pmaddwd     (%[consts]), %%xmm0\n"
+		"pmaddwd   16(%[consts]), %%xmm1\n"
+		"pmaddwd   32(%[consts]), %%xmm2\n"
+		"pmaddwd   48(%[consts]), %%xmm3\n"
+		"pmaddwd   64(%[consts]), %%xmm4\n"
+		"paddd       (%[round]), %%xmm0\n"
+		"paddd       %%xmm1, %%xmm0\n"
+		"paddd       %%xmm3, %%xmm2\n"
+		"paddd       %%xmm4, %%xmm0\n"
+		"paddd       %%xmm2, %%xmm0\n"
+		"\n"
+		"psrad     %[shift], %%xmm0\n"
+		"packssdw    %%xmm0, %%xmm0\n"
+		"\n"
+		"pshufd       $0x00, %%xmm0, %%xmm1\n"
+		"pshufd       $0x55, %%xmm0, %%xmm0\n"
+		"pmaddwd   80(%[consts]), %%xmm1\n"
+		"pmaddwd   96(%[consts]), %%xmm0\n"
+		"paddd       %%xmm1, %%xmm0\n"
+		"\n"
+		"movdqa      %%xmm0, (%[out])\n"
+		:
+		: [in] "r" (in), [consts] "r" (consts), [round] "r" (&round_c),
+		  [out] "r" (out), [shift] "i" (SBC_PROTO_FIXED4_SCALE)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "cc", "memory");
+}
+
+static inline void sbc_analyze_eight_sse2(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%[in]), %%xmm0\n"
+		"movdqu    16(%[in]), %%xmm1\n"
+		"movdqu    32(%[in]), %%xmm2\n"
+		"movdqu    48(%[in]), %%xmm3\n"
+		"pmaddwd     (%[consts]), %%xmm0\n"
+		"pmaddwd   16(%[consts]), %%xmm1\n"
+		"pmaddwd   32(%[consts]), %%xmm2\n"
+		"pmaddwd   48(%[consts]), %%xmm3\n"
+		"paddd       (%[round]), %%xmm0\n"
+		"paddd       (%[round]), %%xmm1\n"
+		"paddd       %%xmm2, %%xmm0\n"
+		"paddd       %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    64(%[in]), %%xmm2\n"
+		"movdqu    80(%[in]), %%xmm3\n"
+		"movdqu    96(%[in]), %%xmm4\n"
+		"movdqu   112(%[in]), %%xmm5\n"
+		"pmaddwd   64(%[consts]), %%xmm2\n"
+		"pmaddwd   80(%[consts]), %%xmm3\n"
+		"pmaddwd   96(%[consts]), %%xmm4\n"
+		"pmaddwd  112(%[consts]), %%xmm5\n"
+		"paddd       %%xmm2, %%xmm0\n"
+		"paddd       %%xmm3, %%xmm1\n"
+		"paddd       %%xmm4, %%xmm0\n"
+		"paddd       %%xmm5, %%xmm1\n"
+		"\n"
+		"movdqu   128(%[in]), %%xmm2\n"
+		"movdqu   144(%[in]), %%xmm3\n"
+		"pmaddwd  128(%[consts]), %%xmm2\n"
+		"pmaddwd  144(%[consts]), %%xmm3\n"
+		"paddd       %%xmm2, %%xmm0\n"
+		"paddd       %%xmm3, %%xmm1\n"
+		"\n"
+		"psrad     %[shift], %%xmm0\n"
+		"psrad     %[shift], %%xmm1\n"
+		"packssdw    %%xmm1, %%xmm0\n"
+		"\n"
+		"pshufd       $0x00, %%xmm0, %%xmm2\n"
+		"pshufd       $0x55, %%xmm0, %%xmm4\n"
+		"movdqa      %%xmm2, %%xmm3\n"
+		"movdqa      %%xmm4, %%xmm5\n"
+		"pmaddwd  160(%[consts]), %%xmm2\n"
+		"pmaddwd  176(%[consts]), %%xmm3\n"
+		"pmaddwd  192(%[consts]), %%xmm4\n"
+		"pmaddwd  208(%[consts]), %%xmm5\n"
+		"paddd       %%xmm4, %%xmm2\n"
+		"paddd       %%xmm5, %%xmm3\n"
+		"\n"
+		"pshufd       $0xaa, %%xmm0, %%xmm4\n"
+		"pshufd       $0xff, %%xmm0, %%xmm0\n"
+		"movdqa      %%xmm4, %%xmm5\n"
+		"movdqa      %%xmm0, %%xmm1\n"
+		"pmaddwd  224(%[consts]), %%xmm4\n"
+		"pmaddwd  240(%[consts]), %%xmm5\n"
+		"pmaddwd  256(%[consts]), %%xmm0\n"
+		"pmaddwd  272(%[consts]), %%xmm1\n"
+		"paddd       %%xmm4, %%xmm2\n"
+		"paddd       %%xmm5, %%xmm3\n"
+		"paddd       %%xmm0, %%xmm2\n"
+		"paddd       %%xmm1, %%xmm3\n"
+		"\n"
+		"movdqa      %%xmm2, (%[out])\n"
+		"movdqa      %%xmm3, 16(%[out])\n"
+		:
+		: [in] "r" (in), [consts] "r" (consts), [round] "r" (&round_c),
+		  [out] "r" (out), [shift] "i" (SBC_PROTO_FIXED8_SCALE)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+		  "cc", "memory");
+}
+
+static inline void sbc_analyze_4b_4s_sse2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_four_sse2(x + 12, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 8, out, analysis_consts_fixed4_simd_even);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 4, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse2(x + 0, out, analysis_consts_fixed4_simd_even);
+}
+
+static inline void sbc_analyze_4b_8s_sse2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_sse2(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse2(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+/*
+ * Accumulate (abs(x) - 1) of the 4 values from 'src' into 'acc' with
+ * bitwise OR (zero values are skipped), the same as it is done in MMX code.
+ * Needs xmm7 to be set to zero and uses xmm6 as a temporary register.
+ */
+#define SF_ACCUMULATE(src, acc)					\
+	"movdqa      " src ", %%xmm6\n"				\
+	"pcmpgtd     %%xmm7, %%xmm6\n"				\
+	"paddd       " src ", %%xmm6\n"				\
+	"movdqa      %%xmm7, " src "\n"				\
+	"pcmpgtd     %%xmm6, " src "\n"				\
+	"pxor        " src ", %%xmm6\n"				\
+	"por         %%xmm6, " acc "\n"
+
+static void sbc_calc_scalefactors_sse2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	int ch, sb;
+	intptr_t blk;
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb += 4) {
+			blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]));
+			asm volatile (
+				"movdqa      (%[consts]), %%xmm0\n"
+				"pxor        %%xmm7, %%xmm7\n"
+			"1:\n"
+				"movdqa      (%[in], %[blk]), %%xmm1\n"
+				SF_ACCUMULATE("%%xmm1", "%%xmm0")
+
+				"sub         %[inc], %[blk]\n"
+				"jns         1b\n"
+
+				"movd        %%xmm0, %k[blk]\n"
+				"bsrl        %k[blk], %k[blk]\n"
+				"subl        %[c], %k[blk]\n"
+				"movl        %k[blk], (%[out])\n"
+				"psrldq        $4, %%xmm0\n"
+				"movd        %%xmm0, %k[blk]\n"
+				"bsrl        %k[blk], %k[blk]\n"
+				"subl        %[c], %k[blk]\n"
+				"movl        %k[blk], 4(%[out])\n"
+				"psrldq        $4, %%xmm0\n"
+				"movd        %%xmm0, %k[blk]\n"
+				"bsrl        %k[blk], %k[blk]\n"
+				"subl        %[c], %k[blk]\n"
+				"movl        %k[blk], 8(%[out])\n"
+				"psrldq        $4, %%xmm0\n"
+				"movd        %%xmm0, %k[blk]\n"
+				"bsrl        %k[blk], %k[blk]\n"
+				"subl        %[c], %k[blk]\n"
+				"movl        %k[blk], 12(%[out])\n"
+			: [blk] "+r" (blk)
+			: [in] "r" (&sb_sample_f[0][ch][sb]),
+			  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+			  [out] "r" (&scale_factor[ch][sb]),
+			  [consts] "r" (&consts),
+			  [c] "i" (SCALE_OUT_BITS)
+			: "xmm0", "xmm1", "xmm6", "xmm7", "cc", "memory");
+		}
+	}
+}
+
+static int sbc_calc_scalefactors_j_sse2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	/* scale factors bits for left, right, mid and side channels */
+	uint32_t SBC_ALIGNED x[4][4];
+	int32_t SBC_ALIGNED mask[4];
+	int sb, i, joint = 0;
+	intptr_t blk;
+
+	for (sb = 0; sb < subbands; sb += 4) {
+		blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		asm volatile (
+			"movdqa      (%[consts]), %%xmm0\n"
+			"movdqa      %%xmm0, %%xmm1\n"
+			"movdqa      %%xmm0, %%xmm2\n"
+			"movdqa      %%xmm0, %%xmm3\n"
+			"pxor        %%xmm7, %%xmm7\n"
+		"1:\n"
+			"movdqa      (%[in], %[blk]), %%xmm4\n"
+			"movdqa    32(%[in], %[blk]), %%xmm5\n"
+			"movdqa      %%xmm4, %%xmm8\n"
+			"movdqa      %%xmm5, %%xmm9\n"
+			"psrad         $1, %%xmm8\n"
+			"psrad         $1, %%xmm9\n"
+			"movdqa      %%xmm8, %%xmm10\n"
+			"paddd       %%xmm9, %%xmm8\n"
+			"psubd       %%xmm9, %%xmm10\n"
+			SF_ACCUMULATE("%%xmm4", "%%xmm0")
+			SF_ACCUMULATE("%%xmm5", "%%xmm1")
+			SF_ACCUMULATE("%%xmm8", "%%xmm2")
+			SF_ACCUMULATE("%%xmm10", "%%xmm3")
+
+			"sub         %[inc], %[blk]\n"
+			"jns         1b\n"
+
+			"movdqa      %%xmm0, (%[x])\n"
+			"movdqa      %%xmm1, 16(%[x])\n"
+			"movdqa      %%xmm2, 32(%[x])\n"
+			"movdqa      %%xmm3, 48(%[x])\n"
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][sb]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [x] "r" (x),
+		  [consts] "r" (&consts)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6",
+		  "xmm7", "xmm8", "xmm9", "xmm10", "cc", "memory");
+
+		for (i = 0; i < 4; i++) {
+			uint32_t l = (31 - SCALE_OUT_BITS) - __builtin_clz(x[0][i]);
+			uint32_t r = (31 - SCALE_OUT_BITS) - __builtin_clz(x[1][i]);
+			uint32_t m = (31 - SCALE_OUT_BITS) - __builtin_clz(x[2][i]);
+			uint32_t s = (31 - SCALE_OUT_BITS) - __builtin_clz(x[3][i]);
+
+			mask[i] = 0;
+			/* last subband does not use joint stereo */
+			if (sb + i < subbands - 1 && l + r > m + s) {
+				joint |= 1 << (subbands - 1 - (sb + i));
+				mask[i] = -1;
+				l = m;
+				r = s;
+			}
+			scale_factor[0][sb + i] = l;
+			scale_factor[1][sb + i] = r;
+		}
+
+		if (!(mask[0] | mask[1] | mask[2] | mask[3]))
+			continue;
+
+		/* replace left/right with mid/side for joint stereo subbands */
+		blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		asm volatile (
+			"movdqa      (%[mask]), %%xmm7\n"
+		"1:\n"
+			"movdqa      (%[in], %[blk]), %%xmm0\n"
+			"movdqa    32(%[in], %[blk]), %%xmm1\n"
+			"movdqa      %%xmm0, %%xmm2\n"
+			"movdqa      %%xmm1, %%xmm3\n"
+			"psrad         $1, %%xmm2\n"
+			"psrad         $1, %%xmm3\n"
+			"movdqa      %%xmm2, %%xmm4\n"
+			"paddd       %%xmm3, %%xmm2\n"
+			"psubd       %%xmm3, %%xmm4\n"
+			"pand        %%xmm7, %%xmm2\n"
+			"pand        %%xmm7, %%xmm4\n"
+			"movdqa      %%xmm7, %%xmm5\n"
+			"movdqa      %%xmm7, %%xmm6\n"
+			"pandn       %%xmm0, %%xmm5\n"
+			"pandn       %%xmm1, %%xmm6\n"
+			"por         %%xmm5, %%xmm2\n"
+			"por         %%xmm6, %%xmm4\n"
+			"movdqa      %%xmm2, (%[in], %[blk])\n"
+			"movdqa      %%xmm4, 32(%[in], %[blk])\n"
+
+			"sub         %[inc], %[blk]\n"
+			"jns         1b\n"
+		: [blk] "+r" (blk)
+		: [in] "r" (&sb_sample_f[0][0][sb]),
+		  [inc] "i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+		  [mask] "r" (mask)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6",
+		  "xmm7", "cc", "memory");
+	}
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+/*
+ * Input samples deinterleaving and reordering. The samples are loaded
+ * from 'pcm' into xmm0..xmm3 (8 samples per register for each channel)
+ * and converted to the order expected by the analysis filter with
+ * 'pshuflw'/'pshufd' + 'punpcklwd' sequences. SSE2 has no generic
+ * shuffle instruction, so the only sample which does not fit into
+ * this scheme is moved between registers with 'pextrw'/'pinsrw'.
+ */
+
+/* swap bytes in each 16-bit element of 'reg' */
+#define PCM_BSWAP(reg)							\
+	"movdqa      " reg ", %%xmm7\n"				\
+	"psrlw         $8, " reg "\n"				\
+	"psllw         $8, %%xmm7\n"				\
+	"por         %%xmm7, " reg "\n"
+
+/* split interleaved stereo samples: lo <- left, hi <- right */
+#define PCM_DEINTERLEAVE(lo, hi)					\
+	"movdqa      " lo ", %%xmm6\n"				\
+	"movdqa      " hi ", %%xmm7\n"				\
+	"pslld        $16, " lo "\n"				\
+	"pslld        $16, " hi "\n"				\
+	"psrad        $16, " lo "\n"				\
+	"psrad        $16, " hi "\n"				\
+	"packssdw    " hi ", " lo "\n"				\
+	"psrad        $16, %%xmm6\n"				\
+	"psrad        $16, %%xmm7\n"				\
+	"packssdw    %%xmm7, %%xmm6\n"				\
+	"movdqa      %%xmm6, " hi "\n"
+
+/* x[0..7] = { 7, 3, 6, 4, 0, 2, 1, 5 } */
+#define PCM_REORDER_4S(reg)						\
+	"pshufd       $0x03, " reg ", %%xmm6\n"			\
+	"pshufd       $0x09, " reg ", " reg "\n"			\
+	"pshuflw      $0xe1, %%xmm6, %%xmm6\n"			\
+	"pshuflw      $0xc9, " reg ", " reg "\n"			\
+	"punpcklwd   " reg ", %%xmm6\n"				\
+	"movdqa      %%xmm6, " reg "\n"
+
+/*
+ * a = samples 0..7, b = samples 8..15, result:
+ * a[0..7] = { 15, 7, 14, 8, 13, 9, 12, 10 }
+ * b[0..7] = { 11, 3, 6, 0, 5, 1, 4, 2 }
+ */
+#define PCM_REORDER_8S(a, b)						\
+	"pextrw        $7, " a ", %%eax\n"				\
+	"pextrw        $3, " b ", %%edx\n"				\
+	"pshufd       $0x0b, " b ", %%xmm6\n"			\
+	"pshufd       $0x0b, " a ", %%xmm7\n"			\
+	"pshuflw      $0xb1, %%xmm6, %%xmm6\n"			\
+	"pshuflw      $0xb1, %%xmm7, %%xmm7\n"			\
+	"pshuflw      $0x93, " b ", " b "\n"			\
+	"pshuflw      $0x93, " a ", " a "\n"			\
+	"punpcklwd   " b ", %%xmm6\n"				\
+	"punpcklwd   " a ", %%xmm7\n"				\
+	"pinsrw        $1, %%eax, %%xmm6\n"			\
+	"pinsrw        $0, %%edx, %%xmm7\n"			\
+	"movdqa      %%xmm6, " a "\n"				\
+	"movdqa      %%xmm7, " b "\n"
+
+static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s4_sse2(
+	int position,
+	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+	int nsamples, int nchannels, int big_endian)
+{
+	/* handle X buffer wraparound */
+	if (position < nsamples) {
+		if (nchannels > 0)
+			memcpy(&X[0][SBC_X_BUFFER_SIZE - 40], &X[0][position],
+							36 * sizeof(int16_t));
+		if (nchannels > 1)
+			memcpy(&X[1][SBC_X_BUFFER_SIZE - 40], &X[1][position],
+							36 * sizeof(int16_t));
+		position = SBC_X_BUFFER_SIZE - 40;
+	}
+
+	/* copy/permutate audio samples */
+	while ((nsamples -= 8) >= 0) {
+		position -= 8;
+		if (nchannels > 1) {
+			asm volatile (
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"movdqu    16(%[pcm]), %%xmm1\n"
+				"test        %[be], %[be]\n"
+				"jz          1f\n"
+				PCM_BSWAP("%%xmm0")
+				PCM_BSWAP("%%xmm1")
+			"1:\n"
+				PCM_DEINTERLEAVE("%%xmm0", "%%xmm1")
+				PCM_REORDER_4S("%%xmm0")
+				PCM_REORDER_4S("%%xmm1")
+				"movdqa      %%xmm0, (%[x0])\n"
+				"movdqa      %%xmm1, (%[x1])\n"
+				:
+				: [pcm] "r" (pcm), [be] "r" (big_endian),
+				  [x0] "r" (&X[0][position]),
+				  [x1] "r" (&X[1][position])
+				: "xmm0", "xmm1", "xmm6", "xmm7",
+				  "cc", "memory");
+		} else {
+			asm volatile (
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"test        %[be], %[be]\n"
+				"jz          1f\n"
+				PCM_BSWAP("%%xmm0")
+			"1:\n"
+				PCM_REORDER_4S("%%xmm0")
+				"movdqa      %%xmm0, (%[x0])\n"
+				:
+				: [pcm] "r" (pcm), [be] "r" (big_endian),
+				  [x0] "r" (&X[0][position])
+				: "xmm0", "xmm6", "xmm7", "cc", "memory");
+		}
+		pcm += 16 * nchannels;
+	}
+
+	return position;
+}
+
+static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_sse2(
+	int position,
+	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+	int nsamples, int nchannels, int big_endian)
+{
+	/* handle X buffer wraparound */
+	if (position < nsamples) {
+		if (nchannels > 0)
+			memcpy(&X[0][SBC_X_BUFFER_SIZE - 72], &X[0][position],
+							72 * sizeof(int16_t));
+		if (nchannels > 1)
+			memcpy(&X[1][SBC_X_BUFFER_SIZE - 72], &X[1][position],
+							72 * sizeof(int16_t));
+		position = SBC_X_BUFFER_SIZE - 72;
+	}
+
+	/* copy/permutate audio samples */
+	while ((nsamples -= 16) >= 0) {
+		position -= 16;
+		if (nchannels > 1) {
+			asm volatile (
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"movdqu    16(%[pcm]), %%xmm1\n"
+				"movdqu    32(%[pcm]), %%xmm2\n"
+				"movdqu    48(%[pcm]), %%xmm3\n"
+				"test        %[be], %[be]\n"
+				"jz          1f\n"
+				PCM_BSWAP("%%xmm0")
+				PCM_BSWAP("%%xmm1")
+				PCM_BSWAP("%%xmm2")
+				PCM_BSWAP("%%xmm3")
+			"1:\n"
+				PCM_DEINTERLEAVE("%%xmm0", "%%xmm1")
+				PCM_DEINTERLEAVE("%%xmm2", "%%xmm3")
+				PCM_REORDER_8S("%%xmm0", "%%xmm2")
+				PCM_REORDER_8S("%%xmm1", "%%xmm3")
+				"movdqa      %%xmm0, (%[x0])\n"
+				"movdqa      %%xmm2, 16(%[x0])\n"
+				"movdqa      %%xmm1, (%[x1])\n"
+				"movdqa      %%xmm3, 16(%[x1])\n"
+				:
+				: [pcm] "r" (pcm), [be] "r" (big_endian),
+				  [x0] "r" (&X[0][position]),
+				  [x1] "r" (&X[1][position])
+				: "eax", "edx", "xmm0", "xmm1", "xmm2", "xmm3",
+				  "xmm6", "xmm7", "cc", "memory");
+		} else {
+			asm volatile (
+				"movdqu      (%[pcm]), %%xmm0\n"
+				"movdqu    16(%[pcm]), %%xmm2\n"
+				"test        %[be], %[be]\n"
+				"jz          1f\n"
+				PCM_BSWAP("%%xmm0")
+				PCM_BSWAP("%%xmm2")
+			"1:\n"
+				PCM_REORDER_8S("%%xmm0", "%%xmm2")
+				"movdqa      %%xmm0, (%[x0])\n"
+				"movdqa      %%xmm2, 16(%[x0])\n"
+				:
+				: [pcm] "r" (pcm), [be] "r" (big_endian),
+				  [x0] "r" (&X[0][position])
+				: "eax", "edx", "xmm0", "xmm2", "xmm6",
+				  "xmm7", "cc", "memory");
+		}
+		pcm += 32 * nchannels;
+	}
+
+	return position;
+}
+
+static int sbc_enc_process_input_4s_le_sse2(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s4_sse2(
+			position, pcm, X, nsamples, 2, 0);
+	else
+		return sbc_encoder_process_input_s4_sse2(
+			position, pcm, X, nsamples, 1, 0);
+}
+
+static int sbc_enc_process_input_4s_be_sse2(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s4_sse2(
+			position, pcm, X, nsamples, 2, 1);
+	else
+		return sbc_encoder_process_input_s4_sse2(
+			position, pcm, X, nsamples, 1, 1);
+}
+
+static int sbc_enc_process_input_8s_le_sse2(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s8_sse2(
+			position, pcm, X, nsamples, 2, 0);
+	else
+		return sbc_encoder_process_input_s8_sse2(
+			position, pcm, X, nsamples, 1, 0);
+}
+
+static int sbc_enc_process_input_8s_be_sse2(int position,
+		const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+		int nsamples, int nchannels)
+{
+	if (nchannels > 1)
+		return sbc_encoder_process_input_s8_sse2(
+			position, pcm, X, nsamples, 2, 1);
+	else
+		return sbc_encoder_process_input_s8_sse2(
+			position, pcm, X, nsamples, 1, 1);
+}
+
+/*
+ * SSE2 has no instruction for 32x32->32 bit multiplication, so 'pmuludq'
+ * is used for even and odd lanes separately. Only the lower halves of
+ * the 64-bit products are relevant, and they are the same for signed and
+ * unsigned multiplication. So the results are bit exact with the C code,
+ * which relies on int32_t wraparound.
+ *
+ * Multiply 4 int32_t values from memory by the broadcasted value in
+ * xmm4 and accumulate the even/odd products in 'acc_e' and 'acc_o'
+ */
+#define SYN_MATRIX_MUL(consts, acc_e, acc_o)			\
+	"movdqa   " consts ", %%xmm5\n"				\
+	"movdqa      %%xmm5, %%xmm6\n"				\
+	"psrlq          $32, %%xmm6\n"				\
+	"pmuludq     %%xmm4, %%xmm5\n"				\
+	"pmuludq     %%xmm4, %%xmm6\n"				\
+	"paddd       %%xmm5, " acc_e "\n"			\
+	"paddd       %%xmm6, " acc_o "\n"
+
+/* Multiply 8 values by one subband sample for 'sbc_synthesize_*_sse2' */
+#define SYN_MATRIX_STEP(s, stride)					\
+	"movd     " #s "*4(%[sb]), %%xmm4\n"				\
+	"pshufd       $0x00, %%xmm4, %%xmm4\n"				\
+	SYN_MATRIX_MUL(#s "*" #stride "(%[consts])", "%%xmm0", "%%xmm1")\
+	SYN_MATRIX_MUL(#s "*" #stride "+16(%[consts])", "%%xmm2", "%%xmm3")
+
+/* Multiply 4 values from the history buffer by 4 window coefficients */
+#define SYN_WINDOW_MUL(w, consts, acc_e, acc_o)			\
+	"movdqa   " w ", %%xmm4\n"				\
+	"movdqa   " consts ", %%xmm5\n"				\
+	"movdqa      %%xmm4, %%xmm6\n"				\
+	"movdqa      %%xmm5, %%xmm7\n"				\
+	"psrlq          $32, %%xmm6\n"				\
+	"psrlq          $32, %%xmm7\n"				\
+	"pmuludq     %%xmm5, %%xmm4\n"				\
+	"pmuludq     %%xmm7, %%xmm6\n"				\
+	"paddd       %%xmm4, " acc_e "\n"			\
+	"paddd       %%xmm6, " acc_o "\n"
+
+/* Merge even and odd lanes back: acc_e = { e0, o0, e2, o2 } */
+#define SYN_MERGE(acc_e, acc_o)					\
+	"pshufd       $0x88, " acc_e ", " acc_e "\n"		\
+	"pshufd       $0x88, " acc_o ", " acc_o "\n"		\
+	"punpckldq  " acc_o ", " acc_e "\n"
+
+#define SYN_WINDOW_STEP_4(t, off)					\
+	SYN_WINDOW_MUL(#t "*64+" #off "(%[w])", #t "*16(%[consts])",	\
+			"%%xmm0", "%%xmm1")
+
+#define SYN_WINDOW_STEP_8(t, off)					\
+	SYN_WINDOW_MUL(#t "*64+" #off "(%[w])", #t "*32(%[consts])",	\
+			"%%xmm0", "%%xmm1")				\
+	SYN_WINDOW_MUL(#t "*64+" #off "+16(%[w])",			\
+			#t "*32+16(%[consts])", "%%xmm2", "%%xmm3")
+
+static inline void sbc_synthesis_matrix_sse2(const int32_t *sb,
+				int32_t *w, const int32_t *consts, int n)
+{
+	/* 8 matrixed values, both the copies in the ring buffer */
+	if (n == 4) {
+		asm volatile (
+			"pxor        %%xmm0, %%xmm0\n"
+			"pxor        %%xmm1, %%xmm1\n"
+			"pxor        %%xmm2, %%xmm2\n"
+			"pxor        %%xmm3, %%xmm3\n"
+			SYN_MATRIX_STEP(0, 32)
+			SYN_MATRIX_STEP(1, 32)
+			SYN_MATRIX_STEP(2, 32)
+			SYN_MATRIX_STEP(3, 32)
+			SYN_MERGE("%%xmm0", "%%xmm1")
+			SYN_MERGE("%%xmm2", "%%xmm3")
+			"psrad           %[shift], %%xmm0\n"
+			"psrad           %[shift], %%xmm2\n"
+			"movdqa      %%xmm0, (%[w])\n"
+			"movdqa      %%xmm2, 16(%[w])\n"
+			"movdqa      %%xmm0, 640(%[w])\n"
+			"movdqa      %%xmm2, 656(%[w])\n"
+			:
+			: [sb] "r" (sb), [w] "r" (w), [consts] "r" (consts),
+			  [shift] "i" (SCALE4_STAGED1_BITS)
+			: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+			  "xmm6", "cc", "memory");
+	} else {
+		asm volatile (
+			"pxor        %%xmm0, %%xmm0\n"
+			"pxor        %%xmm1, %%xmm1\n"
+			"pxor        %%xmm2, %%xmm2\n"
+			"pxor        %%xmm3, %%xmm3\n"
+			SYN_MATRIX_STEP(0, 64)
+			SYN_MATRIX_STEP(1, 64)
+			SYN_MATRIX_STEP(2, 64)
+			SYN_MATRIX_STEP(3, 64)
+			SYN_MATRIX_STEP(4, 64)
+			SYN_MATRIX_STEP(5, 64)
+			SYN_MATRIX_STEP(6, 64)
+			SYN_MATRIX_STEP(7, 64)
+			SYN_MERGE("%%xmm0", "%%xmm1")
+			SYN_MERGE("%%xmm2", "%%xmm3")
+			"psrad           %[shift], %%xmm0\n"
+			"psrad           %[shift], %%xmm2\n"
+			"movdqa      %%xmm0, (%[w])\n"
+			"movdqa      %%xmm2, 16(%[w])\n"
+			"movdqa      %%xmm0, 640(%[w])\n"
+			"movdqa      %%xmm2, 656(%[w])\n"
+			:
+			: [sb] "r" (sb), [w] "r" (w), [consts] "r" (consts),
+			  [shift] "i" (SCALE8_STAGED1_BITS)
+			: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+			  "xmm6", "cc", "memory");
+	}
+}
+
+static inline void sbc_synthesize_four_sse2(const int32_t *sb,
+						int32_t *w, int16_t *out)
+{
+	sbc_synthesis_matrix_sse2(sb, w, synmatrix4_simd[0], 4);
+
+	asm volatile (
+		"pxor        %%xmm0, %%xmm0\n"
+		"pxor        %%xmm1, %%xmm1\n"
+		SYN_WINDOW_STEP_4(0, 0)
+		SYN_WINDOW_STEP_4(1, 16)
+		SYN_WINDOW_STEP_4(2, 0)
+		SYN_WINDOW_STEP_4(3, 16)
+		SYN_WINDOW_STEP_4(4, 0)
+		SYN_WINDOW_STEP_4(5, 16)
+		SYN_WINDOW_STEP_4(6, 0)
+		SYN_WINDOW_STEP_4(7, 16)
+		SYN_WINDOW_STEP_4(8, 0)
+		SYN_WINDOW_STEP_4(9, 16)
+		SYN_MERGE("%%xmm0", "%%xmm1")
+		"psrad           %[shift], %%xmm0\n"
+		"packssdw    %%xmm0, %%xmm0\n"
+		"movq        %%xmm0, (%[out])\n"
+		:
+		: [w] "r" (w), [consts] "r" (sbc_proto_4_40_simd),
+		  [out] "r" (out), [shift] "i" (SCALE4_STAGED1_BITS)
+		: "xmm0", "xmm1", "xmm4", "xmm5", "xmm6", "xmm7",
+		  "cc", "memory");
+}
+
+static inline void sbc_synthesize_eight_sse2(const int32_t *sb,
+						int32_t *w, int16_t *out)
+{
+	sbc_synthesis_matrix_sse2(sb, w, synmatrix8_simd[0], 8);
+	sbc_synthesis_matrix_sse2(sb, w + 8, synmatrix8_simd[0] + 8, 8);
+
+	asm volatile (
+		"pxor        %%xmm0, %%xmm0\n"
+		"pxor        %%xmm1, %%xmm1\n"
+		"pxor        %%xmm2, %%xmm2\n"
+		"pxor        %%xmm3, %%xmm3\n"
+		SYN_WINDOW_STEP_8(0, 0)
+		SYN_WINDOW_STEP_8(1, 32)
+		SYN_WINDOW_STEP_8(2, 0)
+		SYN_WINDOW_STEP_8(3, 32)
+		SYN_WINDOW_STEP_8(4, 0)
+		SYN_WINDOW_STEP_8(5, 32)
+		SYN_WINDOW_STEP_8(6, 0)
+		SYN_WINDOW_STEP_8(7, 32)
+		SYN_WINDOW_STEP_8(8, 0)
+		SYN_WINDOW_STEP_8(9, 32)
+		SYN_MERGE("%%xmm0", "%%xmm1")
+		SYN_MERGE("%%xmm2", "%%xmm3")
+		"psrad           %[shift], %%xmm0\n"
+		"psrad           %[shift], %%xmm2\n"
+		"packssdw    %%xmm2, %%xmm0\n"
+		"movdqu      %%xmm0, (%[out])\n"
+		:
+		: [w] "r" (w), [consts] "r" (sbc_proto_8_80_simd),
+		  [out] "r" (out), [shift] "i" (SCALE8_STAGED1_BITS)
+		: "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+		  "xmm6", "xmm7", "cc", "memory");
+}
+
+static void sbc_synthesize_4s_sse2(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk, pos = state->position[ch];
+
+	for (blk = 0; blk < blocks; blk++) {
+		pos = (pos == 0 ? 10 : pos) - 1;
+		sbc_synthesize_four_sse2(sb_sample[blk][ch],
+				state->W[ch][pos], pcm + blk * 4);
+	}
+
+	state->position[ch] = pos;
+}
+
+static void sbc_synthesize_8s_sse2(struct sbc_decoder_state *state, int ch,
+			int32_t sb_sample[16][2][8], int16_t *pcm, int blocks)
+{
+	int blk, pos = state->position[ch];
+
+	for (blk = 0; blk < blocks; blk++) {
+		pos = (pos == 0 ? 10 : pos) - 1;
+		sbc_synthesize_eight_sse2(sb_sample[blk][ch],
+				state->W[ch][pos], pcm + blk * 8);
+	}
+
+	state->position[ch] = pos;
+}
+
+void sbc_init_primitives_sse2(struct sbc_encoder_state *state)
+{
+	/* We assume that all 64-bit processors have SSE2 support */
+	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_sse2;
+	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_sse2;
+	state->sbc_enc_process_input_4s_le = sbc_enc_process_input_4s_le_sse2;
+	state->sbc_enc_process_input_4s_be = sbc_enc_process_input_4s_be_sse2;
+	state->sbc_enc_process_input_8s_le = sbc_enc_process_input_8s_le_sse2;
+	state->sbc_enc_process_input_8s_be = sbc_enc_process_input_8s_be_sse2;
+	state->sbc_calc_scalefactors = sbc_calc_scalefactors_sse2;
+	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_sse2;
+	state->implementation_info = "SSE2";
+}
+
+void sbc_init_dec_primitives_sse2(struct sbc_decoder_state *state)
+{
+	/* We assume that all 64-bit processors have SSE2 support */
+	state->sbc_synthesize_4s = sbc_synthesize_4s_sse2;
+	state->sbc_synthesize_8s = sbc_synthesize_8s_sse2;
+	state->implementation_info = "SSE2";
+}
+
+#endif
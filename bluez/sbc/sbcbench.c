@@ -0,0 +1,481 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The codec source is included directly, so that the frame packing and
+ * unpacking functions and the codec private state can be timed on their
+ * own. Only the primitives are taken from libsbc.
+ */
+#include "sbc.c"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+/* Number of frames kept in the input and output buffers */
+#define BENCH_FRAMES 64
+
+static unsigned int nframes = 1000;
+static int failed = 0;
+
+static uint8_t pcm[BENCH_FRAMES * 512];
+static uint8_t stream[BENCH_FRAMES * 1024];
+static uint8_t output[BENCH_FRAMES * 1024];
+
+static const struct {
+	uint8_t id;
+	int rate;
+} freqs[] = {
+	{ SBC_FREQ_16000, 16000 },
+	{ SBC_FREQ_32000, 32000 },
+	{ SBC_FREQ_44100, 44100 },
+	{ SBC_FREQ_48000, 48000 },
+};
+
+static const struct {
+	uint8_t id;
+	const char *name;
+} modes[] = {
+	{ SBC_MODE_MONO,		"MONO" },
+	{ SBC_MODE_DUAL_CHANNEL,	"DUAL" },
+	{ SBC_MODE_STEREO,		"STEREO" },
+	{ SBC_MODE_JOINT_STEREO,	"JOINT" },
+};
+
+static const int bitpools[] = { 2, 19, 35, 53 };
+
+static uint64_t get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Two tones with some noise, so that all the subbands are busy */
+static void generate_pcm(void)
+{
+	uint32_t seed = 1;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pcm) / 2; i++) {
+		int16_t s;
+
+		seed = seed * 1103515245 + 12345;
+		s = (int16_t) (((i * 37) & 0x3ff) * 24 - 12288 +
+				((i * 1013) & 0x7fff) / 4 +
+				(int16_t) (seed >> 16) / 8);
+		memcpy(&pcm[i * 2], &s, sizeof(s));
+	}
+}
+
+static void setup(sbc_t *sbc, int freq, int blocks, int subbands, int mode,
+							int bitpool)
+{
+	sbc_init(sbc, 0);
+	sbc->frequency = freq;
+	sbc->blocks = blocks;
+	sbc->subbands = subbands;
+	sbc->mode = mode;
+	sbc->bitpool = bitpool;
+	sbc->allocation = SBC_AM_LOUDNESS;
+}
+
+/*
+ * Initializes the encoder with implementation 'impl', returns -1 if there
+ * are no more implementations and 1 if it is not supported by the CPU
+ */
+static int setup_encoder(sbc_t *sbc, int impl)
+{
+	struct sbc_priv *priv = sbc->priv;
+	ssize_t written;
+	int err;
+
+	if (sbc_encode(sbc, pcm, sizeof(pcm), output, sizeof(output),
+							&written) <= 0)
+		return -1;
+
+	err = sbc_init_primitives_nth(&priv->enc_state, impl);
+	if (err != 0)
+		return err;
+
+	sbc_encoder_setup(sbc, priv);
+
+	return 0;
+}
+
+/* Same as setup_encoder() for the decoder */
+static int setup_decoder(sbc_t *sbc, const uint8_t *data, size_t len,
+								int impl)
+{
+	struct sbc_priv *priv = sbc->priv;
+	size_t written;
+
+	if (sbc_decode(sbc, data, len, output, sizeof(output), &written) <= 0)
+		return -1;
+
+	return sbc_init_dec_primitives_nth(&priv->dec_state, impl);
+}
+
+static void report(const char *impl, const char *test, sbc_t *sbc,
+					const char *config, uint64_t nsec)
+{
+	double per_frame = (double) nsec / nframes;
+	double duration = sbc_get_frame_duration(sbc) * 1000.0;
+
+	printf("%-10s %-20s %-28s %10.1f ns/frame %9.1fx\n", impl, test,
+				config, per_frame, duration / per_frame);
+}
+
+static void bench_primitives(int subbands)
+{
+	struct sbc_priv *priv, *dpriv;
+	int32_t SBC_ALIGNED sb_sample_f[16][2][8];
+	uint64_t start, copy;
+	const char *info;
+	ssize_t len = 0;
+	char config[32];
+	unsigned int i;
+	int impl, err, joint = 0;
+	sbc_t sbc, dsbc;
+
+	snprintf(config, sizeof(config), "48000 16 %d JOINT 53",
+						subbands ? 8 : 4);
+
+	/* frame packing is the same C code for all implementations */
+	setup(&sbc, SBC_FREQ_48000, SBC_BLK_16, subbands,
+					SBC_MODE_JOINT_STEREO, 53);
+	if (setup_encoder(&sbc, 0) < 0)
+		goto done;
+	priv = sbc.priv;
+
+	start = get_nsec();
+	for (i = 0; i < nframes; i++)
+		len = sbc_pack_frame(stream, &priv->frame, sizeof(stream),
+							joint, 0);
+	report("C", "pack", &sbc, config, get_nsec() - start);
+
+	start = get_nsec();
+	for (i = 0; i < nframes; i++)
+		len = sbc_pack_frame(stream, &priv->frame, sizeof(stream),
+					joint, SBC_FLAG_REFERENCE_BITSTREAM);
+	report("C", "pack (ref)", &sbc, config, get_nsec() - start);
+
+	sbc_init(&dsbc, 0);
+	if (setup_decoder(&dsbc, stream, len, 0) < 0) {
+		sbc_finish(&dsbc);
+		goto done;
+	}
+	dpriv = dsbc.priv;
+
+	start = get_nsec();
+	for (i = 0; i < nframes; i++)
+		sbc_unpack_frame(stream, &dpriv->frame, len, 0);
+	report("C", "unpack", &sbc, config, get_nsec() - start);
+
+	start = get_nsec();
+	for (i = 0; i < nframes; i++)
+		sbc_unpack_frame(stream, &dpriv->frame, len,
+					SBC_FLAG_REFERENCE_BITSTREAM);
+	report("C", "unpack (ref)", &sbc, config, get_nsec() - start);
+
+	sbc_finish(&dsbc);
+	sbc_finish(&sbc);
+
+	for (impl = 0; ; impl++) {
+		setup(&sbc, SBC_FREQ_48000, SBC_BLK_16, subbands,
+					SBC_MODE_JOINT_STEREO, 53);
+		err = setup_encoder(&sbc, impl);
+		if (err != 0) {
+			sbc_finish(&sbc);
+			if (err < 0)
+				break;
+			continue;
+		}
+		priv = sbc.priv;
+		info = priv->enc_state.implementation_info;
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++)
+			priv->enc_state.position = priv->enc_process_input(
+				priv->enc_state.position, pcm +
+				(i % BENCH_FRAMES) * priv->frame.codesize,
+				priv->enc_state.X,
+				priv->frame.subbands * priv->frame.blocks,
+				priv->frame.channels);
+		report(info, "process_input", &sbc, config,
+							get_nsec() - start);
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++)
+			sbc_analyze_audio(&priv->enc_state, &priv->frame);
+		report(info, subbands ? "analyze_4b_8s" : "analyze_4b_4s",
+					&sbc, config, get_nsec() - start);
+
+		/* joint stereo scale factors calculation modifies the
+		 * subband samples, the cost of restoring them is subtracted */
+		memcpy(sb_sample_f, priv->frame.sb_sample_f,
+						sizeof(sb_sample_f));
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++)
+			memcpy(priv->frame.sb_sample_f, sb_sample_f,
+						sizeof(sb_sample_f));
+		copy = get_nsec() - start;
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++)
+			priv->enc_state.sbc_calc_scalefactors(
+				priv->frame.sb_sample_f,
+				priv->frame.scale_factor,
+				priv->frame.blocks, priv->frame.channels,
+				priv->frame.subbands);
+		report(info, "calc_scalefactors", &sbc, config,
+							get_nsec() - start);
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++) {
+			memcpy(priv->frame.sb_sample_f, sb_sample_f,
+						sizeof(sb_sample_f));
+			joint = priv->enc_state.sbc_calc_scalefactors_j(
+				priv->frame.sb_sample_f,
+				priv->frame.scale_factor,
+				priv->frame.blocks, priv->frame.subbands);
+		}
+		start += copy;
+		report(info, "calc_scalefactors_j", &sbc, config,
+							get_nsec() - start);
+
+		sbc_finish(&sbc);
+	}
+
+	setup(&sbc, SBC_FREQ_48000, SBC_BLK_16, subbands,
+					SBC_MODE_JOINT_STEREO, 53);
+	if (sbc_encode(&sbc, pcm, sizeof(pcm), stream, sizeof(stream),
+							&len) <= 0)
+		goto done;
+
+	for (impl = 0; ; impl++) {
+		sbc_init(&dsbc, 0);
+		err = setup_decoder(&dsbc, stream, len, impl);
+		if (err != 0) {
+			sbc_finish(&dsbc);
+			if (err < 0)
+				break;
+			continue;
+		}
+		dpriv = dsbc.priv;
+		info = dpriv->dec_state.implementation_info;
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i++)
+			sbc_synthesize_audio(&dpriv->dec_state, &dpriv->frame);
+		report(info, subbands ? "synthesize_8s" : "synthesize_4s",
+					&sbc, config, get_nsec() - start);
+
+		sbc_finish(&dsbc);
+	}
+
+done:
+	sbc_finish(&sbc);
+}
+
+static void bench_codec(int freq, int blocks, int subbands, int mode,
+							int bitpool)
+{
+	struct sbc_priv *priv;
+	size_t codesize, frame_len, stream_len, dec_len;
+	uint64_t start;
+	const char *info;
+	ssize_t written;
+	char config[32];
+	unsigned int i, n;
+	int impl, err;
+	sbc_t sbc;
+
+	snprintf(config, sizeof(config), "%d %d %d %s %d", freqs[freq].rate,
+			4 + blocks * 4, subbands ? 8 : 4, modes[mode].name,
+			bitpool);
+
+	/* reference stream for the decoder */
+	setup(&sbc, freqs[freq].id, blocks, subbands, modes[mode].id, bitpool);
+	codesize = sbc_get_codesize(&sbc);
+	frame_len = sbc_get_frame_length(&sbc);
+	stream_len = sbc_encode_frames(&sbc, pcm, codesize * BENCH_FRAMES,
+					stream, sizeof(stream), &written);
+	sbc_finish(&sbc);
+	if ((ssize_t) stream_len <= 0)
+		return;
+
+	/* Callers size their buffers from sbc_get_frame_length() */
+	if ((size_t) written != frame_len * BENCH_FRAMES) {
+		fprintf(stderr, "%s: frame length %zu, encoded %zd bytes "
+				"for %d frames\n", config, frame_len,
+				written, BENCH_FRAMES);
+		failed = 1;
+		return;
+	}
+
+	stream_len = written;
+
+	for (impl = 0; ; impl++) {
+		setup(&sbc, freqs[freq].id, blocks, subbands,
+						modes[mode].id, bitpool);
+		err = setup_encoder(&sbc, impl);
+		if (err != 0) {
+			sbc_finish(&sbc);
+			if (err < 0)
+				break;
+			continue;
+		}
+		priv = sbc.priv;
+		info = priv->enc_state.implementation_info;
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i += n) {
+			n = nframes - i < BENCH_FRAMES ?
+					nframes - i : BENCH_FRAMES;
+			sbc_encode_frames(&sbc, pcm, n * codesize, output,
+						sizeof(output), &written);
+		}
+		report(info, "encode", &sbc, config, get_nsec() - start);
+
+		sbc_finish(&sbc);
+	}
+
+	for (impl = 0; ; impl++) {
+		sbc_init(&sbc, 0);
+		err = setup_decoder(&sbc, stream, stream_len, impl);
+		if (err != 0) {
+			sbc_finish(&sbc);
+			if (err < 0)
+				break;
+			continue;
+		}
+		priv = sbc.priv;
+		info = priv->dec_state.implementation_info;
+
+		start = get_nsec();
+		for (i = 0; i < nframes; i += n) {
+			n = nframes - i < BENCH_FRAMES ?
+					nframes - i : BENCH_FRAMES;
+			sbc_decode_frames(&sbc, stream, n * frame_len, output,
+						sizeof(output), &dec_len);
+		}
+		report(info, "decode", &sbc, config, get_nsec() - start);
+
+		sbc_finish(&sbc);
+	}
+}
+
+static void usage(void)
+{
+	printf("SBC benchmark utility ver %s\n", VERSION);
+	printf("Copyright (c) 2004-2010  Marcel Holtmann\n\n");
+
+	printf("Usage:\n"
+		"\tsbcbench [options]\n"
+		"\n");
+
+	printf("Options:\n"
+		"\t-h, --help           Display help\n"
+		"\t-n, --frames <num>   Number of frames per test (default 1000)\n"
+		"\t-p, --primitives     Only time the codec primitives\n"
+		"\t-c, --codec          Only time full encoding and decoding\n"
+		"\n");
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "frames",	1, 0, 'n' },
+	{ "primitives",	0, 0, 'p' },
+	{ "codec",	0, 0, 'c' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	int opt, primitives = 1, codec = 1;
+	int freq, blocks, subbands, mode, bitpool;
+
+	while ((opt = getopt_long(argc, argv, "+hn:pc",
+						main_options, NULL)) != -1) {
+		switch(opt) {
+		case 'h':
+			usage();
+			exit(0);
+
+		case 'n':
+			nframes = atoi(optarg);
+			if (nframes == 0) {
+				fprintf(stderr, "Invalid number of frames\n");
+				exit(1);
+			}
+			break;
+
+		case 'p':
+			codec = 0;
+			break;
+
+		case 'c':
+			primitives = 0;
+			break;
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	generate_pcm();
+
+	printf("%-10s %-20s %-28s %19s %10s\n", "IMPL", "TEST",
+		"RATE BLOCKS SUBBANDS MODE BP", "TIME", "REALTIME");
+
+	if (primitives) {
+		bench_primitives(SBC_SB_4);
+		bench_primitives(SBC_SB_8);
+	}
+
+	if (!codec)
+		return 0;
+
+	for (freq = 0; freq < 4; freq++)
+	for (blocks = SBC_BLK_4; blocks <= SBC_BLK_16; blocks++)
+	for (subbands = SBC_SB_4; subbands <= SBC_SB_8; subbands++)
+	for (mode = 0; mode < 4; mode++)
+	for (bitpool = 0; bitpool < 4; bitpool++) {
+		int max = (subbands ? 8 : 4) *
+			(modes[mode].id == SBC_MODE_MONO ||
+			modes[mode].id == SBC_MODE_DUAL_CHANNEL ? 16 : 32);
+
+		if (bitpools[bitpool] > max)
+			continue;
+
+		bench_codec(freq, blocks, subbands, mode, bitpools[bitpool]);
+	}
+
+	return failed;
+}
@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/soundcard.h>
@@ -43,6 +44,165 @@
 #define BUF_SIZE 8192
 
 static int verbose = 0;
+static unsigned long flags = 0;
+static int threads = 1;
+
+struct segment {
+	pthread_t thread;
+	const unsigned char *stream;
+	size_t warmup;
+	size_t len;
+	unsigned char *output;
+	size_t output_size;
+	ssize_t decoded;
+};
+
+static void *decode_segment(void *user_data)
+{
+	struct segment *seg = user_data;
+	ssize_t consumed;
+	size_t len;
+	sbc_t sbc;
+
+	seg->decoded = -1;
+
+	sbc_init(&sbc, flags);
+	sbc.endian = SBC_BE;
+
+	/* Decode the frames preceding the segment first to get the same
+	 * synthesis filter history as a sequential decoder would have,
+	 * the audio decoded from them is thrown away */
+	if (seg->warmup > 0) {
+		consumed = sbc_decode_frames(&sbc, seg->stream, seg->warmup,
+					seg->output, seg->output_size, &len);
+		if (consumed != (ssize_t) seg->warmup)
+			goto done;
+	}
+
+	consumed = sbc_decode_frames(&sbc, seg->stream + seg->warmup,
+				seg->len, seg->output, seg->output_size, &len);
+	if (consumed == (ssize_t) seg->len)
+		seg->decoded = len;
+
+done:
+	sbc_finish(&sbc);
+
+	return NULL;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, buf, len);
+		if (written <= 0)
+			return -1;
+
+		buf += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/*
+ * Decodes the whole stream split into segments with one thread per
+ * segment. The synthesis filter only depends on the last 10 blocks of
+ * subband samples, so starting every segment that many blocks early makes
+ * the spliced output identical to sequential decoding.
+ */
+static void decode_threaded(sbc_t *sbc, const unsigned char *stream,
+						int streamlen, int ad)
+{
+	struct segment *segs;
+	unsigned int *offsets = NULL, *tmp;
+	unsigned int nframes = 0, alloc = 0, per_thread, warmup;
+	unsigned int start, i, n;
+	size_t codesize = sbc_get_codesize(sbc);
+	ssize_t framelen;
+	int pos = 0;
+	sbc_t parser;
+
+	/* find the frame boundaries */
+	sbc_init(&parser, flags);
+
+	while (1) {
+		if (nframes == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			tmp = realloc(offsets, (alloc + 1) * sizeof(*offsets));
+			if (!tmp) {
+				perror("Can't allocate memory");
+				goto done;
+			}
+			offsets = tmp;
+		}
+
+		offsets[nframes] = pos;
+
+		framelen = sbc_parse(&parser, stream + pos, streamlen - pos);
+		if (framelen <= 0)
+			break;
+
+		pos += framelen;
+		nframes++;
+	}
+
+	warmup = (10 + (4 + sbc->blocks * 4) - 1) / (4 + sbc->blocks * 4);
+	per_thread = (nframes + threads - 1) / threads;
+
+	segs = calloc(threads, sizeof(*segs));
+	if (!segs) {
+		perror("Can't allocate memory");
+		goto done;
+	}
+
+	for (i = 0, start = 0; i < (unsigned int) threads &&
+					start < nframes; i++) {
+		struct segment *seg = &segs[i];
+		unsigned int w = start < warmup ? start : warmup;
+
+		n = nframes - start < per_thread ? nframes - start : per_thread;
+
+		seg->stream = stream + offsets[start - w];
+		seg->warmup = offsets[start] - offsets[start - w];
+		seg->len = offsets[start + n] - offsets[start];
+		seg->output_size = (n > w ? n : w) * codesize;
+		seg->output = malloc(seg->output_size);
+		if (!seg->output ||
+				pthread_create(&seg->thread, NULL,
+						decode_segment, seg) != 0) {
+			perror("Can't start decoder thread");
+			free(seg->output);
+			break;
+		}
+
+		start += n;
+	}
+
+	n = i;
+
+	/* splice the decoded segments in order */
+	for (i = 0; i < n; i++) {
+		struct segment *seg = &segs[i];
+
+		pthread_join(seg->thread, NULL);
+
+		if (seg->decoded < 0)
+			fprintf(stderr, "sbc_decode_frames fail in segment %u\n",
+									i);
+		else if (write_all(ad, seg->output, seg->decoded) < 0)
+			perror("Can't write decoded audio");
+
+		free(seg->output);
+	}
+
+	free(segs);
+
+done:
+	sbc_finish(&parser);
+	free(offsets);
+}
 
 static void decode(char *filename, char *output, int tofile)
 {
@@ -98,7 +258,7 @@ static void decode(char *filename, char *output, int tofile)
 		goto free;
 	}
 
-	sbc_init(&sbc, 0L);
+	sbc_init(&sbc, flags);
 	sbc.endian = SBC_BE;
 
 	framelen = sbc_decode(&sbc, stream, streamlen, buf, sizeof(buf), &len);
@@ -168,6 +328,11 @@ static void decode(char *filename, char *output, int tofile)
 		}
 	}
 
+	if (threads > 1) {
+		decode_threaded(&sbc, stream, streamlen, ad);
+		goto close;
+	}
+
 	count = len;
 
 	while (framelen > 0) {
@@ -231,6 +396,8 @@ static void usage(void)
 		"\t-v, --verbose        Verbose mode\n"
 		"\t-d, --device <dsp>   Sound device\n"
 		"\t-f, --file <file>    Decode to a file\n"
+		"\t-r, --reference      Use reference bitstream unpacking\n"
+		"\t-t, --threads <num>  Decode in parallel with <num> threads\n"
 		"\n");
 }
 
@@ -239,6 +406,8 @@ static struct option main_options[] = {
 	{ "device",	1, 0, 'd' },
 	{ "verbose",	0, 0, 'v' },
 	{ "file",	1, 0, 'f' },
+	{ "reference",	0, 0, 'r' },
+	{ "threads",	1, 0, 't' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -247,7 +416,7 @@ int main(int argc, char *argv[])
 	char *output = NULL;
 	int i, opt, tofile = 0;
 
-	while ((opt = getopt_long(argc, argv, "+hvd:f:",
+	while ((opt = getopt_long(argc, argv, "+hvd:f:rt:",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -270,6 +439,18 @@ int main(int argc, char *argv[])
 			tofile = 1;
 			break;
 
+		case 'r':
+			flags |= SBC_FLAG_REFERENCE_BITSTREAM;
+			break;
+
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				fprintf(stderr, "Invalid number of threads\n");
+				exit(1);
+			}
+			break;
+
 		default:
 			exit(1);
 		}
@@ -34,16 +34,169 @@
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "sbc.h"
 #include "formats.h"
 
 static int verbose = 0;
+static unsigned long flags = 0;
+static int threads = 1;
 
 #define BUF_SIZE 32768
 static unsigned char input[BUF_SIZE], output[BUF_SIZE + BUF_SIZE / 4];
 
+struct segment {
+	pthread_t thread;
+	sbc_t sbc;
+	const unsigned char *input;
+	size_t warmup;
+	size_t len;
+	unsigned char *output;
+	size_t output_size;
+	ssize_t encoded;
+};
+
+static void *encode_segment(void *user_data)
+{
+	struct segment *seg = user_data;
+	ssize_t len;
+
+	seg->encoded = -1;
+
+	/* Run the input preceding the segment through the encoder to get
+	 * the same analysis filter history as a sequential encoder would
+	 * have, the frames encoded from it are thrown away */
+	if (seg->warmup > 0) {
+		len = sbc_encode_frames(&seg->sbc, seg->input, seg->warmup,
+					seg->output, seg->output_size,
+					&seg->encoded);
+		if (len != (ssize_t) seg->warmup)
+			return NULL;
+	}
+
+	len = sbc_encode_frames(&seg->sbc, seg->input + seg->warmup, seg->len,
+				seg->output, seg->output_size, &seg->encoded);
+	if (len != (ssize_t) seg->len)
+		seg->encoded = -1;
+
+	return NULL;
+}
+
+/*
+ * Encodes the whole input split into segments with one thread per
+ * segment. The analysis filter only looks at the last 10 blocks of input
+ * samples, the rest of the SBC_X_BUFFER_SIZE history buffer is there to
+ * make buffer wraparound cheap, so starting every segment that many
+ * blocks early makes the spliced output identical to sequential encoding.
+ */
+static void encode_threaded(sbc_t *sbc, int fd)
+{
+	struct segment *segs;
+	unsigned char *data = NULL;
+	size_t size = 0, alloc = 0, codesize, frame_length;
+	unsigned int nframes, per_thread, warmup, start, i, n;
+	ssize_t len;
+
+	/* read the whole input */
+	while (1) {
+		if (size == alloc) {
+			unsigned char *tmp;
+
+			alloc = alloc ? alloc * 2 : BUF_SIZE;
+			tmp = realloc(data, alloc);
+			if (!tmp) {
+				perror("Can't allocate memory");
+				goto done;
+			}
+			data = tmp;
+		}
+
+		len = read(fd, data + size, alloc - size);
+		if (len < 0) {
+			perror("Can't read audio data");
+			goto done;
+		}
+		if (len == 0)
+			break;
+
+		size += len;
+	}
+
+	codesize = sbc_get_codesize(sbc);
+	frame_length = sbc_get_frame_length(sbc);
+	nframes = size / codesize;
+	warmup = (10 + (4 + sbc->blocks * 4) - 1) / (4 + sbc->blocks * 4);
+	per_thread = (nframes + threads - 1) / threads;
+
+	segs = calloc(threads, sizeof(*segs));
+	if (!segs) {
+		perror("Can't allocate memory");
+		goto done;
+	}
+
+	for (i = 0, start = 0; i < (unsigned int) threads &&
+					start < nframes; i++) {
+		struct segment *seg = &segs[i];
+		unsigned int w = start < warmup ? start : warmup;
+
+		n = nframes - start < per_thread ? nframes - start : per_thread;
+
+		sbc_init(&seg->sbc, flags);
+		seg->sbc.frequency = sbc->frequency;
+		seg->sbc.blocks = sbc->blocks;
+		seg->sbc.subbands = sbc->subbands;
+		seg->sbc.mode = sbc->mode;
+		seg->sbc.allocation = sbc->allocation;
+		seg->sbc.bitpool = sbc->bitpool;
+		seg->sbc.endian = sbc->endian;
+
+		seg->input = data + (start - w) * codesize;
+		seg->warmup = w * codesize;
+		seg->len = n * codesize;
+		seg->output_size = (n > w ? n : w) * frame_length;
+		seg->output = malloc(seg->output_size);
+		if (!seg->output ||
+				pthread_create(&seg->thread, NULL,
+						encode_segment, seg) != 0) {
+			perror("Can't start encoder thread");
+			sbc_finish(&seg->sbc);
+			free(seg->output);
+			break;
+		}
+
+		start += n;
+	}
+
+	n = i;
+
+	/* splice the encoded segments in order */
+	for (i = 0; i < n; i++) {
+		struct segment *seg = &segs[i];
+
+		pthread_join(seg->thread, NULL);
+
+		/* Segment buffers are sized from sbc_get_frame_length(),
+		 * so any other output size means the two disagree */
+		if (seg->encoded < 0 || (size_t) seg->encoded !=
+					seg->len / codesize * frame_length)
+			fprintf(stderr, "sbc_encode_frames fail in segment %u\n",
+									i);
+		else if (write(fileno(stdout), seg->output, seg->encoded) !=
+							seg->encoded)
+			perror("Can't write SBC output");
+
+		sbc_finish(&seg->sbc);
+		free(seg->output);
+	}
+
+	free(segs);
+
+done:
+	free(data);
+}
+
 static void encode(char *filename, int subbands, int bitpool, int joint,
 					int dualchannel, int snr, int blocks)
 {
@@ -87,7 +240,7 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 		goto done;
 	}
 
-	sbc_init(&sbc, 0L);
+	sbc_init(&sbc, flags);
 
 	switch (BE_INT(au_hdr.sample_rate)) {
 	case 16000:
@@ -149,6 +302,11 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 						"STEREO" : "JOINTSTEREO");
 	}
 
+	if (threads > 1) {
+		encode_threaded(&sbc, fd);
+		goto finish;
+	}
+
 	codesize = sbc_get_codesize(&sbc);
 	nframes = sizeof(input) / codesize;
 	while (1) {
@@ -164,19 +322,16 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 			/* Not enough data for encoding even a single frame */
 			break;
 		}
-		/* encode all the data from the input buffer in a loop */
+		/* encode all the data from the input buffer in one go */
 		inp = input;
 		outp = output;
-		while (size >= codesize) {
-			len = sbc_encode(&sbc, inp, codesize,
-				outp, sizeof(output) - (outp - output),
-				&encoded);
-			if (len != codesize || encoded <= 0) {
-				fprintf(stderr,
-					"sbc_encode fail, len=%zd, encoded=%lu\n",
-					len, (unsigned long) encoded);
-				break;
-			}
+		len = sbc_encode_frames(&sbc, inp, size, outp, sizeof(output),
+								&encoded);
+		if (len <= 0 || encoded <= 0) {
+			fprintf(stderr,
+				"sbc_encode_frames fail, len=%zd, encoded=%lu\n",
+				len, (unsigned long) encoded);
+		} else {
 			size -= len;
 			inp += len;
 			outp += encoded;
@@ -196,6 +351,7 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 		}
 	}
 
+finish:
 	sbc_finish(&sbc);
 
 done:
@@ -221,6 +377,8 @@ static void usage(void)
 		"\t-d, --dualchannel    Dual channel\n"
 		"\t-S, --snr            Use SNR mode (default is loudness)\n"
 		"\t-B, --blocks         Number of blocks (4, 8, 12 or 16)\n"
+		"\t-r, --reference      Use reference bitstream packing\n"
+		"\t-t, --threads <num>  Encode in parallel with <num> threads\n"
 		"\n");
 }
 
@@ -233,6 +391,8 @@ static struct option main_options[] = {
 	{ "dualchannel",0, 0, 'd' },
 	{ "snr",	0, 0, 'S' },
 	{ "blocks",	1, 0, 'B' },
+	{ "reference",	0, 0, 'r' },
+	{ "threads",	1, 0, 't' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -241,7 +401,7 @@ int main(int argc, char *argv[])
 	int i, opt, subbands = 8, bitpool = 32, joint = 0, dualchannel = 0;
 	int snr = 0, blocks = 16;
 
-	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:",
+	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:rt:",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -285,6 +445,18 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'r':
+			flags |= SBC_FLAG_REFERENCE_BITSTREAM;
+			break;
+
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				fprintf(stderr, "Invalid number of threads\n");
+				exit(1);
+			}
+			break;
+
 		default:
 			usage();
 			exit(1);
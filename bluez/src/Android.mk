@@ -24,6 +24,7 @@ LOCAL_SRC_FILES:= \
 	sdpd-service.c \
 	sdpd-database.c \
 	sdp-xml.c \
+	sdp-browse.c \
 	storage.c \
 	textfile.c \
 	attrib-server.c \
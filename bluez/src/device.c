@@ -58,6 +58,7 @@
 #include "sdp-client.h"
 #endif
 #include "glib-helper.h"
+#include "sdp-browse.h"
 #include "gattrib.h"
 #include "gatt.h"
 #include "agent.h"
@@ -103,7 +104,6 @@ struct browse_req {
 	GSList *profiles_added;
 	GSList *profiles_removed;
 	sdp_list_t *records;
-	int search_uuid;
 	int reconnect_attempt;
 	guint listener_id;
 };
@@ -191,7 +191,8 @@ static void browse_request_cancel(struct browse_req *req)
 
 	adapter_get_address(adapter, &src);
 
-	bt_cancel_discovery(&src, &device->bdaddr);
+	if (bt_cancel_browse(&src, &device->bdaddr) < 0)
+		bt_cancel_discovery(&src, &device->bdaddr);
 
 	device->browse = NULL;
 	browse_request_free(req);
@@ -1115,6 +1116,8 @@ static void device_remove_stored(struct btd_device *device)
 	delete_entry(&src, "trusts", addr);
 	delete_entry(&src, "types", addr);
 	delete_entry(&src, "primary", addr);
+	delete_entry(&src, "avdtp", addr);
+	delete_a2dp_config(&src, &device->bdaddr);
 	delete_all_records(&src, &device->bdaddr);
 	delete_device_service(&src, &device->bdaddr);
 
@@ -1620,38 +1623,43 @@ cleanup:
 	browse_request_free(req);
 }
 
+static int browse_services(struct browse_req *req);
+
 static void browse_cb(sdp_list_t *recs, int err, gpointer user_data)
 {
 	struct browse_req *req = user_data;
-	struct btd_device *device = req->device;
-	struct btd_adapter *adapter = device->adapter;
-	bdaddr_t src;
-	uuid_t uuid;
 
-	/* If we have a valid response and req->search_uuid == 2, then L2CAP
-	 * UUID & PNP searching was successful -- we are done */
-	if (err < 0 || (req->search_uuid == 2 && req->records)) {
-		if (err == -ECONNRESET && req->reconnect_attempt < 1) {
-			req->search_uuid--;
-			req->reconnect_attempt++;
-		} else
-			goto done;
+	if (err == -ECONNRESET && req->reconnect_attempt < 1) {
+		req->reconnect_attempt++;
+		if (browse_services(req) == 0)
+			return;
 	}
 
-	update_services(req, recs);
+	search_cb(recs, err, user_data);
+}
 
-	adapter_get_address(adapter, &src);
+/* Search all the mandatory UUIDs at once, see bt_browse_services */
+static int browse_services(struct browse_req *req)
+{
+	struct btd_device *device = req->device;
+	uuid_t uuids[G_N_ELEMENTS(uuid_list)];
+	sdp_list_t *search = NULL;
+	bdaddr_t src;
+	int i, err;
 
-	/* Search for mandatory uuids */
-	if (uuid_list[req->search_uuid]) {
-		sdp_uuid16_create(&uuid, uuid_list[req->search_uuid++]);
-		bt_search_service(&src, &device->bdaddr, &uuid,
-						browse_cb, user_data, NULL);
-		return;
+	adapter_get_address(device->adapter, &src);
+
+	for (i = 0; uuid_list[i]; i++) {
+		sdp_uuid16_create(&uuids[i], uuid_list[i]);
+		search = sdp_list_append(search, &uuids[i]);
 	}
 
-done:
-	search_cb(recs, err, user_data);
+	err = bt_browse_services(&src, &device->bdaddr, search, browse_cb,
+								req, NULL);
+
+	sdp_list_free(search, NULL);
+
+	return err;
 }
 
 static void init_browse(struct browse_req *req, gboolean reverse)
@@ -1825,9 +1833,7 @@ int device_browse_sdp(struct btd_device *device, DBusConnection *conn,
 {
 	struct btd_adapter *adapter = device->adapter;
 	struct browse_req *req;
-	bt_callback_t cb;
 	bdaddr_t src;
-	uuid_t uuid;
 	int err;
 
 	if (device->browse)
@@ -1837,16 +1843,14 @@ int device_browse_sdp(struct btd_device *device, DBusConnection *conn,
 
 	req = g_new0(struct browse_req, 1);
 	req->device = btd_device_ref(device);
-	if (search) {
-		memcpy(&uuid, search, sizeof(uuid_t));
-		cb = search_cb;
-	} else {
-		sdp_uuid16_create(&uuid, uuid_list[req->search_uuid++]);
+	if (search)
+		err = bt_search_service(&src, &device->bdaddr, search,
+							search_cb, req, NULL);
+	else {
 		init_browse(req, reverse);
-		cb = browse_cb;
+		err = browse_services(req);
 	}
 
-	err = bt_search_service(&src, &device->bdaddr, &uuid, cb, req, NULL);
 	if (err < 0) {
 		browse_request_free(req);
 		return err;
@@ -330,6 +330,35 @@ int bt_search_service(const bdaddr_t *src, const bdaddr_t *dst,
 	return 0;
 }
 
+static void search_context_cancel(struct search_context *ctxt)
+{
+	if (ctxt->io_id)
+		g_source_remove(ctxt->io_id);
+
+	if (ctxt->session)
+		sdp_close(ctxt->session);
+
+	search_context_cleanup(ctxt);
+}
+
+int bt_cancel_search(bt_callback_t cb, void *user_data)
+{
+	GSList *l;
+
+	for (l = context_list; l; l = l->next) {
+		struct search_context *ctxt = l->data;
+
+		if (ctxt->cb != cb || ctxt->user_data != user_data)
+			continue;
+
+		search_context_cancel(ctxt);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
 static gint find_by_bdaddr(gconstpointer data, gconstpointer user_data)
 {
 	const struct search_context *ctxt = data, *search = user_data;
@@ -357,13 +386,7 @@ int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst)
 	if (!ctxt->session)
 		return -ENOTCONN;
 
-	if (ctxt->io_id)
-		g_source_remove(ctxt->io_id);
-
-	if (ctxt->session)
-		sdp_close(ctxt->session);
-
-	search_context_cleanup(ctxt);
+	search_context_cancel(ctxt);
 
 	return 0;
 }
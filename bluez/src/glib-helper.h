@@ -28,6 +28,7 @@ typedef void (*bt_destroy_t) (gpointer user_data);
 int bt_search_service(const bdaddr_t *src, const bdaddr_t *dst,
 			uuid_t *uuid, bt_callback_t cb, void *user_data,
 			bt_destroy_t destroy);
+int bt_cancel_search(bt_callback_t cb, void *user_data);
 int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst);
 #endif
 
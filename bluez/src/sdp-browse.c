@@ -0,0 +1,302 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+
+#include <glib.h>
+
+#ifdef STE_BT
+#include "sdp-client.h"
+#endif
+#include "glib-helper.h"
+#include "sdp-browse.h"
+
+/* Number of SDP connections a browse uses in parallel */
+#define BROWSE_MAX_SESSIONS 3
+
+/* Attempts for a search whose connection failed while others went on */
+#define BROWSE_MAX_ATTEMPTS 2
+
+struct browse_entry {
+	uuid_t			uuid;
+	sdp_list_t		*recs;
+	int			attempts;
+	gboolean		pending;
+};
+
+struct browse_context {
+	bdaddr_t		src;
+	bdaddr_t		dst;
+	struct browse_entry	*entries;
+	int			count;
+	int			active;
+	int			refs;
+	int			err;
+	GSList			*searches;
+	bt_callback_t		cb;
+	bt_destroy_t		destroy;
+	gpointer		user_data;
+};
+
+struct browse_search {
+	struct browse_context	*browse;
+	int			index;
+};
+
+static GSList *browse_list = NULL;
+
+static void browse_search_cb(sdp_list_t *recs, int err, gpointer user_data);
+
+static void browse_context_free(struct browse_context *browse)
+{
+	int i;
+
+	browse_list = g_slist_remove(browse_list, browse);
+
+	for (i = 0; i < browse->count; i++)
+		sdp_list_free(browse->entries[i].recs,
+					(sdp_free_func_t) sdp_record_free);
+
+	g_free(browse->entries);
+	g_free(browse);
+}
+
+static void browse_unref(struct browse_context *browse)
+{
+	if (--browse->refs > 0)
+		return;
+
+	if (browse->destroy)
+		browse->destroy(browse->user_data);
+
+	browse_context_free(browse);
+}
+
+static void browse_search_free(gpointer user_data)
+{
+	struct browse_search *search = user_data;
+	struct browse_context *browse = search->browse;
+
+	browse->searches = g_slist_remove(browse->searches, search);
+	g_free(search);
+
+	browse_unref(browse);
+}
+
+static int browse_start(struct browse_context *browse)
+{
+	struct browse_search *search;
+	struct browse_entry *entry = NULL;
+	int i, err;
+
+	for (i = 0; i < browse->count; i++) {
+		if (browse->entries[i].pending) {
+			entry = &browse->entries[i];
+			break;
+		}
+	}
+
+	if (entry == NULL)
+		return 0;
+
+	search = g_new0(struct browse_search, 1);
+	search->browse = browse;
+	search->index = i;
+
+	err = bt_search_service(&browse->src, &browse->dst, &entry->uuid,
+				browse_search_cb, search, browse_search_free);
+	if (err < 0) {
+		g_free(search);
+		return err;
+	}
+
+	entry->pending = FALSE;
+	entry->attempts++;
+
+	browse->searches = g_slist_append(browse->searches, search);
+	browse->active++;
+	browse->refs++;
+
+	return 0;
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const sdp_record_t *r1 = a;
+	const sdp_record_t *r2 = b;
+
+	return r1->handle - r2->handle;
+}
+
+static void browse_complete(struct browse_context *browse)
+{
+	sdp_list_t *recs = NULL;
+	int i;
+
+	/* Merge in the order of the UUIDs, dropping records found twice */
+	for (i = 0; i < browse->count; i++) {
+		sdp_list_t *l;
+
+		for (l = browse->entries[i].recs; l; l = l->next) {
+			if (sdp_list_find(recs, l->data, rec_cmp))
+				continue;
+
+			recs = sdp_list_append(recs, l->data);
+		}
+	}
+
+	/* Remotes may reject some of the UUIDs: records found are enough */
+	browse->cb(recs, recs ? 0 : browse->err, browse->user_data);
+	browse->cb = NULL;
+
+	sdp_list_free(recs, NULL);
+}
+
+static void browse_search_cb(sdp_list_t *recs, int err, gpointer user_data)
+{
+	struct browse_search *search = user_data;
+	struct browse_context *browse = search->browse;
+	struct browse_entry *entry = &browse->entries[search->index];
+	sdp_list_t *l;
+
+	browse->active--;
+
+	/* I/O errors are reported as positive values */
+	if (err > 0)
+		err = -err;
+
+	if (err < 0) {
+		/* Leave it to a connection that is still working */
+		if (browse->active > 0 && entry->attempts < BROWSE_MAX_ATTEMPTS)
+			entry->pending = TRUE;
+		else if (!browse->err)
+			browse->err = err;
+	} else {
+		for (l = recs; l; l = l->next)
+			entry->recs = sdp_list_append(entry->recs,
+						sdp_copy_record(l->data));
+	}
+
+	/* The session just used is cached: go on with the next UUID */
+	if (err == 0) {
+		int start_err = browse_start(browse);
+
+		if (start_err < 0 && browse->active == 0 && !browse->err)
+			browse->err = start_err;
+	}
+
+	if (browse->active > 0 || !browse->cb)
+		return;
+
+	browse_complete(browse);
+}
+
+/*
+ * Search a list of UUIDs, reporting the union of the records found with
+ * a single callback. An SDP connection only carries one transaction at
+ * a time, so the searches are spread over up to BROWSE_MAX_SESSIONS
+ * connections and each connection moves on to the next UUID when its
+ * search completes. An error is only reported when no record was found.
+ */
+int bt_browse_services(const bdaddr_t *src, const bdaddr_t *dst,
+			sdp_list_t *uuids, bt_callback_t cb, void *user_data,
+			bt_destroy_t destroy)
+{
+	struct browse_context *browse;
+	sdp_list_t *l;
+	int i, err = 0;
+
+	if (!cb || !uuids)
+		return -EINVAL;
+
+	browse = g_new0(struct browse_context, 1);
+	bacpy(&browse->src, src);
+	bacpy(&browse->dst, dst);
+	browse->count = sdp_list_len(uuids);
+	browse->entries = g_new0(struct browse_entry, browse->count);
+	browse->cb = cb;
+	browse->destroy = destroy;
+	browse->user_data = user_data;
+
+	for (l = uuids, i = 0; l; l = l->next, i++) {
+		browse->entries[i].uuid = *((uuid_t *) l->data);
+		browse->entries[i].pending = TRUE;
+	}
+
+	for (i = 0; i < browse->count && i < BROWSE_MAX_SESSIONS; i++) {
+		err = browse_start(browse);
+		if (err < 0)
+			break;
+	}
+
+	if (browse->active == 0) {
+		browse_context_free(browse);
+		return err;
+	}
+
+	browse_list = g_slist_append(browse_list, browse);
+
+	return 0;
+}
+
+static void browse_cancel(struct browse_context *browse)
+{
+	/* Hold the context until the last search has been dropped */
+	browse->refs++;
+	browse->cb = NULL;
+
+	while (browse->searches) {
+		struct browse_search *search = browse->searches->data;
+
+		browse->searches = g_slist_remove(browse->searches, search);
+		bt_cancel_search(browse_search_cb, search);
+	}
+
+	browse_unref(browse);
+}
+
+int bt_cancel_browse(const bdaddr_t *src, const bdaddr_t *dst)
+{
+	GSList *l;
+
+	for (l = browse_list; l; l = l->next) {
+		struct browse_context *browse = l->data;
+
+		if (bacmp(&browse->src, src) || bacmp(&browse->dst, dst))
+			continue;
+
+		browse_cancel(browse);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -87,11 +88,475 @@ static void access_free(void *p)
 	free(p);
 }
 
+/*
+ * Inverted index of the repository: one posting per 128-bit UUID found
+ * in any record pattern, listing the records that carry it in handle
+ * order. The postings are kept in an array sorted by UUID.
+ */
+typedef struct {
+	uint128_t uuid;
+	sdp_record_t **records;
+	unsigned int count;
+	unsigned int size;
+} sdp_posting_t;
+
+static sdp_posting_t *uuid_index;
+static unsigned int uuid_index_count;
+static unsigned int uuid_index_size;
+
+/* Set when a record could not be indexed, searches then scan the
+ * whole repository until it is reset */
+static int uuid_index_incomplete;
+
+static int uuid_value(const uuid_t *uuid, uint128_t *value)
+{
+	uuid_t uuid128;
+
+	switch (uuid->type) {
+	case SDP_UUID128:
+		*value = uuid->value.uuid128;
+		return 0;
+	case SDP_UUID32:
+		sdp_uuid32_to_uuid128(&uuid128, uuid);
+		break;
+	case SDP_UUID16:
+		sdp_uuid16_to_uuid128(&uuid128, uuid);
+		break;
+	default:
+		return -1;
+	}
+
+	*value = uuid128.value.uuid128;
+	return 0;
+}
+
+/*
+ * Binary search for the posting of a UUID. Returns its position or,
+ * if there is none, the position where it would be inserted.
+ */
+static unsigned int posting_locate(const uint128_t *uuid, int *found)
+{
+	unsigned int low = 0, high = uuid_index_count;
+
+	*found = 0;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		int cmp = memcmp(&uuid_index[mid].uuid, uuid, sizeof(*uuid));
+
+		if (cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static sdp_posting_t *posting_find(const uuid_t *uuid)
+{
+	uint128_t value;
+	unsigned int pos;
+	int found;
+
+	if (uuid_value(uuid, &value) < 0)
+		return NULL;
+
+	pos = posting_locate(&value, &found);
+
+	return found ? &uuid_index[pos] : NULL;
+}
+
+/* Same as posting_locate, for a record handle within one posting */
+static unsigned int posting_record_locate(const sdp_posting_t *posting,
+						uint32_t handle, int *found)
+{
+	unsigned int low = 0, high = posting->count;
+
+	*found = 0;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		uint32_t h = posting->records[mid]->handle;
+
+		if (h == handle) {
+			*found = 1;
+			return mid;
+		}
+
+		if (h < handle)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static int posting_insert(const uint128_t *uuid, sdp_record_t *rec)
+{
+	sdp_posting_t *posting;
+	unsigned int pos;
+	int found;
+
+	pos = posting_locate(uuid, &found);
+
+	if (!found) {
+		if (uuid_index_count == uuid_index_size) {
+			unsigned int size = uuid_index_size ?
+						uuid_index_size * 2 : 16;
+			sdp_posting_t *index;
+
+			index = realloc(uuid_index, size * sizeof(*index));
+			if (!index)
+				return -ENOMEM;
+
+			uuid_index = index;
+			uuid_index_size = size;
+		}
+
+		memmove(&uuid_index[pos + 1], &uuid_index[pos],
+				(uuid_index_count - pos) * sizeof(*uuid_index));
+		uuid_index_count++;
+
+		posting = &uuid_index[pos];
+		memset(posting, 0, sizeof(*posting));
+		posting->uuid = *uuid;
+	} else
+		posting = &uuid_index[pos];
+
+	pos = posting_record_locate(posting, rec->handle, &found);
+	if (found) {
+		posting->records[pos] = rec;
+		return 0;
+	}
+
+	if (posting->count == posting->size) {
+		unsigned int size = posting->size ? posting->size * 2 : 4;
+		sdp_record_t **records;
+
+		records = realloc(posting->records, size * sizeof(*records));
+		if (!records)
+			return -ENOMEM;
+
+		posting->records = records;
+		posting->size = size;
+	}
+
+	memmove(&posting->records[pos + 1], &posting->records[pos],
+			(posting->count - pos) * sizeof(*posting->records));
+	posting->records[pos] = rec;
+	posting->count++;
+
+	return 0;
+}
+
+/*
+ * Drop a record from every posting. The pattern the record had when it
+ * was indexed may have changed since, so all postings are looked at.
+ */
+static void index_unlink(sdp_record_t *rec)
+{
+	unsigned int i = 0;
+
+	while (i < uuid_index_count) {
+		sdp_posting_t *posting = &uuid_index[i];
+		unsigned int pos;
+		int found;
+
+		pos = posting_record_locate(posting, rec->handle, &found);
+		if (found && posting->records[pos] == rec) {
+			posting->count--;
+			memmove(&posting->records[pos],
+					&posting->records[pos + 1],
+					(posting->count - pos) *
+						sizeof(*posting->records));
+		}
+
+		if (posting->count > 0) {
+			i++;
+			continue;
+		}
+
+		free(posting->records);
+		uuid_index_count--;
+		memmove(posting, posting + 1,
+				(uuid_index_count - i) * sizeof(*uuid_index));
+	}
+}
+
+static void index_link(sdp_record_t *rec)
+{
+	sdp_list_t *p;
+
+	for (p = rec->pattern; p; p = p->next) {
+		uint128_t value;
+
+		if (p->data == NULL || uuid_value(p->data, &value) < 0)
+			continue;
+
+		if (posting_insert(&value, rec) < 0) {
+			error("Failed to index record 0x%x", rec->handle);
+			/* Never leave the record half indexed */
+			index_unlink(rec);
+			uuid_index_incomplete = 1;
+			return;
+		}
+	}
+}
+
+static void index_reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < uuid_index_count; i++)
+		free(uuid_index[i].records);
+
+	free(uuid_index);
+	uuid_index = NULL;
+	uuid_index_count = 0;
+	uuid_index_size = 0;
+	uuid_index_incomplete = 0;
+}
+
+/*
+ * Encoded attributes of the records in the repository, built when a
+ * record is first asked for and dropped whenever it changes. Attribute
+ * responses are copied out of it: as attributes are sorted, any range
+ * of ids is a single slice located by the offsets.
+ */
+typedef struct {
+	uint32_t handle;
+	sdp_buf_t pdu;			/* Attribute sequence as sent */
+	int count;			/* Attributes in the sequence */
+	uint16_t *ids;			/* Their ids, ascending */
+	uint32_t *offsets;		/* Their start, plus the end */
+} sdp_pdu_cache_t;
+
+static sdp_list_t *pdu_cache_db;
+
+static int pdu_cache_sort(const void *c1, const void *c2)
+{
+	const sdp_pdu_cache_t *cache1 = c1;
+	const sdp_pdu_cache_t *cache2 = c2;
+
+	return cache1->handle - cache2->handle;
+}
+
+static void pdu_cache_free(void *p)
+{
+	sdp_pdu_cache_t *cache = p;
+
+	free(cache->pdu.data);
+	free(cache->ids);
+	free(cache->offsets);
+	free(cache);
+}
+
+/* Encoded size of the data element at p, 0 if it is truncated */
+static uint32_t element_size(const uint8_t *p, uint32_t len)
+{
+	uint32_t size;
+
+	if (len < sizeof(uint8_t))
+		return 0;
+
+	switch (*p & 0x07) {
+	case 0:
+		size = *p == SDP_DATA_NIL ? 1 : 2;
+		break;
+	case 1:
+		size = 3;
+		break;
+	case 2:
+		size = 5;
+		break;
+	case 3:
+		size = 9;
+		break;
+	case 4:
+		size = 17;
+		break;
+	case 5:
+		if (len < 2)
+			return 0;
+		size = 2 + p[1];
+		break;
+	case 6:
+		if (len < 3)
+			return 0;
+		size = 3 + ntohs(bt_get_unaligned((uint16_t *) (p + 1)));
+		break;
+	default:
+		if (len < 5)
+			return 0;
+		size = 5 + ntohl(bt_get_unaligned((uint32_t *) (p + 1)));
+		break;
+	}
+
+	return size <= len ? size : 0;
+}
+
+static sdp_pdu_cache_t *pdu_cache_new(const sdp_record_t *rec)
+{
+	sdp_pdu_cache_t *cache;
+	uint32_t pos, size;
+	uint8_t dtd;
+	int i, seqlen;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->handle = rec->handle;
+	cache->count = sdp_list_len(rec->attrlist);
+
+	if (sdp_gen_record_pdu(rec, &cache->pdu) < 0)
+		goto failed;
+
+	cache->ids = malloc((cache->count + 1) * sizeof(uint16_t));
+	cache->offsets = malloc((cache->count + 1) * sizeof(uint32_t));
+	if (!cache->ids || !cache->offsets)
+		goto failed;
+
+	pos = 0;
+	if (cache->count > 0)
+		pos = sdp_extract_seqtype(cache->pdu.data,
+					cache->pdu.data_size, &dtd, &seqlen);
+
+	/* Each attribute is its id as UINT16 element and the value */
+	for (i = 0; i < cache->count; i++) {
+		const uint8_t *p = cache->pdu.data + pos;
+		uint32_t left = cache->pdu.data_size - pos;
+
+		if (pos == 0 || left < 3 || *p != SDP_UINT16)
+			goto failed;
+
+		size = element_size(p + 3, left - 3);
+		if (size == 0)
+			goto failed;
+
+		cache->ids[i] = ntohs(bt_get_unaligned((uint16_t *) (p + 1)));
+		cache->offsets[i] = pos;
+		pos += 3 + size;
+	}
+
+	cache->offsets[cache->count] = pos;
+
+	return cache;
+
+failed:
+	error("Unable to cache the PDU of record 0x%x", rec->handle);
+	pdu_cache_free(cache);
+	return NULL;
+}
+
+static void pdu_cache_drop(uint32_t handle)
+{
+	sdp_pdu_cache_t c, *cache;
+	sdp_list_t *p;
+
+	c.handle = handle;
+	p = sdp_list_find(pdu_cache_db, &c, pdu_cache_sort);
+	if (!p)
+		return;
+
+	cache = p->data;
+	pdu_cache_db = sdp_list_remove(pdu_cache_db, cache);
+	pdu_cache_free(cache);
+}
+
+static sdp_pdu_cache_t *pdu_cache_get(sdp_record_t *rec)
+{
+	sdp_pdu_cache_t c, *cache;
+	sdp_list_t *p;
+
+	/* Changes are only tracked for records in the repository */
+	if (sdp_record_find(rec->handle) != rec)
+		return NULL;
+
+	c.handle = rec->handle;
+	p = sdp_list_find(pdu_cache_db, &c, pdu_cache_sort);
+	if (p)
+		return p->data;
+
+	cache = pdu_cache_new(rec);
+	if (!cache)
+		return NULL;
+
+	pdu_cache_db = sdp_list_insert_sorted(pdu_cache_db, cache,
+							pdu_cache_sort);
+
+	return cache;
+}
+
+/*
+ * The encoded attribute sequence of a record in the repository, as
+ * sdp_gen_record_pdu() builds it. NULL if it could not be built.
+ */
+const sdp_buf_t *sdp_svcdb_get_pdu(sdp_record_t *rec)
+{
+	sdp_pdu_cache_t *cache = pdu_cache_get(rec);
+
+	return cache ? &cache->pdu : NULL;
+}
+
+/* First cached attribute with an id not below attr */
+static int pdu_cache_find(sdp_pdu_cache_t *cache, uint32_t attr)
+{
+	int low = 0, high = cache->count;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		if (cache->ids[mid] < attr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Points at the encoding of all attributes of a record in the repository
+ * with ids from low to high. It stays valid until the record changes.
+ */
+int sdp_svcdb_get_pdu_range(sdp_record_t *rec, uint16_t low, uint16_t high,
+					const uint8_t **data, uint32_t *len)
+{
+	sdp_pdu_cache_t *cache;
+	int first, last;
+
+	cache = pdu_cache_get(rec);
+	if (!cache)
+		return -ENOMEM;
+
+	first = pdu_cache_find(cache, low);
+	last = pdu_cache_find(cache, (uint32_t) high + 1);
+	if (last < first)
+		last = first;
+
+	*data = cache->pdu.data + cache->offsets[first];
+	*len = cache->offsets[last] - cache->offsets[first];
+
+	return 0;
+}
+
 /*
  * Reset the service repository by deleting its contents
  */
 void sdp_svcdb_reset(void)
 {
+	index_reset();
+	sdp_list_free(pdu_cache_db, pdu_cache_free);
+	pdu_cache_db = NULL;
 	sdp_list_free(service_db, (sdp_free_func_t) sdp_record_free);
 	sdp_list_free(access_db, access_free);
 }
@@ -177,6 +642,8 @@ void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec)
 	SDPDBG("with handle : 0x%x", rec->handle);
 
 	service_db = sdp_list_insert_sorted(service_db, rec, record_sort);
+	index_link(rec);
+	pdu_cache_drop(rec->handle);
 
 	dev = malloc(sizeof(*dev));
 	if (!dev)
@@ -257,8 +724,12 @@ int sdp_record_remove(uint32_t handle)
 	}
 
 	r = p->data;
-	if (r)
+	if (r) {
+		index_unlink(r);
 		service_db = sdp_list_remove(service_db, r);
+	}
+
+	pdu_cache_drop(handle);
 
 	p = access_locate(handle);
 	if (p == NULL || p->data == NULL)
@@ -287,6 +758,144 @@ sdp_list_t *sdp_get_record_list(void)
 	return service_db;
 }
 
+/*
+ * Bring the index and the cached encoding up to date after the attributes
+ * of a record in the repository changed. Records not in the repository
+ * are ignored.
+ */
+void sdp_svcdb_reindex(sdp_record_t *rec)
+{
+	if (sdp_record_find(rec->handle) != rec)
+		return;
+
+	index_unlink(rec);
+	index_link(rec);
+	pdu_cache_drop(rec->handle);
+}
+
+/*
+ * Start a search for the records matching a search pattern: each and
+ * every UUID of the search pattern must be present in the record's
+ * pattern. The records are then returned in handle order
+ * by sdp_svcdb_search_next(); nothing is allocated on the way.
+ */
+void sdp_svcdb_search_init(sdp_search_t *search, sdp_list_t *pattern)
+{
+	sdp_posting_t *lead = NULL;
+	sdp_list_t *p;
+
+	memset(search, 0, sizeof(*search));
+	search->pattern = pattern;
+
+	/* Without any UUID every record matches */
+	if (pattern == NULL) {
+		search->next = service_db;
+		return;
+	}
+
+	if (uuid_index_incomplete) {
+		for (p = pattern; p; p = p->next)
+			search->count++;
+
+		search->next = service_db;
+		search->scan = 1;
+		return;
+	}
+
+	/* Walk the shortest posting and probe the others */
+	for (p = pattern; p; p = p->next) {
+		sdp_posting_t *posting;
+
+		search->count++;
+
+		posting = p->data ? posting_find(p->data) : NULL;
+		if (posting == NULL) {
+			search->lead = NULL;
+			search->done = 1;
+			return;
+		}
+
+		if (lead == NULL || posting->count < lead->count)
+			lead = posting;
+	}
+
+	search->lead = lead;
+}
+
+/* Pattern match without the index, for when it is incomplete */
+static int record_match(sdp_search_t *search, sdp_record_t *rec)
+{
+	sdp_list_t *p, *q;
+
+	if (sdp_list_len(rec->pattern) < search->count)
+		return 0;
+
+	for (p = search->pattern; p; p = p->next) {
+		uint128_t value, v;
+
+		if (p->data == NULL || uuid_value(p->data, &value) < 0)
+			return 0;
+
+		for (q = rec->pattern; q; q = q->next) {
+			if (q->data && uuid_value(q->data, &v) == 0 &&
+					memcmp(&v, &value, sizeof(v)) == 0)
+				break;
+		}
+
+		if (q == NULL)
+			return 0;
+	}
+
+	return 1;
+}
+
+sdp_record_t *sdp_svcdb_search_next(sdp_search_t *search)
+{
+	sdp_posting_t *lead = search->lead;
+
+	if (search->done)
+		return NULL;
+
+	if (lead == NULL) {
+		sdp_list_t *p;
+
+		while ((p = search->next)) {
+			search->next = p->next;
+
+			if (!search->scan || record_match(search, p->data))
+				return p->data;
+		}
+
+		search->done = 1;
+		return NULL;
+	}
+
+	while (search->pos < lead->count) {
+		sdp_record_t *rec = lead->records[search->pos++];
+		sdp_list_t *p;
+
+		for (p = search->pattern; p; p = p->next) {
+			sdp_posting_t *posting = posting_find(p->data);
+			int found;
+
+			if (posting == lead)
+				continue;
+
+			posting_record_locate(posting, rec->handle, &found);
+			if (!found)
+				break;
+		}
+
+		/* A pattern shorter than the search never matched, even
+		 * when the search repeats a UUID */
+		if (p == NULL && sdp_list_len(rec->pattern) >= search->count)
+			return rec;
+	}
+
+	search->done = 1;
+	return NULL;
+}
+
 sdp_list_t *sdp_get_access_list(void)
 {
 	return access_db;
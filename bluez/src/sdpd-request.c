@@ -33,6 +33,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -46,7 +48,7 @@
 #include "log.h"
 
 typedef struct {
-	uint32_t timestamp;
+	uint32_t token;
 	union {
 		uint16_t maxBytesSent;
 		uint16_t lastIndexSent;
@@ -57,41 +59,247 @@ typedef struct {
 
 #define MIN(x, y) ((x) < (y)) ? (x): (y)
 
-typedef struct _sdp_cstate_list sdp_cstate_list_t;
-
-struct _sdp_cstate_list {
-	sdp_cstate_list_t *next;
-	uint32_t timestamp;
+/*
+ * Responses that do not fit in one PDU are cached until the client has
+ * fetched them with continuation requests. Entries are bound to the
+ * connection that created them and found by a token through a hash
+ * table. The cache is bounded: entries idle for CSTATE_TTL seconds
+ * expire, each connection may keep CSTATE_MAX_CLIENT of them and the
+ * oldest ones are evicted once CSTATE_MAX_ENTRIES or CSTATE_MAX_BYTES
+ * are exceeded.
+ */
+#define CSTATE_HASH_SIZE	64
+#define CSTATE_TTL		30
+#define CSTATE_MAX_CLIENT	4
+#define CSTATE_MAX_ENTRIES	64
+#define CSTATE_MAX_BYTES	(256 * 1024)
+
+typedef struct _sdp_cstate_entry sdp_cstate_entry_t;
+
+struct _sdp_cstate_entry {
+	sdp_cstate_entry_t *next;	/* Same hash bucket */
+	sdp_cstate_entry_t *older;
+	sdp_cstate_entry_t *newer;
+	uint32_t token;
+	int sock;
+	time_t expire;
 	sdp_buf_t buf;
 };
 
-static sdp_cstate_list_t *cstates;
+static sdp_cstate_entry_t *cstate_hash[CSTATE_HASH_SIZE];
+static sdp_cstate_entry_t *cstate_oldest;
+static sdp_cstate_entry_t *cstate_newest;
+static unsigned int cstate_count;
+static size_t cstate_bytes;
 
-/* FIXME: should probably remove it when it's found */
-static sdp_buf_t *sdp_get_cached_rsp(sdp_cont_state_t *cstate)
+static uint32_t cstate_seed;
+static uint32_t cstate_serial;
+
+static time_t cstate_now(void)
 {
-	sdp_cstate_list_t *p;
+	struct timespec ts;
 
-	for (p = cstates; p; p = p->next)
-		if (p->timestamp == cstate->timestamp)
-			return &p->buf;
-	return 0;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return ts.tv_sec;
+}
+
+static sdp_cstate_entry_t **cstate_bucket(uint32_t token)
+{
+	return &cstate_hash[token % CSTATE_HASH_SIZE];
+}
+
+static sdp_cstate_entry_t *cstate_lookup(int sock, uint32_t token)
+{
+	sdp_cstate_entry_t *e;
+
+	for (e = *cstate_bucket(token); e; e = e->next)
+		if (e->token == token && e->sock == sock)
+			return e;
+
+	return NULL;
+}
+
+static void cstate_unlink_age(sdp_cstate_entry_t *e)
+{
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		cstate_oldest = e->newer;
+
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		cstate_newest = e->older;
+
+	e->older = NULL;
+	e->newer = NULL;
 }
 
-static uint32_t sdp_cstate_alloc_buf(sdp_buf_t *buf)
+static void cstate_link_age(sdp_cstate_entry_t *e)
 {
-	sdp_cstate_list_t *cstate = malloc(sizeof(sdp_cstate_list_t));
-	uint8_t *data = malloc(buf->data_size);
+	e->older = cstate_newest;
+	e->newer = NULL;
+
+	if (cstate_newest)
+		cstate_newest->newer = e;
+	else
+		cstate_oldest = e;
+
+	cstate_newest = e;
+}
+
+static void cstate_free(sdp_cstate_entry_t *e)
+{
+	sdp_cstate_entry_t **p;
+
+	for (p = cstate_bucket(e->token); *p; p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+
+	cstate_unlink_age(e);
+
+	cstate_count--;
+	cstate_bytes -= e->buf.buf_size;
+
+	free(e->buf.data);
+	free(e);
+}
+
+static void cstate_expire(time_t now)
+{
+	while (cstate_oldest && cstate_oldest->expire <= now)
+		cstate_free(cstate_oldest);
+}
+
+/*
+ * Tokens are a bijective scramble of a serial number, so they do not
+ * repeat before the serial wraps; the lookup covers that case too.
+ */
+static uint32_t cstate_new_token(int sock)
+{
+	uint32_t token;
+
+	if (cstate_seed == 0)
+		cstate_seed = (sdp_get_time() ^ ((uint32_t) getpid() << 16)) | 1;
+
+	do {
+		token = (++cstate_serial * 0x9e3779b1) ^ cstate_seed;
+	} while (token == 0 || cstate_lookup(sock, token));
+
+	return token;
+}
+
+static sdp_buf_t *sdp_get_cached_rsp(sdp_req_t *req, sdp_cont_state_t *cstate)
+{
+	time_t now = cstate_now();
+	sdp_cstate_entry_t *e;
+
+	cstate_expire(now);
+
+	e = cstate_lookup(req->sock, cstate->token);
+	if (!e)
+		return NULL;
+
+	/* Keep the entry alive as long as the client is fetching it */
+	e->expire = now + CSTATE_TTL;
+	cstate_unlink_age(e);
+	cstate_link_age(e);
+
+	return &e->buf;
+}
+
+/* Drop a cached response once its last part has been sent */
+static void sdp_cstate_release(sdp_req_t *req, sdp_cont_state_t *cstate)
+{
+	sdp_cstate_entry_t *e = cstate_lookup(req->sock, cstate->token);
+
+	if (e)
+		cstate_free(e);
+}
+
+static uint32_t sdp_cstate_alloc_buf(sdp_req_t *req, sdp_buf_t *buf)
+{
+	sdp_cstate_entry_t *cstate, *e, **bucket;
+	time_t now = cstate_now();
+	unsigned int client = 0;
+
+	/* Never flush the whole cache for a single response */
+	if (buf->data_size > CSTATE_MAX_BYTES)
+		return 0;
+
+	cstate_expire(now);
+
+	/* Make room: first within the client's own share, then globally */
+	for (e = cstate_oldest; e; e = e->newer)
+		if (e->sock == req->sock)
+			client++;
+
+	for (e = cstate_oldest; e && client >= CSTATE_MAX_CLIENT; ) {
+		sdp_cstate_entry_t *newer = e->newer;
+
+		if (e->sock == req->sock) {
+			cstate_free(e);
+			client--;
+		}
+
+		e = newer;
+	}
+
+	while (cstate_oldest && (cstate_count >= CSTATE_MAX_ENTRIES ||
+			cstate_bytes + buf->data_size > CSTATE_MAX_BYTES))
+		cstate_free(cstate_oldest);
+
+	cstate = malloc(sizeof(sdp_cstate_entry_t));
+	if (!cstate)
+		return 0;
+
+	memset(cstate, 0, sizeof(sdp_cstate_entry_t));
+
+	cstate->buf.data = malloc(buf->data_size);
+	if (!cstate->buf.data) {
+		free(cstate);
+		return 0;
+	}
 
-	memcpy(data, buf->data, buf->data_size);
-	memset((char *)cstate, 0, sizeof(sdp_cstate_list_t));
-	cstate->buf.data = data;
+	memcpy(cstate->buf.data, buf->data, buf->data_size);
 	cstate->buf.data_size = buf->data_size;
 	cstate->buf.buf_size = buf->data_size;
-	cstate->timestamp = sdp_get_time();
-	cstate->next = cstates;
-	cstates = cstate;
-	return cstate->timestamp;
+	cstate->sock = req->sock;
+	cstate->expire = now + CSTATE_TTL;
+	cstate->token = cstate_new_token(req->sock);
+
+	bucket = cstate_bucket(cstate->token);
+	cstate->next = *bucket;
+	*bucket = cstate;
+
+	cstate_link_age(cstate);
+
+	cstate_count++;
+	cstate_bytes += cstate->buf.buf_size;
+
+	return cstate->token;
+}
+
+/*
+ * Drop the cached responses of a connection that went away
+ */
+void sdp_cstate_cleanup(int sock)
+{
+	sdp_cstate_entry_t *e = cstate_oldest;
+
+	while (e) {
+		sdp_cstate_entry_t *newer = e->newer;
+
+		if (e->sock == sock)
+			cstate_free(e);
+
+		e = newer;
+	}
 }
 
 /* Additional values for checking datatype (not in spec) */
@@ -255,7 +463,7 @@ static int sdp_set_cstate_pdu(sdp_buf_t *buf, sdp_cont_state_t *cstate)
 	int length = 0;
 
 	if (cstate) {
-		SDPDBG("Non null sdp_cstate_t id : 0x%x", cstate->timestamp);
+		SDPDBG("Non null sdp_cstate_t id : 0x%x", cstate->token);
 		*pdata = sizeof(sdp_cont_state_t);
 		pdata += sizeof(uint8_t);
 		length += sizeof(uint8_t);
@@ -299,55 +507,16 @@ static int sdp_cstate_get(uint8_t *buffer, size_t len,
 
 	memcpy(*cstate, buffer, sizeof(sdp_cont_state_t));
 
-	SDPDBG("Cstate TS : 0x%x", (*cstate)->timestamp);
+	SDPDBG("Cstate TS : 0x%x", (*cstate)->token);
 	SDPDBG("Bytes sent : %d", (*cstate)->cStateValue.maxBytesSent);
 
 	return 0;
 }
 
-/*
- * The matching process is defined as "each and every UUID
- * specified in the "search pattern" must be present in the
- * "target pattern". Here "search pattern" is the set of UUIDs
- * specified by the service discovery client and "target pattern"
- * is the set of UUIDs present in a service record.
- *
- * Return 1 if each and every UUID in the search
- * pattern exists in the target pattern, 0 if the
- * match succeeds and -1 on error.
- */
-static int sdp_match_uuid(sdp_list_t *search, sdp_list_t *pattern)
-{
-	/*
-	 * The target is a sorted list, so we need not look
-	 * at all elements to confirm existence of an element
-	 * from the search pattern
-	 */
-	int patlen = sdp_list_len(pattern);
-
-	if (patlen < sdp_list_len(search))
-		return -1;
-	for (; search; search = search->next) {
-		uuid_t *uuid128;
-		void *data = search->data;
-		sdp_list_t *list;
-		if (data == NULL)
-			return -1;
-
-		/* create 128-bit form of the search UUID */
-		uuid128 = sdp_uuid_to_uuid128((uuid_t *)data);
-		list = sdp_list_find(pattern, uuid128, sdp_uuid128_cmp);
-		bt_free(uuid128);
-		if (!list)
-			return 0;
-	}
-	return 1;
-}
-
 /*
  * Service search request PDU. This method extracts the search pattern
- * (a sequence of UUIDs) and calls the matching function
- * to find matching services
+ * (a sequence of UUIDs) and looks up the matching services
+ * in the service repository
  */
 static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 {
@@ -421,17 +590,18 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 	buf->data_size += sizeof(uint16_t);
 
 	if (cstate == NULL) {
-		/* for every record in the DB, do a pattern search */
-		sdp_list_t *list = sdp_get_record_list();
+		/* look up the records matching the pattern in the index */
+		sdp_search_t search;
+		sdp_record_t *rec;
 
-		handleSize = 0;
-		for (; list && rsp_count < expected; list = list->next) {
-			sdp_record_t *rec = list->data;
+		sdp_svcdb_search_init(&search, pattern);
 
+		handleSize = 0;
+		while (rsp_count < expected &&
+				(rec = sdp_svcdb_search_next(&search))) {
 			SDPDBG("Checking svcRec : 0x%x", rec->handle);
 
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
+			if (sdp_check_access(rec->handle, &req->device)) {
 				rsp_count++;
 				bt_put_unaligned(htonl(rec->handle), (uint32_t *)pdata);
 				pdata += sizeof(uint32_t);
@@ -447,7 +617,12 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 		if (rsp_count > actual) {
 			/* cache the rsp and generate a continuation state */
-			cStateId = sdp_cstate_alloc_buf(buf);
+			cStateId = sdp_cstate_alloc_buf(req, buf);
+			if (cStateId == 0) {
+				error("Can't cache the service search response");
+				status = SDP_INSUFFICIENT_RESOURCES;
+				goto done;
+			}
 			/*
 			 * subtract handleSize since we now send only
 			 * a subset of handles
@@ -461,14 +636,14 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 	/* under both the conditions below, the rsp buffer is not built yet */
 	if (cstate || cStateId > 0) {
-		short lastIndex = 0;
+		uint16_t lastIndex = 0;
 
 		if (cstate) {
 			/*
 			 * Get the previous sdp_cont_state_t and obtain
 			 * the cached rsp
 			 */
-			sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+			sdp_buf_t *pCache = sdp_get_cached_rsp(req, cstate);
 			if (pCache) {
 				pCacheBuffer = pCache->data;
 				/* get the rsp_count from the cached buffer */
@@ -476,6 +651,10 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 				/* get index of the last sdp_record_t sent */
 				lastIndex = cstate->cStateValue.lastIndexSent;
+				if (lastIndex >= rsp_count) {
+					status = SDP_INVALID_CSTATE;
+					goto done;
+				}
 			} else {
 				status = SDP_INVALID_CSTATE;
 				goto done;
@@ -514,6 +693,8 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 		if (i == rsp_count) {
 			/* set "null" continuationState */
 			sdp_set_cstate_pdu(buf, NULL);
+			if (cstate)
+				sdp_cstate_release(req, cstate);
 		} else {
 			/*
 			 * there's more: set lastIndexSent to
@@ -527,7 +708,7 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 				memcpy(&newState, cstate, sizeof(sdp_cont_state_t));
 			else {
 				memset(&newState, 0, sizeof(sdp_cont_state_t));
-				newState.timestamp = cStateId;
+				newState.token = cStateId;
 			}
 			newState.cStateValue.lastIndexSent = i;
 			sdp_set_cstate_pdu(buf, &newState);
@@ -549,9 +730,66 @@ done:
  * requested identifiers are present in the PDU form of
  * the request
  */
+/* Range of attribute ids asked for by one element of the sequence */
+static int attr_range(struct attrid *aid, uint16_t *low, uint16_t *high)
+{
+	SDPDBG("AttrDataType : %d", aid->dtd);
+
+	if (aid->dtd == SDP_UINT16) {
+		*low = bt_get_unaligned((uint16_t *)&aid->uint16);
+		*high = *low;
+	} else if (aid->dtd == SDP_UINT32) {
+		uint32_t range = bt_get_unaligned((uint32_t *)&aid->uint32);
+		*low = (0xffff0000 & range) >> 16;
+		*high = 0x0000ffff & range;
+
+		SDPDBG("attr range : 0x%x", range);
+		SDPDBG("Low id : 0x%x", *low);
+		SDPDBG("High id : 0x%x", *high);
+
+		/* An inverted range still yields its high end */
+		if (*low > *high)
+			*low = *high;
+	} else {
+		error("Unexpected data type : 0x%x", aid->dtd);
+		error("Expect uint16_t or uint32_t");
+		return SDP_INVALID_SYNTAX;
+	}
+
+	return 0;
+}
+
+/* Encodes the attributes one by one when the record has no cached PDU */
+static int extract_attrs_uncached(sdp_record_t *rec, sdp_list_t *seq,
+							sdp_buf_t *buf)
+{
+	for (; seq; seq = seq->next) {
+		uint16_t low, high;
+		sdp_list_t *l;
+		int err;
+
+		err = attr_range(seq->data, &low, &high);
+		if (err)
+			return err;
+
+		/* attrlist is sorted by id */
+		for (l = rec->attrlist; l; l = l->next) {
+			sdp_data_t *d = l->data;
+
+			if (d->attrId > high)
+				break;
+
+			if (d->attrId >= low)
+				sdp_append_to_pdu(buf, d);
+		}
+	}
+
+	return 0;
+}
+
 static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 {
-	sdp_buf_t pdu;
+	const sdp_buf_t *pdu;
 
 	if (!rec)
 		return SDP_INVALID_RECORD_HANDLE;
@@ -563,53 +801,34 @@ static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 
 	SDPDBG("Entries in attr seq : %d", sdp_list_len(seq));
 
-	sdp_gen_record_pdu(rec, &pdu);
+	/* The repository keeps the encoding, attributes are copied from it */
+	pdu = sdp_svcdb_get_pdu(rec);
+	if (!pdu)
+		return extract_attrs_uncached(rec, seq, buf);
 
 	for (; seq; seq = seq->next) {
 		struct attrid *aid = seq->data;
-
-		SDPDBG("AttrDataType : %d", aid->dtd);
-
-		if (aid->dtd == SDP_UINT16) {
-			uint16_t attr = bt_get_unaligned((uint16_t *)&aid->uint16);
-			sdp_data_t *a = sdp_data_get(rec, attr);
-			if (a)
-				sdp_append_to_pdu(buf, a);
-		} else if (aid->dtd == SDP_UINT32) {
-			uint32_t range = bt_get_unaligned((uint32_t *)&aid->uint32);
-			uint16_t attr;
-			uint16_t low = (0xffff0000 & range) >> 16;
-			uint16_t high = 0x0000ffff & range;
-			sdp_data_t *data;
-
-			SDPDBG("attr range : 0x%x", range);
-			SDPDBG("Low id : 0x%x", low);
-			SDPDBG("High id : 0x%x", high);
-
-			if (low == 0x0000 && high == 0xffff && pdu.data_size <= buf->buf_size) {
-				/* copy it */
-				memcpy(buf->data, pdu.data, pdu.data_size);
-				buf->data_size = pdu.data_size;
-				break;
-			}
-			/* (else) sub-range of attributes */
-			for (attr = low; attr < high; attr++) {
-				data = sdp_data_get(rec, attr);
-				if (data)
-					sdp_append_to_pdu(buf, data);
-			}
-			data = sdp_data_get(rec, high);
-			if (data)
-				sdp_append_to_pdu(buf, data);
-		} else {
-			error("Unexpected data type : 0x%x", aid->dtd);
-			error("Expect uint16_t or uint32_t");
-			free(pdu.data);
-			return SDP_INVALID_SYNTAX;
+		uint16_t low, high;
+		const uint8_t *data;
+		uint32_t len;
+		int err;
+
+		err = attr_range(aid, &low, &high);
+		if (err)
+			return err;
+
+		if (aid->dtd == SDP_UINT32 && low == 0x0000 && high == 0xffff &&
+					pdu->data_size <= buf->buf_size) {
+			/* copy it */
+			memcpy(buf->data, pdu->data, pdu->data_size);
+			buf->data_size = pdu->data_size;
+			break;
 		}
-	}
 
-	free(pdu.data);
+		if (sdp_svcdb_get_pdu_range(rec, low, high, &data, &len) == 0 &&
+								len > 0)
+			sdp_append_to_buf(buf, (uint8_t *) data, len);
+	}
 
 	return 0;
 }
@@ -709,11 +928,11 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 	buf->buf_size -= sizeof(uint16_t);
 
 	if (cstate) {
-		sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+		sdp_buf_t *pCache = sdp_get_cached_rsp(req, cstate);
 
 		SDPDBG("Obtained cached rsp : %p", pCache);
 
-		if (pCache) {
+		if (pCache && cstate->cStateValue.maxBytesSent <= pCache->data_size) {
 			short sent = MIN(max_rsp_size, pCache->data_size - cstate->cStateValue.maxBytesSent);
 			pResponse = pCache->data;
 			memcpy(buf->data, pResponse + cstate->cStateValue.maxBytesSent, sent);
@@ -722,9 +941,10 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 
 			SDPDBG("Response size : %d sending now : %d bytes sent so far : %d",
 				pCache->data_size, sent, cstate->cStateValue.maxBytesSent);
-			if (cstate->cStateValue.maxBytesSent == pCache->data_size)
+			if (cstate->cStateValue.maxBytesSent == pCache->data_size) {
 				cstate_size = sdp_set_cstate_pdu(buf, NULL);
-			else
+				sdp_cstate_release(req, cstate);
+			} else
 				cstate_size = sdp_set_cstate_pdu(buf, cstate);
 		} else {
 			status = SDP_INVALID_CSTATE;
@@ -737,15 +957,20 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
-			/*
-			 * Reset the buffer size to the maximum expected and
-			 * set the sdp_cont_state_t
-			 */
-			SDPDBG("Creating continuation state of size : %d", buf->data_size);
-			buf->data_size = max_rsp_size;
-			newState.cStateValue.maxBytesSent = max_rsp_size;
-			cstate_size = sdp_set_cstate_pdu(buf, &newState);
+			newState.token = sdp_cstate_alloc_buf(req, buf);
+			if (newState.token == 0) {
+				error("Can't cache the service attribute response");
+				status = SDP_INSUFFICIENT_RESOURCES;
+			} else {
+				/*
+				 * Reset the buffer size to the maximum expected
+				 * and set the sdp_cont_state_t
+				 */
+				SDPDBG("Creating continuation state of size : %d", buf->data_size);
+				buf->data_size = max_rsp_size;
+				newState.cStateValue.maxBytesSent = max_rsp_size;
+				cstate_size = sdp_set_cstate_pdu(buf, &newState);
+			}
 		} else {
 			if (buf->data_size == 0)
 				sdp_append_to_buf(buf, 0, 0);
@@ -779,7 +1004,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 	uint8_t *pdata, *pResponse = NULL;
 	unsigned int max;
 	int scanned, rsp_count = 0;
-	sdp_list_t *pattern = NULL, *seq = NULL, *svcList;
+	sdp_list_t *pattern = NULL, *seq = NULL;
 	sdp_cont_state_t *cstate = NULL;
 	short cstate_size = 0;
 	uint8_t dtd = 0;
@@ -845,8 +1070,6 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 		goto done;
 	}
 
-	svcList = sdp_get_record_list();
-
 	tmpbuf.data = malloc(USHRT_MAX);
 	tmpbuf.data_size = 0;
 	tmpbuf.buf_size = USHRT_MAX;
@@ -864,11 +1087,12 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 
 	if (cstate == NULL) {
 		/* no continuation state -> create new response */
-		sdp_list_t *p;
-		for (p = svcList; p; p = p->next) {
-			sdp_record_t *rec = p->data;
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
+		sdp_search_t search;
+		sdp_record_t *rec;
+
+		sdp_svcdb_search_init(&search, pattern);
+		while ((rec = sdp_svcdb_search_next(&search))) {
+			if (sdp_check_access(rec->handle, &req->device)) {
 				rsp_count++;
 				status = extract_attrs(rec, seq, &tmpbuf);
 
@@ -894,28 +1118,34 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
-			/*
-			 * Reset the buffer size to the maximum expected and
-			 * set the sdp_cont_state_t
-			 */
-			buf->data_size = max;
-			newState.cStateValue.maxBytesSent = max;
-			cstate_size = sdp_set_cstate_pdu(buf, &newState);
+			newState.token = sdp_cstate_alloc_buf(req, buf);
+			if (newState.token == 0) {
+				error("Can't cache the service search attribute response");
+				status = SDP_INSUFFICIENT_RESOURCES;
+			} else {
+				/*
+				 * Reset the buffer size to the maximum expected
+				 * and set the sdp_cont_state_t
+				 */
+				buf->data_size = max;
+				newState.cStateValue.maxBytesSent = max;
+				cstate_size = sdp_set_cstate_pdu(buf, &newState);
+			}
 		} else
 			cstate_size = sdp_set_cstate_pdu(buf, NULL);
 	} else {
 		/* continuation State exists -> get from cache */
-		sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
-		if (pCache) {
+		sdp_buf_t *pCache = sdp_get_cached_rsp(req, cstate);
+		if (pCache && cstate->cStateValue.maxBytesSent <= pCache->data_size) {
 			uint16_t sent = MIN(max, pCache->data_size - cstate->cStateValue.maxBytesSent);
 			pResponse = pCache->data;
 			memcpy(buf->data, pResponse + cstate->cStateValue.maxBytesSent, sent);
 			buf->data_size += sent;
 			cstate->cStateValue.maxBytesSent += sent;
-			if (cstate->cStateValue.maxBytesSent == pCache->data_size)
+			if (cstate->cStateValue.maxBytesSent == pCache->data_size) {
 				cstate_size = sdp_set_cstate_pdu(buf, NULL);
-			else
+				sdp_cstate_release(req, cstate);
+			} else
 				cstate_size = sdp_set_cstate_pdu(buf, cstate);
 		} else {
 			status = SDP_INVALID_CSTATE;
@@ -91,6 +91,7 @@ static void update_db_timestamp(void)
 	uint32_t dbts = sdp_get_time();
 	sdp_data_t *d = sdp_data_alloc(SDP_UINT32, &dbts);
 	sdp_attr_replace(server, SDP_ATTR_SVCDB_STATE, d);
+	sdp_svcdb_reindex(server);
 }
 
 void register_public_browse_group(void)
@@ -114,6 +115,8 @@ void register_public_browse_group(void)
 	sdp_uuid16_create(&pbgid, PUBLIC_BROWSE_GROUP);
 	sdp_attr_add_new(browse, SDP_ATTR_GROUP_ID,
 				SDP_UUID16, &pbgid.value.uuid16);
+
+	sdp_svcdb_reindex(browse);
 }
 
 /*
@@ -169,6 +172,7 @@ void register_server_service(void)
 	free(versionDTDs);
 	sdp_attr_add(server, SDP_ATTR_VERSION_NUM_LIST, pData);
 
+	sdp_svcdb_reindex(server);
 	update_db_timestamp();
 }
 
@@ -228,6 +232,7 @@ void register_device_id(const uint16_t vendor, const uint16_t product,
 	source_data = sdp_data_alloc(SDP_UINT16, &source);
 	sdp_attr_add(record, 0x0205, source_data);
 
+	sdp_svcdb_reindex(record);
 	update_db_timestamp();
 }
 
@@ -258,6 +263,8 @@ int add_record_to_server(const bdaddr_t *src, sdp_record_t *rec)
 		sdp_pattern_add_uuid(rec, &uuid);
 	}
 
+	sdp_svcdb_reindex(rec);
+
 	for (pattern = rec->pattern; pattern; pattern = pattern->next) {
 		char uuid[32];
 
@@ -390,6 +397,10 @@ static sdp_record_t *extract_pdu_server(bdaddr_t *device, uint8_t *p,
 #endif
 		*scanned += seqlen;
 	}
+
+	/* the pattern may have changed for a record already registered */
+	sdp_svcdb_reindex(rec);
+
 	return rec;
 }
 
@@ -447,6 +458,8 @@ success:
 		sdp_pattern_add_uuid(rec, &uuid);
 	}
 
+	sdp_svcdb_reindex(rec);
+
 	update_db_timestamp();
 
 	/* Build a rsp buffer */
@@ -45,7 +45,18 @@ typedef struct request {
 	int      len;
 } sdp_req_t;
 
+typedef struct {
+	sdp_list_t *pattern;
+	int         count;
+	void        *lead;
+	unsigned int pos;
+	sdp_list_t  *next;
+	int         scan;
+	int         done;
+} sdp_search_t;
+
 void handle_request(int sk, uint8_t *data, int len);
+void sdp_cstate_cleanup(int sock);
 
 int service_register_req(sdp_req_t *req, sdp_buf_t *rsp);
 int service_update_req(sdp_req_t *req, sdp_buf_t *rsp);
@@ -65,6 +76,12 @@ sdp_record_t *sdp_record_find(uint32_t handle);
 void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec);
 int sdp_record_remove(uint32_t handle);
 sdp_list_t *sdp_get_record_list(void);
+void sdp_svcdb_reindex(sdp_record_t *rec);
+const sdp_buf_t *sdp_svcdb_get_pdu(sdp_record_t *rec);
+int sdp_svcdb_get_pdu_range(sdp_record_t *rec, uint16_t low, uint16_t high,
+					const uint8_t **data, uint32_t *len);
+void sdp_svcdb_search_init(sdp_search_t *search, sdp_list_t *pattern);
+sdp_record_t *sdp_svcdb_search_next(sdp_search_t *search);
 sdp_list_t *sdp_get_access_list(void);
 int sdp_check_access(uint32_t handle, bdaddr_t *device);
 uint32_t sdp_next_handle(void);
@@ -1259,6 +1259,117 @@ char *read_device_services(const bdaddr_t *sba, const bdaddr_t *dba)
 	return textfile_caseget(filename, addr);
 }
 
+int write_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba,
+							const char *seps)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	ba2str(dba, addr);
+
+	return textfile_put(filename, addr, seps);
+}
+
+char *read_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	ba2str(dba, addr);
+
+	return textfile_caseget(filename, addr);
+}
+
+int delete_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	ba2str(dba, addr);
+
+	return textfile_del(filename, addr);
+}
+
+/* Stream configurations are keyed by MAC#SEID of the remote SEP, only
+ * the last one that worked is kept per device */
+static GSList *a2dp_config_keys(const char *filename, const bdaddr_t *dba)
+{
+	struct match match;
+	char address[18];
+
+	ba2str(dba, address);
+
+	memset(&match, 0, sizeof(match));
+	match.pattern = address;
+
+	textfile_foreach(filename, filter_keys, &match);
+
+	return match.keys;
+}
+
+int write_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba,
+					uint8_t rseid, const char *config)
+{
+	char filename[PATH_MAX + 1], addr[18], key[21];
+
+	delete_a2dp_config(sba, dba);
+
+	create_filename(filename, PATH_MAX, sba, "a2dp");
+
+	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	ba2str(dba, addr);
+
+	snprintf(key, sizeof(key), "%17s#%02X", addr, rseid);
+
+	return textfile_put(filename, key, config);
+}
+
+char *read_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba,
+							uint8_t *rseid)
+{
+	char filename[PATH_MAX + 1], *config = NULL;
+	GSList *keys;
+
+	create_filename(filename, PATH_MAX, sba, "a2dp");
+
+	keys = a2dp_config_keys(filename, dba);
+	if (keys == NULL)
+		return NULL;
+
+	/* Each key contains: MAC#SEID */
+	if (sscanf((char *) keys->data + 18, "%02hhX", rseid) == 1)
+		config = textfile_caseget(filename, keys->data);
+
+	g_slist_foreach(keys, (GFunc) g_free, NULL);
+	g_slist_free(keys);
+
+	return config;
+}
+
+int delete_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1];
+	GSList *keys, *l;
+
+	create_filename(filename, PATH_MAX, sba, "a2dp");
+
+	keys = a2dp_config_keys(filename, dba);
+
+	for (l = keys; l; l = l->next)
+		textfile_del(filename, l->data);
+
+	g_slist_foreach(keys, (GFunc) g_free, NULL);
+	g_slist_free(keys);
+
+	return 0;
+}
+
 int write_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
 					uint16_t handle, const char *chars)
 {
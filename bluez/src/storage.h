@@ -77,6 +77,15 @@ int write_device_services(const bdaddr_t *sba, const bdaddr_t *dba,
 							const char *services);
 int delete_device_service(const bdaddr_t *sba, const bdaddr_t *dba);
 char *read_device_services(const bdaddr_t *sba, const bdaddr_t *dba);
+int write_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba,
+							const char *seps);
+char *read_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba);
+int delete_avdtp_seps(const bdaddr_t *sba, const bdaddr_t *dba);
+int write_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba,
+					uint8_t rseid, const char *config);
+char *read_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba,
+							uint8_t *rseid);
+int delete_a2dp_config(const bdaddr_t *sba, const bdaddr_t *dba);
 int write_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
 					uint16_t handle, const char *chars);
 char *read_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,